@@ -57,6 +57,7 @@ __FBSDID("$FreeBSD$");
 #include <cam/cam.h>
 #include <cam/cam_ccb.h>
 #include <cam/cam_periph.h>
+#include <cam/cam_iosched.h>
 #include <cam/cam_xpt_periph.h>
 #include <cam/cam_sim.h>
 
@@ -128,8 +129,7 @@ struct trim_request {
 };
 
 struct ada_softc {
-	struct	 bio_queue_head bio_queue;
-	struct	 bio_queue_head trim_queue;
+	struct	 cam_iosched_softc *cam_iosched;
 	int	 outstanding_cmds;	/* Number of active commands */
 	int	 refcount;		/* Active xpt_action() calls */
 	ada_state state;
@@ -730,8 +730,8 @@ adaschedule(struct cam_periph *periph)
 		return;
 
 	/* Check if we have more work to do. */
-	if (bioq_first(&softc->bio_queue) ||
-	    (!softc->trim_running && bioq_first(&softc->trim_queue))) {
+	if (cam_iosched_has_io(softc->cam_iosched) ||
+	    (!softc->trim_running && cam_iosched_has_trim(softc->cam_iosched))) {
 		xpt_schedule(periph, CAM_PRIORITY_NORMAL);
 	}
 }
@@ -766,14 +766,8 @@ adastrategy(struct bio *bp)
 	/*
 	 * Place it in the queue of disk activities for this disk
 	 */
-	if (bp->bio_cmd == BIO_DELETE) {
-		bioq_disksort(&softc->trim_queue, bp);
-	} else {
-		if (ADA_SIO)
-		    bioq_disksort(&softc->bio_queue, bp);
-		else
-		    bioq_insert_tail(&softc->bio_queue, bp);
-	}
+	cam_iosched_set_sort_queue(softc->cam_iosched, ADA_SIO);
+	cam_iosched_queue_work(softc->cam_iosched, bp);
 
 	/*
 	 * Schedule ourselves for performing the work.
@@ -934,8 +928,7 @@ adaoninvalidate(struct cam_periph *periph)
 	 * XXX Handle any transactions queued to the card
 	 *     with XPT_ABORT_CCB.
 	 */
-	bioq_flush(&softc->bio_queue, NULL, ENXIO);
-	bioq_flush(&softc->trim_queue, NULL, ENXIO);
+	cam_iosched_flush(softc->cam_iosched, NULL, ENXIO);
 
 	disk_gone(softc->disk);
 }
@@ -959,6 +952,7 @@ adacleanup(struct cam_periph *periph)
 
 	disk_destroy(softc->disk);
 	callout_drain(&softc->sendordered_c);
+	cam_iosched_fini(softc->cam_iosched);
 	free(softc, M_DEVBUF);
 	cam_periph_lock(periph);
 }
@@ -1120,6 +1114,8 @@ adasysctlinit(void *context, int pending)
 		OID_AUTO, "sort_io_queue", CTLFLAG_RW | CTLFLAG_MPSAFE,
 		&softc->sort_io_queue, 0,
 		"Sort IO queue to try and optimise disk access patterns");
+	cam_iosched_sysctl_init(softc->cam_iosched, &softc->sysctl_ctx,
+	    softc->sysctl_tree);
 #ifdef ADA_TEST_FAILURE
 	/*
 	 * Add a 'door bell' sysctl which allows one to set it from userland
@@ -1185,8 +1181,12 @@ adaregister(struct cam_periph *periph, void *arg)
 		return(CAM_REQ_CMP_ERR);
 	}
 
-	bioq_init(&softc->bio_queue);
-	bioq_init(&softc->trim_queue);
+	if (cam_iosched_init(&softc->cam_iosched, periph, adaschedule) != 0) {
+		printf("adaregister: Unable to probe new device. "
+		    "Unable to allocate iosched memory\n");
+		free(softc, M_DEVBUF);
+		return(CAM_REQ_CMP_ERR);
+	}
 
 	if ((cgd->ident_data.capabilities1 & ATA_SUPPORT_DMA) &&
 	    (cgd->inq_flags & SID_DMA))
@@ -1217,6 +1217,8 @@ adaregister(struct cam_periph *periph, void *arg)
 		softc->flags |= ADA_FLAG_CAN_CFA;
 
 	periph->softc = softc;
+	/* Scheduled CCBs are only ever used for XPT_ATA_IO requests. */
+	periph->ccb_class = CAM_CCB_CLASS_ATAIO;
 
 	/*
 	 * See if this device has any quirks.
@@ -1434,7 +1436,7 @@ ada_dsmtrim(struct ada_softc *softc, struct bio *bp, struct ccb_ataio *ataio)
 		uint64_t lba = bp->bio_pblkno;
 		int count = bp->bio_bcount / softc->params.secsize;
 
-		bioq_remove(&softc->trim_queue, bp);
+		cam_iosched_take_trim(softc->cam_iosched, bp);
 
 		/* Try to extend the previous range. */
 		if (lba == lastlba) {
@@ -1471,7 +1473,7 @@ ada_dsmtrim(struct ada_softc *softc, struct bio *bp, struct ccb_ataio *ataio)
 		}
 		lastlba = lba;
 		TAILQ_INSERT_TAIL(&req->bps, bp, bio_queue);
-		bp = bioq_first(&softc->trim_queue);
+		bp = cam_iosched_first_trim(softc->cam_iosched);
 		if (bp == NULL ||
 		    bp->bio_bcount / softc->params.secsize >
 		    (softc->trim_max_ranges - ranges) * ATA_DSM_RANGE_MAX)
@@ -1500,7 +1502,7 @@ ada_cfaerase(struct ada_softc *softc, struct bio *bp, struct ccb_ataio *ataio)
 
 	bzero(req, sizeof(*req));
 	TAILQ_INIT(&req->bps);
-	bioq_remove(&softc->trim_queue, bp);
+	cam_iosched_take_trim(softc->cam_iosched, bp);
 	TAILQ_INSERT_TAIL(&req->bps, bp, bio_queue);
 
 	cam_fill_ataio(ataio,
@@ -1533,7 +1535,7 @@ adastart(struct cam_periph *periph, union ccb *start_ccb)
 
 		/* Run TRIM if not running yet. */
 		if (!softc->trim_running &&
-		    (bp = bioq_first(&softc->trim_queue)) != 0) {
+		    (bp = cam_iosched_next_trim(softc->cam_iosched)) != NULL) {
 			if (softc->flags & ADA_FLAG_CAN_TRIM) {
 				ada_dsmtrim(softc, bp, ataio);
 			} else if ((softc->flags & ADA_FLAG_CAN_CFA) &&
@@ -1541,7 +1543,7 @@ adastart(struct cam_periph *periph, union ccb *start_ccb)
 				ada_cfaerase(softc, bp, ataio);
 			} else {
 				/* This can happen if DMA was disabled. */
-				bioq_remove(&softc->trim_queue, bp);
+				cam_iosched_take_trim(softc->cam_iosched, bp);
 				biofinish(bp, NULL, EOPNOTSUPP);
 				xpt_release_ccb(start_ccb);
 				adaschedule(periph);
@@ -1553,12 +1555,11 @@ adastart(struct cam_periph *periph, union ccb *start_ccb)
 			goto out;
 		}
 		/* Run regular command. */
-		bp = bioq_first(&softc->bio_queue);
+		bp = cam_iosched_next_bio(softc->cam_iosched);
 		if (bp == NULL) {
 			xpt_release_ccb(start_ccb);
 			break;
 		}
-		bioq_remove(&softc->bio_queue, bp);
 
 		if ((bp->bio_flags & BIO_ORDERED) != 0
 		 || (softc->flags & ADA_FLAG_NEED_OTAG) != 0) {
@@ -1711,6 +1712,7 @@ adastart(struct cam_periph *periph, union ccb *start_ccb)
 		start_ccb->ccb_h.flags |= CAM_UNLOCKED;
 out:
 		start_ccb->ccb_h.ccb_bp = bp;
+		cam_iosched_submit(softc->cam_iosched, bp, start_ccb);
 		softc->outstanding_cmds++;
 		softc->refcount++;
 		cam_periph_unlock(periph);
@@ -1755,7 +1757,7 @@ adadone(struct cam_periph *periph, union ccb *done_ccb)
 {
 	struct ada_softc *softc;
 	struct ccb_ataio *ataio;
-	struct ccb_getdev *cgd;
+	struct ccb_getdev cgd;
 	struct cam_path *path;
 	int state;
 
@@ -1793,6 +1795,7 @@ adadone(struct cam_periph *periph, union ccb *done_ccb)
 			error = 0;
 		}
 		bp = (struct bio *)done_ccb->ccb_h.ccb_bp;
+		cam_iosched_bio_complete(softc->cam_iosched, bp, done_ccb);
 		bp->bio_error = error;
 		if (error != 0) {
 			bp->bio_resid = bp->bio_bcount;
@@ -1839,6 +1842,11 @@ adadone(struct cam_periph *periph, union ccb *done_ccb)
 				biodone(bp1);
 			}
 		} else {
+			/*
+			 * The scheduler may have held work back behind this
+			 * command's queue-depth slot.
+			 */
+			adaschedule(periph);
 			cam_periph_unlock(periph);
 			biodone(bp);
 		}
@@ -1869,12 +1877,11 @@ out:
 		 * is removed, and we need it around for the CCB release
 		 * operation.
 		 */
-		cgd = (struct ccb_getdev *)done_ccb;
-		xpt_setup_ccb(&cgd->ccb_h, path, CAM_PRIORITY_NORMAL);
-		cgd->ccb_h.func_code = XPT_GDEV_TYPE;
-		xpt_action((union ccb *)cgd);
+		xpt_setup_ccb(&cgd.ccb_h, path, CAM_PRIORITY_NORMAL);
+		cgd.ccb_h.func_code = XPT_GDEV_TYPE;
+		xpt_action((union ccb *)&cgd);
 		if (ADA_WC >= 0 &&
-		    cgd->ident_data.support.command1 & ATA_SUPPORT_WRITECACHE) {
+		    cgd.ident_data.support.command1 & ATA_SUPPORT_WRITECACHE) {
 			softc->state = ADA_STATE_WCACHE;
 			xpt_release_ccb(done_ccb);
 			xpt_schedule(periph, CAM_PRIORITY_DEV);
@@ -0,0 +1,603 @@
+/*-
+ * CAM peripheral I/O scheduler.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer,
+ *    without modification, immediately at the beginning of the file.
+ * 2. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/bio.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+
+#include <cam/cam.h>
+#include <cam/cam_ccb.h>
+#include <cam/cam_periph.h>
+#include <cam/cam_xpt_periph.h>
+#include <cam/cam_iosched.h>
+
+static MALLOC_DEFINE(M_CAMSCHED, "CAM I/O Scheduler",
+    "CAM I/O Scheduler buffers");
+
+static SYSCTL_NODE(_kern_cam, OID_AUTO, iosched, CTLFLAG_RD, 0,
+    "CAM I/O Scheduler parameters");
+
+static int cam_iosched_policy = CAM_IOSCHED_FIFO;
+SYSCTL_INT(_kern_cam_iosched, OID_AUTO, policy, CTLFLAG_RWTUN,
+    &cam_iosched_policy, 0,
+    "Default scheduling policy for new devices (0 = FIFO, 1 = weighted)");
+
+/*
+ * Dispatch timestamps live in the CCB's qos.periph_data, which the periph
+ * drivers do not otherwise use.  They are kept in units of 2^-20 seconds
+ * (sbintime_t shifted down) and truncated to 32 bits so they fit a
+ * uintptr_t everywhere; a difference taken modulo 2^32 stays correct for
+ * anything that completes within an hour.
+ */
+#define	CAM_IOSCHED_TS_SHIFT	12
+#define	CAM_IOSCHED_TS_US(t)	(((uint64_t)(t) * 1000000) >> 20)
+
+#define	CAM_IOSCHED_HIST_BUCKETS	8
+static const uint64_t cam_iosched_hist_us[CAM_IOSCHED_HIST_BUCKETS - 1] = {
+	100, 250, 500, 1000, 5000, 20000, 100000
+};
+
+#define	CAM_IOSCHED_DEF_READ_WEIGHT	4
+#define	CAM_IOSCHED_DEF_WRITE_WEIGHT	1
+#define	CAM_IOSCHED_DEF_TRIM_INFLIGHT	1
+
+/*
+ * Per-class state.  Each class owns a queue, though under the FIFO policy
+ * reads share the write queue.  The counters describe bios by command,
+ * regardless of which queue they waited on.
+ */
+struct iop_stats {
+	const char	*name;
+	struct bio_queue_head queue;
+	int		queued;		/* Bios waiting on this queue */
+	int		in_flight;	/* Submitted and not yet complete */
+	int		max_inflight;	/* Queue-depth limit, 0 = none */
+	int		weight;		/* Dispatch share when contended */
+	int		credits;	/* Dispatches left this round */
+	uint64_t	total;		/* Completed requests */
+	uint64_t	ewma_us;	/* Latency moving average, 1/8 gain */
+	uint64_t	max_us;		/* Worst latency seen */
+	uint64_t	hist[CAM_IOSCHED_HIST_BUCKETS];
+};
+
+struct cam_iosched_softc {
+	struct cam_periph *periph;
+	cam_iosched_schedule_t *schedule;
+	int		policy;
+	int		sort_io_queue;
+	int		barriers;	/* Ordered bios on the write queue */
+	struct iop_stats read_stats;
+	struct iop_stats write_stats;
+	struct iop_stats trim_stats;
+	int		trim_target_us;	/* Delete latency target, 0 = none */
+	sbintime_t	trim_next;	/* Hold deletes until this time */
+	struct callout	trim_c;
+};
+
+#define	CAM_IOSCHED_BARRIER(bp)						\
+	((bp)->bio_cmd == BIO_FLUSH || ((bp)->bio_flags & BIO_ORDERED) != 0)
+
+static uintptr_t
+cam_iosched_now(void)
+{
+
+	return ((uint32_t)(sbinuptime() >> CAM_IOSCHED_TS_SHIFT));
+}
+
+static struct iop_stats *
+cam_iosched_class(struct cam_iosched_softc *isc, struct bio *bp)
+{
+
+	switch (bp->bio_cmd) {
+	case BIO_READ:
+		return (&isc->read_stats);
+	case BIO_DELETE:
+		return (&isc->trim_stats);
+	default:
+		return (&isc->write_stats);
+	}
+}
+
+static void
+cam_iosched_stats_init(struct iop_stats *ios, const char *name, int weight,
+    int max_inflight)
+{
+
+	ios->name = name;
+	bioq_init_sorted(&ios->queue);
+	ios->weight = weight;
+	ios->credits = weight;
+	ios->max_inflight = max_inflight;
+}
+
+static void
+cam_iosched_trim_timeout(void *arg)
+{
+	struct cam_iosched_softc *isc = arg;
+
+	isc->schedule(isc->periph);
+}
+
+int
+cam_iosched_init(struct cam_iosched_softc **iscp, struct cam_periph *periph,
+    cam_iosched_schedule_t *schedule)
+{
+	struct cam_iosched_softc *isc;
+
+	isc = malloc(sizeof(*isc), M_CAMSCHED, M_NOWAIT | M_ZERO);
+	if (isc == NULL)
+		return (ENOMEM);
+	isc->periph = periph;
+	isc->schedule = schedule;
+	isc->policy = cam_iosched_policy;
+	if (isc->policy < 0 || isc->policy >= CAM_IOSCHED_MAX)
+		isc->policy = CAM_IOSCHED_FIFO;
+	cam_iosched_stats_init(&isc->read_stats, "read",
+	    CAM_IOSCHED_DEF_READ_WEIGHT, 0);
+	cam_iosched_stats_init(&isc->write_stats, "write",
+	    CAM_IOSCHED_DEF_WRITE_WEIGHT, 0);
+	cam_iosched_stats_init(&isc->trim_stats, "trim", 0,
+	    CAM_IOSCHED_DEF_TRIM_INFLIGHT);
+	callout_init_mtx(&isc->trim_c, cam_periph_mtx(periph), 0);
+	*iscp = isc;
+	return (0);
+}
+
+/*
+ * Release the scheduler.  All queues must already have been flushed and
+ * the periph lock must not be held, since the delete pacing callout is
+ * drained here.
+ */
+void
+cam_iosched_fini(struct cam_iosched_softc *isc)
+{
+
+	if (isc == NULL)
+		return;
+	callout_drain(&isc->trim_c);
+	free(isc, M_CAMSCHED);
+}
+
+/*
+ * Change the policy of a live device.  Reads waiting on their own queue
+ * were all queued ahead of any ordered request on the write queue, so
+ * moving them to its front keeps every ordering guarantee.
+ */
+static void
+cam_iosched_set_policy(struct cam_iosched_softc *isc, int policy)
+{
+	struct bio_queue_head *rq, *wq;
+	struct bio *bp;
+
+	if (policy == isc->policy)
+		return;
+	if (policy == CAM_IOSCHED_FIFO) {
+		rq = &isc->read_stats.queue;
+		wq = &isc->write_stats.queue;
+		while ((bp = TAILQ_LAST(&rq->queue, bio_queue)) != NULL) {
+			bioq_remove(rq, bp);
+			bioq_insert_head(wq, bp);
+		}
+		isc->write_stats.queued += isc->read_stats.queued;
+		isc->read_stats.queued = 0;
+	}
+	isc->read_stats.credits = isc->read_stats.weight;
+	isc->write_stats.credits = isc->write_stats.weight;
+	isc->trim_next = 0;
+	callout_stop(&isc->trim_c);
+	isc->policy = policy;
+}
+
+static int
+cam_iosched_policy_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct cam_iosched_softc *isc = arg1;
+	int error, value;
+
+	value = isc->policy;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 0 || value >= CAM_IOSCHED_MAX)
+		return (EINVAL);
+	cam_periph_lock(isc->periph);
+	cam_iosched_set_policy(isc, value);
+	isc->schedule(isc->periph);
+	cam_periph_unlock(isc->periph);
+	return (0);
+}
+
+static int
+cam_iosched_hist_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct iop_stats *ios = arg1;
+	struct sbuf sb;
+	int error, i;
+
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	for (i = 0; i < CAM_IOSCHED_HIST_BUCKETS; i++) {
+		if (i < CAM_IOSCHED_HIST_BUCKETS - 1)
+			sbuf_printf(&sb, "%s<%juus:%ju", i == 0 ? "" : " ",
+			    (uintmax_t)cam_iosched_hist_us[i],
+			    (uintmax_t)ios->hist[i]);
+		else
+			sbuf_printf(&sb, " >=%juus:%ju",
+			    (uintmax_t)cam_iosched_hist_us[i - 1],
+			    (uintmax_t)ios->hist[i]);
+	}
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+static void
+cam_iosched_iop_sysctl_init(struct iop_stats *ios,
+    struct sysctl_ctx_list *ctx, struct sysctl_oid *parent)
+{
+	struct sysctl_oid_list *n;
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(parent), OID_AUTO,
+	    ios->name, CTLFLAG_RD, 0, ios->name);
+	n = SYSCTL_CHILDREN(node);
+
+	if (ios->weight != 0)
+		SYSCTL_ADD_INT(ctx, n, OID_AUTO, "weight", CTLFLAG_RW,
+		    &ios->weight, 0,
+		    "Relative dispatch share under the weighted policy");
+	SYSCTL_ADD_INT(ctx, n, OID_AUTO, "max_inflight", CTLFLAG_RW,
+	    &ios->max_inflight, 0,
+	    "Queue-depth limit under the weighted policy (0 = none)");
+	SYSCTL_ADD_INT(ctx, n, OID_AUTO, "queued", CTLFLAG_RD,
+	    &ios->queued, 0, "Requests waiting on this queue");
+	SYSCTL_ADD_INT(ctx, n, OID_AUTO, "inflight", CTLFLAG_RD,
+	    &ios->in_flight, 0, "Requests outstanding on the device");
+	SYSCTL_ADD_UQUAD(ctx, n, OID_AUTO, "total", CTLFLAG_RD,
+	    &ios->total, "Requests completed");
+	SYSCTL_ADD_UQUAD(ctx, n, OID_AUTO, "latency_ewma_us", CTLFLAG_RD,
+	    &ios->ewma_us, "Moving average of completion latency (us)");
+	SYSCTL_ADD_UQUAD(ctx, n, OID_AUTO, "latency_max_us", CTLFLAG_RD,
+	    &ios->max_us, "Largest completion latency seen (us)");
+	SYSCTL_ADD_PROC(ctx, n, OID_AUTO, "latency_hist",
+	    CTLTYPE_STRING | CTLFLAG_RD, ios, 0, cam_iosched_hist_sysctl, "A",
+	    "Completion latency histogram");
+}
+
+void
+cam_iosched_sysctl_init(struct cam_iosched_softc *isc,
+    struct sysctl_ctx_list *ctx, struct sysctl_oid *node)
+{
+	struct sysctl_oid *tree;
+
+	tree = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+	    "iosched", CTLFLAG_RD, 0, "I/O scheduler statistics");
+	if (tree == NULL)
+		return;
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(tree), OID_AUTO, "policy",
+	    CTLTYPE_INT | CTLFLAG_RW, isc, 0, cam_iosched_policy_sysctl, "I",
+	    "Scheduling policy (0 = FIFO, 1 = weighted)");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(tree), OID_AUTO,
+	    "trim_target_latency_us", CTLFLAG_RW, &isc->trim_target_us, 0,
+	    "Hold deletes back while their latency exceeds this (0 = never)");
+	cam_iosched_iop_sysctl_init(&isc->read_stats, ctx, tree);
+	cam_iosched_iop_sysctl_init(&isc->write_stats, ctx, tree);
+	cam_iosched_iop_sysctl_init(&isc->trim_stats, ctx, tree);
+}
+
+void
+cam_iosched_set_sort_queue(struct cam_iosched_softc *isc, int val)
+{
+
+	isc->sort_io_queue = val;
+}
+
+static void
+cam_iosched_enqueue(struct cam_iosched_softc *isc, struct iop_stats *ios,
+    struct bio *bp)
+{
+
+	if (isc->sort_io_queue)
+		bioq_disksort(&ios->queue, bp);
+	else
+		bioq_insert_tail(&ios->queue, bp);
+	ios->queued++;
+}
+
+static void
+cam_iosched_dequeue(struct cam_iosched_softc *isc, struct iop_stats *ios,
+    struct bio *bp)
+{
+
+	bioq_remove(&ios->queue, bp);
+	ios->queued--;
+	if (ios == &isc->write_stats && CAM_IOSCHED_BARRIER(bp))
+		isc->barriers--;
+}
+
+/*
+ * Queue a bio.  Deletes always go to their own, sorted, queue.  Under the
+ * weighted policy reads get a queue of their own too, except that once an
+ * ordered request or a flush is waiting, every later read queues behind
+ * it on the write queue so it cannot be dispatched ahead of the barrier.
+ */
+void
+cam_iosched_queue_work(struct cam_iosched_softc *isc, struct bio *bp)
+{
+
+	if (bp->bio_cmd == BIO_DELETE) {
+		bioq_disksort(&isc->trim_stats.queue, bp);
+		isc->trim_stats.queued++;
+		return;
+	}
+	if (isc->policy == CAM_IOSCHED_WEIGHTED && bp->bio_cmd == BIO_READ &&
+	    isc->barriers == 0 && (bp->bio_flags & BIO_ORDERED) == 0) {
+		cam_iosched_enqueue(isc, &isc->read_stats, bp);
+		return;
+	}
+	if (CAM_IOSCHED_BARRIER(bp))
+		isc->barriers++;
+	cam_iosched_enqueue(isc, &isc->write_stats, bp);
+}
+
+static int
+cam_iosched_below_limit(struct cam_iosched_softc *isc, struct bio *bp)
+{
+	struct iop_stats *ios;
+
+	ios = cam_iosched_class(isc, bp);
+	return (ios->max_inflight <= 0 || ios->in_flight < ios->max_inflight);
+}
+
+/*
+ * Choose the queue the next read or write comes from, without taking
+ * anything off it.  A barrier at the head of the write queue waits until
+ * every read queued before it has been dispatched.  When both queues can
+ * go, the one with credits left this round wins, reads first.
+ */
+static struct iop_stats *
+cam_iosched_pick(struct cam_iosched_softc *isc, int *contended)
+{
+	struct bio *rbp, *wbp;
+
+	*contended = 0;
+	wbp = bioq_first(&isc->write_stats.queue);
+	if (isc->policy == CAM_IOSCHED_FIFO)
+		return (wbp != NULL ? &isc->write_stats : NULL);
+
+	rbp = bioq_first(&isc->read_stats.queue);
+	if (wbp != NULL && CAM_IOSCHED_BARRIER(wbp) && rbp != NULL)
+		wbp = NULL;
+	if (wbp != NULL && !cam_iosched_below_limit(isc, wbp))
+		wbp = NULL;
+	if (rbp != NULL && !cam_iosched_below_limit(isc, rbp))
+		rbp = NULL;
+	if (rbp == NULL)
+		return (wbp != NULL ? &isc->write_stats : NULL);
+	if (wbp == NULL)
+		return (&isc->read_stats);
+	*contended = 1;
+	if (isc->read_stats.credits > 0 || isc->write_stats.credits <= 0)
+		return (&isc->read_stats);
+	return (&isc->write_stats);
+}
+
+struct bio *
+cam_iosched_next_bio(struct cam_iosched_softc *isc)
+{
+	struct iop_stats *ios;
+	struct bio *bp;
+	int contended;
+
+	ios = cam_iosched_pick(isc, &contended);
+	if (ios == NULL)
+		return (NULL);
+	bp = bioq_first(&ios->queue);
+	cam_iosched_dequeue(isc, ios, bp);
+	if (contended) {
+		ios->credits--;
+		if (isc->read_stats.credits <= 0 &&
+		    isc->write_stats.credits <= 0) {
+			isc->read_stats.credits = imax(isc->read_stats.weight, 1);
+			isc->write_stats.credits =
+			    imax(isc->write_stats.weight, 1);
+		}
+	}
+	return (bp);
+}
+
+int
+cam_iosched_has_io(struct cam_iosched_softc *isc)
+{
+	int contended;
+
+	return (cam_iosched_pick(isc, &contended) != NULL);
+}
+
+/*
+ * Return the delete to start next, if deletes may be started now.  Under
+ * the weighted policy they are limited by max_inflight and, while their
+ * average latency is over target, held back in proportion to the excess;
+ * a callout kicks the periph once the hold expires.  The caller still
+ * takes the bio with cam_iosched_take_trim().
+ */
+struct bio *
+cam_iosched_next_trim(struct cam_iosched_softc *isc)
+{
+	struct bio *bp;
+
+	bp = bioq_first(&isc->trim_stats.queue);
+	if (bp == NULL || isc->policy == CAM_IOSCHED_FIFO)
+		return (bp);
+	if (!cam_iosched_below_limit(isc, bp))
+		return (NULL);
+	if (isc->trim_next != 0) {
+		if (sbinuptime() < isc->trim_next) {
+			if (!callout_pending(&isc->trim_c))
+				callout_reset_sbt(&isc->trim_c, isc->trim_next,
+				    0, cam_iosched_trim_timeout, isc,
+				    C_ABSOLUTE);
+			return (NULL);
+		}
+		isc->trim_next = 0;
+	}
+	return (bp);
+}
+
+/*
+ * Peek at the delete queue without regard to pacing, for drivers that
+ * coalesce several queued deletes into one command.
+ */
+struct bio *
+cam_iosched_first_trim(struct cam_iosched_softc *isc)
+{
+
+	return (bioq_first(&isc->trim_stats.queue));
+}
+
+void
+cam_iosched_take_trim(struct cam_iosched_softc *isc, struct bio *bp)
+{
+
+	cam_iosched_dequeue(isc, &isc->trim_stats, bp);
+}
+
+void
+cam_iosched_put_back_trim(struct cam_iosched_softc *isc, struct bio *bp)
+{
+
+	bioq_disksort(&isc->trim_stats.queue, bp);
+	isc->trim_stats.queued++;
+}
+
+int
+cam_iosched_has_trim(struct cam_iosched_softc *isc)
+{
+
+	return (cam_iosched_next_trim(isc) != NULL);
+}
+
+int
+cam_iosched_has_work(struct cam_iosched_softc *isc)
+{
+
+	return (cam_iosched_has_io(isc) || cam_iosched_has_trim(isc));
+}
+
+void
+cam_iosched_flush_io(struct cam_iosched_softc *isc, struct devstat *stp,
+    int err)
+{
+
+	bioq_flush(&isc->read_stats.queue, stp, err);
+	bioq_flush(&isc->write_stats.queue, stp, err);
+	isc->read_stats.queued = 0;
+	isc->write_stats.queued = 0;
+	isc->barriers = 0;
+}
+
+void
+cam_iosched_flush(struct cam_iosched_softc *isc, struct devstat *stp, int err)
+{
+
+	cam_iosched_flush_io(isc, stp, err);
+	bioq_flush(&isc->trim_stats.queue, stp, err);
+	isc->trim_stats.queued = 0;
+}
+
+/*
+ * Note that bp is about to be sent to the device in ccb.  For commands
+ * that carry several bios, such as a coalesced delete, pass the first.
+ */
+void
+cam_iosched_submit(struct cam_iosched_softc *isc, struct bio *bp,
+    union ccb *ccb)
+{
+
+	ccb->ccb_h.qos.periph_data = cam_iosched_now();
+	cam_iosched_class(isc, bp)->in_flight++;
+}
+
+/*
+ * A command passed to cam_iosched_submit() failed and its bios were put
+ * back on the queue instead of being completed.  It is no longer in
+ * flight, but must not count towards the totals or the latency.
+ */
+void
+cam_iosched_bio_requeued(struct cam_iosched_softc *isc, struct bio *bp)
+{
+
+	cam_iosched_class(isc, bp)->in_flight--;
+}
+
+/*
+ * Account for the completion of a command passed to cam_iosched_submit().
+ * Must not be called for a CCB that is being retried.
+ */
+void
+cam_iosched_bio_complete(struct cam_iosched_softc *isc, struct bio *bp,
+    union ccb *done_ccb)
+{
+	struct iop_stats *ios;
+	uint64_t lat;
+	int i;
+
+	ios = cam_iosched_class(isc, bp);
+	ios->in_flight--;
+	ios->total++;
+	lat = CAM_IOSCHED_TS_US((uint32_t)(cam_iosched_now() -
+	    done_ccb->ccb_h.qos.periph_data));
+	if (ios->total == 1)
+		ios->ewma_us = lat;
+	else
+		ios->ewma_us = ios->ewma_us - (ios->ewma_us >> 3) + (lat >> 3);
+	if (lat > ios->max_us)
+		ios->max_us = lat;
+	for (i = 0; i < CAM_IOSCHED_HIST_BUCKETS - 1; i++)
+		if (lat < cam_iosched_hist_us[i])
+			break;
+	ios->hist[i]++;
+
+	if (ios == &isc->trim_stats && isc->policy == CAM_IOSCHED_WEIGHTED) {
+		if (isc->trim_target_us > 0 &&
+		    ios->ewma_us > (uint64_t)isc->trim_target_us)
+			isc->trim_next = sbinuptime() +
+			    (ios->ewma_us - isc->trim_target_us) * SBT_1US;
+		else
+			isc->trim_next = 0;
+	}
+}
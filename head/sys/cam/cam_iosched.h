@@ -0,0 +1,86 @@
+/*-
+ * CAM peripheral I/O scheduler definitions.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer,
+ *    without modification, immediately at the beginning of the file.
+ * 2. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#ifndef _CAM_CAM_IOSCHED_H
+#define _CAM_CAM_IOSCHED_H 1
+
+#ifdef _KERNEL
+
+/*
+ * Scheduling policies.  FIFO keeps reads and writes on a single queue in
+ * arrival (or disksort) order, exactly as the periph drivers always have.
+ * WEIGHTED splits reads, writes and deletes into separate classes that
+ * are dispatched by weight, each with its own queue-depth limit, and
+ * paces deletes against a target latency.
+ */
+#define	CAM_IOSCHED_FIFO	0
+#define	CAM_IOSCHED_WEIGHTED	1
+#define	CAM_IOSCHED_MAX		2
+
+struct bio;
+struct cam_periph;
+struct cam_iosched_softc;
+struct devstat;
+struct sysctl_ctx_list;
+struct sysctl_oid;
+union ccb;
+
+/*
+ * Called, with the periph lock held, when work held back by the scheduler
+ * becomes eligible again.  Normally the periph's own xxschedule() routine.
+ */
+typedef void cam_iosched_schedule_t(struct cam_periph *);
+
+int	cam_iosched_init(struct cam_iosched_softc **, struct cam_periph *,
+	    cam_iosched_schedule_t *);
+void	cam_iosched_fini(struct cam_iosched_softc *);
+void	cam_iosched_sysctl_init(struct cam_iosched_softc *,
+	    struct sysctl_ctx_list *, struct sysctl_oid *);
+void	cam_iosched_set_sort_queue(struct cam_iosched_softc *, int);
+void	cam_iosched_queue_work(struct cam_iosched_softc *, struct bio *);
+struct bio *cam_iosched_next_bio(struct cam_iosched_softc *);
+struct bio *cam_iosched_next_trim(struct cam_iosched_softc *);
+struct bio *cam_iosched_first_trim(struct cam_iosched_softc *);
+void	cam_iosched_take_trim(struct cam_iosched_softc *, struct bio *);
+void	cam_iosched_put_back_trim(struct cam_iosched_softc *, struct bio *);
+int	cam_iosched_has_io(struct cam_iosched_softc *);
+int	cam_iosched_has_trim(struct cam_iosched_softc *);
+int	cam_iosched_has_work(struct cam_iosched_softc *);
+void	cam_iosched_flush(struct cam_iosched_softc *, struct devstat *, int);
+void	cam_iosched_flush_io(struct cam_iosched_softc *, struct devstat *,
+	    int);
+void	cam_iosched_submit(struct cam_iosched_softc *, struct bio *,
+	    union ccb *);
+void	cam_iosched_bio_complete(struct cam_iosched_softc *, struct bio *,
+	    union ccb *);
+void	cam_iosched_bio_requeued(struct cam_iosched_softc *, struct bio *);
+
+#endif /* _KERNEL */
+#endif /* _CAM_CAM_IOSCHED_H */
@@ -68,6 +68,7 @@ static	u_int		camperiphunit(struct periph_driver *p_drv,
 static	void		camperiphdone(struct cam_periph *periph, 
 					union ccb *done_ccb);
 static  void		camperiphfree(struct cam_periph *periph);
+static	size_t		cam_periph_ccb_len(union ccb *ccb);
 static int		camperiphscsistatuserror(union ccb *ccb,
 					        union ccb **orig_ccb,
 						 cam_flags camflags,
@@ -1032,8 +1033,12 @@ cam_periph_ioctl(struct cam_periph *periph, u_long cmd, caddr_t addr,
 			}
 		}
 
-		/* copy the result back out */	
-		bcopy(ccb, addr, sizeof(union ccb));
+		/*
+		 * Copy the result back out.  Our CCB may be smaller than the
+		 * union ccb the caller handed us.
+		 */
+		bzero(addr, sizeof(union ccb));
+		bcopy(ccb, addr, sizeof(struct ccb_getdevlist));
 
 		/* and release the ccb */
 		xpt_release_ccb(ccb);
@@ -1159,6 +1164,26 @@ cam_release_devq(struct cam_path *path, u_int32_t relsim_flags,
 	return (crs.qfrozen_cnt);
 }
 
+/*
+ * Number of bytes that are meaningful when copying a CCB used for error
+ * recovery.  Scheduled SCSI and ATA I/O CCBs may come from a size class
+ * smaller than the union ccb, so never copy more than the I/O structure
+ * itself.
+ */
+static size_t
+cam_periph_ccb_len(union ccb *ccb)
+{
+
+	switch (ccb->ccb_h.func_code) {
+	case XPT_SCSI_IO:
+		return (sizeof(struct ccb_scsiio));
+	case XPT_ATA_IO:
+		return (sizeof(struct ccb_ataio));
+	default:
+		return (sizeof(union ccb));
+	}
+}
+
 #define saved_ccb_ptr ppriv_ptr0
 static void
 camperiphdone(struct cam_periph *periph, union ccb *done_ccb)
@@ -1222,7 +1247,7 @@ camperiphdone(struct cam_periph *periph, union ccb *done_ccb)
 	 * error processing is performed by the owner of the CCB.
 	 */
 	saved_ccb = (union ccb *)done_ccb->ccb_h.saved_ccb_ptr;
-	bcopy(saved_ccb, done_ccb, sizeof(*done_ccb));
+	bcopy(saved_ccb, done_ccb, cam_periph_ccb_len(saved_ccb));
 	xpt_free_ccb(saved_ccb);
 	if (done_ccb->ccb_h.cbfcnp != camperiphdone)
 		periph->flags &= ~CAM_PERIPH_RECOVERY_INPROG;
@@ -1494,7 +1519,7 @@ camperiphscsisenseerror(union ccb *ccb, union ccb **orig,
 			 * this freeze will be dropped as part of ERESTART.
 			 */
 			ccb->ccb_h.status &= ~CAM_DEV_QFRZN;
-			bcopy(ccb, orig_ccb, sizeof(*orig_ccb));
+			bcopy(ccb, orig_ccb, cam_periph_ccb_len(ccb));
 		}
 
 		switch (err_action & SS_MASK) {
@@ -127,6 +127,7 @@ struct cam_periph {
 	uint32_t		 immediate_priority;
 	int			 periph_allocating;
 	int			 periph_allocated;
+	int			 ccb_class;	/* Size class for scheduled CCBs */
 	u_int32_t		 refcount;
 	SLIST_HEAD(, ccb_hdr)	 ccb_list;	/* For "immediate" requests */
 	SLIST_ENTRY(cam_periph)  periph_links;
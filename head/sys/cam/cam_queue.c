@@ -228,11 +228,12 @@ cam_devq_alloc(int devices, int openings)
 int
 cam_devq_init(struct cam_devq *devq, int devices, int openings)
 {
+	int i;
 
 	bzero(devq, sizeof(*devq));
 	mtx_init(&devq->send_mtx, "CAM queue lock", NULL, MTX_DEF);
-	if (camq_init(&devq->send_queue, devices) != 0)
-		return (1);
+	for (i = 0; i < CAM_DEVQ_BUCKETS; i++)
+		TAILQ_INIT(&devq->send_ready[i]);
 	devq->send_openings = openings;
 	devq->send_active = 0;
 	return (0);
@@ -242,18 +243,19 @@ void
 cam_devq_free(struct cam_devq *devq)
 {
 
-	camq_fini(&devq->send_queue);
 	mtx_destroy(&devq->send_mtx);
 	free(devq, M_CAMDEVQ);
 }
 
+/*
+ * The ready lists are linked through the devices themselves and need no
+ * preallocated space; this is kept for API compatibility.
+ */
 u_int32_t
 cam_devq_resize(struct cam_devq *camq, int devices)
 {
-	u_int32_t retval;
 
-	retval = camq_resize(&camq->send_queue, devices);
-	return (retval);
+	return (CAM_REQ_CMP);
 }
 
 struct cam_ccbq *
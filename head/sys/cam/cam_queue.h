@@ -68,12 +68,41 @@ struct cam_ccbq {
 };
 
 struct cam_ed;
+struct thread;
+
+/*
+ * Devices with CCBs ready to send wait on per-priority ready lists rather
+ * than in a heap.  A CAM priority is a run level shifted left by 8 plus a
+ * small offset, so CAM_DEVQ_PRIO_SHIFT yields two lists per run level, and
+ * all priorities past the last run level share the final list.  Queueing
+ * and dequeueing a device are O(1), and devices of equal priority are
+ * served round robin.
+ */
+#define	CAM_DEVQ_PRIO_SHIFT	7
+#define	CAM_DEVQ_BUCKETS	(((CAM_RL_VALUES << 8) >> CAM_DEVQ_PRIO_SHIFT) + 1)
+
+/*
+ * Up to CAM_DEVQ_MAX_RUNNERS threads may hand CCBs to the SIM at once.  Each
+ * runner owns the device it is sending for until the SIM action returns, so
+ * CCBs for one device still reach the SIM in queue order.
+ */
+#define	CAM_DEVQ_MAX_RUNNERS	8
+
+struct cam_devq_runner {
+	struct thread	*td;
+	struct cam_ed	*dev;
+};
 
 struct cam_devq {
 	struct mtx	 send_mtx;
-	struct camq	 send_queue;
-	int		 send_openings;
-	int		 send_active;
+	TAILQ_HEAD(, cam_ed) send_ready[CAM_DEVQ_BUCKETS];
+	u_int		 send_ready_map;	/* Non-empty send_ready lists */
+	int		 send_entries;		/* Devices on send_ready lists */
+	u_int32_t	 send_frozen;		/* SIM queue freeze count */
+	int		 send_runners;
+	struct cam_devq_runner send_runner[CAM_DEVQ_MAX_RUNNERS];
+	volatile int	 send_openings;		/* Updated atomically */
+	volatile int	 send_active;		/* Updated atomically */
 };
 
 
@@ -35,6 +35,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/systm.h>
 #include <sys/types.h>
 #include <sys/malloc.h>
+#include <sys/counter.h>
 #include <sys/kernel.h>
 #include <sys/time.h>
 #include <sys/conf.h>
@@ -66,6 +67,8 @@ __FBSDID("$FreeBSD$");
 #include <cam/scsi/scsi_message.h>
 #include <cam/scsi/scsi_pass.h>
 
+#include <vm/uma.h>
+
 #include <machine/md_var.h>	/* geometry translation */
 #include <machine/stdarg.h>	/* for xpt_print below */
 
@@ -82,7 +85,6 @@ __FBSDID("$FreeBSD$");
 /* Datastructures internal to the xpt layer */
 MALLOC_DEFINE(M_CAMXPT, "CAM XPT", "CAM XPT buffers");
 MALLOC_DEFINE(M_CAMDEV, "CAM DEV", "CAM devices");
-MALLOC_DEFINE(M_CAMCCB, "CAM CCB", "CAM CCBs");
 MALLOC_DEFINE(M_CAMPATH, "CAM path", "CAM paths");
 
 /* Object for defering XPT actions to a taskqueue */
@@ -198,6 +200,13 @@ static struct cdevsw xpt_cdevsw = {
 	.d_name =	"xpt",
 };
 
+static int xpt_devq_runners = CAM_DEVQ_MAX_RUNNERS;
+static int xpt_devq_runners_sysctl(SYSCTL_HANDLER_ARGS);
+SYSCTL_PROC(_kern_cam, OID_AUTO, devq_runners,
+    CTLTYPE_INT | CTLFLAG_RWTUN | CTLFLAG_MPSAFE, &xpt_devq_runners, 0,
+    xpt_devq_runners_sysctl, "I",
+    "Threads that may send CCBs from one SIM queue concurrently");
+
 /* Storage for debugging datastructures */
 struct cam_path *cam_dpath;
 u_int32_t cam_dflags = CAM_DEBUG_FLAGS;
@@ -207,6 +216,44 @@ u_int32_t cam_debug_delay = CAM_DEBUG_DELAY;
 SYSCTL_UINT(_kern_cam, OID_AUTO, debug_delay, CTLFLAG_RWTUN,
 	&cam_debug_delay, 0, "Delay in us after each debug message");
 
+/*
+ * CCBs come from UMA zones so that the per-CPU bucket caches absorb the
+ * allocate/free pair performed for every scheduled I/O.  A peripheral driver
+ * that only ever issues one kind of I/O CCB from its scheduled CCBs may pick
+ * a smaller size class, so it neither allocates nor zeroes the full union.
+ * Each class may leave one output-only range (the autosense buffer) to be
+ * filled in by the SIM instead of clearing it on every allocation.
+ */
+struct xpt_ccb_class {
+	const char	*name;
+	size_t		size;
+	size_t		skip_off;
+	size_t		skip_len;
+	uma_zone_t	zone;
+	counter_u64_t	allocs;
+	counter_u64_t	failures;
+};
+
+static struct xpt_ccb_class xpt_ccb_classes[CAM_CCB_CLASS_MAX] = {
+	[CAM_CCB_CLASS_FULL] = {
+		.name = "full",
+		.size = sizeof(union ccb),
+	},
+	[CAM_CCB_CLASS_SCSIIO] = {
+		.name = "scsiio",
+		.size = sizeof(struct ccb_scsiio),
+		.skip_off = offsetof(struct ccb_scsiio, sense_data),
+		.skip_len = sizeof(struct scsi_sense_data),
+	},
+	[CAM_CCB_CLASS_ATAIO] = {
+		.name = "ataio",
+		.size = sizeof(struct ccb_ataio),
+	},
+};
+
+static SYSCTL_NODE(_kern_cam, OID_AUTO, ccb, CTLFLAG_RD, 0,
+    "CAM CCB allocator");
+
 /* Our boot-time initialization hook */
 static int cam_module_event_handler(module_t, int /*modeventtype_t*/, void *);
 
@@ -217,6 +264,9 @@ static moduledata_t cam_moduledata = {
 };
 
 static int	xpt_init(void *);
+static void	xpt_ccb_zones_init(void);
+static int	xpt_ccb_zone_sysctl(SYSCTL_HANDLER_ARGS);
+static union ccb *xpt_ccb_class_alloc(int ccb_class, int flags);
 
 DECLARE_MODULE(cam, cam_moduledata, SI_SUB_CONFIGURE, SI_ORDER_SECOND);
 MODULE_VERSION(cam, 1);
@@ -251,8 +301,10 @@ static struct cam_et*
 static struct cam_ed*
 		 xpt_find_device(struct cam_et *target, lun_id_t lun_id);
 static void	 xpt_config(void *arg);
-static int	 xpt_schedule_dev(struct camq *queue, cam_pinfo *dev_pinfo,
+static int	 xpt_schedule_dev(struct cam_devq *devq, struct cam_ed *dev,
 				 u_int32_t new_priority);
+static void	 xpt_devq_remove(struct cam_devq *devq, struct cam_ed *dev);
+static struct cam_ed *xpt_devq_dequeue(struct cam_devq *devq);
 static xpt_devicefunc_t xptpassannouncefunc;
 static void	 xptaction(struct cam_sim *sim, union ccb *work_ccb);
 static void	 xptpoll(struct cam_sim *sim);
@@ -319,16 +371,16 @@ xpt_schedule_devq(struct cam_devq *devq, struct cam_ed *dev)
 	mtx_assert(&devq->send_mtx, MA_OWNED);
 	if ((dev->ccbq.queue.entries > 0) &&
 	    (dev->ccbq.dev_openings > 0) &&
-	    (dev->ccbq.queue.qfrozen_cnt == 0)) {
+	    (dev->ccbq.queue.qfrozen_cnt == 0) &&
+	    (dev->devq_dispatching == 0)) {
 		/*
 		 * The priority of a device waiting for controller
 		 * resources is that of the highest priority CCB
-		 * enqueued.
+		 * enqueued.  A device owned by a devq runner is
+		 * rescheduled by that runner once its CCB is sent.
 		 */
-		retval =
-		    xpt_schedule_dev(&devq->send_queue,
-				     &dev->devq_entry,
-				     CAMQ_GET_PRIO(&dev->ccbq.queue));
+		retval = xpt_schedule_dev(devq, dev,
+		    CAMQ_GET_PRIO(&dev->ccbq.queue));
 	} else {
 		retval = 0;
 	}
@@ -845,6 +897,8 @@ xpt_init(void *dummy)
 	cam_status status;
 	int error, i;
 
+	xpt_ccb_zones_init();
+
 	TAILQ_INIT(&xsoftc.xpt_busses);
 	TAILQ_INIT(&xsoftc.ccb_scanq);
 	STAILQ_INIT(&xsoftc.highpowerq);
@@ -3082,6 +3136,55 @@ xpt_schedule(struct cam_periph *periph, u_int32_t new_priority)
 }
 
 
+static int
+xpt_devq_runners_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	int error, value;
+
+	value = xpt_devq_runners;
+	error = sysctl_handle_int(oidp, &value, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (value < 1 || value > CAM_DEVQ_MAX_RUNNERS)
+		return (EINVAL);
+	xpt_devq_runners = value;
+	return (0);
+}
+
+static __inline int
+xpt_devq_bucket(u_int32_t priority)
+{
+
+	return (min(priority >> CAM_DEVQ_PRIO_SHIFT, CAM_DEVQ_BUCKETS - 1));
+}
+
+static void
+xpt_devq_remove(struct cam_devq *devq, struct cam_ed *dev)
+{
+	int bucket;
+
+	mtx_assert(&devq->send_mtx, MA_OWNED);
+	bucket = dev->devq_entry.index;
+	TAILQ_REMOVE(&devq->send_ready[bucket], dev, devq_links);
+	if (TAILQ_EMPTY(&devq->send_ready[bucket]))
+		devq->send_ready_map &= ~(1u << bucket);
+	dev->devq_entry.index = CAM_UNQUEUED_INDEX;
+	devq->send_entries--;
+}
+
+static struct cam_ed *
+xpt_devq_dequeue(struct cam_devq *devq)
+{
+	struct cam_ed *dev;
+
+	mtx_assert(&devq->send_mtx, MA_OWNED);
+	if (devq->send_ready_map == 0)
+		return (NULL);
+	dev = TAILQ_FIRST(&devq->send_ready[ffs(devq->send_ready_map) - 1]);
+	xpt_devq_remove(devq, dev);
+	return (dev);
+}
+
 /*
  * Schedule a device to run on a given queue.
  * If the device was inserted as a new entry on the queue,
@@ -3091,42 +3194,40 @@ xpt_schedule(struct cam_periph *periph, u_int32_t new_priority)
  * to run the queue.
  */
 static int
-xpt_schedule_dev(struct camq *queue, cam_pinfo *pinfo,
+xpt_schedule_dev(struct cam_devq *devq, struct cam_ed *dev,
 		 u_int32_t new_priority)
 {
-	int retval;
-	u_int32_t old_priority;
+	cam_pinfo *pinfo;
+	int bucket;
 
 	CAM_DEBUG_PRINT(CAM_DEBUG_XPT, ("xpt_schedule_dev\n"));
 
-	old_priority = pinfo->priority;
+	pinfo = &dev->devq_entry;
+	bucket = xpt_devq_bucket(new_priority);
 
 	/*
 	 * Are we already queued?
 	 */
 	if (pinfo->index != CAM_UNQUEUED_INDEX) {
 		/* Simply reorder based on new priority */
-		if (new_priority < old_priority) {
-			camq_change_priority(queue, pinfo->index,
-					     new_priority);
-			CAM_DEBUG_PRINT(CAM_DEBUG_XPT,
-					("changed priority to %d\n",
-					 new_priority));
-			retval = 1;
-		} else
-			retval = 0;
+		if (new_priority >= pinfo->priority)
+			return (0);
+		pinfo->priority = new_priority;
+		CAM_DEBUG_PRINT(CAM_DEBUG_XPT,
+				("changed priority to %d\n", new_priority));
+		if (bucket == pinfo->index)
+			return (1);
+		xpt_devq_remove(devq, dev);
 	} else {
-		/* New entry on the queue */
-		if (new_priority < old_priority)
-			pinfo->priority = new_priority;
-
 		CAM_DEBUG_PRINT(CAM_DEBUG_XPT,
 				("Inserting onto queue\n"));
-		pinfo->generation = ++queue->generation;
-		camq_insert(queue, pinfo);
-		retval = 1;
 	}
-	return (retval);
+	pinfo->priority = new_priority;
+	pinfo->index = bucket;
+	TAILQ_INSERT_TAIL(&devq->send_ready[bucket], dev, devq_links);
+	devq->send_ready_map |= 1u << bucket;
+	devq->send_entries++;
+	return (1);
 }
 
 static void
@@ -3196,24 +3297,46 @@ restart:
 	periph->periph_allocating = 0;
 }
 
+/*
+ * Send queued CCBs to the SIM.  Several threads may do this for the same
+ * devq at once, each taking a runner slot and owning one device at a time,
+ * so independent devices are dispatched concurrently while CCBs for any one
+ * device keep their order.  A thread that re-enters from within a SIM action,
+ * or that finds every slot busy, leaves its work to the active runners; they
+ * check the ready lists again before giving up their slots.
+ */
 static void
 xpt_run_devq(struct cam_devq *devq)
 {
 	char cdb_str[(SCSI_MAX_CDBLEN * 3) + 1];
-	int lock;
+	struct cam_devq_runner *runner;
+	int i, lock;
 
 	CAM_DEBUG_PRINT(CAM_DEBUG_XPT, ("xpt_run_devq\n"));
 
-	devq->send_queue.qfrozen_cnt++;
-	while ((devq->send_queue.entries > 0)
+	mtx_assert(&devq->send_mtx, MA_OWNED);
+	if (devq->send_entries == 0 || devq->send_openings <= 0 ||
+	    devq->send_frozen != 0 || devq->send_runners >= xpt_devq_runners)
+		return;
+	runner = NULL;
+	for (i = 0; i < CAM_DEVQ_MAX_RUNNERS; i++) {
+		if (devq->send_runner[i].td == curthread)
+			return;
+		if (runner == NULL && devq->send_runner[i].td == NULL)
+			runner = &devq->send_runner[i];
+	}
+	runner->td = curthread;
+	runner->dev = NULL;
+	devq->send_runners++;
+
+	while ((devq->send_entries > 0)
 	    && (devq->send_openings > 0)
-	    && (devq->send_queue.qfrozen_cnt <= 1)) {
+	    && (devq->send_frozen == 0)) {
 		struct	cam_ed *device;
 		union ccb *work_ccb;
 		struct	cam_sim *sim;
 
-		device = (struct cam_ed *)camq_remove(&devq->send_queue,
-							   CAMQ_HEAD);
+		device = xpt_devq_dequeue(devq);
 		CAM_DEBUG_PRINT(CAM_DEBUG_XPT,
 				("running device %p\n", device));
 
@@ -3250,9 +3373,10 @@ xpt_run_devq(struct cam_devq *devq)
 		}
 		cam_ccbq_remove_ccb(&device->ccbq, work_ccb);
 		cam_ccbq_send_ccb(&device->ccbq, work_ccb);
-		devq->send_openings--;
-		devq->send_active++;
-		xpt_schedule_devq(devq, device);
+		atomic_subtract_int(&devq->send_openings, 1);
+		atomic_add_int(&devq->send_active, 1);
+		device->devq_dispatching = 1;
+		runner->dev = device;
 		mtx_unlock(&devq->send_mtx);
 
 		if ((work_ccb->ccb_h.flags & CAM_DEV_QFREEZE) != 0) {
@@ -3310,8 +3434,20 @@ xpt_run_devq(struct cam_devq *devq)
 		if (lock)
 			CAM_SIM_UNLOCK(sim);
 		mtx_lock(&devq->send_mtx);
+
+		/*
+		 * The CCB may have completed and the device gone away while
+		 * we were unlocked; xpt_release_device() clears our reference
+		 * in that case.
+		 */
+		if ((device = runner->dev) != NULL) {
+			runner->dev = NULL;
+			device->devq_dispatching = 0;
+			xpt_schedule_devq(devq, device);
+		}
 	}
-	devq->send_queue.qfrozen_cnt--;
+	runner->td = NULL;
+	devq->send_runners--;
 }
 
 /*
@@ -3821,7 +3957,7 @@ xpt_release_ccb(union ccb *free_ccb)
 	device = free_ccb->ccb_h.path->device;
 	periph = free_ccb->ccb_h.path->periph;
 
-	xpt_free_ccb(free_ccb);
+	uma_zfree(xpt_ccb_classes[periph->ccb_class].zone, free_ccb);
 	periph->periph_allocated--;
 	cam_ccbq_release_opening(&device->ccbq);
 	xpt_run_allocq(periph, 0);
@@ -4317,7 +4453,7 @@ xpt_freeze_devq_device(struct cam_ed *dev, u_int count)
 	freeze = (dev->ccbq.queue.qfrozen_cnt += count);
 	/* Remove frozen device from sendq. */
 	if (device_is_queued(dev))
-		camq_remove(&devq->send_queue, dev->devq_entry.index);
+		xpt_devq_remove(devq, dev);
 	return (freeze);
 }
 
@@ -4344,7 +4480,7 @@ xpt_freeze_simq(struct cam_sim *sim, u_int count)
 
 	devq = sim->devq;
 	mtx_lock(&devq->send_mtx);
-	freeze = (devq->send_queue.qfrozen_cnt += count);
+	freeze = (devq->send_frozen += count);
 	mtx_unlock(&devq->send_mtx);
 	return (freeze);
 }
@@ -4427,14 +4563,14 @@ xpt_release_simq(struct cam_sim *sim, int run_queue)
 
 	devq = sim->devq;
 	mtx_lock(&devq->send_mtx);
-	if (devq->send_queue.qfrozen_cnt <= 0) {
+	if (devq->send_frozen <= 0) {
 #ifdef INVARIANTS
 		printf("xpt_release_simq: requested 1 > present %u\n",
-		    devq->send_queue.qfrozen_cnt);
+		    devq->send_frozen);
 #endif
 	} else
-		devq->send_queue.qfrozen_cnt--;
-	if (devq->send_queue.qfrozen_cnt == 0) {
+		devq->send_frozen--;
+	if (devq->send_frozen == 0) {
 		/*
 		 * If there is a timeout scheduled to release this
 		 * sim queue, remove it.  The queue frozen count is
@@ -4499,12 +4635,86 @@ xpt_done_direct(union ccb *done_ccb)
 	xpt_done_process(&done_ccb->ccb_h);
 }
 
+static void
+xpt_ccb_zones_init(void)
+{
+	struct xpt_ccb_class *cc;
+	struct sysctl_oid *oid;
+	char name[32];
+	int i;
+
+	for (i = 0; i < CAM_CCB_CLASS_MAX; i++) {
+		cc = &xpt_ccb_classes[i];
+		if (i == CAM_CCB_CLASS_FULL)
+			strlcpy(name, "CAM CCB", sizeof(name));
+		else
+			snprintf(name, sizeof(name), "CAM CCB %s", cc->name);
+		cc->zone = uma_zcreate(name, cc->size, NULL, NULL, NULL, NULL,
+		    UMA_ALIGN_PTR, 0);
+		cc->allocs = counter_u64_alloc(M_WAITOK);
+		cc->failures = counter_u64_alloc(M_WAITOK);
+
+		oid = SYSCTL_ADD_NODE(NULL, SYSCTL_STATIC_CHILDREN(_kern_cam_ccb),
+		    OID_AUTO, cc->name, CTLFLAG_RD, 0, "CCB size class");
+		SYSCTL_ADD_UINT(NULL, SYSCTL_CHILDREN(oid), OID_AUTO, "size",
+		    CTLFLAG_RD, NULL, cc->size, "Size of each CCB in bytes");
+		SYSCTL_ADD_COUNTER_U64(NULL, SYSCTL_CHILDREN(oid), OID_AUTO,
+		    "allocs", CTLFLAG_RD, &cc->allocs, "CCBs allocated");
+		SYSCTL_ADD_COUNTER_U64(NULL, SYSCTL_CHILDREN(oid), OID_AUTO,
+		    "failures", CTLFLAG_RD, &cc->failures,
+		    "Failed CCB allocations");
+		SYSCTL_ADD_PROC(NULL, SYSCTL_CHILDREN(oid), OID_AUTO, "in_use",
+		    CTLTYPE_INT | CTLFLAG_RD, cc, 0, xpt_ccb_zone_sysctl, "I",
+		    "CCBs currently allocated");
+	}
+}
+
+static int
+xpt_ccb_zone_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct xpt_ccb_class *cc;
+	int cur;
+
+	cc = (struct xpt_ccb_class *)arg1;
+	cur = uma_zone_get_cur(cc->zone);
+	return (sysctl_handle_int(oidp, &cur, 0, req));
+}
+
+/*
+ * Allocate a CCB from the given size class.  Everything but the class'
+ * output-only range is cleared; callers see the same zeroed request fields
+ * they always got from malloc(9) with M_ZERO.
+ */
+static union ccb *
+xpt_ccb_class_alloc(int ccb_class, int flags)
+{
+	struct xpt_ccb_class *cc;
+	union ccb *new_ccb;
+	size_t tail;
+
+	cc = &xpt_ccb_classes[ccb_class];
+	new_ccb = uma_zalloc(cc->zone, flags);
+	if (new_ccb == NULL) {
+		counter_u64_add(cc->failures, 1);
+		return (NULL);
+	}
+	counter_u64_add(cc->allocs, 1);
+	if (cc->skip_len == 0) {
+		bzero(new_ccb, cc->size);
+	} else {
+		tail = cc->skip_off + cc->skip_len;
+		bzero(new_ccb, cc->skip_off);
+		bzero((char *)new_ccb + tail, cc->size - tail);
+	}
+	return (new_ccb);
+}
+
 union ccb *
 xpt_alloc_ccb()
 {
 	union ccb *new_ccb;
 
-	new_ccb = malloc(sizeof(*new_ccb), M_CAMCCB, M_ZERO|M_WAITOK);
+	new_ccb = xpt_ccb_class_alloc(CAM_CCB_CLASS_FULL, M_WAITOK);
 	return (new_ccb);
 }
 
@@ -4513,14 +4723,14 @@ xpt_alloc_ccb_nowait()
 {
 	union ccb *new_ccb;
 
-	new_ccb = malloc(sizeof(*new_ccb), M_CAMCCB, M_ZERO|M_NOWAIT);
+	new_ccb = xpt_ccb_class_alloc(CAM_CCB_CLASS_FULL, M_NOWAIT);
 	return (new_ccb);
 }
 
 void
 xpt_free_ccb(union ccb *free_ccb)
 {
-	free(free_ccb, M_CAMCCB);
+	uma_zfree(xpt_ccb_classes[CAM_CCB_CLASS_FULL].zone, free_ccb);
 }
 
 
@@ -4537,7 +4747,7 @@ xpt_get_ccb_nowait(struct cam_periph *periph)
 {
 	union ccb *new_ccb;
 
-	new_ccb = malloc(sizeof(*new_ccb), M_CAMCCB, M_ZERO|M_NOWAIT);
+	new_ccb = xpt_ccb_class_alloc(periph->ccb_class, M_NOWAIT);
 	if (new_ccb == NULL)
 		return (NULL);
 	periph->periph_allocated++;
@@ -4551,7 +4761,7 @@ xpt_get_ccb(struct cam_periph *periph)
 	union ccb *new_ccb;
 
 	cam_periph_unlock(periph);
-	new_ccb = malloc(sizeof(*new_ccb), M_CAMCCB, M_ZERO|M_WAITOK);
+	new_ccb = xpt_ccb_class_alloc(periph->ccb_class, M_WAITOK);
 	cam_periph_lock(periph);
 	periph->periph_allocated++;
 	cam_ccbq_take_opening(&periph->path->device->ccbq);
@@ -4708,17 +4918,9 @@ xpt_alloc_device(struct cam_eb *bus, struct cam_et *target, lun_id_t lun_id)
 {
 	struct cam_ed	*cur_device, *device;
 	struct cam_devq	*devq;
-	cam_status status;
 
 	mtx_assert(&bus->eb_mtx, MA_OWNED);
-	/* Make space for us in the device queue on our bus */
 	devq = bus->sim->devq;
-	mtx_lock(&devq->send_mtx);
-	status = cam_devq_resize(devq, devq->send_queue.array_size + 1);
-	mtx_unlock(&devq->send_mtx);
-	if (status != CAM_REQ_CMP)
-		return (NULL);
-
 	device = (struct cam_ed *)malloc(sizeof(*device),
 					 M_CAMDEV, M_NOWAIT|M_ZERO);
 	if (device == NULL)
@@ -4775,6 +4977,7 @@ xpt_release_device(struct cam_ed *device)
 {
 	struct cam_eb *bus = device->target->bus;
 	struct cam_devq *devq;
+	int i;
 
 	mtx_lock(&bus->eb_mtx);
 	if (--device->refcount > 0) {
@@ -4786,10 +4989,19 @@ xpt_release_device(struct cam_ed *device)
 	device->target->generation++;
 	mtx_unlock(&bus->eb_mtx);
 
-	/* Release our slot in the devq */
+	/*
+	 * A devq runner may still hold us if our last CCB completed while
+	 * it was sending it; make sure it does not touch us again.
+	 */
 	devq = bus->sim->devq;
 	mtx_lock(&devq->send_mtx);
-	cam_devq_resize(devq, devq->send_queue.array_size - 1);
+	if (device->devq_dispatching != 0) {
+		for (i = 0; i < CAM_DEVQ_MAX_RUNNERS; i++) {
+			if (devq->send_runner[i].dev == device)
+				devq->send_runner[i].dev = NULL;
+		}
+		device->devq_dispatching = 0;
+	}
 	mtx_unlock(&devq->send_mtx);
 
 	KASSERT(SLIST_EMPTY(&device->periphs),
@@ -5230,9 +5442,9 @@ xpt_done_process(struct ccb_hdr *ccb_h)
 	if ((ccb_h->func_code & XPT_FC_USER_CCB) == 0) {
 		struct cam_ed *dev = ccb_h->path->device;
 
+		atomic_subtract_int(&devq->send_active, 1);
+		atomic_add_int(&devq->send_openings, 1);
 		mtx_lock(&devq->send_mtx);
-		devq->send_active--;
-		devq->send_openings++;
 		cam_ccbq_ccb_done(&dev->ccbq, (union ccb *)ccb_h);
 
 		if (((dev->flags & CAM_DEV_REL_ON_QUEUE_EMPTY) != 0
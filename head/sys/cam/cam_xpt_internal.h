@@ -62,7 +62,9 @@ struct xpt_xport {
  * cam_ed structure for each device on the bus.
  */
 struct cam_ed {
-	cam_pinfo	 devq_entry;
+	cam_pinfo	 devq_entry;	/* index is the ready list, if queued */
+	TAILQ_ENTRY(cam_ed) devq_links;
+	int		 devq_dispatching; /* A devq runner owns the device */
 	TAILQ_ENTRY(cam_ed) links;
 	struct	cam_et	 *target;
 	struct	cam_sim  *sim;
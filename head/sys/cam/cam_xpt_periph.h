@@ -38,6 +38,17 @@
 
 /* Functions accessed by the peripheral drivers */
 #ifdef _KERNEL
+/*
+ * Size classes for the CCBs handed to a peripheral's start routine.  A
+ * driver may select a class other than CAM_CCB_CLASS_FULL in its constructor,
+ * before any CCB is scheduled, when it only uses those CCBs for the matching
+ * I/O function code.
+ */
+#define	CAM_CCB_CLASS_FULL	0	/* union ccb */
+#define	CAM_CCB_CLASS_SCSIIO	1	/* struct ccb_scsiio */
+#define	CAM_CCB_CLASS_ATAIO	2	/* struct ccb_ataio */
+#define	CAM_CCB_CLASS_MAX	3
+
 void		xpt_polled_action(union ccb *ccb);
 void		xpt_release_ccb(union ccb *released_ccb);
 void		xpt_schedule(struct cam_periph *perph, u_int32_t new_priority);
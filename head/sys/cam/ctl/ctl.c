@@ -467,7 +467,9 @@ static ctl_action ctl_check_for_blockage(struct ctl_lun *lun,
     union ctl_io *pending_io, union ctl_io *ooa_io);
 static ctl_action ctl_check_ooa(struct ctl_lun *lun, union ctl_io *pending_io,
 				union ctl_io *starting_io);
-static int ctl_check_blocked(struct ctl_lun *lun);
+static int ctl_check_blocked(struct ctl_lun *lun, union ctl_io *done_io);
+static void ctl_ooa_insert(struct ctl_lun *lun, union ctl_io *io);
+static void ctl_ooa_remove(struct ctl_lun *lun, union ctl_io *io);
 static int ctl_scsiio_lun_check(struct ctl_lun *lun,
 				const struct ctl_cmd_entry *entry,
 				struct ctl_scsiio *ctsio);
@@ -2247,7 +2249,7 @@ ctl_serialize_other_sc_cmd(struct ctl_scsiio *ctsio)
 	if (TAILQ_EMPTY(&lun->ooa_queue))
 		lun->idle_time += getsbinuptime() - lun->last_busy;
 #endif
-	TAILQ_INSERT_TAIL(&lun->ooa_queue, &ctsio->io_hdr, ooa_links);
+	ctl_ooa_insert(lun, (union ctl_io *)ctsio);
 
 	switch (ctl_check_ooa(lun, (union ctl_io *)ctsio,
 		(union ctl_io *)TAILQ_PREV(&ctsio->io_hdr, ctl_ooaq,
@@ -2277,18 +2279,18 @@ ctl_serialize_other_sc_cmd(struct ctl_scsiio *ctsio)
 		}
 		break;
 	case CTL_ACTION_OVERLAP:
-		TAILQ_REMOVE(&lun->ooa_queue, &ctsio->io_hdr, ooa_links);
+		ctl_ooa_remove(lun, (union ctl_io *)ctsio);
 		mtx_unlock(&lun->lun_lock);
 		ctl_set_overlapped_cmd(ctsio);
 		goto badjuju;
 	case CTL_ACTION_OVERLAP_TAG:
-		TAILQ_REMOVE(&lun->ooa_queue, &ctsio->io_hdr, ooa_links);
+		ctl_ooa_remove(lun, (union ctl_io *)ctsio);
 		mtx_unlock(&lun->lun_lock);
 		ctl_set_overlapped_tag(ctsio, ctsio->tag_num);
 		goto badjuju;
 	case CTL_ACTION_ERROR:
 	default:
-		TAILQ_REMOVE(&lun->ooa_queue, &ctsio->io_hdr, ooa_links);
+		ctl_ooa_remove(lun, (union ctl_io *)ctsio);
 		mtx_unlock(&lun->lun_lock);
 
 		ctl_set_internal_failure(ctsio, /*sks_valid*/ 0,
@@ -4490,6 +4492,10 @@ ctl_alloc_lun(struct ctl_softc *ctl_softc, struct ctl_lun *ctl_lun,
 #endif
 	TAILQ_INIT(&lun->ooa_queue);
 	TAILQ_INIT(&lun->blocked_queue);
+	RB_INIT(&lun->ooa_tree);
+	TAILQ_INIT(&lun->ooa_other);
+	for (i = 0; i < CTL_OOA_TAG_HASH_SIZE; i++)
+		LIST_INIT(&lun->ooa_tags[i]);
 	STAILQ_INIT(&lun->error_list);
 	ctl_tpc_lun_init(lun);
 
@@ -5717,7 +5723,7 @@ ctl_unmap(struct ctl_scsiio *ctsio)
 	ptrlen->ptr = (void *)buf;
 	ptrlen->len = len;
 	ptrlen->flags = byte2;
-	ctl_check_blocked(lun);
+	ctl_check_blocked(lun, NULL);
 	mtx_unlock(&lun->lun_lock);
 
 	retval = lun->backend->config_write((union ctl_io *)ctsio);
@@ -10832,6 +10838,88 @@ ctl_get_lba_len(union ctl_io *io, uint64_t *lba, uint64_t *len)
 	return (0);
 }
 
+static int
+ctl_ooa_cmp(struct ctl_io_hdr *a, struct ctl_io_hdr *b)
+{
+
+	if (a->ooa_lba != b->ooa_lba)
+		return (a->ooa_lba < b->ooa_lba ? -1 : 1);
+	if (a->ooa_seq != b->ooa_seq)
+		return (a->ooa_seq < b->ooa_seq ? -1 : 1);
+	return (0);
+}
+
+RB_GENERATE_STATIC(ctl_ooa_tree, ctl_io_hdr, ooa_rb, ctl_ooa_cmp);
+
+/*
+ * Put an I/O at the tail of the OOA queue and into the indexes over it.
+ */
+static void
+ctl_ooa_insert(struct ctl_lun *lun, union ctl_io *io)
+{
+	struct ctl_io_hdr *hdr;
+	const struct ctl_cmd_entry *entry;
+	uint64_t lba, len;
+	int b;
+
+	mtx_assert(&lun->lun_lock, MA_OWNED);
+
+	hdr = &io->io_hdr;
+	TAILQ_INSERT_TAIL(&lun->ooa_queue, hdr, ooa_links);
+	hdr->ooa_seq = ++lun->ooa_seq;
+	hdr->ooa_flags = 0;
+
+	if (hdr->io_type == CTL_IO_SCSI &&
+	    io->scsiio.tag_type != CTL_TAG_UNTAGGED) {
+		LIST_INSERT_HEAD(
+		    &lun->ooa_tags[CTL_OOA_TAG_HASH(io->scsiio.tag_num)],
+		    hdr, ooa_tag_links);
+		hdr->ooa_flags |= CTL_OOA_TAGGED;
+	}
+
+	if (hdr->io_type == CTL_IO_SCSI &&
+	    (io->scsiio.tag_type == CTL_TAG_UNTAGGED ||
+	     io->scsiio.tag_type == CTL_TAG_SIMPLE) &&
+	    io->scsiio.cdb[0] != UNMAP &&
+	    ctl_get_lba_len(io, &lba, &len) == 0 &&
+	    len != 0 && len <= CTL_OOA_MAXLEN && lba + len > lba) {
+		entry = ctl_get_cmd_entry(&io->scsiio, NULL);
+		if (entry->seridx == CTL_SERIDX_READ ||
+		    entry->seridx == CTL_SERIDX_WRITE) {
+			hdr->ooa_lba = lba;
+			hdr->ooa_len = len;
+			hdr->ooa_flags |= CTL_OOA_TREE;
+			RB_INSERT(ctl_ooa_tree, &lun->ooa_tree, hdr);
+			b = fls(len);
+			if (lun->ooa_len_cnt[b]++ == 0)
+				lun->ooa_len_mask |= 1 << b;
+			return;
+		}
+	}
+	TAILQ_INSERT_TAIL(&lun->ooa_other, hdr, ooa_other_links);
+}
+
+static void
+ctl_ooa_remove(struct ctl_lun *lun, union ctl_io *io)
+{
+	struct ctl_io_hdr *hdr;
+	int b;
+
+	mtx_assert(&lun->lun_lock, MA_OWNED);
+
+	hdr = &io->io_hdr;
+	TAILQ_REMOVE(&lun->ooa_queue, hdr, ooa_links);
+	if (hdr->ooa_flags & CTL_OOA_TAGGED)
+		LIST_REMOVE(hdr, ooa_tag_links);
+	if (hdr->ooa_flags & CTL_OOA_TREE) {
+		RB_REMOVE(ctl_ooa_tree, &lun->ooa_tree, hdr);
+		b = fls(hdr->ooa_len);
+		if (--lun->ooa_len_cnt[b] == 0)
+			lun->ooa_len_mask &= ~(1 << b);
+	} else
+		TAILQ_REMOVE(&lun->ooa_other, hdr, ooa_other_links);
+}
+
 static ctl_action
 ctl_extent_check_lba(uint64_t lba1, uint64_t len1, uint64_t lba2, uint64_t len2,
     bool seq)
@@ -11037,6 +11125,79 @@ ctl_check_for_blockage(struct ctl_lun *lun, union ctl_io *pending_io,
 	return (CTL_ACTION_ERROR);
 }
 
+/*
+ * Indexed equivalent of walking the OOA queue back from pending_io's
+ * predecessor, for a simple-tagged I/O in the range index.  The walk
+ * stops at the nearest older I/O that does not pass; every older I/O that
+ * can fail to pass is either on the "other" list, shares pending_io's tag
+ * number, or overlaps (or, for sequential serialization, immediately
+ * precedes) its LBA range.  Check just those and keep the nearest.
+ */
+static ctl_action
+ctl_check_ooa_indexed(struct ctl_lun *lun, union ctl_io *pending_io)
+{
+	struct ctl_io_hdr *hdr, *best, key;
+	ctl_action action, best_action;
+	uint64_t seq, start, end, maxlen;
+
+	seq = pending_io->io_hdr.ooa_seq;
+	best = NULL;
+	best_action = CTL_ACTION_PASS;
+
+	TAILQ_FOREACH_REVERSE(hdr, &lun->ooa_other, ctl_ooa_otherq,
+	    ooa_other_links) {
+		if (hdr->ooa_seq >= seq)
+			continue;
+		action = ctl_check_for_blockage(lun, pending_io,
+		    (union ctl_io *)hdr);
+		if (action != CTL_ACTION_PASS) {
+			best = hdr;
+			best_action = action;
+			break;
+		}
+	}
+
+	LIST_FOREACH(hdr,
+	    &lun->ooa_tags[CTL_OOA_TAG_HASH(pending_io->scsiio.tag_num)],
+	    ooa_tag_links) {
+		if (hdr->ooa_seq >= seq ||
+		    (best != NULL && hdr->ooa_seq <= best->ooa_seq))
+			continue;
+		action = ctl_check_for_blockage(lun, pending_io,
+		    (union ctl_io *)hdr);
+		if (action != CTL_ACTION_PASS) {
+			best = hdr;
+			best_action = action;
+		}
+	}
+
+	/*
+	 * No indexed I/O is longer than the largest length class present,
+	 * so nothing starting further back than that can reach us.
+	 */
+	start = pending_io->io_hdr.ooa_lba;
+	end = start + pending_io->io_hdr.ooa_len - 1;
+	maxlen = (1ULL << fls(lun->ooa_len_mask)) - 1;
+	key.ooa_lba = start > maxlen ? start - maxlen : 0;
+	key.ooa_seq = 0;
+	for (hdr = RB_NFIND(ctl_ooa_tree, &lun->ooa_tree, &key);
+	     hdr != NULL && hdr->ooa_lba <= end;
+	     hdr = RB_NEXT(ctl_ooa_tree, &lun->ooa_tree, hdr)) {
+		if (hdr->ooa_lba + hdr->ooa_len < start ||
+		    hdr->ooa_seq >= seq ||
+		    (best != NULL && hdr->ooa_seq <= best->ooa_seq))
+			continue;
+		action = ctl_check_for_blockage(lun, pending_io,
+		    (union ctl_io *)hdr);
+		if (action != CTL_ACTION_PASS) {
+			best = hdr;
+			best_action = action;
+		}
+	}
+
+	return (best_action);
+}
+
 /*
  * Check for blockage or overlaps against the OOA (Order Of Arrival) queue.
  * Assumptions:
@@ -11052,6 +11213,13 @@ ctl_check_ooa(struct ctl_lun *lun, union ctl_io *pending_io,
 
 	mtx_assert(&lun->lun_lock, MA_OWNED);
 
+	if (starting_io != NULL &&
+	    TAILQ_NEXT(&starting_io->io_hdr, ooa_links) ==
+	    &pending_io->io_hdr &&
+	    (pending_io->io_hdr.ooa_flags & CTL_OOA_TREE) &&
+	    pending_io->scsiio.tag_type == CTL_TAG_SIMPLE)
+		return (ctl_check_ooa_indexed(lun, pending_io));
+
 	/*
 	 * Run back along the OOA queue, starting with the current
 	 * blocked I/O and going through every I/O before it on the
@@ -11088,13 +11256,41 @@ ctl_check_ooa(struct ctl_lun *lun, union ctl_io *pending_io,
 	return (CTL_ACTION_PASS);
 }
 
+/*
+ * Could older_io have been what kept pending_io blocked?  Only answers
+ * "no" when the indexes make that certain: older_io arrived later, or
+ * both are simple READ/WRITE-class I/O in the range index with distinct
+ * tags whose ranges neither overlap nor touch.
+ */
+static int
+ctl_ooa_may_block(union ctl_io *older_io, union ctl_io *pending_io)
+{
+	struct ctl_io_hdr *o, *p;
+
+	o = &older_io->io_hdr;
+	p = &pending_io->io_hdr;
+	if (o->ooa_seq > p->ooa_seq)
+		return (0);
+	if ((o->ooa_flags & CTL_OOA_TREE) == 0 ||
+	    (p->ooa_flags & CTL_OOA_TREE) == 0 ||
+	    pending_io->scsiio.tag_type != CTL_TAG_SIMPLE)
+		return (1);
+	if ((o->ooa_flags & CTL_OOA_TAGGED) &&
+	    older_io->scsiio.tag_num == pending_io->scsiio.tag_num)
+		return (1);
+	return (o->ooa_lba <= p->ooa_lba + p->ooa_len - 1 &&
+	    o->ooa_lba + o->ooa_len >= p->ooa_lba);
+}
+
 /*
  * Assumptions:
  * - An I/O has just completed, and has been removed from the per-LUN OOA
  *   queue, so some items on the blocked queue may now be unblocked.
+ * - If done_io is not NULL, that removal is the only thing that changed;
+ *   blocked I/O that done_io could not have been blocking is skipped.
  */
 static int
-ctl_check_blocked(struct ctl_lun *lun)
+ctl_check_blocked(struct ctl_lun *lun, union ctl_io *done_io)
 {
 	struct ctl_softc *softc = lun->ctl_softc;
 	union ctl_io *cur_blocked, *next_blocked;
@@ -11118,6 +11314,10 @@ ctl_check_blocked(struct ctl_lun *lun)
 		next_blocked = (union ctl_io *)TAILQ_NEXT(&cur_blocked->io_hdr,
 							  blocked_links);
 
+		if (done_io != NULL &&
+		    !ctl_ooa_may_block(done_io, cur_blocked))
+			continue;
+
 		prev_ooa = (union ctl_io *)TAILQ_PREV(&cur_blocked->io_hdr,
 						      ctl_ooaq, ooa_links);
 
@@ -11400,14 +11600,14 @@ ctl_failover_lun(union ctl_io *rio)
 				TAILQ_REMOVE(&lun->blocked_queue, io,
 				    blocked_links);
 				io->flags &= ~CTL_FLAG_BLOCKED;
-				TAILQ_REMOVE(&lun->ooa_queue, io, ooa_links);
+				ctl_ooa_remove(lun, (union ctl_io *)io);
 				ctl_free_io((union ctl_io *)io);
 			}
 		}
 		TAILQ_FOREACH_SAFE(io, &lun->ooa_queue, ooa_links, next_io) {
 			/* We are master */
 			if (io->flags & CTL_FLAG_FROM_OTHER_SC) {
-				TAILQ_REMOVE(&lun->ooa_queue, io, ooa_links);
+				ctl_ooa_remove(lun, (union ctl_io *)io);
 				ctl_free_io((union ctl_io *)io);
 			}
 			/* We are slave */
@@ -11420,7 +11620,7 @@ ctl_failover_lun(union ctl_io *rio)
 				}
 			}
 		}
-		ctl_check_blocked(lun);
+		ctl_check_blocked(lun, NULL);
 	}
 	mtx_unlock(&lun->lun_lock);
 }
@@ -11466,8 +11666,7 @@ ctl_scsiio_precheck(struct ctl_softc *softc, struct ctl_scsiio *ctsio)
 				    lun->last_busy;
 			}
 #endif
-			TAILQ_INSERT_TAIL(&lun->ooa_queue, &ctsio->io_hdr,
-			    ooa_links);
+			ctl_ooa_insert(lun, (union ctl_io *)ctsio);
 		}
 	} else {
 		ctsio->io_hdr.ctl_private[CTL_PRIV_LUN].ptr = NULL;
@@ -12338,9 +12537,8 @@ ctl_handle_isc(union ctl_io *io)
 		} else {
 			free_io = 1;
 			mtx_lock(&lun->lun_lock);
-			TAILQ_REMOVE(&lun->ooa_queue, &io->io_hdr,
-				     ooa_links);
-			ctl_check_blocked(lun);
+			ctl_ooa_remove(lun, io);
+			ctl_check_blocked(lun, io);
 			mtx_unlock(&lun->lun_lock);
 		}
 		break;
@@ -13176,7 +13374,7 @@ ctl_process_done(union ctl_io *io)
 	/*
 	 * Remove this from the OOA queue.
 	 */
-	TAILQ_REMOVE(&lun->ooa_queue, &io->io_hdr, ooa_links);
+	ctl_ooa_remove(lun, io);
 #ifdef CTL_TIME_IO
 	if (TAILQ_EMPTY(&lun->ooa_queue))
 		lun->last_busy = getsbinuptime();
@@ -13186,7 +13384,7 @@ ctl_process_done(union ctl_io *io)
 	 * Run through the blocked queue on this LUN and see if anything
 	 * has become unblocked, now that this transaction is done.
 	 */
-	ctl_check_blocked(lun);
+	ctl_check_blocked(lun, io);
 
 	/*
 	 * If the LUN has been invalidated, free it if there is nothing
@@ -13359,7 +13557,7 @@ ctl_serseq_done(union ctl_io *io)
 		return;
 	mtx_lock(&lun->lun_lock);
 	io->io_hdr.flags |= CTL_FLAG_SERSEQ_DONE;
-	ctl_check_blocked(lun);
+	ctl_check_blocked(lun, NULL);
 	mtx_unlock(&lun->lun_lock);
 }
 
@@ -237,6 +237,19 @@ typedef int (*be_ioctl_t)(struct cdev *dev, u_long cmd, caddr_t addr, int flag,
 typedef int (*be_luninfo_t)(void *be_lun, struct sbuf *sb);
 typedef uint64_t (*be_lunattr_t)(void *be_lun, const char *attrname);
 
+/*
+ * Copy offload.  Copy len bytes starting at srclba on src to dstlba on
+ * dst, both of which are LUNs of this backend, and call done(arg, error)
+ * once the copy has finished.  A non-zero return means the copy was not
+ * started and done will not be called; the caller then falls back to
+ * reading and writing the data itself.  Called with the CTL lock held,
+ * so the method must not sleep before it returns.
+ */
+typedef void (*be_copy_done_t)(void *arg, int error);
+typedef int (*be_copy_t)(struct ctl_be_lun *src, uint64_t srclba,
+			 struct ctl_be_lun *dst, uint64_t dstlba, uint64_t len,
+			 be_copy_done_t done, void *arg);
+
 struct ctl_backend_driver {
 	char		  name[CTL_BE_NAME_LEN]; /* passed to CTL */
 	ctl_backend_flags flags;	         /* passed to CTL */
@@ -248,6 +261,7 @@ struct ctl_backend_driver {
 	be_ioctl_t	  ioctl;		 /* passed to CTL */
 	be_luninfo_t	  lun_info;		 /* passed to CTL */
 	be_lunattr_t	  lun_attr;		 /* passed to CTL */
+	be_copy_t	  copy;			 /* passed to CTL */
 #ifdef CS_BE_CONFIG_MOVE_DONE_IS_NOT_USED
 	be_func_t	  config_move_done;	 /* passed to backend */
 #endif
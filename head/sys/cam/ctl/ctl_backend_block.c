@@ -54,6 +54,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/condvar.h>
+#include <sys/cpuset.h>
 #include <sys/malloc.h>
 #include <sys/conf.h>
 #include <sys/ioccom.h>
@@ -72,6 +73,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/filio.h>
 #include <sys/proc.h>
 #include <sys/pcpu.h>
+#include <sys/smp.h>
 #include <sys/module.h>
 #include <sys/sdt.h>
 #include <sys/devicestat.h>
@@ -138,6 +140,27 @@ union ctl_be_block_bedata {
 struct ctl_be_block_io;
 struct ctl_be_block_lun;
 
+STAILQ_HEAD(ctl_be_block_hdrq, ctl_io_hdr);
+
+/*
+ * Worker queue.  By default each LUN has one per CBB_QUEUE_THREADS of its
+ * threads, but no more than one per CPU; the num_queues tunable overrides
+ * that.  Blocking file and zvol VOPs need several threads per queue to keep
+ * the backing store busy.  New work goes to the queue serving the
+ * submitting CPU and the queue's threads are bound to the CPUs it serves;
+ * an I/O stays on the same queue until it completes.
+ */
+struct ctl_be_block_queue {
+	struct mtx		lock;
+	struct ctl_be_block_hdrq input_queue;
+	struct ctl_be_block_hdrq config_read_queue;
+	struct ctl_be_block_hdrq config_write_queue;
+	struct ctl_be_block_hdrq datamove_queue;
+	struct ctl_be_block_lun	*lun;
+	struct taskqueue	*taskqueue;
+	struct task		task;
+} __aligned(CACHE_LINE_SIZE);
+
 typedef void (*cbb_dispatch_t)(struct ctl_be_block_lun *be_lun,
 			       struct ctl_be_block_io *beio);
 typedef uint64_t (*cbb_getattr_t)(struct ctl_be_block_lun *be_lun,
@@ -167,15 +190,41 @@ struct ctl_be_block_lun {
 	ctl_be_block_lun_flags flags;
 	STAILQ_ENTRY(ctl_be_block_lun) links;
 	struct ctl_be_lun cbe_lun;
-	struct taskqueue *io_taskqueue;
-	struct task io_task;
+	struct ctl_be_block_queue *queues;
+	int num_queues;
 	int num_threads;
-	STAILQ_HEAD(, ctl_io_hdr) input_queue;
-	STAILQ_HEAD(, ctl_io_hdr) config_read_queue;
-	STAILQ_HEAD(, ctl_io_hdr) config_write_queue;
-	STAILQ_HEAD(, ctl_io_hdr) datamove_queue;
+	int copies;
 	struct mtx_padalign io_lock;
-	struct mtx_padalign queue_lock;
+};
+
+/*
+ * Copy between two LUNs of this backend, on behalf of CTL's third-party
+ * copy code.  The range is split into chunks, up to depth of which are
+ * being read or written at a time.
+ */
+struct ctl_be_block_copy {
+	struct ctl_be_block_lun		*src;
+	struct ctl_be_block_lun		*dst;
+	off_t				srcoff;
+	off_t				dstoff;
+	off_t				len;
+	be_copy_done_t			done;
+	void				*arg;
+	struct task			task;
+	struct mtx			lock;
+	off_t				chunk;
+	off_t				next;	/* Next chunk to start */
+	int				depth;
+	int				active;	/* Chunks in progress */
+	int				error;
+};
+
+struct ctl_be_block_copy_chunk {
+	struct ctl_be_block_copy	*copy;
+	off_t				off;
+	off_t				len;
+	struct task			task;
+	uint8_t				buf[];
 };
 
 /*
@@ -211,15 +260,39 @@ struct ctl_be_block_io {
 	struct ctl_be_block_softc	*softc;
 	struct ctl_be_block_lun		*lun;
 	void (*beio_cont)(struct ctl_be_block_io *beio); /* to continue processing */
+	STAILQ_ENTRY(ctl_be_block_io)	links;	/* worker batch */
+	struct ctl_be_block_io		*merged; /* sent as part of this one */
 };
 
+STAILQ_HEAD(ctl_be_block_ioq, ctl_be_block_io);
+
 extern struct ctl_softc *control_softc;
 
+#define	CBB_QUEUE_THREADS	4	/* Default minimum threads per queue */
+
 static int cbb_num_threads = 14;
 SYSCTL_NODE(_kern_cam_ctl, OID_AUTO, block, CTLFLAG_RD, 0,
 	    "CAM Target Layer Block Backend");
 SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, num_threads, CTLFLAG_RWTUN,
            &cbb_num_threads, 0, "Number of threads per backing file");
+static int cbb_num_queues = 0;
+SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, num_queues, CTLFLAG_RWTUN,
+           &cbb_num_queues, 0,
+	   "Number of worker queues per backing file (0 = one per 4 threads, "
+	   "at most one per CPU)");
+static int cbb_batch = 16;
+SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, batch, CTLFLAG_RWTUN,
+           &cbb_batch, 0, "Maximum I/Os taken per worker queue pass");
+static int cbb_copy_size = 1024 * 1024;
+SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, copy_size, CTLFLAG_RWTUN,
+           &cbb_copy_size, 0, "Chunk size of copies offloaded by CTL");
+static int cbb_copy_depth = 4;
+SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, copy_depth, CTLFLAG_RWTUN,
+           &cbb_copy_depth, 0, "Chunks of an offloaded copy in flight");
+static int cbb_copy_threads = 4;
+SYSCTL_INT(_kern_cam_ctl_block, OID_AUTO, copy_threads, CTLFLAG_RDTUN,
+           &cbb_copy_threads, 0, "Threads serving offloaded copies");
+static struct taskqueue *cbb_copy_tq;
 
 static struct ctl_be_block_io *ctl_alloc_beio(struct ctl_be_block_softc *softc);
 static void ctl_free_beio(struct ctl_be_block_io *beio);
@@ -246,10 +319,19 @@ static void ctl_be_block_cr_dispatch(struct ctl_be_block_lun *be_lun,
 				    union ctl_io *io);
 static void ctl_be_block_cw_dispatch(struct ctl_be_block_lun *be_lun,
 				    union ctl_io *io);
-static void ctl_be_block_dispatch(struct ctl_be_block_lun *be_lun,
+static struct ctl_be_block_io *ctl_be_block_dispatch(
+				  struct ctl_be_block_lun *be_lun,
 				  union ctl_io *io);
+static void ctl_be_block_dispatch_batch(struct ctl_be_block_lun *be_lun,
+					struct ctl_be_block_ioq *batch);
+static void ctl_be_block_enqueue(struct ctl_be_block_queue *queue,
+				 struct ctl_be_block_hdrq *hdrq,
+				 union ctl_io *io);
 static void ctl_be_block_worker(void *context, int pending);
 static int ctl_be_block_submit(union ctl_io *io);
+static int ctl_be_block_copy(struct ctl_be_lun *src, uint64_t srclba,
+			     struct ctl_be_lun *dst, uint64_t dstlba,
+			     uint64_t len, be_copy_done_t done, void *arg);
 static int ctl_be_block_ioctl(struct cdev *dev, u_long cmd, caddr_t addr,
 				   int flag, struct thread *td);
 static int ctl_be_block_open_file(struct ctl_be_block_lun *be_lun,
@@ -285,7 +367,8 @@ static struct ctl_backend_driver ctl_be_block_driver =
 	.config_write = ctl_be_block_config_write,
 	.ioctl = ctl_be_block_ioctl,
 	.lun_info = ctl_be_block_lun_info,
-	.lun_attr = ctl_be_block_lun_attr
+	.lun_attr = ctl_be_block_lun_attr,
+	.copy = ctl_be_block_copy
 };
 
 MALLOC_DEFINE(M_CTLBLK, "ctlblk", "Memory used for CTL block backend");
@@ -394,6 +477,7 @@ ctl_be_block_move_done(union ctl_io *io)
 {
 	struct ctl_be_block_io *beio;
 	struct ctl_be_block_lun *be_lun;
+	struct ctl_be_block_queue *queue;
 	struct ctl_lba_len_flags *lbalen;
 #ifdef CTL_TIME_IO
 	struct bintime cur_bt;
@@ -462,10 +546,8 @@ ctl_be_block_move_done(union ctl_io *io)
 	 * This move done routine is generally called in the SIM's
 	 * interrupt context, and therefore we cannot block.
 	 */
-	mtx_lock(&be_lun->queue_lock);
-	STAILQ_INSERT_TAIL(&be_lun->datamove_queue, &io->io_hdr, links);
-	mtx_unlock(&be_lun->queue_lock);
-	taskqueue_enqueue(be_lun->io_taskqueue, &be_lun->io_task);
+	queue = &be_lun->queues[PRIV(io)->flags];
+	ctl_be_block_enqueue(queue, &queue->datamove_queue, io);
 
 	return (0);
 }
@@ -615,6 +697,144 @@ SDT_PROBE_DEFINE1(cbb, kernel, write, file_start, "uint64_t");
 SDT_PROBE_DEFINE1(cbb, kernel, read, file_done,"uint64_t");
 SDT_PROBE_DEFINE1(cbb, kernel, write, file_done, "uint64_t");
 
+/*
+ * Build a uio covering a beio and the beios merged behind it, and start
+ * their devstat transactions.  Returns the iovec array to free once the
+ * I/O is done, or NULL.
+ */
+static struct iovec *
+ctl_be_block_uio(struct ctl_be_block_lun *be_lun,
+		 struct ctl_be_block_io *beio, struct uio *xuio)
+{
+	struct ctl_be_block_io *cur;
+	struct iovec *xiovec, *xiovecs;
+	struct bintime t0;
+	int i, num_segs;
+
+	bzero(xuio, sizeof(*xuio));
+	num_segs = 0;
+	for (cur = beio; cur != NULL; cur = cur->merged) {
+		num_segs += cur->num_segs;
+		xuio->uio_resid += cur->io_len;
+	}
+	if (beio->merged == NULL)
+		xiovecs = beio->xiovecs;
+	else
+		xiovecs = malloc(sizeof(*xiovecs) * num_segs, M_CTLBLK,
+		    M_WAITOK);
+	xuio->uio_rw = (beio->bio_cmd == BIO_READ) ? UIO_READ : UIO_WRITE;
+	xuio->uio_offset = beio->io_offset;
+	xuio->uio_segflg = UIO_SYSSPACE;
+	xuio->uio_iov = xiovecs;
+	xuio->uio_iovcnt = num_segs;
+	xuio->uio_td = curthread;
+
+	xiovec = xiovecs;
+	for (cur = beio; cur != NULL; cur = cur->merged) {
+		for (i = 0; i < cur->num_segs; i++, xiovec++) {
+			xiovec->iov_base = cur->sg_segs[i].addr;
+			xiovec->iov_len = cur->sg_segs[i].len;
+		}
+	}
+
+	binuptime(&t0);
+	mtx_lock(&be_lun->io_lock);
+	for (cur = beio; cur != NULL; cur = cur->merged) {
+		cur->ds_t0 = t0;
+		devstat_start_transaction(be_lun->disk_stats, &cur->ds_t0);
+	}
+	mtx_unlock(&be_lun->io_lock);
+
+	return (xiovecs != beio->xiovecs ? xiovecs : NULL);
+}
+
+/*
+ * Finish a uio based request for a beio and the beios merged behind it.
+ * resid is what the backing store left untransferred of the whole thing.
+ */
+static void
+ctl_be_block_uio_done(struct ctl_be_block_lun *be_lun,
+		      struct ctl_be_block_io *beio, int error, ssize_t resid)
+{
+	struct ctl_be_block_io *cur;
+	union ctl_io *io;
+	uint64_t done;
+	size_t s;
+	int i;
+
+	mtx_lock(&be_lun->io_lock);
+	for (done = 0, cur = beio; cur != NULL; cur = cur->merged) {
+		done += cur->io_len;
+		devstat_end_transaction(be_lun->disk_stats, cur->io_len,
+		    cur->ds_tag_type, cur->ds_trans_type,
+		    /*now*/ NULL, /*then*/&cur->ds_t0);
+	}
+	mtx_unlock(&be_lun->io_lock);
+	done -= resid;
+
+	for (; beio != NULL; beio = cur) {
+		cur = beio->merged;
+		beio->merged = NULL;
+		io = beio->io;
+
+		if (error == 0 && beio->bio_cmd == BIO_READ &&
+		    done < beio->io_len) {
+			/*
+			 * If we red less then requested (EOF), then
+			 * we should clean the rest of the buffer.
+			 */
+			s = done;
+			for (i = 0; i < beio->num_segs; i++) {
+				if (s >= beio->sg_segs[i].len) {
+					s -= beio->sg_segs[i].len;
+					continue;
+				}
+				bzero((uint8_t *)beio->sg_segs[i].addr + s,
+				    beio->sg_segs[i].len - s);
+				s = 0;
+			}
+		}
+		done -= MIN(done, beio->io_len);
+
+		/*
+		 * If we got an error, set the sense data to "MEDIUM ERROR"
+		 * and return the I/O to the user.
+		 */
+		if (error != 0) {
+			if (error == ENOSPC || error == EDQUOT) {
+				ctl_set_space_alloc_fail(&io->scsiio);
+			} else if (error == EROFS || error == EACCES) {
+				ctl_set_hw_write_protected(&io->scsiio);
+			} else {
+				ctl_set_medium_error(&io->scsiio,
+				    beio->bio_cmd == BIO_READ);
+			}
+			ctl_complete_beio(beio);
+			continue;
+		}
+
+		/*
+		 * If this is a write or a verify, we're all done.
+		 * If this is a read, we can now send the data to the user.
+		 */
+		if ((beio->bio_cmd == BIO_WRITE) ||
+		    (ARGS(io)->flags & CTL_LLF_VERIFY)) {
+			ctl_set_success(&io->scsiio);
+			ctl_complete_beio(beio);
+		} else {
+			if ((ARGS(io)->flags & CTL_LLF_READ) &&
+			    beio->beio_cont == NULL) {
+				ctl_set_success(&io->scsiio);
+				ctl_serseq_done(io);
+			}
+#ifdef CTL_TIME_IO
+			getbinuptime(&io->io_hdr.dma_start_bt);
+#endif
+			ctl_datamove(io);
+		}
+	}
+}
+
 static void
 ctl_be_block_dispatch_file(struct ctl_be_block_lun *be_lun,
 			   struct ctl_be_block_io *beio)
@@ -622,9 +842,8 @@ ctl_be_block_dispatch_file(struct ctl_be_block_lun *be_lun,
 	struct ctl_be_block_filedata *file_data;
 	union ctl_io *io;
 	struct uio xuio;
-	struct iovec *xiovec;
-	size_t s;
-	int error, flags, i;
+	struct iovec *xiovecs;
+	int error, flags;
 
 	DPRINTF("entered\n");
 
@@ -636,30 +855,12 @@ ctl_be_block_dispatch_file(struct ctl_be_block_lun *be_lun,
 	if (beio->bio_cmd == BIO_WRITE && ARGS(io)->flags & CTL_LLF_FUA)
 		flags |= IO_SYNC;
 
-	bzero(&xuio, sizeof(xuio));
 	if (beio->bio_cmd == BIO_READ) {
 		SDT_PROBE(cbb, kernel, read, file_start, 0, 0, 0, 0, 0);
-		xuio.uio_rw = UIO_READ;
 	} else {
 		SDT_PROBE(cbb, kernel, write, file_start, 0, 0, 0, 0, 0);
-		xuio.uio_rw = UIO_WRITE;
-	}
-	xuio.uio_offset = beio->io_offset;
-	xuio.uio_resid = beio->io_len;
-	xuio.uio_segflg = UIO_SYSSPACE;
-	xuio.uio_iov = beio->xiovecs;
-	xuio.uio_iovcnt = beio->num_segs;
-	xuio.uio_td = curthread;
-
-	for (i = 0, xiovec = xuio.uio_iov; i < xuio.uio_iovcnt; i++, xiovec++) {
-		xiovec->iov_base = beio->sg_segs[i].addr;
-		xiovec->iov_len = beio->sg_segs[i].len;
 	}
-
-	binuptime(&beio->ds_t0);
-	mtx_lock(&be_lun->io_lock);
-	devstat_start_transaction(beio->lun->disk_stats, &beio->ds_t0);
-	mtx_unlock(&be_lun->io_lock);
+	xiovecs = ctl_be_block_uio(be_lun, beio, &xuio);
 
 	if (beio->bio_cmd == BIO_READ) {
 		vn_lock(be_lun->vn, LK_SHARED | LK_RETRY);
@@ -685,22 +886,6 @@ ctl_be_block_dispatch_file(struct ctl_be_block_lun *be_lun,
 
 		VOP_UNLOCK(be_lun->vn, 0);
 		SDT_PROBE(cbb, kernel, read, file_done, 0, 0, 0, 0, 0);
-		if (error == 0 && xuio.uio_resid > 0) {
-			/*
-			 * If we red less then requested (EOF), then
-			 * we should clean the rest of the buffer.
-			 */
-			s = beio->io_len - xuio.uio_resid;
-			for (i = 0; i < beio->num_segs; i++) {
-				if (s >= beio->sg_segs[i].len) {
-					s -= beio->sg_segs[i].len;
-					continue;
-				}
-				bzero((uint8_t *)beio->sg_segs[i].addr + s,
-				    beio->sg_segs[i].len - s);
-				s = 0;
-			}
-		}
 	} else {
 		struct mount *mountpoint;
 		int lock_flags;
@@ -736,48 +921,9 @@ ctl_be_block_dispatch_file(struct ctl_be_block_lun *be_lun,
 		SDT_PROBE(cbb, kernel, write, file_done, 0, 0, 0, 0, 0);
         }
 
-	mtx_lock(&be_lun->io_lock);
-	devstat_end_transaction(beio->lun->disk_stats, beio->io_len,
-	    beio->ds_tag_type, beio->ds_trans_type,
-	    /*now*/ NULL, /*then*/&beio->ds_t0);
-	mtx_unlock(&be_lun->io_lock);
-
-	/*
-	 * If we got an error, set the sense data to "MEDIUM ERROR" and
-	 * return the I/O to the user.
-	 */
-	if (error != 0) {
-		if (error == ENOSPC || error == EDQUOT) {
-			ctl_set_space_alloc_fail(&io->scsiio);
-		} else if (error == EROFS || error == EACCES) {
-			ctl_set_hw_write_protected(&io->scsiio);
-		} else {
-			ctl_set_medium_error(&io->scsiio,
-			    beio->bio_cmd == BIO_READ);
-		}
-		ctl_complete_beio(beio);
-		return;
-	}
-
-	/*
-	 * If this is a write or a verify, we're all done.
-	 * If this is a read, we can now send the data to the user.
-	 */
-	if ((beio->bio_cmd == BIO_WRITE) ||
-	    (ARGS(io)->flags & CTL_LLF_VERIFY)) {
-		ctl_set_success(&io->scsiio);
-		ctl_complete_beio(beio);
-	} else {
-		if ((ARGS(io)->flags & CTL_LLF_READ) &&
-		    beio->beio_cont == NULL) {
-			ctl_set_success(&io->scsiio);
-			ctl_serseq_done(io);
-		}
-#ifdef CTL_TIME_IO
-		getbinuptime(&io->io_hdr.dma_start_bt);
-#endif
-		ctl_datamove(io);
-	}
+	if (xiovecs != NULL)
+		free(xiovecs, M_CTLBLK);
+	ctl_be_block_uio_done(be_lun, beio, error, xuio.uio_resid);
 }
 
 static void
@@ -855,8 +1001,8 @@ ctl_be_block_dispatch_zvol(struct ctl_be_block_lun *be_lun,
 	struct cdevsw *csw;
 	struct cdev *dev;
 	struct uio xuio;
-	struct iovec *xiovec;
-	int error, flags, i, ref;
+	struct iovec *xiovecs;
+	int error, flags, ref;
 
 	DPRINTF("entered\n");
 
@@ -867,30 +1013,12 @@ ctl_be_block_dispatch_zvol(struct ctl_be_block_lun *be_lun,
 	if (beio->bio_cmd == BIO_WRITE && ARGS(io)->flags & CTL_LLF_FUA)
 		flags |= IO_SYNC;
 
-	bzero(&xuio, sizeof(xuio));
 	if (beio->bio_cmd == BIO_READ) {
 		SDT_PROBE(cbb, kernel, read, file_start, 0, 0, 0, 0, 0);
-		xuio.uio_rw = UIO_READ;
 	} else {
 		SDT_PROBE(cbb, kernel, write, file_start, 0, 0, 0, 0, 0);
-		xuio.uio_rw = UIO_WRITE;
 	}
-	xuio.uio_offset = beio->io_offset;
-	xuio.uio_resid = beio->io_len;
-	xuio.uio_segflg = UIO_SYSSPACE;
-	xuio.uio_iov = beio->xiovecs;
-	xuio.uio_iovcnt = beio->num_segs;
-	xuio.uio_td = curthread;
-
-	for (i = 0, xiovec = xuio.uio_iov; i < xuio.uio_iovcnt; i++, xiovec++) {
-		xiovec->iov_base = beio->sg_segs[i].addr;
-		xiovec->iov_len = beio->sg_segs[i].len;
-	}
-
-	binuptime(&beio->ds_t0);
-	mtx_lock(&be_lun->io_lock);
-	devstat_start_transaction(beio->lun->disk_stats, &beio->ds_t0);
-	mtx_unlock(&be_lun->io_lock);
+	xiovecs = ctl_be_block_uio(be_lun, beio, &xuio);
 
 	csw = devvn_refthread(be_lun->vn, &dev, &ref);
 	if (csw) {
@@ -907,48 +1035,9 @@ ctl_be_block_dispatch_zvol(struct ctl_be_block_lun *be_lun,
 	else
 		SDT_PROBE(cbb, kernel, write, file_done, 0, 0, 0, 0, 0);
 
-	mtx_lock(&be_lun->io_lock);
-	devstat_end_transaction(beio->lun->disk_stats, beio->io_len,
-	    beio->ds_tag_type, beio->ds_trans_type,
-	    /*now*/ NULL, /*then*/&beio->ds_t0);
-	mtx_unlock(&be_lun->io_lock);
-
-	/*
-	 * If we got an error, set the sense data to "MEDIUM ERROR" and
-	 * return the I/O to the user.
-	 */
-	if (error != 0) {
-		if (error == ENOSPC || error == EDQUOT) {
-			ctl_set_space_alloc_fail(&io->scsiio);
-		} else if (error == EROFS || error == EACCES) {
-			ctl_set_hw_write_protected(&io->scsiio);
-		} else {
-			ctl_set_medium_error(&io->scsiio,
-			    beio->bio_cmd == BIO_READ);
-		}
-		ctl_complete_beio(beio);
-		return;
-	}
-
-	/*
-	 * If this is a write or a verify, we're all done.
-	 * If this is a read, we can now send the data to the user.
-	 */
-	if ((beio->bio_cmd == BIO_WRITE) ||
-	    (ARGS(io)->flags & CTL_LLF_VERIFY)) {
-		ctl_set_success(&io->scsiio);
-		ctl_complete_beio(beio);
-	} else {
-		if ((ARGS(io)->flags & CTL_LLF_READ) &&
-		    beio->beio_cont == NULL) {
-			ctl_set_success(&io->scsiio);
-			ctl_serseq_done(io);
-		}
-#ifdef CTL_TIME_IO
-		getbinuptime(&io->io_hdr.dma_start_bt);
-#endif
-		ctl_datamove(io);
-	}
+	if (xiovecs != NULL)
+		free(xiovecs, M_CTLBLK);
+	ctl_be_block_uio_done(be_lun, beio, error, xuio.uio_resid);
 }
 
 static void
@@ -1510,6 +1599,7 @@ static void
 ctl_be_block_next(struct ctl_be_block_io *beio)
 {
 	struct ctl_be_block_lun *be_lun;
+	struct ctl_be_block_queue *queue;
 	union ctl_io *io;
 
 	io = beio->io;
@@ -1525,13 +1615,16 @@ ctl_be_block_next(struct ctl_be_block_io *beio)
 	io->io_hdr.status &= ~CTL_STATUS_MASK;
 	io->io_hdr.status |= CTL_STATUS_NONE;
 
-	mtx_lock(&be_lun->queue_lock);
-	STAILQ_INSERT_TAIL(&be_lun->input_queue, &io->io_hdr, links);
-	mtx_unlock(&be_lun->queue_lock);
-	taskqueue_enqueue(be_lun->io_taskqueue, &be_lun->io_task);
+	queue = &be_lun->queues[PRIV(io)->flags];
+	ctl_be_block_enqueue(queue, &queue->input_queue, io);
 }
 
-static void
+/*
+ * Set up the next chunk of a READ or WRITE.  Writes first fetch their
+ * data from the initiator; reads are returned to the caller to be sent
+ * to the backing store as part of a batch.
+ */
+static struct ctl_be_block_io *
 ctl_be_block_dispatch(struct ctl_be_block_lun *be_lun,
 			   union ctl_io *io)
 {
@@ -1639,23 +1732,82 @@ ctl_be_block_dispatch(struct ctl_be_block_lun *be_lun,
 	 */
 	if (beio->bio_cmd == BIO_READ) {
 		SDT_PROBE(cbb, kernel, read, alloc_done, 0, 0, 0, 0, 0);
-		be_lun->dispatch(be_lun, beio);
-	} else {
-		SDT_PROBE(cbb, kernel, write, alloc_done, 0, 0, 0, 0, 0);
+		return (beio);
+	}
+	SDT_PROBE(cbb, kernel, write, alloc_done, 0, 0, 0, 0, 0);
 #ifdef CTL_TIME_IO
-		getbinuptime(&io->io_hdr.dma_start_bt);
+	getbinuptime(&io->io_hdr.dma_start_bt);
 #endif
-		ctl_datamove(io);
+	ctl_datamove(io);
+	return (NULL);
+}
+
+static void
+ctl_be_block_enqueue(struct ctl_be_block_queue *queue,
+		     struct ctl_be_block_hdrq *hdrq, union ctl_io *io)
+{
+
+	mtx_lock(&queue->lock);
+	STAILQ_INSERT_TAIL(hdrq, &io->io_hdr, links);
+	mtx_unlock(&queue->lock);
+	taskqueue_enqueue(queue->taskqueue, &queue->task);
+}
+
+/*
+ * Two beios can be sent to the backing store as one request if they move
+ * data the same way through adjacent ranges with the same cache flags.
+ */
+static int
+ctl_be_block_can_merge(struct ctl_be_block_io *beio,
+		       struct ctl_be_block_io *next)
+{
+
+	return (beio->bio_cmd == next->bio_cmd &&
+	    (beio->bio_cmd == BIO_READ || beio->bio_cmd == BIO_WRITE) &&
+	    beio->io_offset + beio->io_len == next->io_offset &&
+	    (ARGS(beio->io)->flags & (CTL_LLF_FUA | CTL_LLF_DPO)) ==
+	    (ARGS(next->io)->flags & (CTL_LLF_FUA | CTL_LLF_DPO)));
+}
+
+/*
+ * Send a batch of beios to the backing store.  The file and zvol paths go
+ * through a uio, so runs of contiguous beios are chained together there
+ * and issued as a single VOP_READ/VOP_WRITE or d_read/d_write.  Device
+ * backed LUNs already issue one bio per segment, and the segments of
+ * separate beios are not contiguous in memory, so they are sent as is.
+ */
+static void
+ctl_be_block_dispatch_batch(struct ctl_be_block_lun *be_lun,
+			    struct ctl_be_block_ioq *batch)
+{
+	struct ctl_be_block_io *beio, *last, *next;
+	int merge;
+
+	merge = (be_lun->dispatch == ctl_be_block_dispatch_file ||
+	    be_lun->dispatch == ctl_be_block_dispatch_zvol);
+	while ((beio = STAILQ_FIRST(batch)) != NULL) {
+		STAILQ_REMOVE_HEAD(batch, links);
+		for (last = beio; merge &&
+		    (next = STAILQ_FIRST(batch)) != NULL &&
+		    ctl_be_block_can_merge(last, next); last = next) {
+			STAILQ_REMOVE_HEAD(batch, links);
+			last->merged = next;
+		}
+		be_lun->dispatch(be_lun, beio);
 	}
 }
 
 static void
 ctl_be_block_worker(void *context, int pending)
 {
-	struct ctl_be_block_lun *be_lun = (struct ctl_be_block_lun *)context;
+	struct ctl_be_block_queue *queue = (struct ctl_be_block_queue *)context;
+	struct ctl_be_block_lun *be_lun = queue->lun;
 	struct ctl_be_lun *cbe_lun = &be_lun->cbe_lun;
+	struct ctl_be_block_hdrq datamove, input;
+	struct ctl_be_block_ioq batch;
 	union ctl_io *io;
 	struct ctl_be_block_io *beio;
+	int n;
 
 	DPRINTF("entered\n");
 	/*
@@ -1664,83 +1816,102 @@ ctl_be_block_worker(void *context, int pending)
 	 * so make response maximally opaque to not confuse initiator.
 	 */
 	for (;;) {
-		mtx_lock(&be_lun->queue_lock);
-		io = (union ctl_io *)STAILQ_FIRST(&be_lun->datamove_queue);
-		if (io != NULL) {
-			DPRINTF("datamove queue\n");
-			STAILQ_REMOVE(&be_lun->datamove_queue, &io->io_hdr,
-				      ctl_io_hdr, links);
-			mtx_unlock(&be_lun->queue_lock);
-			beio = (struct ctl_be_block_io *)PRIV(io)->ptr;
-			if (cbe_lun->flags & CTL_LUN_FLAG_NO_MEDIA) {
-				ctl_set_busy(&io->scsiio);
-				ctl_complete_beio(beio);
-				return;
-			}
-			be_lun->dispatch(be_lun, beio);
-			continue;
-		}
-		io = (union ctl_io *)STAILQ_FIRST(&be_lun->config_write_queue);
+		mtx_lock(&queue->lock);
+		io = (union ctl_io *)STAILQ_FIRST(&queue->config_write_queue);
 		if (io != NULL) {
 			DPRINTF("config write queue\n");
-			STAILQ_REMOVE(&be_lun->config_write_queue, &io->io_hdr,
-				      ctl_io_hdr, links);
-			mtx_unlock(&be_lun->queue_lock);
+			STAILQ_REMOVE_HEAD(&queue->config_write_queue, links);
+			mtx_unlock(&queue->lock);
 			if (cbe_lun->flags & CTL_LUN_FLAG_NO_MEDIA) {
 				ctl_set_busy(&io->scsiio);
 				ctl_config_write_done(io);
-				return;
+				continue;
 			}
 			ctl_be_block_cw_dispatch(be_lun, io);
 			continue;
 		}
-		io = (union ctl_io *)STAILQ_FIRST(&be_lun->config_read_queue);
+		io = (union ctl_io *)STAILQ_FIRST(&queue->config_read_queue);
 		if (io != NULL) {
 			DPRINTF("config read queue\n");
-			STAILQ_REMOVE(&be_lun->config_read_queue, &io->io_hdr,
-				      ctl_io_hdr, links);
-			mtx_unlock(&be_lun->queue_lock);
+			STAILQ_REMOVE_HEAD(&queue->config_read_queue, links);
+			mtx_unlock(&queue->lock);
 			if (cbe_lun->flags & CTL_LUN_FLAG_NO_MEDIA) {
 				ctl_set_busy(&io->scsiio);
 				ctl_config_read_done(io);
-				return;
+				continue;
 			}
 			ctl_be_block_cr_dispatch(be_lun, io);
 			continue;
 		}
-		io = (union ctl_io *)STAILQ_FIRST(&be_lun->input_queue);
-		if (io != NULL) {
+
+		/*
+		 * Take a batch of data I/O in one go, writes whose data
+		 * has arrived first, then new I/O.
+		 */
+		STAILQ_INIT(&datamove);
+		STAILQ_INIT(&input);
+		for (n = 0; n < MAX(cbb_batch, 1); n++) {
+			if ((io = (union ctl_io *)
+			    STAILQ_FIRST(&queue->datamove_queue)) != NULL) {
+				STAILQ_REMOVE_HEAD(&queue->datamove_queue,
+				    links);
+				STAILQ_INSERT_TAIL(&datamove, &io->io_hdr,
+				    links);
+			} else if ((io = (union ctl_io *)
+			    STAILQ_FIRST(&queue->input_queue)) != NULL) {
+				STAILQ_REMOVE_HEAD(&queue->input_queue, links);
+				STAILQ_INSERT_TAIL(&input, &io->io_hdr, links);
+			} else
+				break;
+		}
+		mtx_unlock(&queue->lock);
+
+		/*
+		 * If we get here with nothing to do, there is no work left
+		 * in the queues, so just break out and let the task queue
+		 * go to sleep.
+		 */
+		if (n == 0)
+			break;
+
+		STAILQ_INIT(&batch);
+		while ((io = (union ctl_io *)STAILQ_FIRST(&datamove)) != NULL) {
+			DPRINTF("datamove queue\n");
+			STAILQ_REMOVE_HEAD(&datamove, links);
+			beio = (struct ctl_be_block_io *)PRIV(io)->ptr;
+			if (cbe_lun->flags & CTL_LUN_FLAG_NO_MEDIA) {
+				ctl_set_busy(&io->scsiio);
+				ctl_complete_beio(beio);
+				continue;
+			}
+			STAILQ_INSERT_TAIL(&batch, beio, links);
+		}
+		while ((io = (union ctl_io *)STAILQ_FIRST(&input)) != NULL) {
 			DPRINTF("input queue\n");
-			STAILQ_REMOVE(&be_lun->input_queue, &io->io_hdr,
-				      ctl_io_hdr, links);
-			mtx_unlock(&be_lun->queue_lock);
+			STAILQ_REMOVE_HEAD(&input, links);
 			if (cbe_lun->flags & CTL_LUN_FLAG_NO_MEDIA) {
 				ctl_set_busy(&io->scsiio);
 				ctl_data_submit_done(io);
-				return;
+				continue;
 			}
-			ctl_be_block_dispatch(be_lun, io);
-			continue;
+			beio = ctl_be_block_dispatch(be_lun, io);
+			if (beio != NULL)
+				STAILQ_INSERT_TAIL(&batch, beio, links);
 		}
-
-		/*
-		 * If we get here, there is no work left in the queues, so
-		 * just break out and let the task queue go to sleep.
-		 */
-		mtx_unlock(&be_lun->queue_lock);
-		break;
+		ctl_be_block_dispatch_batch(be_lun, &batch);
 	}
 }
 
 /*
  * Entry point from CTL to the backend for I/O.  We queue everything to a
- * work thread, so this just puts the I/O on a queue and wakes up the
- * thread.
+ * work thread, so this just puts the I/O on the queue serving this CPU
+ * and wakes up its threads.
  */
 static int
 ctl_be_block_submit(union ctl_io *io)
 {
 	struct ctl_be_block_lun *be_lun;
+	struct ctl_be_block_queue *queue;
 	struct ctl_be_lun *cbe_lun;
 
 	DPRINTF("entered\n");
@@ -1756,15 +1927,271 @@ ctl_be_block_submit(union ctl_io *io)
 		"%#x) encountered", io->io_hdr.io_type));
 
 	PRIV(io)->len = 0;
+	PRIV(io)->flags = curcpu % be_lun->num_queues;
 
-	mtx_lock(&be_lun->queue_lock);
-	STAILQ_INSERT_TAIL(&be_lun->input_queue, &io->io_hdr, links);
-	mtx_unlock(&be_lun->queue_lock);
-	taskqueue_enqueue(be_lun->io_taskqueue, &be_lun->io_task);
+	queue = &be_lun->queues[PRIV(io)->flags];
+	ctl_be_block_enqueue(queue, &queue->input_queue, io);
 
 	return (CTL_RETVAL_COMPLETE);
 }
 
+/*
+ * Read or write one chunk of an offloaded copy, the same way
+ * ctl_be_block_dispatch_file() and ctl_be_block_dispatch_zvol() do.
+ */
+static int
+ctl_be_block_copy_rw(struct ctl_be_block_lun *be_lun, enum uio_rw rw,
+		     uint8_t *buf, off_t len, off_t off)
+{
+	struct mount *mountpoint;
+	struct cdevsw *csw;
+	struct cdev *dev;
+	struct uio xuio;
+	struct iovec xiovec;
+	int error, lock_flags, ref;
+
+	xiovec.iov_base = buf;
+	xiovec.iov_len = len;
+	bzero(&xuio, sizeof(xuio));
+	xuio.uio_rw = rw;
+	xuio.uio_offset = off;
+	xuio.uio_resid = len;
+	xuio.uio_segflg = UIO_SYSSPACE;
+	xuio.uio_iov = &xiovec;
+	xuio.uio_iovcnt = 1;
+	xuio.uio_td = curthread;
+
+	if (be_lun->dev_type == CTL_BE_BLOCK_FILE) {
+		if (rw == UIO_READ) {
+			vn_lock(be_lun->vn, LK_SHARED | LK_RETRY);
+			error = VOP_READ(be_lun->vn, &xuio, 0,
+			    be_lun->backend.file.cred);
+			VOP_UNLOCK(be_lun->vn, 0);
+		} else {
+			(void)vn_start_write(be_lun->vn, &mountpoint, V_WAIT);
+			if (MNT_SHARED_WRITES(mountpoint) || ((mountpoint == NULL)
+			  && MNT_SHARED_WRITES(be_lun->vn->v_mount)))
+				lock_flags = LK_SHARED;
+			else
+				lock_flags = LK_EXCLUSIVE;
+			vn_lock(be_lun->vn, lock_flags | LK_RETRY);
+			error = VOP_WRITE(be_lun->vn, &xuio, 0,
+			    be_lun->backend.file.cred);
+			VOP_UNLOCK(be_lun->vn, 0);
+			vn_finished_write(mountpoint);
+		}
+	} else {
+		csw = devvn_refthread(be_lun->vn, &dev, &ref);
+		if (csw) {
+			if (rw == UIO_READ)
+				error = csw->d_read(dev, &xuio, 0);
+			else
+				error = csw->d_write(dev, &xuio, 0);
+			dev_relthread(dev, ref);
+		} else
+			error = ENXIO;
+	}
+	if (error == 0 && xuio.uio_resid != 0)
+		error = EIO;
+	return (error);
+}
+
+static void
+ctl_be_block_copy_rele(struct ctl_be_block_lun *be_lun)
+{
+
+	mtx_lock(&be_lun->io_lock);
+	if (--be_lun->copies == 0)
+		wakeup(&be_lun->copies);
+	mtx_unlock(&be_lun->io_lock);
+}
+
+static void
+ctl_be_block_copy_finish(struct ctl_be_block_copy *copy)
+{
+
+	ctl_be_block_copy_rele(copy->src);
+	if (copy->dst != copy->src)
+		ctl_be_block_copy_rele(copy->dst);
+	copy->done(copy->arg, copy->error);
+	mtx_destroy(&copy->lock);
+	free(copy, M_CTLBLK);
+}
+
+/*
+ * Move one chunk, then pick up the next one that nobody has started yet.
+ * The task is requeued rather than looping, so that the copy threads take
+ * turns between copies.
+ */
+static void
+ctl_be_block_copy_chunk(void *context, int pending)
+{
+	struct ctl_be_block_copy_chunk *ch = context;
+	struct ctl_be_block_copy *copy = ch->copy;
+	int error, last;
+
+	error = ctl_be_block_copy_rw(copy->src, UIO_READ, ch->buf, ch->len,
+	    copy->srcoff + ch->off);
+	if (error == 0)
+		error = ctl_be_block_copy_rw(copy->dst, UIO_WRITE, ch->buf,
+		    ch->len, copy->dstoff + ch->off);
+
+	mtx_lock(&copy->lock);
+	if (error != 0 && copy->error == 0)
+		copy->error = error;
+	if (copy->error == 0 && copy->next < copy->len) {
+		ch->off = copy->next;
+		ch->len = omin(copy->chunk, copy->len - ch->off);
+		copy->next += ch->len;
+		mtx_unlock(&copy->lock);
+		taskqueue_enqueue(cbb_copy_tq, &ch->task);
+		return;
+	}
+	last = (--copy->active == 0);
+	mtx_unlock(&copy->lock);
+
+	free(ch, M_CTLBLK);
+	if (last)
+		ctl_be_block_copy_finish(copy);
+}
+
+/*
+ * Set up the chunks of a new copy; this can sleep, which the caller of
+ * ctl_be_block_copy() can't.
+ */
+static void
+ctl_be_block_copy_start(void *context, int pending)
+{
+	struct ctl_be_block_copy *copy = context;
+	struct ctl_be_block_copy_chunk *ch;
+	int i, last, n;
+
+	if (copy->len == 0) {
+		ctl_be_block_copy_finish(copy);
+		return;
+	}
+	n = MIN(copy->depth, howmany(copy->len, copy->chunk));
+	mtx_lock(&copy->lock);
+	copy->active = n;
+	mtx_unlock(&copy->lock);
+	for (i = 0; i < n; i++) {
+		ch = malloc(sizeof(*ch) + copy->chunk, M_CTLBLK, M_WAITOK);
+		ch->copy = copy;
+		mtx_lock(&copy->lock);
+		/* The chunks already running may have done the rest. */
+		if (copy->error != 0 || copy->next >= copy->len) {
+			copy->active -= n - i;
+			last = (copy->active == 0);
+			mtx_unlock(&copy->lock);
+			free(ch, M_CTLBLK);
+			if (last)
+				ctl_be_block_copy_finish(copy);
+			return;
+		}
+		ch->off = copy->next;
+		ch->len = omin(copy->chunk, copy->len - ch->off);
+		copy->next += ch->len;
+		mtx_unlock(&copy->lock);
+		TASK_INIT(&ch->task, 0, ctl_be_block_copy_chunk, ch);
+		taskqueue_enqueue(cbb_copy_tq, &ch->task);
+	}
+}
+
+/*
+ * Take a copy reference on a LUN for the duration of an offloaded copy,
+ * unless it has no media or is backed by something we can only reach via
+ * bios.  ctl_be_block_drain_queues() waits for these references before
+ * the backing store is closed.
+ */
+static int
+ctl_be_block_copy_hold(struct ctl_be_block_lun *be_lun, off_t off, off_t len)
+{
+	int error;
+
+	mtx_lock(&be_lun->io_lock);
+	if ((be_lun->cbe_lun.flags & CTL_LUN_FLAG_NO_MEDIA) != 0 ||
+	    be_lun->vn == NULL ||
+	    (be_lun->dev_type != CTL_BE_BLOCK_FILE &&
+	     be_lun->dispatch != ctl_be_block_dispatch_zvol))
+		error = EOPNOTSUPP;
+	else if (len > be_lun->size_bytes || off > be_lun->size_bytes - len)
+		error = EINVAL;
+	else {
+		be_lun->copies++;
+		error = 0;
+	}
+	mtx_unlock(&be_lun->io_lock);
+	return (error);
+}
+
+/*
+ * Entry point from CTL for copies between two of our LUNs.  The data is
+ * moved in large chunks through bounce buffers by the copy threads, with
+ * several chunks in flight, instead of as a series of separate read and
+ * write commands going through CTL, the frontend-facing buffers and back.
+ * The LUNs' own worker threads are left to serve normal I/O.
+ */
+static int
+ctl_be_block_copy(struct ctl_be_lun *src, uint64_t srclba,
+		  struct ctl_be_lun *dst, uint64_t dstlba, uint64_t len,
+		  be_copy_done_t done, void *arg)
+{
+	struct ctl_be_block_lun *sbe_lun, *dbe_lun;
+	struct ctl_be_block_copy *copy;
+	int error;
+
+	sbe_lun = (struct ctl_be_block_lun *)src->be_lun;
+	dbe_lun = (struct ctl_be_block_lun *)dst->be_lun;
+	if (len > OFF_MAX || srclba > OFF_MAX / src->blocksize ||
+	    dstlba > OFF_MAX / dst->blocksize)
+		return (EINVAL);
+	copy = malloc(sizeof(*copy), M_CTLBLK, M_NOWAIT | M_ZERO);
+	if (copy == NULL)
+		return (ENOMEM);
+	copy->src = sbe_lun;
+	copy->dst = dbe_lun;
+	copy->srcoff = srclba * src->blocksize;
+	copy->dstoff = dstlba * dst->blocksize;
+	copy->len = len;
+	copy->done = done;
+	copy->arg = arg;
+	copy->chunk = cbb_copy_size;
+	copy->chunk -= copy->chunk % dst->blocksize;
+	copy->chunk = omin(omax(copy->chunk, dst->blocksize), len);
+	/*
+	 * Chunks may complete in any order, which is only safe when the
+	 * source and destination don't overlap.
+	 */
+	copy->depth = MAX(cbb_copy_depth, 1);
+	if (sbe_lun == dbe_lun && copy->srcoff < copy->dstoff + (off_t)len &&
+	    copy->dstoff < copy->srcoff + (off_t)len)
+		copy->depth = 1;
+
+	error = ctl_be_block_copy_hold(sbe_lun, copy->srcoff, len);
+	if (error != 0) {
+		free(copy, M_CTLBLK);
+		return (error);
+	}
+	if (dbe_lun != sbe_lun) {
+		error = ctl_be_block_copy_hold(dbe_lun, copy->dstoff, len);
+		if (error != 0) {
+			ctl_be_block_copy_rele(sbe_lun);
+			free(copy, M_CTLBLK);
+			return (error);
+		}
+	} else if (len > dbe_lun->size_bytes ||
+	    copy->dstoff > dbe_lun->size_bytes - len) {
+		ctl_be_block_copy_rele(sbe_lun);
+		free(copy, M_CTLBLK);
+		return (EINVAL);
+	}
+
+	mtx_init(&copy->lock, "cblk copy", NULL, MTX_DEF);
+	TASK_INIT(&copy->task, 0, ctl_be_block_copy_start, copy);
+	taskqueue_enqueue(cbb_copy_tq, &copy->task);
+	return (0);
+}
+
 static int
 ctl_be_block_ioctl(struct cdev *dev, u_long cmd, caddr_t addr,
 			int flag, struct thread *td)
@@ -2228,6 +2655,98 @@ again:
 	return (0);
 }
 
+/*
+ * Create the LUN's worker queues and spread num_threads threads across
+ * them, binding each queue's threads to the CPUs whose work it takes.
+ */
+static int
+ctl_be_block_init_queues(struct ctl_be_block_lun *be_lun, int num_threads)
+{
+	struct ctl_be_block_queue *queue;
+	cpuset_t mask;
+	int c, i, n, num_queues, retval;
+
+	if (cbb_num_queues > 0)
+		num_queues = cbb_num_queues;
+	else
+		num_queues = MIN(mp_ncpus, num_threads / CBB_QUEUE_THREADS);
+	num_queues = MAX(MIN(num_queues, num_threads), 1);
+	be_lun->queues = malloc(sizeof(*queue) * num_queues, M_CTLBLK,
+	    M_WAITOK | M_ZERO);
+	be_lun->num_queues = num_queues;
+	for (i = 0; i < num_queues; i++) {
+		queue = &be_lun->queues[i];
+		queue->lun = be_lun;
+		STAILQ_INIT(&queue->input_queue);
+		STAILQ_INIT(&queue->config_read_queue);
+		STAILQ_INIT(&queue->config_write_queue);
+		STAILQ_INIT(&queue->datamove_queue);
+		mtx_init(&queue->lock, "cblk queue lock", NULL, MTX_DEF);
+		TASK_INIT(&queue->task, /*priority*/0, ctl_be_block_worker,
+		    queue);
+	}
+
+	for (i = 0; i < num_queues; i++) {
+		queue = &be_lun->queues[i];
+		queue->taskqueue = taskqueue_create(be_lun->lunname, M_WAITOK,
+		    taskqueue_thread_enqueue, /*context*/&queue->taskqueue);
+		if (queue->taskqueue == NULL)
+			return (ENOMEM);
+
+		n = num_threads / num_queues + (i < num_threads % num_queues);
+		CPU_ZERO(&mask);
+		CPU_FOREACH(c) {
+			if (c % num_queues == i)
+				CPU_SET(c, &mask);
+		}
+		if (CPU_EMPTY(&mask)) {
+			retval = taskqueue_start_threads(&queue->taskqueue, n,
+			    PWAIT, "%s taskq %d", be_lun->lunname, i);
+		} else {
+			retval = taskqueue_start_threads_cpuset(
+			    &queue->taskqueue, n, PWAIT, &mask,
+			    "%s taskq %d", be_lun->lunname, i);
+		}
+		if (retval != 0)
+			return (retval);
+	}
+	return (0);
+}
+
+static void
+ctl_be_block_drain_queues(struct ctl_be_block_lun *be_lun)
+{
+	int i;
+
+	for (i = 0; i < be_lun->num_queues; i++)
+		taskqueue_drain_all(be_lun->queues[i].taskqueue);
+
+	/* Copies may be running on another LUN's threads. */
+	mtx_lock(&be_lun->io_lock);
+	while (be_lun->copies > 0)
+		mtx_sleep(&be_lun->copies, &be_lun->io_lock, 0, "cbbcpy", 0);
+	mtx_unlock(&be_lun->io_lock);
+}
+
+static void
+ctl_be_block_free_queues(struct ctl_be_block_lun *be_lun)
+{
+	struct ctl_be_block_queue *queue;
+	int i;
+
+	for (i = 0; i < be_lun->num_queues; i++) {
+		queue = &be_lun->queues[i];
+		if (queue->taskqueue != NULL) {
+			taskqueue_drain_all(queue->taskqueue);
+			taskqueue_free(queue->taskqueue);
+		}
+		mtx_destroy(&queue->lock);
+	}
+	free(be_lun->queues, M_CTLBLK);
+	be_lun->queues = NULL;
+	be_lun->num_queues = 0;
+}
+
 static int
 ctl_be_block_create(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 {
@@ -2249,13 +2768,8 @@ ctl_be_block_create(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 	cbe_lun->be_lun = be_lun;
 	be_lun->params = req->reqdata.create;
 	be_lun->softc = softc;
-	STAILQ_INIT(&be_lun->input_queue);
-	STAILQ_INIT(&be_lun->config_read_queue);
-	STAILQ_INIT(&be_lun->config_write_queue);
-	STAILQ_INIT(&be_lun->datamove_queue);
 	sprintf(be_lun->lunname, "cblk%d", softc->num_luns);
 	mtx_init(&be_lun->io_lock, "cblk io lock", NULL, MTX_DEF);
-	mtx_init(&be_lun->queue_lock, "cblk queue lock", NULL, MTX_DEF);
 	ctl_init_opts(&cbe_lun->options,
 	    req->num_be_args, req->kern_be_args);
 	be_lun->lun_zone = uma_zcreate(be_lun->lunname, CTLBLK_MAX_SEG,
@@ -2366,17 +2880,6 @@ ctl_be_block_create(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 			    sizeof(params->device_id)));
 	}
 
-	TASK_INIT(&be_lun->io_task, /*priority*/0, ctl_be_block_worker, be_lun);
-
-	be_lun->io_taskqueue = taskqueue_create(be_lun->lunname, M_WAITOK,
-	    taskqueue_thread_enqueue, /*context*/&be_lun->io_taskqueue);
-
-	if (be_lun->io_taskqueue == NULL) {
-		snprintf(req->error_str, sizeof(req->error_str),
-			 "unable to create taskqueue");
-		goto bailout_error;
-	}
-
 	/*
 	 * Note that we start the same number of threads by default for
 	 * both the file case and the block device case.  For the file
@@ -2391,14 +2894,12 @@ ctl_be_block_create(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 	 * device, he can specify that when the LUN is created, or change
 	 * the tunable/sysctl to alter the default number of threads.
 	 */
-	retval = taskqueue_start_threads(&be_lun->io_taskqueue,
-					 /*num threads*/num_threads,
-					 /*priority*/PWAIT,
-					 /*thread name*/
-					 "%s taskq", be_lun->lunname);
-
-	if (retval != 0)
+	retval = ctl_be_block_init_queues(be_lun, num_threads);
+	if (retval != 0) {
+		snprintf(req->error_str, sizeof(req->error_str),
+			 "unable to start worker threads");
 		goto bailout_error;
+	}
 
 	be_lun->num_threads = num_threads;
 
@@ -2463,15 +2964,14 @@ ctl_be_block_create(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 bailout_error:
 	req->status = CTL_LUN_ERROR;
 
-	if (be_lun->io_taskqueue != NULL)
-		taskqueue_free(be_lun->io_taskqueue);
+	if (be_lun->queues != NULL)
+		ctl_be_block_free_queues(be_lun);
 	ctl_be_block_close(be_lun);
 	if (be_lun->dev_path != NULL)
 		free(be_lun->dev_path, M_CTLBLK);
 	if (be_lun->lun_zone != NULL)
 		uma_zdestroy(be_lun->lun_zone);
 	ctl_free_opts(&cbe_lun->options);
-	mtx_destroy(&be_lun->queue_lock);
 	mtx_destroy(&be_lun->io_lock);
 	free(be_lun, M_CTLBLK);
 
@@ -2513,7 +3013,7 @@ ctl_be_block_rm(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 	if (be_lun->vn != NULL) {
 		cbe_lun->flags |= CTL_LUN_FLAG_NO_MEDIA;
 		ctl_lun_no_media(cbe_lun);
-		taskqueue_drain_all(be_lun->io_taskqueue);
+		ctl_be_block_drain_queues(be_lun);
 		ctl_be_block_close(be_lun);
 	}
 
@@ -2546,8 +3046,7 @@ ctl_be_block_rm(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 	softc->num_luns--;
 	mtx_unlock(&softc->lock);
 
-	taskqueue_drain_all(be_lun->io_taskqueue);
-	taskqueue_free(be_lun->io_taskqueue);
+	ctl_be_block_free_queues(be_lun);
 
 	if (be_lun->disk_stats != NULL)
 		devstat_remove_entry(be_lun->disk_stats);
@@ -2556,7 +3055,6 @@ ctl_be_block_rm(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 
 	ctl_free_opts(&cbe_lun->options);
 	free(be_lun->dev_path, M_CTLBLK);
-	mtx_destroy(&be_lun->queue_lock);
 	mtx_destroy(&be_lun->io_lock);
 	free(be_lun, M_CTLBLK);
 
@@ -2641,7 +3139,7 @@ ctl_be_block_modify(struct ctl_be_block_softc *softc, struct ctl_lun_req *req)
 		if (be_lun->vn != NULL) {
 			cbe_lun->flags |= CTL_LUN_FLAG_NO_MEDIA;
 			ctl_lun_no_media(cbe_lun);
-			taskqueue_drain_all(be_lun->io_taskqueue);
+			ctl_be_block_drain_queues(be_lun);
 			error = ctl_be_block_close(be_lun);
 		} else
 			error = 0;
@@ -2719,6 +3217,7 @@ static int
 ctl_be_block_config_write(union ctl_io *io)
 {
 	struct ctl_be_block_lun *be_lun;
+	struct ctl_be_block_queue *queue;
 	struct ctl_be_lun *cbe_lun;
 	int retval;
 
@@ -2743,11 +3242,8 @@ ctl_be_block_config_write(union ctl_io *io)
 		 * user asked to be synced out.  When they issue a sync
 		 * cache command, we'll sync out the whole thing.
 		 */
-		mtx_lock(&be_lun->queue_lock);
-		STAILQ_INSERT_TAIL(&be_lun->config_write_queue, &io->io_hdr,
-				   links);
-		mtx_unlock(&be_lun->queue_lock);
-		taskqueue_enqueue(be_lun->io_taskqueue, &be_lun->io_task);
+		queue = &be_lun->queues[curcpu % be_lun->num_queues];
+		ctl_be_block_enqueue(queue, &queue->config_write_queue, io);
 		break;
 	case START_STOP_UNIT: {
 		struct scsi_start_stop_unit *cdb;
@@ -2805,6 +3301,7 @@ static int
 ctl_be_block_config_read(union ctl_io *io)
 {
 	struct ctl_be_block_lun *be_lun;
+	struct ctl_be_block_queue *queue;
 	struct ctl_be_lun *cbe_lun;
 	int retval = 0;
 
@@ -2817,12 +3314,9 @@ ctl_be_block_config_read(union ctl_io *io)
 	switch (io->scsiio.cdb[0]) {
 	case SERVICE_ACTION_IN:
 		if (io->scsiio.cdb[1] == SGLS_SERVICE_ACTION) {
-			mtx_lock(&be_lun->queue_lock);
-			STAILQ_INSERT_TAIL(&be_lun->config_read_queue,
-			    &io->io_hdr, links);
-			mtx_unlock(&be_lun->queue_lock);
-			taskqueue_enqueue(be_lun->io_taskqueue,
-			    &be_lun->io_task);
+			queue = &be_lun->queues[curcpu % be_lun->num_queues];
+			ctl_be_block_enqueue(queue, &queue->config_read_queue,
+			    io);
 			retval = CTL_RETVAL_QUEUED;
 			break;
 		}
@@ -2860,6 +3354,10 @@ ctl_be_block_lun_info(void *be_lun, struct sbuf *sb)
 	if (retval != 0)
 		goto bailout;
 	retval = sbuf_printf(sb, "</num_threads>\n");
+	if (retval != 0)
+		goto bailout;
+	retval = sbuf_printf(sb, "\t<num_queues>%d</num_queues>\n",
+	    lun->num_queues);
 
 bailout:
 	return (retval);
@@ -2888,6 +3386,10 @@ ctl_be_block_init(void)
 	beio_zone = uma_zcreate("beio", sizeof(struct ctl_be_block_io),
 	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 	STAILQ_INIT(&softc->lun_list);
+	cbb_copy_tq = taskqueue_create("cbb copy", M_WAITOK,
+	    taskqueue_thread_enqueue, &cbb_copy_tq);
+	taskqueue_start_threads(&cbb_copy_tq, MAX(cbb_copy_threads, 1),
+	    PWAIT, "cblk copy");
 
 	return (retval);
 }
@@ -50,6 +50,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/types.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/sx.h>
 #include <sys/malloc.h>
 #include <sys/taskqueue.h>
 #include <sys/time.h>
@@ -71,12 +72,33 @@ __FBSDID("$FreeBSD$");
 #include <cam/ctl/ctl_private.h>
 #include <cam/ctl/ctl_error.h>
 
+/*
+ * By default all LUNs share a single scratch buffer: writes are discarded
+ * and reads return whatever happens to be in it.  Setting the "capacity"
+ * option instead gives the LUN its own storage, kept in a radix tree of
+ * PAGE_SIZE pages that are allocated on first write.  Unwritten pages read
+ * as zeroes, UNMAP and WRITE SAME release pages, and no more than
+ * "capacity" bytes of pages are ever allocated for the LUN.
+ */
+#define	PPP	(PAGE_SIZE / sizeof(void *))	/* Pointers per page */
+#define	PPPS	(PAGE_SHIFT - (sizeof(void *) == 8 ? 3 : 2))
+
 typedef enum {
 	CTL_BE_RAMDISK_LUN_UNCONFIGURED	= 0x01,
 	CTL_BE_RAMDISK_LUN_CONFIG_ERR	= 0x02,
 	CTL_BE_RAMDISK_LUN_WAITING	= 0x04
 } ctl_be_ramdisk_lun_flags;
 
+/*
+ * A batch of pages waiting to be reclaimed.  The pages may still be the
+ * target of a data move, so they cannot be used to link themselves.
+ */
+struct ctl_be_ramdisk_dead {
+	struct ctl_be_ramdisk_dead *next;
+	u_int count;
+	void *page[PPP - 2];
+};
+
 struct ctl_be_ramdisk_lun {
 	struct ctl_lun_create_params params;
 	char lunname[32];
@@ -90,7 +112,42 @@ struct ctl_be_ramdisk_lun {
 	struct task io_task;
 	STAILQ_HEAD(, ctl_io_hdr) cont_queue;
 	struct mtx_padalign queue_lock;
+
+	/*
+	 * Sparse page tree, used when cap_bytes is non-zero.  The tree has
+	 * indir levels of indirect pages, each holding PPP pointers.
+	 */
+	struct sx page_lock;
+	void *pages;
+	int indir;
+	uint64_t cap_bytes;
+	uint64_t cap_used;
+
+	/*
+	 * Pages released by UNMAP, WRITE SAME or a size reduction may still
+	 * be referenced by data moves in progress, so they are parked on the
+	 * current generation's list and only freed once every I/O that
+	 * started in that generation has finished.  Protected by queue_lock.
+	 */
+	int gen_cur;
+	u_int gen_active[2];
+	struct ctl_be_ramdisk_dead *gen_free[2];
+};
+
+/*
+ * Per-I/O backend state, kept in the CTL_PRIV_BACKEND slot.
+ */
+struct ctl_be_ramdisk_io {
+	uint64_t resid;			/* Bytes left to move */
+	uint32_t gen;			/* Generation held, see above */
+	uint32_t flags;
 };
+#define	CTL_BE_RAMDISK_IO_GEN		0x01	/* Holding a generation */
+#define	CTL_BE_RAMDISK_IO_BOUNCE	0x02	/* kern_data_ptr is ours */
+
+CTASSERT(sizeof(struct ctl_be_ramdisk_io) <= sizeof(union ctl_priv));
+#define	PRIV(io)	\
+    ((struct ctl_be_ramdisk_io *)&(io)->io_hdr.ctl_private[CTL_PRIV_BACKEND])
 
 struct ctl_be_ramdisk_softc {
 	struct mtx lock;
@@ -101,6 +158,7 @@ struct ctl_be_ramdisk_softc {
 #else
 	uint8_t *ramdisk_buffer;
 #endif
+	uint8_t *zero_page;
 	int num_luns;
 	STAILQ_HEAD(, ctl_be_ramdisk_lun) lun_list;
 };
@@ -113,6 +171,9 @@ void ctl_backend_ramdisk_shutdown(void);
 static int ctl_backend_ramdisk_move_done(union ctl_io *io);
 static int ctl_backend_ramdisk_submit(union ctl_io *io);
 static void ctl_backend_ramdisk_continue(union ctl_io *io);
+static int ctl_backend_ramdisk_map(union ctl_io *io, int *len_filled,
+				   int *sg_filled);
+static void ctl_backend_ramdisk_compare(union ctl_io *io);
 static int ctl_backend_ramdisk_ioctl(struct cdev *dev, u_long cmd,
 				     caddr_t addr, int flag, struct thread *td);
 static int ctl_backend_ramdisk_rm(struct ctl_be_ramdisk_softc *softc,
@@ -127,6 +188,8 @@ static void ctl_backend_ramdisk_lun_config_status(void *be_lun,
 						  ctl_lun_config_status status);
 static int ctl_backend_ramdisk_config_write(union ctl_io *io);
 static int ctl_backend_ramdisk_config_read(union ctl_io *io);
+static void ctl_backend_ramdisk_ws(union ctl_io *io);
+static void ctl_backend_ramdisk_unmap(union ctl_io *io);
 
 static struct ctl_backend_driver ctl_be_ramdisk_driver = 
 {
@@ -166,6 +229,7 @@ ctl_backend_ramdisk_init(void)
 	softc->ramdisk_buffer = (uint8_t *)malloc(softc->rd_size, M_RAMDISK,
 						  M_WAITOK);
 #endif
+	softc->zero_page = malloc(PAGE_SIZE, M_RAMDISK, M_WAITOK | M_ZERO);
 
 	return (0);
 }
@@ -201,6 +265,7 @@ ctl_backend_ramdisk_shutdown(void)
 #else
 	free(softc->ramdisk_buffer, M_RAMDISK);
 #endif
+	free(softc->zero_page, M_RAMDISK);
 
 	if (ctl_backend_deregister(&ctl_be_ramdisk_driver) != 0) {
 		printf("ctl_backend_ramdisk_shutdown: "
@@ -208,6 +273,262 @@ ctl_backend_ramdisk_shutdown(void)
 	}
 }
 
+static int
+ctl_backend_ramdisk_indir(uint64_t size_bytes)
+{
+	uint64_t npages;
+	int indir;
+
+	npages = howmany(size_bytes, PAGE_SIZE);
+	for (indir = 1; indir * PPPS < 64 &&
+	    ((uint64_t)1 << (indir * PPPS)) < npages; indir++)
+		;
+	return (indir);
+}
+
+/*
+ * Add levels to the top of the page tree until it covers size_bytes.
+ * Called with page_lock held exclusively.
+ */
+static void
+ctl_backend_ramdisk_grow(struct ctl_be_ramdisk_lun *be_lun,
+    uint64_t size_bytes)
+{
+	void **node;
+	int indir;
+
+	sx_assert(&be_lun->page_lock, SA_XLOCKED);
+	indir = ctl_backend_ramdisk_indir(size_bytes);
+	for (; be_lun->indir < indir; be_lun->indir++) {
+		if (be_lun->pages == NULL)
+			continue;
+		node = malloc(PAGE_SIZE, M_RAMDISK, M_WAITOK | M_ZERO);
+		node[0] = be_lun->pages;
+		be_lun->pages = node;
+	}
+}
+
+/*
+ * Walk the page tree down to the leaf slot for page number pn.  With alloc
+ * set, missing indirect pages are created; that needs page_lock held
+ * exclusively.  Otherwise a missing subtree returns NULL and sets *skip to
+ * the number of pages from pn to the end of that subtree.
+ */
+static void **
+ctl_backend_ramdisk_slot(struct ctl_be_ramdisk_lun *be_lun, uint64_t pn,
+    int alloc, uint64_t *skip)
+{
+	void **node, **slot;
+	int s;
+
+	slot = &be_lun->pages;
+	for (s = be_lun->indir * PPPS; s > 0; s -= PPPS) {
+		node = *slot;
+		if (node == NULL) {
+			if (!alloc) {
+				*skip = ((uint64_t)1 << s) -
+				    (pn & (((uint64_t)1 << s) - 1));
+				return (NULL);
+			}
+			node = malloc(PAGE_SIZE, M_RAMDISK, M_WAITOK | M_ZERO);
+			*slot = node;
+		}
+		slot = &node[(pn >> (s - PPPS)) & (PPP - 1)];
+	}
+	return (slot);
+}
+
+/*
+ * Return the page backing page number pn.  A page that was never written
+ * reads as NULL.  For writes the page is allocated instead, unless that
+ * would take the LUN past its capacity, in which case NULL is returned.
+ */
+static uint8_t *
+ctl_backend_ramdisk_getpage(struct ctl_be_ramdisk_lun *be_lun, uint64_t pn,
+    int write)
+{
+	void **slot;
+	uint64_t skip;
+
+	if (!write) {
+		sx_assert(&be_lun->page_lock, SA_LOCKED);
+		slot = ctl_backend_ramdisk_slot(be_lun, pn, 0, &skip);
+		return (slot != NULL ? *slot : NULL);
+	}
+
+	sx_assert(&be_lun->page_lock, SA_XLOCKED);
+	slot = ctl_backend_ramdisk_slot(be_lun, pn, 1, NULL);
+	if (*slot == NULL) {
+		if (be_lun->cap_used + PAGE_SIZE > be_lun->cap_bytes)
+			return (NULL);
+		*slot = malloc(PAGE_SIZE, M_RAMDISK, M_WAITOK | M_ZERO);
+		be_lun->cap_used += PAGE_SIZE;
+	}
+	return (*slot);
+}
+
+static void
+ctl_backend_ramdisk_free_dead(struct ctl_be_ramdisk_dead *dead)
+{
+	struct ctl_be_ramdisk_dead *next;
+	u_int i;
+
+	for (; dead != NULL; dead = next) {
+		next = dead->next;
+		for (i = 0; i < dead->count; i++)
+			free(dead->page[i], M_RAMDISK);
+		free(dead, M_RAMDISK);
+	}
+}
+
+/*
+ * Free the dead pages no data move can reference any more, moving on to
+ * the next generation once the previous one has drained.  Called with
+ * queue_lock held, returns with it released.
+ */
+static void
+ctl_backend_ramdisk_reclaim(struct ctl_be_ramdisk_lun *be_lun)
+{
+	struct ctl_be_ramdisk_dead *dead;
+	int old;
+
+	mtx_assert(&be_lun->queue_lock, MA_OWNED);
+	for (;;) {
+		old = be_lun->gen_cur ^ 1;
+		if (be_lun->gen_active[old] != 0)
+			break;
+		if (be_lun->gen_free[old] != NULL) {
+			dead = be_lun->gen_free[old];
+			be_lun->gen_free[old] = NULL;
+			mtx_unlock(&be_lun->queue_lock);
+			ctl_backend_ramdisk_free_dead(dead);
+			mtx_lock(&be_lun->queue_lock);
+			continue;
+		}
+		if (be_lun->gen_free[be_lun->gen_cur] == NULL)
+			break;
+		be_lun->gen_cur = old;
+	}
+	mtx_unlock(&be_lun->queue_lock);
+}
+
+static void
+ctl_backend_ramdisk_gen_enter(struct ctl_be_ramdisk_lun *be_lun,
+    union ctl_io *io)
+{
+
+	mtx_lock(&be_lun->queue_lock);
+	PRIV(io)->gen = be_lun->gen_cur;
+	be_lun->gen_active[be_lun->gen_cur]++;
+	mtx_unlock(&be_lun->queue_lock);
+	PRIV(io)->flags |= CTL_BE_RAMDISK_IO_GEN;
+}
+
+static void
+ctl_backend_ramdisk_gen_exit(struct ctl_be_ramdisk_lun *be_lun,
+    union ctl_io *io)
+{
+
+	if ((PRIV(io)->flags & CTL_BE_RAMDISK_IO_GEN) == 0)
+		return;
+	PRIV(io)->flags &= ~CTL_BE_RAMDISK_IO_GEN;
+	mtx_lock(&be_lun->queue_lock);
+	be_lun->gen_active[PRIV(io)->gen]--;
+	ctl_backend_ramdisk_reclaim(be_lun);
+}
+
+/*
+ * Deallocate the byte range [off, off + len).  Pages wholly inside the
+ * range are unlinked from the tree and queued for reclaim, the covered
+ * parts of any others are zeroed.  Called with page_lock held
+ * exclusively.
+ */
+static void
+ctl_backend_ramdisk_release(struct ctl_be_ramdisk_lun *be_lun, uint64_t off,
+    uint64_t len)
+{
+	struct ctl_be_ramdisk_dead *dead, *last;
+	void **slot;
+	uint64_t pn, skip;
+	u_int po, seg;
+
+	sx_assert(&be_lun->page_lock, SA_XLOCKED);
+	dead = last = NULL;
+	while (len > 0) {
+		pn = off >> PAGE_SHIFT;
+		po = off & PAGE_MASK;
+		seg = MIN(PAGE_SIZE - po, len);
+		slot = ctl_backend_ramdisk_slot(be_lun, pn, 0, &skip);
+		if (slot == NULL) {
+			/* Nothing at all is allocated in this subtree. */
+			if (skip > ((off + len - 1) >> PAGE_SHIFT) - pn)
+				break;
+			skip = ((pn + skip) << PAGE_SHIFT) - off;
+			off += skip;
+			len -= skip;
+			continue;
+		}
+		if (*slot != NULL && seg < PAGE_SIZE) {
+			memset((uint8_t *)*slot + po, 0, seg);
+		} else if (*slot != NULL) {
+			if (dead == NULL || dead->count == nitems(dead->page)) {
+				dead = malloc(sizeof(*dead), M_RAMDISK,
+				    M_WAITOK | M_ZERO);
+				dead->next = last;
+				last = dead;
+			}
+			dead->page[dead->count++] = *slot;
+			*slot = NULL;
+			be_lun->cap_used -= PAGE_SIZE;
+		}
+		off += seg;
+		len -= seg;
+	}
+	if (dead == NULL)
+		return;
+
+	mtx_lock(&be_lun->queue_lock);
+	for (last = dead; last->next != NULL; last = last->next)
+		;
+	last->next = be_lun->gen_free[be_lun->gen_cur];
+	be_lun->gen_free[be_lun->gen_cur] = dead;
+	ctl_backend_ramdisk_reclaim(be_lun);
+}
+
+static void
+ctl_backend_ramdisk_free_tree(void **node, int indir)
+{
+	u_int i;
+
+	for (i = 0; i < PPP; i++) {
+		if (node[i] == NULL)
+			continue;
+		if (indir > 1)
+			ctl_backend_ramdisk_free_tree(node[i], indir - 1);
+		else
+			free(node[i], M_RAMDISK);
+	}
+	free(node, M_RAMDISK);
+}
+
+/*
+ * Release all of a LUN's storage.  No I/O may be outstanding.
+ */
+static void
+ctl_backend_ramdisk_free_pages(struct ctl_be_ramdisk_lun *be_lun)
+{
+	int i;
+
+	if (be_lun->pages != NULL)
+		ctl_backend_ramdisk_free_tree(be_lun->pages, be_lun->indir);
+	be_lun->pages = NULL;
+	for (i = 0; i < 2; i++) {
+		ctl_backend_ramdisk_free_dead(be_lun->gen_free[i]);
+		be_lun->gen_free[i] = NULL;
+	}
+	be_lun->cap_used = 0;
+}
+
 static int
 ctl_backend_ramdisk_move_done(union ctl_io *io)
 {
@@ -227,14 +548,21 @@ ctl_backend_ramdisk_move_done(union ctl_io *io)
 	bintime_add(&io->io_hdr.dma_bt, &cur_bt);
 #endif
 	io->io_hdr.num_dmas++;
-	if (io->scsiio.kern_sg_entries > 0)
+	if (PRIV(io)->flags & CTL_BE_RAMDISK_IO_BOUNCE) {
+		if ((io->io_hdr.flags & CTL_FLAG_ABORT) == 0 &&
+		    io->io_hdr.port_status == 0 &&
+		    (io->io_hdr.status & CTL_STATUS_MASK) == CTL_STATUS_NONE)
+			ctl_backend_ramdisk_compare(io);
+		free(io->scsiio.kern_data_ptr, M_RAMDISK);
+		PRIV(io)->flags &= ~CTL_BE_RAMDISK_IO_BOUNCE;
+	} else if (io->scsiio.kern_sg_entries > 0)
 		free(io->scsiio.kern_data_ptr, M_RAMDISK);
 	io->scsiio.kern_rel_offset += io->scsiio.kern_data_len;
 	if (io->io_hdr.flags & CTL_FLAG_ABORT) {
 		;
 	} else if ((io->io_hdr.port_status == 0) &&
 	    ((io->io_hdr.status & CTL_STATUS_MASK) == CTL_STATUS_NONE)) {
-		if (io->io_hdr.ctl_private[CTL_PRIV_BACKEND].integer > 0) {
+		if (PRIV(io)->resid > 0) {
 			mtx_lock(&be_lun->queue_lock);
 			STAILQ_INSERT_TAIL(&be_lun->cont_queue,
 			    &io->io_hdr, links);
@@ -260,6 +588,7 @@ ctl_backend_ramdisk_move_done(union ctl_io *io)
 					 /*retry_count*/
 					 io->io_hdr.port_status);
 	}
+	ctl_backend_ramdisk_gen_exit(be_lun, io);
 	ctl_data_submit_done(io);
 	return(0);
 }
@@ -268,26 +597,167 @@ static int
 ctl_backend_ramdisk_submit(union ctl_io *io)
 {
 	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
 	struct ctl_lba_len_flags *lbalen;
 
 	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
 		CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
 	lbalen = (struct ctl_lba_len_flags *)&io->io_hdr.ctl_private[CTL_PRIV_LBA_LEN];
 	if (lbalen->flags & CTL_LLF_VERIFY) {
 		ctl_set_success(&io->scsiio);
 		ctl_data_submit_done(io);
 		return (CTL_RETVAL_COMPLETE);
 	}
-	io->io_hdr.ctl_private[CTL_PRIV_BACKEND].integer =
-	    lbalen->len * cbe_lun->blocksize;
+	PRIV(io)->resid = (uint64_t)lbalen->len * cbe_lun->blocksize;
+	PRIV(io)->flags = 0;
+	if (be_lun->cap_bytes != 0)
+		ctl_backend_ramdisk_gen_enter(be_lun, io);
 	ctl_backend_ramdisk_continue(io);
 	return (CTL_RETVAL_COMPLETE);
 }
 
+/*
+ * Map the next chunk of a transfer on a LUN with its own page tree.  The
+ * S/G list points straight at the backing pages, with holes read from the
+ * shared zero page.  Data to compare is moved into a bounce buffer and
+ * checked against the pages by ctl_backend_ramdisk_compare().
+ */
+static int
+ctl_backend_ramdisk_map(union ctl_io *io, int *len_filled, int *sg_filled)
+{
+	struct ctl_be_ramdisk_softc *softc;
+	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
+	struct ctl_lba_len_flags *lbalen;
+	struct ctl_sg_entry *sg_entries;
+	uint64_t off;
+	uint8_t *page;
+	u_int len, po, seg;
+	int i, nsg, write;
+
+	softc = &rd_softc;
+	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
+		CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
+	lbalen = (struct ctl_lba_len_flags *)&io->io_hdr.ctl_private[CTL_PRIV_LBA_LEN];
+	len = MIN(PRIV(io)->resid, softc->rd_size);
+	*len_filled = len;
+
+	if (lbalen->flags & CTL_LLF_COMPARE) {
+		io->scsiio.kern_data_ptr = malloc(len, M_RAMDISK, M_WAITOK);
+		PRIV(io)->flags |= CTL_BE_RAMDISK_IO_BOUNCE;
+		*sg_filled = 0;
+		return (0);
+	}
+
+	off = (lbalen->lba + lbalen->len) * cbe_lun->blocksize -
+	    PRIV(io)->resid;
+	nsg = howmany((off & PAGE_MASK) + len, PAGE_SIZE);
+	sg_entries = malloc(sizeof(struct ctl_sg_entry) * nsg, M_RAMDISK,
+	    M_WAITOK);
+	write = (lbalen->flags & CTL_LLF_WRITE) != 0;
+	if (write)
+		sx_xlock(&be_lun->page_lock);
+	else
+		sx_slock(&be_lun->page_lock);
+	for (i = 0; i < nsg; i++) {
+		po = off & PAGE_MASK;
+		seg = MIN(PAGE_SIZE - po, len);
+		page = ctl_backend_ramdisk_getpage(be_lun, off >> PAGE_SHIFT,
+		    write);
+		if (page == NULL) {
+			if (write)
+				break;
+			page = softc->zero_page;
+		}
+		sg_entries[i].addr = page + po;
+		sg_entries[i].len = seg;
+		off += seg;
+		len -= seg;
+	}
+	if (write)
+		sx_xunlock(&be_lun->page_lock);
+	else
+		sx_sunlock(&be_lun->page_lock);
+
+	if (i < nsg) {
+		free(sg_entries, M_RAMDISK);
+		return (ENOSPC);
+	}
+	if (nsg == 1) {
+		io->scsiio.kern_data_ptr = sg_entries[0].addr;
+		free(sg_entries, M_RAMDISK);
+		*sg_filled = 0;
+	} else {
+		io->scsiio.kern_data_ptr = (uint8_t *)sg_entries;
+		*sg_filled = nsg;
+	}
+	return (0);
+}
+
+/*
+ * Compare the chunk just moved into the bounce buffer against the
+ * backing pages, and report the offset of the first mismatch.
+ */
+static void
+ctl_backend_ramdisk_compare(union ctl_io *io)
+{
+	struct ctl_be_ramdisk_softc *softc;
+	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
+	struct ctl_lba_len_flags *lbalen;
+	uint64_t done, off;
+	uint8_t *buf, *page;
+	uint8_t info[8];
+	u_int i, len, po, seg;
+
+	softc = &rd_softc;
+	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
+		CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
+	lbalen = (struct ctl_lba_len_flags *)&io->io_hdr.ctl_private[CTL_PRIV_LBA_LEN];
+	buf = io->scsiio.kern_data_ptr;
+	len = io->scsiio.kern_data_len;
+	done = (uint64_t)lbalen->len * cbe_lun->blocksize - PRIV(io)->resid -
+	    len;
+	off = lbalen->lba * cbe_lun->blocksize + done;
+
+	sx_slock(&be_lun->page_lock);
+	for (i = 0; i < len; i += seg) {
+		po = (off + i) & PAGE_MASK;
+		seg = MIN(PAGE_SIZE - po, len - i);
+		page = ctl_backend_ramdisk_getpage(be_lun, (off + i) >> PAGE_SHIFT,
+		    0);
+		if (page == NULL)
+			page = softc->zero_page;
+		if (memcmp(buf + i, page + po, seg) != 0) {
+			while (buf[i] == page[po]) {
+				i++;
+				po++;
+			}
+			break;
+		}
+	}
+	sx_sunlock(&be_lun->page_lock);
+
+	if (i < len) {
+		scsi_u64to8b(done + i, info);
+		ctl_set_sense(&io->scsiio, /*current_error*/ 1,
+		    /*sense_key*/ SSD_KEY_MISCOMPARE,
+		    /*asc*/ 0x1D, /*ascq*/ 0x00,
+		    /*type*/ SSD_ELEM_INFO,
+		    /*size*/ sizeof(info), /*data*/ &info,
+		    /*type*/ SSD_ELEM_NONE);
+	}
+}
+
 static void
 ctl_backend_ramdisk_continue(union ctl_io *io)
 {
 	struct ctl_be_ramdisk_softc *softc;
+	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
 	int len, len_filled, sg_filled;
 #ifdef CTL_RAMDISK_PAGES
 	struct ctl_sg_entry *sg_entries;
@@ -295,7 +765,20 @@ ctl_backend_ramdisk_continue(union ctl_io *io)
 #endif
 
 	softc = &rd_softc;
-	len = io->io_hdr.ctl_private[CTL_PRIV_BACKEND].integer;
+	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
+		CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
+	if (be_lun->cap_bytes != 0) {
+		if (ctl_backend_ramdisk_map(io, &len_filled, &sg_filled) != 0) {
+			ctl_set_space_alloc_fail(&io->scsiio);
+			ctl_backend_ramdisk_gen_exit(be_lun, io);
+			ctl_data_submit_done(io);
+			return;
+		}
+		goto move;
+	}
+
+	len = PRIV(io)->resid;
 #ifdef CTL_RAMDISK_PAGES
 	sg_filled = min(btoc(len), softc->num_pages);
 	if (sg_filled > 1) {
@@ -319,12 +802,13 @@ ctl_backend_ramdisk_continue(union ctl_io *io)
 	io->scsiio.kern_data_ptr = softc->ramdisk_buffer;
 #endif /* CTL_RAMDISK_PAGES */
 
+move:
 	io->scsiio.be_move_done = ctl_backend_ramdisk_move_done;
 	io->scsiio.kern_data_resid = 0;
 	io->scsiio.kern_data_len = len_filled;
 	io->scsiio.kern_sg_entries = sg_filled;
 	io->io_hdr.flags |= CTL_FLAG_ALLOCATED;
-	io->io_hdr.ctl_private[CTL_PRIV_BACKEND].integer -= len_filled;
+	PRIV(io)->resid -= len_filled;
 #ifdef CTL_TIME_IO
 	getbinuptime(&io->io_hdr.dma_start_bt);
 #endif
@@ -477,6 +961,8 @@ ctl_backend_ramdisk_rm(struct ctl_be_ramdisk_softc *softc,
 		taskqueue_drain_all(be_lun->io_taskqueue);
 		taskqueue_free(be_lun->io_taskqueue);
 		ctl_free_opts(&be_lun->cbe_lun.options);
+		ctl_backend_ramdisk_free_pages(be_lun);
+		sx_destroy(&be_lun->page_lock);
 		mtx_destroy(&be_lun->queue_lock);
 		free(be_lun, M_RAMDISK);
 	}
@@ -508,6 +994,7 @@ ctl_backend_ramdisk_create(struct ctl_be_ramdisk_softc *softc,
 	cbe_lun->be_lun = be_lun;
 	be_lun->params = req->reqdata.create;
 	be_lun->softc = softc;
+	sx_init(&be_lun->page_lock, "cram page lock");
 	sprintf(be_lun->lunname, "cram%d", softc->num_luns);
 	ctl_init_opts(&cbe_lun->options, req->num_be_args, req->kern_be_args);
 
@@ -549,8 +1036,20 @@ ctl_backend_ramdisk_create(struct ctl_be_ramdisk_softc *softc,
 	params->blocksize_bytes = cbe_lun->blocksize;
 	params->lun_size_bytes = be_lun->size_bytes;
 
+	value = ctl_get_opt(&cbe_lun->options, "capacity");
+	if (value != NULL) {
+		if (ctl_expand_number(value, &be_lun->cap_bytes) != 0 ||
+		    be_lun->cap_bytes == 0) {
+			snprintf(req->error_str, sizeof(req->error_str),
+				 "%s: invalid capacity \"%s\"", __func__, value);
+			be_lun->cap_bytes = 0;
+			goto bailout_error;
+		}
+		be_lun->indir = ctl_backend_ramdisk_indir(be_lun->size_bytes);
+	}
+
 	value = ctl_get_opt(&cbe_lun->options, "unmap");
-	if (value != NULL && strcmp(value, "on") == 0)
+	if (value != NULL ? strcmp(value, "on") == 0 : be_lun->cap_bytes != 0)
 		cbe_lun->flags |= CTL_LUN_FLAG_UNMAP;
 	value = ctl_get_opt(&cbe_lun->options, "readonly");
 	if (value != NULL) {
@@ -683,6 +1182,7 @@ bailout_error:
 			taskqueue_free(be_lun->io_taskqueue);
 		}
 		ctl_free_opts(&cbe_lun->options);
+		sx_destroy(&be_lun->page_lock);
 		mtx_destroy(&be_lun->queue_lock);
 		free(be_lun, M_RAMDISK);
 	}
@@ -697,6 +1197,7 @@ ctl_backend_ramdisk_modify(struct ctl_be_ramdisk_softc *softc,
 	struct ctl_be_lun *cbe_lun;
 	struct ctl_lun_modify_params *params;
 	char *value;
+	uint64_t cap_bytes, oldsize, size_blocks, size_bytes;
 	uint32_t blocksize;
 	int wasprim;
 
@@ -738,6 +1239,25 @@ ctl_backend_ramdisk_modify(struct ctl_be_ramdisk_softc *softc,
 			ctl_lun_secondary(cbe_lun);
 	}
 
+	value = ctl_get_opt(&cbe_lun->options, "capacity");
+	if (value != NULL) {
+		if (be_lun->cap_bytes == 0) {
+			snprintf(req->error_str, sizeof(req->error_str),
+				 "%s: capacity can only be set at LUN creation",
+				 __func__);
+			goto bailout_error;
+		}
+		if (ctl_expand_number(value, &cap_bytes) != 0 ||
+		    cap_bytes == 0) {
+			snprintf(req->error_str, sizeof(req->error_str),
+				 "%s: invalid capacity \"%s\"", __func__, value);
+			goto bailout_error;
+		}
+		sx_xlock(&be_lun->page_lock);
+		be_lun->cap_bytes = cap_bytes;
+		sx_xunlock(&be_lun->page_lock);
+	}
+
 	blocksize = be_lun->cbe_lun.blocksize;
 	if (be_lun->params.lun_size_bytes < blocksize) {
 		snprintf(req->error_str, sizeof(req->error_str),
@@ -745,9 +1265,31 @@ ctl_backend_ramdisk_modify(struct ctl_be_ramdisk_softc *softc,
 			be_lun->params.lun_size_bytes, blocksize);
 		goto bailout_error;
 	}
-	be_lun->size_blocks = be_lun->params.lun_size_bytes / blocksize;
-	be_lun->size_bytes = be_lun->size_blocks * blocksize;
-	be_lun->cbe_lun.maxlba = be_lun->size_blocks - 1;
+	oldsize = be_lun->size_bytes;
+	size_blocks = be_lun->params.lun_size_bytes / blocksize;
+	size_bytes = size_blocks * blocksize;
+
+	/*
+	 * I/O past the old end must not be let in before the tree is deep
+	 * enough to index it, or it would alias existing pages; so grow
+	 * first and publish the size after.  When shrinking, publish first
+	 * so that nothing new reaches the pages that are being released.
+	 */
+	if (be_lun->cap_bytes != 0 && size_bytes > oldsize) {
+		sx_xlock(&be_lun->page_lock);
+		ctl_backend_ramdisk_grow(be_lun, size_bytes);
+		sx_xunlock(&be_lun->page_lock);
+	}
+	be_lun->size_blocks = size_blocks;
+	be_lun->size_bytes = size_bytes;
+	be_lun->cbe_lun.maxlba = size_blocks - 1;
+	if (be_lun->cap_bytes != 0 && size_bytes < oldsize) {
+		/* Waits for I/O in flight to the old range. */
+		sx_xlock(&be_lun->page_lock);
+		ctl_backend_ramdisk_release(be_lun, size_bytes,
+		    oldsize - size_bytes);
+		sx_xunlock(&be_lun->page_lock);
+	}
 	ctl_lun_capacity_changed(&be_lun->cbe_lun);
 
 	/* Tell the user the exact size we ended up using */
@@ -784,8 +1326,11 @@ ctl_backend_ramdisk_lun_shutdown(void *be_lun)
 	}
 	mtx_unlock(&softc->lock);
 
-	if (do_free != 0)
+	if (do_free != 0) {
+		ctl_backend_ramdisk_free_pages(lun);
+		sx_destroy(&lun->page_lock);
 		free(be_lun, M_RAMDISK);
+	}
 }
 
 static void
@@ -834,6 +1379,8 @@ ctl_backend_ramdisk_lun_config_status(void *be_lun,
 		STAILQ_REMOVE(&softc->lun_list, lun, ctl_be_ramdisk_lun,
 			      links);
 		softc->num_luns--;
+		ctl_backend_ramdisk_free_pages(lun);
+		sx_destroy(&lun->page_lock);
 		free(lun, M_RAMDISK);
 	}
 	mtx_unlock(&softc->lock);
@@ -892,11 +1439,15 @@ ctl_backend_ramdisk_config_write(union ctl_io *io)
 		break;
 	}
 	case PREVENT_ALLOW:
+		ctl_set_success(&io->scsiio);
+		ctl_config_write_done(io);
+		break;
 	case WRITE_SAME_10:
 	case WRITE_SAME_16:
+		ctl_backend_ramdisk_ws(io);
+		break;
 	case UNMAP:
-		ctl_set_success(&io->scsiio);
-		ctl_config_write_done(io);
+		ctl_backend_ramdisk_unmap(io);
 		break;
 	default:
 		ctl_set_invalid_opcode(&io->scsiio);
@@ -908,6 +1459,125 @@ ctl_backend_ramdisk_config_write(union ctl_io *io)
 	return (retval);
 }
 
+static void
+ctl_backend_ramdisk_ws(union ctl_io *io)
+{
+	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
+	struct ctl_lba_len_flags *lbalen;
+	uint64_t lba, off;
+	uint8_t *buf, *page;
+	u_int i, po, seg;
+
+	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
+	    CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
+	lbalen = (struct ctl_lba_len_flags *)&io->io_hdr.ctl_private[CTL_PRIV_LBA_LEN];
+
+	if (be_lun->cap_bytes == 0) {
+		ctl_set_success(&io->scsiio);
+		ctl_config_write_done(io);
+		return;
+	}
+	if (lbalen->flags & ~(SWS_LBDATA | SWS_UNMAP | SWS_ANCHOR | SWS_NDOB) ||
+	    (lbalen->flags & (SWS_UNMAP | SWS_ANCHOR) &&
+	     (cbe_lun->flags & CTL_LUN_FLAG_UNMAP) == 0)) {
+		ctl_set_invalid_field(&io->scsiio,
+				      /*sks_valid*/ 1,
+				      /*command*/ 1,
+				      /*field*/ 1,
+				      /*bit_valid*/ 0,
+				      /*bit*/ 0);
+		ctl_config_write_done(io);
+		return;
+	}
+
+	/*
+	 * Unwritten pages read as zeroes, so writing zeroes is the same as
+	 * deallocating.  Anchored blocks are simply deallocated too.
+	 */
+	buf = io->scsiio.kern_data_ptr;
+	if ((lbalen->flags & (SWS_UNMAP | SWS_ANCHOR | SWS_NDOB)) != 0 ||
+	    ((lbalen->flags & SWS_LBDATA) == 0 &&
+	     buf[0] == 0 && memcmp(buf, buf + 1, cbe_lun->blocksize - 1) == 0)) {
+		sx_xlock(&be_lun->page_lock);
+		ctl_backend_ramdisk_release(be_lun,
+		    lbalen->lba * cbe_lun->blocksize,
+		    (uint64_t)lbalen->len * cbe_lun->blocksize);
+		sx_xunlock(&be_lun->page_lock);
+		ctl_set_success(&io->scsiio);
+		ctl_config_write_done(io);
+		return;
+	}
+
+	sx_xlock(&be_lun->page_lock);
+	for (lba = lbalen->lba; lba < lbalen->lba + lbalen->len; lba++) {
+		if (lbalen->flags & SWS_LBDATA)
+			scsi_ulto4b(lba, buf);
+		off = lba * cbe_lun->blocksize;
+		for (i = 0; i < cbe_lun->blocksize; i += seg) {
+			po = (off + i) & PAGE_MASK;
+			seg = MIN(PAGE_SIZE - po, cbe_lun->blocksize - i);
+			page = ctl_backend_ramdisk_getpage(be_lun,
+			    (off + i) >> PAGE_SHIFT, 1);
+			if (page == NULL)
+				goto nospace;
+			memcpy(page + po, buf + i, seg);
+		}
+	}
+	sx_xunlock(&be_lun->page_lock);
+	ctl_set_success(&io->scsiio);
+	ctl_config_write_done(io);
+	return;
+
+nospace:
+	sx_xunlock(&be_lun->page_lock);
+	ctl_set_space_alloc_fail(&io->scsiio);
+	ctl_config_write_done(io);
+}
+
+static void
+ctl_backend_ramdisk_unmap(union ctl_io *io)
+{
+	struct ctl_be_lun *cbe_lun;
+	struct ctl_be_ramdisk_lun *be_lun;
+	struct ctl_ptr_len_flags *ptrlen;
+	struct scsi_unmap_desc *buf, *end;
+
+	cbe_lun = (struct ctl_be_lun *)io->io_hdr.ctl_private[
+	    CTL_PRIV_BACKEND_LUN].ptr;
+	be_lun = (struct ctl_be_ramdisk_lun *)cbe_lun->be_lun;
+	ptrlen = (struct ctl_ptr_len_flags *)&io->io_hdr.ctl_private[CTL_PRIV_LBA_LEN];
+
+	if (be_lun->cap_bytes == 0) {
+		ctl_set_success(&io->scsiio);
+		ctl_config_write_done(io);
+		return;
+	}
+	if ((ptrlen->flags & ~SU_ANCHOR) != 0) {
+		ctl_set_invalid_field(&io->scsiio,
+				      /*sks_valid*/ 0,
+				      /*command*/ 1,
+				      /*field*/ 0,
+				      /*bit_valid*/ 0,
+				      /*bit*/ 0);
+		ctl_config_write_done(io);
+		return;
+	}
+
+	buf = (struct scsi_unmap_desc *)ptrlen->ptr;
+	end = buf + ptrlen->len / sizeof(*buf);
+	sx_xlock(&be_lun->page_lock);
+	for (; buf < end; buf++) {
+		ctl_backend_ramdisk_release(be_lun,
+		    scsi_8btou64(buf->lba) * cbe_lun->blocksize,
+		    (uint64_t)scsi_4btoul(buf->length) * cbe_lun->blocksize);
+	}
+	sx_xunlock(&be_lun->page_lock);
+	ctl_set_success(&io->scsiio);
+	ctl_config_write_done(io);
+}
+
 static int
 ctl_backend_ramdisk_config_read(union ctl_io *io)
 {
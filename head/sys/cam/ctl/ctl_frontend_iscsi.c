@@ -97,6 +97,9 @@ static int maxcmdsn_delta = 256;
 SYSCTL_INT(_kern_cam_ctl_iscsi, OID_AUTO, maxcmdsn_delta, CTLFLAG_RWTUN,
     &maxcmdsn_delta, 256, "Number of commands the initiator can send "
     "without confirmation");
+static int nocopy = 1;
+SYSCTL_INT(_kern_cam_ctl_iscsi, OID_AUTO, nocopy, CTLFLAG_RWTUN,
+    &nocopy, 1, "Send Data-In PDUs straight from CTL buffers");
 
 #define	CFISCSI_DEBUG(X, ...)						\
 	do {								\
@@ -142,6 +145,13 @@ SYSCTL_INT(_kern_cam_ctl_iscsi, OID_AUTO, maxcmdsn_delta, CTLFLAG_RWTUN,
 #define	PDU_TOTAL_TRANSFER_LEN(X)	(X)->ip_prv1
 #define	PDU_R2TSN(X)			(X)->ip_prv2
 
+/*
+ * References to the data buffers of a Data-In transfer, held by the
+ * datamove itself and by every mbuf that points into them.
+ */
+#define	IO_DATAIN_REFS(X)						\
+	((volatile u_int *)&(X)->io_hdr.ctl_private[CTL_PRIV_FRONTEND2].integer)
+
 int		cfiscsi_init(void);
 static void	cfiscsi_online(void *arg);
 static void	cfiscsi_offline(void *arg);
@@ -2409,6 +2419,21 @@ cfiscsi_target_find_or_create(struct cfiscsi_softc *softc, const char *name,
 	return (newct);
 }
 
+/*
+ * Drop a reference to the Data-In buffers; the last one completes the
+ * datamove.  May be called from the network stack when it frees the
+ * mbufs, so nothing here may sleep.
+ */
+static void
+cfiscsi_datamove_in_release(void *arg)
+{
+	union ctl_io *io;
+
+	io = arg;
+	if (refcount_release(IO_DATAIN_REFS(io)))
+		io->scsiio.be_move_done(io);
+}
+
 static void
 cfiscsi_datamove_in(union ctl_io *io)
 {
@@ -2476,6 +2501,14 @@ cfiscsi_datamove_in(union ctl_io *io)
 		return;
 	}
 
+	/*
+	 * With nocopy, the PDUs point straight into the CTL buffers.  Those
+	 * must not be released until the network stack is done with them,
+	 * so completion of the datamove is deferred until the last mbuf
+	 * referencing them is freed.
+	 */
+	refcount_init(IO_DATAIN_REFS(io), 1);
+
 	i = 0;
 	sg_addr = NULL;
 	sg_len = 0;
@@ -2488,7 +2521,7 @@ cfiscsi_datamove_in(union ctl_io *io)
 				CFISCSI_SESSION_WARN(cs, "failed to "
 				    "allocate memory; dropping connection");
 				ctl_set_busy(&io->scsiio);
-				io->scsiio.be_move_done(io);
+				cfiscsi_datamove_in_release(io);
 				cfiscsi_session_terminate(cs);
 				return;
 			}
@@ -2539,13 +2572,23 @@ cfiscsi_datamove_in(union ctl_io *io)
 			    len, sg_len));
 		}
 
-		error = icl_pdu_append_data(response, sg_addr, len, M_NOWAIT);
+		if (nocopy) {
+			refcount_acquire(IO_DATAIN_REFS(io));
+			error = icl_pdu_append_ext(response,
+			    __DECONST(char *, sg_addr), len,
+			    cfiscsi_datamove_in_release, io, M_NOWAIT);
+			if (error != 0)
+				refcount_release(IO_DATAIN_REFS(io));
+		} else {
+			error = icl_pdu_append_data(response, sg_addr, len,
+			    M_NOWAIT);
+		}
 		if (error != 0) {
 			CFISCSI_SESSION_WARN(cs, "failed to "
 			    "allocate memory; dropping connection");
 			icl_pdu_free(response);
 			ctl_set_busy(&io->scsiio);
-			io->scsiio.be_move_done(io);
+			cfiscsi_datamove_in_release(io);
 			cfiscsi_session_terminate(cs);
 			return;
 		}
@@ -2624,7 +2667,7 @@ cfiscsi_datamove_in(union ctl_io *io)
 		cfiscsi_pdu_queue(response);
 	}
 
-	io->scsiio.be_move_done(io);
+	cfiscsi_datamove_in_release(io);
 }
 
 static void
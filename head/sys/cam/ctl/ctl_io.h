@@ -40,6 +40,8 @@
 #ifndef	_CTL_IO_H_
 #define	_CTL_IO_H_
 
+#include <sys/tree.h>
+
 #ifdef _CTL_C
 #define EXTERN(__var,__val) __var = __val
 #else
@@ -235,6 +237,14 @@ struct ctl_io_hdr {
 	STAILQ_ENTRY(ctl_io_hdr) links;	/* linked list pointer */
 	TAILQ_ENTRY(ctl_io_hdr) ooa_links;
 	TAILQ_ENTRY(ctl_io_hdr) blocked_links;
+	/* Indexes over the OOA queue, maintained by ctl_ooa_insert() */
+	RB_ENTRY(ctl_io_hdr) ooa_rb;		/* LBA range index */
+	TAILQ_ENTRY(ctl_io_hdr) ooa_other_links; /* Not in the range index */
+	LIST_ENTRY(ctl_io_hdr) ooa_tag_links;	/* Tagged, by tag number */
+	uint64_t	  ooa_seq;	/* Position in the OOA queue */
+	uint64_t	  ooa_lba;
+	uint32_t	  ooa_len;
+	uint32_t	  ooa_flags;
 };
 
 typedef enum {
@@ -127,6 +127,22 @@ typedef enum {
 	CTL_SERIDX_INVLD = CTL_SERIDX_COUNT
 } ctl_seridx;
 
+/*
+ * Besides the OOA queue itself, each LUN indexes its in-flight I/O so that
+ * ordinary READ and WRITE commands can be serialized without walking the
+ * whole queue.  Simple and untagged commands of those classes with a
+ * known, bounded LBA range go into a tree ordered by LBA; everything else
+ * goes on the "other" list.  Tagged commands are also hashed by tag number
+ * for the overlapped tag check.
+ */
+#define	CTL_OOA_TREE		0x01	/* ooa_flags: in the range index */
+#define	CTL_OOA_TAGGED		0x02	/* ooa_flags: in the tag hash */
+
+#define	CTL_OOA_MAXLEN_SHIFT	16
+#define	CTL_OOA_MAXLEN		(1 << CTL_OOA_MAXLEN_SHIFT)
+#define	CTL_OOA_TAG_HASH_SIZE	64
+#define	CTL_OOA_TAG_HASH(tag)	((tag) & (CTL_OOA_TAG_HASH_SIZE - 1))
+
 typedef int	ctl_opfunc(struct ctl_scsiio *ctsio);
 
 struct ctl_cmd_entry {
@@ -380,6 +396,12 @@ struct ctl_lun {
 #endif
 	TAILQ_HEAD(ctl_ooaq, ctl_io_hdr)  ooa_queue;
 	TAILQ_HEAD(ctl_blockq,ctl_io_hdr) blocked_queue;
+	RB_HEAD(ctl_ooa_tree, ctl_io_hdr) ooa_tree;
+	TAILQ_HEAD(ctl_ooa_otherq, ctl_io_hdr) ooa_other;
+	LIST_HEAD(, ctl_io_hdr)		ooa_tags[CTL_OOA_TAG_HASH_SIZE];
+	uint64_t			ooa_seq;
+	uint32_t			ooa_len_mask;	/* Length classes present */
+	uint32_t			ooa_len_cnt[CTL_OOA_MAXLEN_SHIFT + 2];
 	STAILQ_ENTRY(ctl_lun)		links;
 #ifdef CTL_WITH_CA
 	uint32_t			have_ca[CTL_MAX_INITIATORS >> 5];
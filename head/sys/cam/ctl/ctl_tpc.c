@@ -71,6 +71,11 @@ __FBSDID("$FreeBSD$");
 
 MALLOC_DEFINE(M_CTL_TPC, "ctltpc", "CTL TPC");
 
+static int tpc_offload_enable = 1;
+SYSCTL_INT(_kern_cam_ctl, OID_AUTO, tpc_offload, CTLFLAG_RWTUN,
+    &tpc_offload_enable, 0,
+    "Let backends copy data between their own LUNs for EXTENDED COPY and WUT");
+
 typedef enum {
 	TPC_ERR_RETRY		= 0x000,
 	TPC_ERR_FAIL		= 0x001,
@@ -809,6 +814,88 @@ tpc_resolve(struct tpc_list *list, uint16_t idx, uint32_t *ss,
 	    list->init_port, &list->cscd[idx], ss, pb, pbo));
 }
 
+static void tpc_process(struct tpc_list *list);
+
+#define	TPC_OFFLOAD_BAD_FLAGS	(CTL_LUN_RESERVED | CTL_LUN_PR_RESERVED | \
+    CTL_LUN_INVALID | CTL_LUN_DISABLED | CTL_LUN_STOPPED | \
+    CTL_LUN_NO_MEDIA | CTL_LUN_EJECTED)
+
+static void
+tpc_offload_done(void *arg, int error)
+{
+	struct tpc_list *list = arg;
+
+	if (error != 0)
+		list->error = 1;
+	else
+		atomic_add_int(&list->curops, 1);
+	if (atomic_fetchadd_int(&list->tbdio, -1) == 1)
+		tpc_process(list);
+}
+
+/*
+ * Try to have the backend copy numbytes from sl to dl on its own.  That is
+ * only possible when both LUNs live on the same backend, it implements the
+ * copy method and nothing (reservations, media state, write protection,
+ * HA) would make the read and write commands we would otherwise issue do
+ * anything but plain I/O.  Returns 0 if the copy was started, in which
+ * case the list has moved to its next stage and tpc_offload_done() will
+ * process it once the backend is finished.
+ */
+static int
+tpc_offload(struct tpc_list *list, uint64_t sl, uint64_t srclba,
+    uint32_t srcblock, uint64_t dl, uint64_t dstlba, uint32_t dstblock,
+    off_t numbytes)
+{
+	struct ctl_softc *softc = list->lun->ctl_softc;
+	struct ctl_lun *slun, *dlun;
+	int error;
+
+	if (!tpc_offload_enable)
+		return (EOPNOTSUPP);
+	mtx_lock(&softc->ctl_lock);
+	slun = softc->ctl_luns[sl];
+	dlun = softc->ctl_luns[dl];
+	if (slun == NULL || dlun == NULL || slun->backend != dlun->backend ||
+	    slun->backend->copy == NULL ||
+	    slun->be_lun->blocksize != srcblock ||
+	    dlun->be_lun->blocksize != dstblock ||
+	    (slun->flags & TPC_OFFLOAD_BAD_FLAGS) != 0 ||
+	    (dlun->flags & TPC_OFFLOAD_BAD_FLAGS) != 0 ||
+	    (slun->flags & CTL_LUN_PRIMARY_SC) == 0 ||
+	    (dlun->flags & CTL_LUN_PRIMARY_SC) == 0 ||
+	    (dlun->be_lun->flags & CTL_LUN_FLAG_READONLY) != 0 ||
+	    (dlun->mode_pages.control_page[CTL_PAGE_CURRENT].eca_and_aen &
+	     SCP_SWP) != 0) {
+		mtx_unlock(&softc->ctl_lock);
+		return (EOPNOTSUPP);
+	}
+	/*
+	 * The backend trusts the range, so leave anything that is not fully
+	 * inside both LUNs to the READ/WRITE path, which fails it with
+	 * LOGICAL BLOCK ADDRESS OUT OF RANGE.
+	 */
+	if (srclba > slun->be_lun->maxlba ||
+	    numbytes / srcblock > slun->be_lun->maxlba + 1 - srclba ||
+	    dstlba > dlun->be_lun->maxlba ||
+	    numbytes / dstblock > dlun->be_lun->maxlba + 1 - dstlba) {
+		mtx_unlock(&softc->ctl_lock);
+		return (EOPNOTSUPP);
+	}
+	TAILQ_INIT(&list->allio);
+	list->buf = NULL;
+	list->segbytes = numbytes;
+	list->segsectors = numbytes / dstblock;
+	list->tbdio = 1;
+	list->stage++;
+	error = slun->backend->copy(slun->be_lun, srclba, dlun->be_lun,
+	    dstlba, numbytes, tpc_offload_done, list);
+	if (error != 0)
+		list->stage--;
+	mtx_unlock(&softc->ctl_lock);
+	return (error);
+}
+
 static int
 tpc_process_b2b(struct tpc_list *list)
 {
@@ -890,6 +977,10 @@ tpc_process_b2b(struct tpc_list *list)
 		return (CTL_RETVAL_ERROR);
 	}
 
+	if (tpc_offload(list, sl, srclba, srcblock, dl, dstlba, dstblock,
+	    numbytes) == 0)
+		return (CTL_RETVAL_QUEUED);
+
 	list->buf = malloc(numbytes, M_CTL, M_WAITOK);
 	list->segbytes = numbytes;
 	list->segsectors = numbytes / dstblock;
@@ -1200,6 +1291,10 @@ tpc_process_wut(struct tpc_list *list)
 		return (CTL_RETVAL_ERROR);
 	}
 
+	if (tpc_offload(list, list->token->lun, srclba, srcblock,
+	    list->lun->lun, dstlba, dstblock, numbytes) == 0)
+		return (CTL_RETVAL_QUEUED);
+
 	list->buf = malloc(numbytes, M_CTL, M_WAITOK |
 	    (list->token == NULL ? M_ZERO : 0));
 	list->segbytes = numbytes;
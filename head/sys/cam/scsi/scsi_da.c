@@ -46,6 +46,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/cons.h>
 #include <sys/endian.h>
 #include <sys/proc.h>
+#include <sys/smp.h>
 #include <geom/geom.h>
 #include <geom/geom_disk.h>
 #endif /* _KERNEL */
@@ -58,6 +59,7 @@ __FBSDID("$FreeBSD$");
 #include <cam/cam.h>
 #include <cam/cam_ccb.h>
 #include <cam/cam_periph.h>
+#include <cam/cam_iosched.h>
 #include <cam/cam_xpt_periph.h>
 #include <cam/cam_sim.h>
 
@@ -91,7 +93,8 @@ typedef enum {
 	DA_FLAG_CAN_RC16	= 0x400,
 	DA_FLAG_PROBED		= 0x800,
 	DA_FLAG_DIRTY		= 0x1000,
-	DA_FLAG_ANNOUNCED	= 0x2000
+	DA_FLAG_ANNOUNCED	= 0x2000,
+	DA_FLAG_NONROT		= 0x4000
 } da_flags;
 
 typedef enum {
@@ -199,10 +202,20 @@ struct disk_params {
 #define ATA_TRIM_MAX_RANGES	((UNMAP_BUF_SIZE / \
 	(ATA_DSM_RANGE_SIZE * ATA_DSM_BLK_SIZE)) * ATA_DSM_BLK_SIZE)
 
+/*
+ * Per-CPU list of bios queued by dastrategy() without the periph lock.
+ * Bios are pushed LIFO through bio_queue.tqe_next and reversed when
+ * dastart() hands them to the I/O scheduler.
+ */
+struct da_stage {
+	struct bio * volatile	head;
+} __aligned(CACHE_LINE_SIZE);
+
 struct da_softc {
-	struct	 bio_queue_head bio_queue;
-	struct	 bio_queue_head delete_queue;
+	struct	 cam_iosched_softc *cam_iosched;
 	struct	 bio_queue_head delete_run_queue;
+	struct	 da_stage *stage;	/* Lockless bio staging, per CPU */
+	volatile u_int stage_pending;	/* Staged bios await a drain */
 	LIST_HEAD(, ccb_hdr) pending_ccbs;
 	int	 tur;			/* TEST UNIT READY should be sent */
 	int	 refcount;		/* Active xpt_action() calls */
@@ -1249,6 +1262,7 @@ static int da_poll_period = DA_DEFAULT_POLL_PERIOD;
 static int da_retry_count = DA_DEFAULT_RETRY;
 static int da_default_timeout = DA_DEFAULT_TIMEOUT;
 static int da_send_ordered = DA_DEFAULT_SEND_ORDERED;
+static int da_lockless_stage = 1;
 
 static SYSCTL_NODE(_kern_cam, OID_AUTO, da, CTLFLAG_RD, 0,
             "CAM Direct Access Disk driver");
@@ -1260,6 +1274,9 @@ SYSCTL_INT(_kern_cam_da, OID_AUTO, default_timeout, CTLFLAG_RWTUN,
            &da_default_timeout, 0, "Normal I/O timeout (in seconds)");
 SYSCTL_INT(_kern_cam_da, OID_AUTO, send_ordered, CTLFLAG_RWTUN,
            &da_send_ordered, 0, "Send Ordered Tags");
+SYSCTL_INT(_kern_cam_da, OID_AUTO, lockless_stage, CTLFLAG_RWTUN,
+           &da_lockless_stage, 0,
+           "Queue I/O to non-rotational disks without the periph lock");
 
 /*
  * DA_ORDEREDTAG_INTERVAL determines how often, relative
@@ -1396,6 +1413,57 @@ daclose(struct disk *dp)
 	return (0);
 }
 
+/*
+ * Push a bio onto the current CPU's staging list.  Returns non-zero if the
+ * caller is the one that must get dastart() to drain the lists; otherwise
+ * a drain is already due and will pick this bio up.
+ */
+static int
+dastage_push(struct da_softc *softc, struct bio *bp)
+{
+	struct da_stage *st;
+	struct bio *head;
+
+	st = &softc->stage[curcpu];
+	do {
+		head = st->head;
+		bp->bio_queue.tqe_next = head;
+	} while (atomic_cmpset_rel_ptr((volatile uintptr_t *)&st->head,
+	    (uintptr_t)head, (uintptr_t)bp) == 0);
+	return (atomic_cmpset_int(&softc->stage_pending, 0, 1));
+}
+
+/*
+ * Move all staged bios into the I/O scheduler, preserving each CPU's
+ * submission order.  The pending flag is cleared before the lists are
+ * taken, so a bio staged after that point asks for another drain.  A bio
+ * whose dastrategy() call has returned is always queued once this
+ * returns, which is what lets ordered requests queue behind it.
+ */
+static void
+dastage_drain(struct da_softc *softc)
+{
+	struct bio *bp, *list, *next;
+	int i;
+
+	if (softc->stage_pending == 0 ||
+	    atomic_readandclear_int(&softc->stage_pending) == 0)
+		return;
+	for (i = 0; i <= mp_maxid; i++) {
+		bp = (struct bio *)atomic_readandclear_ptr(
+		    (volatile uintptr_t *)&softc->stage[i].head);
+		for (list = NULL; bp != NULL; bp = next) {
+			next = bp->bio_queue.tqe_next;
+			bp->bio_queue.tqe_next = list;
+			list = bp;
+		}
+		for (bp = list; bp != NULL; bp = next) {
+			next = bp->bio_queue.tqe_next;
+			cam_iosched_queue_work(softc->cam_iosched, bp);
+		}
+	}
+}
+
 static void
 daschedule(struct cam_periph *periph)
 {
@@ -1405,9 +1473,9 @@ daschedule(struct cam_periph *periph)
 		return;
 
 	/* Check if we have more work to do. */
-	if (bioq_first(&softc->bio_queue) ||
-	    (!softc->delete_running && bioq_first(&softc->delete_queue)) ||
-	    softc->tur) {
+	if (cam_iosched_has_io(softc->cam_iosched) || softc->stage_pending ||
+	    (!softc->delete_running &&
+	    cam_iosched_has_trim(softc->cam_iosched)) || softc->tur) {
 		xpt_schedule(periph, CAM_PRIORITY_NORMAL);
 	}
 }
@@ -1426,6 +1494,30 @@ dastrategy(struct bio *bp)
 	periph = (struct cam_periph *)bp->bio_disk->d_drv1;
 	softc = (struct da_softc *)periph->softc;
 
+	/*
+	 * Unordered reads and writes to unsorted non-rotational media
+	 * skip the periph lock and go onto a per-CPU staging list.
+	 * Everything else, in particular BIO_FLUSH and BIO_ORDERED, takes
+	 * the lock and drains the staging lists first so it is queued
+	 * behind every bio submitted before it.
+	 */
+	if (da_lockless_stage && softc->stage != NULL &&
+	    (softc->flags & (DA_FLAG_NONROT | DA_FLAG_PACK_INVALID)) ==
+	    DA_FLAG_NONROT && !DA_SIO &&
+	    (bp->bio_cmd == BIO_READ || bp->bio_cmd == BIO_WRITE) &&
+	    (bp->bio_flags & BIO_ORDERED) == 0) {
+		if (dastage_push(softc, bp) == 0)
+			return;
+		cam_periph_lock(periph);
+		if ((softc->flags & DA_FLAG_PACK_INVALID) != 0) {
+			dastage_drain(softc);
+			cam_iosched_flush_io(softc->cam_iosched, NULL, ENXIO);
+		} else
+			daschedule(periph);
+		cam_periph_unlock(periph);
+		return;
+	}
+
 	cam_periph_lock(periph);
 
 	/*
@@ -1442,13 +1534,9 @@ dastrategy(struct bio *bp)
 	/*
 	 * Place it in the queue of disk activities for this disk
 	 */
-	if (bp->bio_cmd == BIO_DELETE) {
-		bioq_disksort(&softc->delete_queue, bp);
-	} else if (DA_SIO) {
-		bioq_disksort(&softc->bio_queue, bp);
-	} else {
-		bioq_insert_tail(&softc->bio_queue, bp);
-	}
+	dastage_drain(softc);
+	cam_iosched_set_sort_queue(softc->cam_iosched, DA_SIO);
+	cam_iosched_queue_work(softc->cam_iosched, bp);
 
 	/*
 	 * Schedule ourselves for performing the work.
@@ -1609,8 +1697,8 @@ daoninvalidate(struct cam_periph *periph)
 	 * XXX Handle any transactions queued to the card
 	 *     with XPT_ABORT_CCB.
 	 */
-	bioq_flush(&softc->bio_queue, NULL, ENXIO);
-	bioq_flush(&softc->delete_queue, NULL, ENXIO);
+	dastage_drain(softc);
+	cam_iosched_flush(softc->cam_iosched, NULL, ENXIO);
 
 	/*
 	 * Tell GEOM that we've gone away, we'll get a callback when it is
@@ -1639,6 +1727,8 @@ dacleanup(struct cam_periph *periph)
 	callout_drain(&softc->mediapoll_c);
 	disk_destroy(softc->disk);
 	callout_drain(&softc->sendordered_c);
+	cam_iosched_fini(softc->cam_iosched);
+	free(softc->stage, M_DEVBUF);
 	free(softc, M_DEVBUF);
 	cam_periph_lock(periph);
 }
@@ -1815,6 +1905,8 @@ dasysctlinit(void *context, int pending)
 	SYSCTL_ADD_INT(&softc->sysctl_ctx, SYSCTL_CHILDREN(softc->sysctl_tree),
 		OID_AUTO, "sort_io_queue", CTLFLAG_RW, &softc->sort_io_queue, 0,
 		"Sort IO queue to try and optimise disk access patterns");
+	cam_iosched_sysctl_init(softc->cam_iosched, &softc->sysctl_ctx,
+	    softc->sysctl_tree);
 
 	SYSCTL_ADD_INT(&softc->sysctl_ctx,
 		       SYSCTL_CHILDREN(softc->sysctl_tree),
@@ -2084,10 +2176,19 @@ daregister(struct cam_periph *periph, void *arg)
 		return(CAM_REQ_CMP_ERR);
 	}
 
+	if (cam_iosched_init(&softc->cam_iosched, periph, daschedule) != 0) {
+		printf("daregister: Unable to probe new device. "
+		       "Unable to allocate iosched memory\n");
+		free(softc, M_DEVBUF);
+		return(CAM_REQ_CMP_ERR);
+	}
+
+	/* Without the staging lists every bio simply takes the locked path. */
+	softc->stage = malloc(sizeof(*softc->stage) * (mp_maxid + 1),
+	    M_DEVBUF, M_NOWAIT | M_ZERO);
+
 	LIST_INIT(&softc->pending_ccbs);
 	softc->state = DA_STATE_PROBE_RC;
-	bioq_init(&softc->bio_queue);
-	bioq_init(&softc->delete_queue);
 	bioq_init(&softc->delete_run_queue);
 	if (SID_IS_REMOVABLE(&cgd->inq_data))
 		softc->flags |= DA_FLAG_PACK_REMOVABLE;
@@ -2098,6 +2199,8 @@ daregister(struct cam_periph *periph, void *arg)
 	softc->sort_io_queue = -1;
 
 	periph->softc = softc;
+	/* Scheduled CCBs are only ever used for XPT_SCSI_IO requests. */
+	periph->ccb_class = CAM_CCB_CLASS_SCSIIO;
 
 	/*
 	 * See if this device has any quirks.
@@ -2282,20 +2385,27 @@ skipstate:
 		struct bio *bp;
 		uint8_t tag_code;
 
+		dastage_drain(softc);
+
 		/* Run BIO_DELETE if not running yet. */
 		if (!softc->delete_running &&
-		    (bp = bioq_first(&softc->delete_queue)) != NULL) {
+		    (bp = cam_iosched_next_trim(softc->cam_iosched)) != NULL) {
 			if (softc->delete_func != NULL) {
 				softc->delete_func(periph, start_ccb, bp);
 				goto out;
 			} else {
-				bioq_flush(&softc->delete_queue, NULL, 0);
+				while ((bp = cam_iosched_first_trim(
+				    softc->cam_iosched)) != NULL) {
+					cam_iosched_take_trim(softc->cam_iosched,
+					    bp);
+					biofinish(bp, NULL, 0);
+				}
 				/* FALLTHROUGH */
 			}
 		}
 
 		/* Run regular command. */
-		bp = bioq_takefirst(&softc->bio_queue);
+		bp = cam_iosched_next_bio(softc->cam_iosched);
 		if (bp == NULL) {
 			if (softc->tur) {
 				softc->tur = 0;
@@ -2394,6 +2504,7 @@ out:
 		}
 
 		start_ccb->ccb_h.ccb_bp = bp;
+		cam_iosched_submit(softc->cam_iosched, bp, start_ccb);
 		softc->refcount++;
 		cam_periph_unlock(periph);
 		xpt_action(start_ccb);
@@ -2634,7 +2745,7 @@ da_delete_unmap(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 	bzero(softc->unmap_buf, sizeof(softc->unmap_buf));
 	bp1 = bp;
 	do {
-		bioq_remove(&softc->delete_queue, bp1);
+		cam_iosched_take_trim(softc->cam_iosched, bp1);
 		if (bp1 != bp)
 			bioq_insert_tail(&softc->delete_run_queue, bp1);
 		lba = bp1->bio_pblkno;
@@ -2674,7 +2785,7 @@ da_delete_unmap(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 			lastcount = c;
 		}
 		lastlba = lba;
-		bp1 = bioq_first(&softc->delete_queue);
+		bp1 = cam_iosched_first_trim(softc->cam_iosched);
 		if (bp1 == NULL || ranges >= softc->unmap_max_ranges ||
 		    totalcount + bp1->bio_bcount /
 		    softc->params.secsize > softc->unmap_max_lba)
@@ -2712,7 +2823,7 @@ da_delete_trim(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 	bzero(softc->unmap_buf, sizeof(softc->unmap_buf));
 	bp1 = bp;
 	do {
-		bioq_remove(&softc->delete_queue, bp1);
+		cam_iosched_take_trim(softc->cam_iosched, bp1);
 		if (bp1 != bp)
 			bioq_insert_tail(&softc->delete_run_queue, bp1);
 		lba = bp1->bio_pblkno;
@@ -2757,7 +2868,7 @@ da_delete_trim(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 			}
 		}
 		lastlba = lba;
-		bp1 = bioq_first(&softc->delete_queue);
+		bp1 = cam_iosched_first_trim(softc->cam_iosched);
 		if (bp1 == NULL || bp1->bio_bcount / softc->params.secsize >
 		    (softc->trim_max_ranges - ranges) * ATA_DSM_RANGE_MAX)
 			break;
@@ -2798,7 +2909,7 @@ da_delete_ws(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 	count = 0;
 	bp1 = bp;
 	do {
-		bioq_remove(&softc->delete_queue, bp1);
+		cam_iosched_take_trim(softc->cam_iosched, bp1);
 		if (bp1 != bp)
 			bioq_insert_tail(&softc->delete_run_queue, bp1);
 		count += bp1->bio_bcount / softc->params.secsize;
@@ -2810,7 +2921,7 @@ da_delete_ws(struct cam_periph *periph, union ccb *ccb, struct bio *bp)
 			count = omin(count, ws_max_blks);
 			break;
 		}
-		bp1 = bioq_first(&softc->delete_queue);
+		bp1 = cam_iosched_first_trim(softc->cam_iosched);
 		if (bp1 == NULL || lba + count != bp1->bio_pblkno ||
 		    count + bp1->bio_bcount /
 		    softc->params.secsize > ws_max_blks)
@@ -2875,8 +2986,8 @@ cmd6workaround(union ccb *ccb)
 				  da_delete_method_desc[softc->delete_method]);
 
 		while ((bp = bioq_takefirst(&softc->delete_run_queue)) != NULL)
-			bioq_disksort(&softc->delete_queue, bp);
-		bioq_disksort(&softc->delete_queue,
+			cam_iosched_put_back_trim(softc->cam_iosched, bp);
+		cam_iosched_put_back_trim(softc->cam_iosched,
 		    (struct bio *)ccb->ccb_h.ccb_bp);
 		ccb->ccb_h.ccb_bp = NULL;
 		return (0);
@@ -2979,6 +3090,16 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 				cam_periph_unlock(periph);
 				return;
 			}
+			/*
+			 * daerror() may have put a failed delete back on
+			 * the queue to be retried with another method.
+			 */
+			if (done_ccb->ccb_h.ccb_bp == NULL)
+				cam_iosched_bio_requeued(softc->cam_iosched,
+				    bp);
+			else
+				cam_iosched_bio_complete(softc->cam_iosched,
+				    bp, done_ccb);
 			bp = (struct bio *)done_ccb->ccb_h.ccb_bp;
 			if (error != 0) {
 				int queued_error;
@@ -3005,8 +3126,9 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 					softc->flags |= DA_FLAG_PACK_INVALID;
 					queued_error = ENXIO;
 				}
-				bioq_flush(&softc->bio_queue, NULL,
-					   queued_error);
+				dastage_drain(softc);
+				cam_iosched_flush_io(softc->cam_iosched, NULL,
+				    queued_error);
 				if (bp != NULL) {
 					bp->bio_error = error;
 					bp->bio_resid = bp->bio_bcount;
@@ -3030,6 +3152,8 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 		} else if (bp != NULL) {
 			if ((done_ccb->ccb_h.status & CAM_DEV_QFRZN) != 0)
 				panic("REQ_CMP with QFRZN");
+			cam_iosched_bio_complete(softc->cam_iosched, bp,
+			    done_ccb);
 			if (state == DA_CCB_DELETE)
 				bp->bio_resid = 0;
 			else
@@ -3078,8 +3202,14 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 					bp1->bio_resid = 0;
 				biodone(bp1);
 			}
-		} else
+		} else {
+			/*
+			 * The scheduler may have held work back behind this
+			 * command's queue-depth slot.
+			 */
+			daschedule(periph);
 			cam_periph_unlock(periph);
+		}
 		if (bp != NULL)
 			biodone(bp);
 		return;
@@ -3469,6 +3599,7 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 			if (softc->disk->d_rotation_rate ==
 			    SVPD_BDC_RATE_NON_ROTATING) {
 				softc->sort_io_queue = 0;
+				softc->flags |= DA_FLAG_NONROT;
 			}
 			if (softc->disk->d_rotation_rate != old_rate) {
 				disk_attr_changed(softc->disk,
@@ -3531,6 +3662,7 @@ dadone(struct cam_periph *periph, union ccb *done_ccb)
 			if (softc->disk->d_rotation_rate ==
 			    ATA_RATE_NON_ROTATING) {
 				softc->sort_io_queue = 0;
+				softc->flags |= DA_FLAG_NONROT;
 			}
 
 			if (softc->disk->d_rotation_rate != old_rate) {
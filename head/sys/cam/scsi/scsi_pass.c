@@ -45,10 +45,14 @@ __FBSDID("$FreeBSD$");
 #include <sys/poll.h>
 #include <sys/selinfo.h>
 #include <sys/sdt.h>
+#include <sys/sysctl.h>
 #include <sys/taskqueue.h>
 #include <vm/uma.h>
 #include <vm/vm.h>
 #include <vm/vm_extern.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_page.h>
 
 #include <machine/bus.h>
 
@@ -97,7 +101,8 @@ typedef enum {
 	PASS_IO_NONE		= 0x00,
 	PASS_IO_USER_SEG_MALLOC	= 0x01,
 	PASS_IO_KERN_SEG_MALLOC	= 0x02,
-	PASS_IO_ABANDONED	= 0x04
+	PASS_IO_ABANDONED	= 0x04,
+	PASS_IO_RING		= 0x08
 } pass_io_flags; 
 
 struct pass_io_req {
@@ -121,9 +126,42 @@ struct pass_io_req {
 	uint8_t				*user_bufs[CAM_PERIPH_MAXMAPS];
 	uint8_t				*kern_bufs[CAM_PERIPH_MAXMAPS];
 	struct bintime			 start_time;
+	uint64_t			 ring_tag;
 	TAILQ_ENTRY(pass_io_req)	 links;
 };
 
+/*
+ * A piece of user memory held and mapped into the kernel for the life of
+ * a ring registration.
+ */
+struct pass_ring_map {
+	vm_page_t		*pages;
+	int			 npages;
+	vm_offset_t		 kva;
+	void			*base;		/* Kernel address of the start */
+	size_t			 len;
+};
+
+typedef enum {
+	PASS_RING_DYING		= 0x01
+} pass_ring_flags;
+
+struct pass_ring {
+	struct pass_ring_map	 map;
+	struct pass_ring_hdr	*hdr;
+	struct pass_ring_sqe	*sq;
+	struct pass_ring_cqe	*cq;
+	uint32_t		 sq_entries;
+	uint32_t		 cq_entries;
+	uint32_t		 sq_head;	/* Kernel copies of our indexes */
+	uint32_t		 cq_tail;
+	int			 inflight;	/* Taken, not yet completed */
+	int			 waiters;	/* Sleeping in CAMIORINGENTER */
+	pass_ring_flags		 flags;
+	int			 num_bufs;
+	struct pass_ring_map	*bufs;
+};
+
 struct pass_softc {
 	pass_state		  state;
 	pass_flags		  flags;
@@ -147,8 +185,20 @@ struct pass_softc {
 	uma_zone_t		  pass_zone;
 	uma_zone_t		  pass_io_zone;
 	size_t			  io_zone_size;
+	struct pass_ring	 *ring;
 };
 
+#define	PASS_RING_MAX_ENTRIES	4096
+#define	PASS_RING_MAX_BUFS	256
+
+static SYSCTL_NODE(_kern_cam, OID_AUTO, pass, CTLFLAG_RD, 0,
+    "CAM Passthrough Driver");
+
+static u_long pass_ring_max_bytes = 64 * 1024 * 1024;
+SYSCTL_ULONG(_kern_cam_pass, OID_AUTO, ring_max_bytes, CTLFLAG_RWTUN,
+    &pass_ring_max_bytes, 0,
+    "Most memory a device's ring registration may hold");
+
 static	d_open_t	passopen;
 static	d_close_t	passclose;
 static	d_ioctl_t	passioctl;
@@ -181,6 +231,12 @@ static	int		passmemdone(struct cam_periph *periph,
 				    struct pass_io_req *io_req);
 static	int		passerror(union ccb *ccb, u_int32_t cam_flags, 
 				  u_int32_t sense_flags);
+static	void		passringfree(struct pass_ring *ring);
+static	int		passringunreg(struct cam_periph *periph);
+static	void		passringrelease(struct pass_softc *softc,
+					struct pass_io_req *io_req);
+static	void		passringpost(struct pass_softc *softc, uint64_t tag,
+				     uint32_t status, union ccb *ccb);
 static 	int		passsendccb(struct cam_periph *periph, union ccb *ccb,
 				    union ccb *inccb);
 
@@ -254,6 +310,7 @@ passrejectios(struct cam_periph *periph)
 	 */
 	TAILQ_FOREACH_SAFE(io_req, &softc->incoming_queue, links, io_req2) {
 		TAILQ_REMOVE(&softc->incoming_queue, io_req, links);
+		passringrelease(softc, io_req);
 		passiocleanup(softc, io_req);
 		uma_zfree(softc->pass_zone, io_req);
 	}
@@ -379,6 +436,15 @@ passcleanup(struct cam_periph *periph)
 
 	cam_periph_unlock(periph);
 
+	/*
+	 * If the device went away while a ring was registered, we never
+	 * saw the last close.  Nothing can be outstanding on it by now.
+	 */
+	if (softc->ring != NULL) {
+		passringfree(softc->ring);
+		softc->ring = NULL;
+	}
+
 	/*
 	 * We call taskqueue_drain() for the physpath task to make sure it
 	 * is complete.  We drop the lock because this can potentially
@@ -776,6 +842,7 @@ passclose(struct cdev *dev, int flag, int fmt, struct thread *td)
 		TAILQ_FOREACH_SAFE(io_req, &softc->incoming_queue, links,
 				   io_req2) {
 			TAILQ_REMOVE(&softc->incoming_queue, io_req, links);
+			passringrelease(softc, io_req);
 			passiocleanup(softc, io_req);
 			uma_zfree(softc->pass_zone, io_req);
 		}
@@ -808,6 +875,13 @@ passclose(struct cdev *dev, int flag, int fmt, struct thread *td)
 			TAILQ_INSERT_TAIL(&softc->abandoned_queue, io_req,
 					  links);
 		}
+
+		/*
+		 * Nobody is left to reap ring completions.  Wait for what
+		 * the ring has outstanding and release it.
+		 */
+		if (softc->ring != NULL)
+			passringunreg(periph);
 	}
 
 	cam_periph_release_locked(periph);
@@ -918,8 +992,10 @@ passdone(struct cam_periph *periph, union ccb *done_ccb)
 		/*
 		 * Copy the allocated CCB contents back to the malloced CCB
 		 * so we can give status back to the user when he requests it.
+		 * Ring requests report their status in a completion entry.
 		 */
-		bcopy(done_ccb, &io_req->ccb, sizeof(*done_ccb));
+		if ((io_req->flags & PASS_IO_RING) == 0)
+			bcopy(done_ccb, &io_req->ccb, sizeof(*done_ccb));
 
 		/*
 		 * Log data/transaction completion with devstat(9).
@@ -974,7 +1050,14 @@ passdone(struct cam_periph *periph, union ccb *done_ccb)
 		 * active queue and put it on the done queue.  Notitfy the
 		 * user that we have a completed I/O.
 		 */
-		if ((io_req->flags & PASS_IO_ABANDONED) == 0) {
+		if ((io_req->flags & (PASS_IO_ABANDONED | PASS_IO_RING)) ==
+		    PASS_IO_RING) {
+			TAILQ_REMOVE(&softc->active_queue, io_req, links);
+			passringpost(softc, io_req->ring_tag,
+			    done_ccb->ccb_h.status, done_ccb);
+			passringrelease(softc, io_req);
+			uma_zfree(softc->pass_zone, io_req);
+		} else if ((io_req->flags & PASS_IO_ABANDONED) == 0) {
 			TAILQ_REMOVE(&softc->active_queue, io_req, links);
 			TAILQ_INSERT_TAIL(&softc->done_queue, io_req, links);
 			selwakeuppri(&softc->read_select, PRIBIO);
@@ -986,6 +1069,7 @@ passdone(struct cam_periph *periph, union ccb *done_ccb)
 			 * abandoned queue and free it.
 			 */
 			TAILQ_REMOVE(&softc->abandoned_queue, io_req, links);
+			passringrelease(softc, io_req);
 			passiocleanup(softc, io_req);
 			uma_zfree(softc->pass_zone, io_req);
 
@@ -1736,6 +1820,434 @@ bailout:
 	return (error);
 }
 
+/*
+ * Hold the pages backing a piece of the caller's address space and map
+ * them into the kernel, so that the ring and data buffers can be reached
+ * from any context for the life of the registration.
+ */
+static int
+passringmap(void *uaddr, size_t len, struct pass_ring_map *rm)
+{
+	vm_offset_t addr, start;
+	int npages;
+
+	addr = (vm_offset_t)uaddr;
+	if (len == 0 || addr + len < addr)
+		return (EINVAL);
+
+	start = trunc_page(addr);
+	npages = atop(round_page(addr + len) - start);
+	rm->pages = malloc(npages * sizeof(vm_page_t), M_SCSIPASS,
+	    M_WAITOK | M_ZERO);
+	if (vm_fault_quick_hold_pages(&curproc->p_vmspace->vm_map, addr, len,
+	    VM_PROT_READ | VM_PROT_WRITE, rm->pages, npages) < 0) {
+		free(rm->pages, M_SCSIPASS);
+		rm->pages = NULL;
+		return (EFAULT);
+	}
+	rm->npages = npages;
+
+	rm->kva = kva_alloc(ptoa(npages));
+	if (rm->kva == 0) {
+		vm_page_unhold_pages(rm->pages, npages);
+		free(rm->pages, M_SCSIPASS);
+		rm->pages = NULL;
+		rm->npages = 0;
+		return (ENOMEM);
+	}
+	pmap_qenter(rm->kva, rm->pages, npages);
+	rm->base = (void *)(rm->kva + (addr & PAGE_MASK));
+	rm->len = len;
+
+	return (0);
+}
+
+static void
+passringunmap(struct pass_ring_map *rm)
+{
+
+	if (rm->pages == NULL)
+		return;
+
+	pmap_qremove(rm->kva, rm->npages);
+	kva_free(rm->kva, ptoa(rm->npages));
+	vm_page_unhold_pages(rm->pages, rm->npages);
+	free(rm->pages, M_SCSIPASS);
+	rm->pages = NULL;
+}
+
+static void
+passringfree(struct pass_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->num_bufs; i++)
+		passringunmap(&ring->bufs[i]);
+	free(ring->bufs, M_SCSIPASS);
+	passringunmap(&ring->map);
+	free(ring, M_SCSIPASS);
+}
+
+static int
+passringreg(struct cam_periph *periph, struct pass_ring_reg *reg)
+{
+	struct pass_softc *softc;
+	struct pass_ring_buf *ubufs;
+	struct pass_ring *ring;
+	size_t maxbytes, total;
+	int error, i;
+
+	softc = (struct pass_softc *)periph->softc;
+	maxbytes = pass_ring_max_bytes;
+
+	cam_periph_assert(periph, MA_OWNED);
+
+	if (softc->ring != NULL)
+		return (EBUSY);
+
+	if (reg->sq_entries == 0 || reg->sq_entries > PASS_RING_MAX_ENTRIES
+	 || !powerof2(reg->sq_entries)
+	 || reg->cq_entries == 0 || reg->cq_entries > PASS_RING_MAX_ENTRIES
+	 || !powerof2(reg->cq_entries)
+	 || reg->num_bufs > PASS_RING_MAX_BUFS
+	 || ((vm_offset_t)reg->ring & PAGE_MASK) != 0
+	 || reg->ring_len < PASS_RING_SIZE(reg->sq_entries, reg->cq_entries))
+		return (EINVAL);
+	if (reg->ring_len > maxbytes)
+		return (EINVAL);
+
+	/*
+	 * Building the ring faults in user memory, so do it unlocked.
+	 */
+	cam_periph_unlock(periph);
+
+	ubufs = NULL;
+	ring = malloc(sizeof(*ring), M_SCSIPASS, M_WAITOK | M_ZERO);
+	ring->sq_entries = reg->sq_entries;
+	ring->cq_entries = reg->cq_entries;
+
+	total = reg->ring_len;
+	if (reg->num_bufs != 0) {
+		ubufs = malloc(reg->num_bufs * sizeof(*ubufs), M_SCSIPASS,
+		    M_WAITOK);
+		error = copyin(reg->bufs, ubufs,
+		    reg->num_bufs * sizeof(*ubufs));
+		if (error != 0)
+			goto bailout;
+		/* Written so that the sum can't wrap past the limit. */
+		for (i = 0; i < reg->num_bufs; i++) {
+			if (ubufs[i].len > maxbytes - total) {
+				error = EINVAL;
+				goto bailout;
+			}
+			total += ubufs[i].len;
+		}
+	}
+
+	error = passringmap(reg->ring, reg->ring_len, &ring->map);
+	if (error != 0)
+		goto bailout;
+	ring->hdr = ring->map.base;
+	ring->sq = (struct pass_ring_sqe *)((uint8_t *)ring->map.base +
+	    PASS_RING_SQ_OFFSET);
+	ring->cq = (struct pass_ring_cqe *)((uint8_t *)ring->map.base +
+	    PASS_RING_CQ_OFFSET(ring->sq_entries));
+
+	if (reg->num_bufs != 0) {
+		ring->bufs = malloc(reg->num_bufs * sizeof(*ring->bufs),
+		    M_SCSIPASS, M_WAITOK | M_ZERO);
+		ring->num_bufs = reg->num_bufs;
+		for (i = 0; i < reg->num_bufs; i++) {
+			error = passringmap(ubufs[i].addr, ubufs[i].len,
+			    &ring->bufs[i]);
+			if (error != 0)
+				goto bailout;
+		}
+	}
+
+	/*
+	 * Start both rings out empty, whatever the caller left there.
+	 */
+	ring->hdr->sq_head = ring->hdr->sq_tail = 0;
+	ring->hdr->cq_head = ring->hdr->cq_tail = 0;
+
+bailout:
+	free(ubufs, M_SCSIPASS);
+	cam_periph_lock(periph);
+
+	if (error == 0 && softc->ring != NULL)
+		error = EBUSY;
+	if (error == 0 && (periph->flags & CAM_PERIPH_INVALID) != 0)
+		error = ENXIO;
+	if (error != 0) {
+		cam_periph_unlock(periph);
+		passringfree(ring);
+		cam_periph_lock(periph);
+		return (error);
+	}
+	softc->ring = ring;
+
+	return (0);
+}
+
+/*
+ * Wait for everything taken from the ring to complete, then release it.
+ * Called with the periph lock held; the lock is dropped while waiting
+ * and while the ring is torn down.
+ */
+static int
+passringunreg(struct cam_periph *periph)
+{
+	struct pass_softc *softc;
+	struct pass_ring *ring;
+
+	softc = (struct pass_softc *)periph->softc;
+
+	cam_periph_assert(periph, MA_OWNED);
+
+	ring = softc->ring;
+	if (ring == NULL)
+		return (ENXIO);
+	if (ring->flags & PASS_RING_DYING)
+		return (EBUSY);
+
+	ring->flags |= PASS_RING_DYING;
+	wakeup(&ring->cq_tail);
+	while (ring->inflight != 0 || ring->waiters != 0)
+		cam_periph_sleep(periph, ring, PRIBIO, "passrngd", 0);
+	softc->ring = NULL;
+
+	cam_periph_unlock(periph);
+	passringfree(ring);
+	cam_periph_lock(periph);
+
+	return (0);
+}
+
+/*
+ * Account for a ring request that is going away without a completion,
+ * because the device or the last descriptor went away under it.
+ */
+static void
+passringrelease(struct pass_softc *softc, struct pass_io_req *io_req)
+{
+	struct pass_ring *ring;
+
+	if ((io_req->flags & PASS_IO_RING) == 0)
+		return;
+
+	ring = softc->ring;
+	KASSERT(ring != NULL && ring->inflight > 0,
+		("%s: ring request with no ring outstanding", __func__));
+	if (--ring->inflight == 0 && (ring->flags & PASS_RING_DYING))
+		wakeup(ring);
+}
+
+/*
+ * Post a completion at the kernel's cq_tail.  Space for it was reserved
+ * when the entry was taken from the submission queue.
+ */
+static void
+passringpost(struct pass_softc *softc, uint64_t tag, uint32_t status,
+	     union ccb *ccb)
+{
+	struct pass_ring *ring;
+	struct pass_ring_cqe *cqe;
+	int sense_len;
+
+	ring = softc->ring;
+	cqe = &ring->cq[ring->cq_tail & (ring->cq_entries - 1)];
+	bzero(cqe, offsetof(struct pass_ring_cqe, u));
+	cqe->user_tag = tag;
+	cqe->status = status;
+
+	if (ccb != NULL) {
+		switch (ccb->ccb_h.func_code) {
+		case XPT_SCSI_IO:
+			cqe->resid = ccb->csio.resid;
+			cqe->scsi_status = ccb->csio.scsi_status;
+			if ((status & CAM_AUTOSNS_VALID) == 0)
+				break;
+			sense_len = ccb->csio.sense_len - ccb->csio.sense_resid;
+			sense_len = imin(imax(sense_len, 0),
+			    sizeof(cqe->u.sense));
+			bcopy(&ccb->csio.sense_data, &cqe->u.sense, sense_len);
+			cqe->sense_len = sense_len;
+			break;
+		case XPT_ATA_IO:
+			cqe->resid = ccb->ataio.resid;
+			bcopy(&ccb->ataio.res, &cqe->u.res, sizeof(cqe->u.res));
+			break;
+		default:
+			break;
+		}
+	}
+
+	ring->cq_tail++;
+	atomic_store_rel_32(&ring->hdr->cq_tail, ring->cq_tail);
+
+	if (ring->waiters != 0)
+		wakeup(&ring->cq_tail);
+	selwakeuppri(&softc->read_select, PRIBIO);
+	KNOTE_LOCKED(&softc->read_select.si_note, 0);
+}
+
+/*
+ * Turn a submission entry into a CCB.  Data may only come from a
+ * registered buffer, which is already mapped into the kernel.
+ */
+static int
+passringsetup(struct cam_periph *periph, struct pass_ring *ring,
+	      struct pass_ring_sqe *sqe, struct pass_io_req *io_req)
+{
+	struct pass_softc *softc;
+	struct pass_ring_map *rm;
+	union ccb *ccb;
+	uint8_t *data_ptr;
+	uint32_t flags;
+
+	softc = (struct pass_softc *)periph->softc;
+	ccb = &io_req->ccb;
+	flags = sqe->flags;
+
+	if ((flags & ~(CAM_DIR_MASK | CAM_PASS_ERR_RECOVER)) != 0
+	 || (flags & CAM_DIR_MASK) == CAM_DIR_BOTH)
+		return (EINVAL);
+
+	data_ptr = NULL;
+	if ((flags & CAM_DIR_MASK) != CAM_DIR_NONE) {
+		if (sqe->buf_index >= ring->num_bufs
+		 || sqe->dxfer_len == 0 || sqe->dxfer_len > softc->maxio)
+			return (EINVAL);
+		rm = &ring->bufs[sqe->buf_index];
+		if (sqe->buf_offset > rm->len
+		 || sqe->dxfer_len > rm->len - sqe->buf_offset)
+			return (EINVAL);
+		data_ptr = (uint8_t *)rm->base + sqe->buf_offset;
+	} else if (sqe->dxfer_len != 0)
+		return (EINVAL);
+
+	xpt_setup_ccb(&ccb->ccb_h, periph->path, CAM_PRIORITY_NORMAL);
+
+	switch (sqe->func_code) {
+	case XPT_SCSI_IO:
+		if (sqe->cdb_len == 0 || sqe->cdb_len > IOCDBLEN)
+			return (EINVAL);
+		cam_fill_csio(&ccb->csio, sqe->retry_count, passdone, flags,
+		    sqe->tag_action, data_ptr, sqe->dxfer_len, SSD_FULL_SIZE,
+		    sqe->cdb_len, sqe->timeout);
+		bcopy(sqe->u.cdb, ccb->csio.cdb_io.cdb_bytes, sqe->cdb_len);
+		break;
+	case XPT_ATA_IO:
+		cam_fill_ataio(&ccb->ataio, sqe->retry_count, passdone, flags,
+		    sqe->tag_action, data_ptr, sqe->dxfer_len, sqe->timeout);
+		bcopy(&sqe->u.cmd, &ccb->ataio.cmd, sizeof(ccb->ataio.cmd));
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	ccb->ccb_h.ccb_ioreq = io_req;
+	io_req->ring_tag = sqe->user_tag;
+	io_req->flags |= PASS_IO_RING;
+
+	return (0);
+}
+
+/*
+ * Take up to to_submit entries from the submission queue, queue them all
+ * for one xpt_schedule(), and optionally wait for completions.  Entries
+ * are only taken while the completion queue has room for every request
+ * outstanding, so a completion never has to be dropped.
+ */
+static int
+passringenter(struct cam_periph *periph, struct pass_ring_enter *re)
+{
+	struct pass_softc *softc;
+	struct pass_ring *ring;
+	struct pass_ring_sqe sqe;
+	struct pass_io_req *io_req;
+	uint32_t avail, used;
+	int error;
+
+	softc = (struct pass_softc *)periph->softc;
+
+	cam_periph_assert(periph, MA_OWNED);
+
+	ring = softc->ring;
+	re->submitted = 0;
+	if (ring == NULL || (ring->flags & PASS_RING_DYING))
+		return (ENXIO);
+	if (periph->flags & CAM_PERIPH_INVALID)
+		return (ENXIO);
+
+	if ((softc->flags & PASS_FLAG_ZONE_VALID) == 0) {
+		error = passcreatezone(periph);
+		if (error != 0)
+			return (error);
+		/* We may have slept; the ring may be on its way out. */
+		if (softc->ring != ring || (ring->flags & PASS_RING_DYING))
+			return (ENXIO);
+	}
+
+	avail = atomic_load_acq_32(&ring->hdr->sq_tail) - ring->sq_head;
+	if (avail > ring->sq_entries)
+		return (EINVAL);
+	avail = min(avail, re->to_submit);
+
+	error = 0;
+	while (re->submitted < avail) {
+		used = ring->cq_tail - atomic_load_acq_32(&ring->hdr->cq_head);
+		if (used > ring->cq_entries) {
+			error = EINVAL;
+			break;
+		}
+		if (used + ring->inflight >= ring->cq_entries)
+			break;
+
+		io_req = uma_zalloc(softc->pass_zone, M_NOWAIT | M_ZERO);
+		if (io_req == NULL) {
+			if (re->submitted == 0)
+				error = ENOMEM;
+			break;
+		}
+
+		/*
+		 * Take a private copy of the entry before validating it;
+		 * the caller may be scribbling on the shared one.
+		 */
+		sqe = ring->sq[ring->sq_head & (ring->sq_entries - 1)];
+		ring->sq_head++;
+		atomic_store_rel_32(&ring->hdr->sq_head, ring->sq_head);
+		re->submitted++;
+		ring->inflight++;
+
+		if (passringsetup(periph, ring, &sqe, io_req) != 0) {
+			passringpost(softc, sqe.user_tag, CAM_REQ_INVALID, NULL);
+			ring->inflight--;
+			uma_zfree(softc->pass_zone, io_req);
+			continue;
+		}
+		TAILQ_INSERT_TAIL(&softc->incoming_queue, io_req, links);
+	}
+	if (!TAILQ_EMPTY(&softc->incoming_queue))
+		xpt_schedule(periph, CAM_PRIORITY_NORMAL);
+
+	while (error == 0 && re->min_complete != 0
+	    && (ring->flags & PASS_RING_DYING) == 0) {
+		used = ring->cq_tail - atomic_load_acq_32(&ring->hdr->cq_head);
+		if (used >= re->min_complete || ring->inflight == 0)
+			break;
+		ring->waiters++;
+		error = cam_periph_sleep(periph, &ring->cq_tail,
+		    PRIBIO | PCATCH, "passrng", 0);
+		if (--ring->waiters == 0 && (ring->flags & PASS_RING_DYING))
+			wakeup(ring);
+	}
+
+	return (error);
+}
+
 static int
 passioctl(struct cdev *dev, u_long cmd, caddr_t addr, int flag, struct thread *td)
 {
@@ -2046,6 +2558,15 @@ passdoioctl(struct cdev *dev, u_long cmd, caddr_t addr, int flag, struct thread
 		uma_zfree(softc->pass_zone, io_req);
 		break;
 	}
+	case CAMIORINGREG:
+		error = passringreg(periph, (struct pass_ring_reg *)addr);
+		break;
+	case CAMIORINGUNREG:
+		error = passringunreg(periph);
+		break;
+	case CAMIORINGENTER:
+		error = passringenter(periph, (struct pass_ring_enter *)addr);
+		break;
 	default:
 		error = cam_periph_ioctl(periph, cmd, addr, passerror);
 		break;
@@ -2076,6 +2597,9 @@ passpoll(struct cdev *dev, int poll_events, struct thread *td)
 
 		if (!TAILQ_EMPTY(&softc->done_queue)) {
 			revents |= poll_events & (POLLIN | POLLRDNORM);
+		} else if (softc->ring != NULL && softc->ring->cq_tail !=
+			   softc->ring->hdr->cq_head) {
+			revents |= poll_events & (POLLIN | POLLRDNORM);
 		}
 		cam_periph_unlock(periph);
 		if (revents == 0)
@@ -2128,10 +2652,13 @@ passreadfilt(struct knote *kn, long hint)
 
 	cam_periph_assert(periph, MA_OWNED);
 
-	if (TAILQ_EMPTY(&softc->done_queue))
-		retval = 0;
-	else
+	if (!TAILQ_EMPTY(&softc->done_queue))
 		retval = 1;
+	else if (softc->ring != NULL &&
+		 softc->ring->cq_tail != softc->ring->hdr->cq_head)
+		retval = 1;
+	else
+		retval = 0;
 
 	return (retval);
 }
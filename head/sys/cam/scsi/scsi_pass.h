@@ -47,4 +47,96 @@
 #define CAMIOQUEUE	_IO(CAM_VERSION, 4)
 #define CAMIOGET	_IO(CAM_VERSION, 5)
 
+/*
+ * Shared-memory submission and completion rings.
+ *
+ * CAMIORINGREG registers a page-aligned region of the caller's memory
+ * laid out as a struct pass_ring_hdr, sq_entries submission entries at
+ * PASS_RING_SQ_OFFSET and cq_entries completion entries at
+ * PASS_RING_CQ_OFFSET(sq_entries).  It may also register data buffers;
+ * the kernel holds and maps the ring and the buffers until CAMIORINGUNREG
+ * or the last close, so commands submitted through the ring need neither
+ * a copy of a CCB nor a per-command mapping of their data.
+ *
+ * The caller fills entries at sq_tail and advances it, then issues one
+ * CAMIORINGENTER for the batch.  The kernel advances sq_head as it takes
+ * entries and posts a completion for every entry it takes, advancing
+ * cq_tail; the caller reaps completions and advances cq_head.  An entry
+ * is only taken while a completion slot is guaranteed for it.  Indexes
+ * run freely and are reduced modulo the (power of two) ring sizes.
+ * Completions are reported to poll(2) and kqueue(2) as readable.
+ */
+struct pass_ring_hdr {
+	volatile uint32_t	sq_head;	/* Written by the kernel */
+	volatile uint32_t	sq_tail;	/* Written by the caller */
+	volatile uint32_t	cq_head;	/* Written by the caller */
+	volatile uint32_t	cq_tail;	/* Written by the kernel */
+	uint32_t		spare[12];
+};
+
+#define	PASS_RING_NOBUF		0xffffffff
+
+struct pass_ring_sqe {
+	uint64_t	user_tag;	/* Returned in the completion */
+	uint32_t	func_code;	/* XPT_SCSI_IO or XPT_ATA_IO */
+	uint32_t	flags;		/* CAM_DIR_*, CAM_PASS_ERR_RECOVER */
+	uint32_t	buf_index;	/* Registered buffer, or PASS_RING_NOBUF */
+	uint32_t	buf_offset;	/* Start of the data in that buffer */
+	uint32_t	dxfer_len;
+	uint32_t	timeout;	/* Milliseconds */
+	uint8_t		retry_count;
+	uint8_t		tag_action;
+	uint8_t		cdb_len;	/* SCSI only */
+	uint8_t		spare[5];
+	union {
+		uint8_t		cdb[IOCDBLEN];
+		struct ata_cmd	cmd;
+	} u;
+};
+
+struct pass_ring_cqe {
+	uint64_t	user_tag;
+	uint32_t	status;		/* ccb_h.status */
+	uint32_t	resid;
+	uint8_t		scsi_status;
+	uint8_t		sense_len;	/* Valid bytes of u.sense */
+	uint8_t		spare[6];
+	union {
+		struct scsi_sense_data	sense;
+		struct ata_res		res;
+	} u;
+};
+
+#define	PASS_RING_SQ_OFFSET	sizeof(struct pass_ring_hdr)
+#define	PASS_RING_CQ_OFFSET(sq_entries)					\
+	(PASS_RING_SQ_OFFSET + (sq_entries) * sizeof(struct pass_ring_sqe))
+#define	PASS_RING_SIZE(sq_entries, cq_entries)				\
+	(PASS_RING_CQ_OFFSET(sq_entries) +				\
+	 (cq_entries) * sizeof(struct pass_ring_cqe))
+
+struct pass_ring_buf {
+	void		*addr;
+	size_t		 len;
+};
+
+struct pass_ring_reg {
+	void			*ring;		/* Page aligned */
+	size_t			 ring_len;	/* At least PASS_RING_SIZE() */
+	uint32_t		 sq_entries;	/* Power of two */
+	uint32_t		 cq_entries;	/* Power of two */
+	uint32_t		 num_bufs;
+	struct pass_ring_buf	*bufs;		/* num_bufs entries */
+};
+
+struct pass_ring_enter {
+	uint32_t	to_submit;	/* Most entries to take from the SQ */
+	uint32_t	min_complete;	/* Wait for this many to be unreaped */
+	uint32_t	submitted;	/* Returned: entries taken */
+	uint32_t	spare;
+};
+
+#define	CAMIORINGREG	_IOW(CAM_VERSION, 6, struct pass_ring_reg)
+#define	CAMIORINGUNREG	_IO(CAM_VERSION, 7)
+#define	CAMIORINGENTER	_IOWR(CAM_VERSION, 8, struct pass_ring_enter)
+
 #endif
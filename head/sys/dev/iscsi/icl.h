@@ -64,6 +64,13 @@ struct icl_conn;
 struct ccb_scsiio;
 union ctl_io;
 
+/*
+ * Called once nothing references a buffer passed to icl_pdu_append_ext()
+ * anymore, i.e. when the PDU has been freed or its data has been
+ * acknowledged by the peer.
+ */
+typedef void (*icl_ext_free_t)(void *arg);
+
 struct icl_pdu {
 	STAILQ_ENTRY(icl_pdu)	ip_next;
 	struct icl_conn		*ip_conn;
@@ -103,6 +110,8 @@ struct icl_conn {
 	size_t			ic_receive_len;
 	int			ic_receive_state;
 	struct icl_pdu		*ic_receive_pdu;
+	struct mbuf		*ic_receive_buf;	/* Read, not parsed. */
+	size_t			ic_receive_buf_len;
 	struct cv		ic_send_cv;
 	struct cv		ic_receive_cv;
 	bool			ic_header_crc32c;
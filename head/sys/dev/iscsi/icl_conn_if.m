@@ -33,6 +33,21 @@
 
 INTERFACE icl_conn;
 
+CODE {
+	static int
+	icl_conn_default_pdu_append_ext(struct icl_conn *ic,
+	    struct icl_pdu *ip, void *addr, size_t len,
+	    icl_ext_free_t freef, void *arg, int flags)
+	{
+		int error;
+
+		error = ICL_CONN_PDU_APPEND_DATA(ic, ip, addr, len, flags);
+		if (error == 0)
+			freef(arg);
+		return (error);
+	}
+};
+
 METHOD size_t pdu_data_segment_length {
 	struct icl_conn *_ic;
 	const struct icl_pdu *_ip;
@@ -46,6 +61,21 @@ METHOD int pdu_append_data {
 	int _flags;
 };
 
+#
+# Append data without copying it; the buffer must stay valid until freef
+# is called.  Backends that can't do that fall back to copying.  On error,
+# freef is not called.
+#
+METHOD int pdu_append_ext {
+	struct icl_conn *_ic;
+	struct icl_pdu *_ip;
+	void *_addr;
+	size_t _len;
+	icl_ext_free_t _freef;
+	void *_arg;
+	int _flags;
+} DEFAULT icl_conn_default_pdu_append_ext;
+
 METHOD void pdu_get_data {
 	struct icl_conn *_ic;
 	struct icl_pdu *_ip;
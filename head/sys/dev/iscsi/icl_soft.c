@@ -39,6 +39,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/capsicum.h>
 #include <sys/condvar.h>
 #include <sys/conf.h>
+#include <sys/counter.h>
 #include <sys/file.h>
 #include <sys/kernel.h>
 #include <sys/kthread.h>
@@ -75,6 +76,47 @@ static int recvspace = 1048576;
 SYSCTL_INT(_kern_icl, OID_AUTO, recvspace, CTLFLAG_RWTUN,
     &recvspace, 0, "Default receive socket buffer size");
 
+
+/*
+ * Batch size histograms: bucket n counts batches of 2^n to 2^(n+1) - 1
+ * PDUs; the last one also counts anything larger.
+ */
+#define	ICL_BATCH_BUCKETS	8
+static counter_u64_t icl_send_batch[ICL_BATCH_BUCKETS];
+static counter_u64_t icl_receive_batch[ICL_BATCH_BUCKETS];
+
+static int
+icl_batch_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	counter_u64_t *hist;
+	uint64_t out[ICL_BATCH_BUCKETS];
+	int i;
+
+	hist = arg1;
+	for (i = 0; i < ICL_BATCH_BUCKETS; i++)
+		out[i] = hist[i] != NULL ? counter_u64_fetch(hist[i]) : 0;
+	return (SYSCTL_OUT(req, out, sizeof(out)));
+}
+SYSCTL_PROC(_kern_icl, OID_AUTO, send_batch,
+    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, icl_send_batch, 0,
+    icl_batch_sysctl, "QU", "Histogram of PDUs sent per sosend() call");
+SYSCTL_PROC(_kern_icl, OID_AUTO, receive_batch,
+    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, icl_receive_batch, 0,
+    icl_batch_sysctl, "QU", "Histogram of PDUs received per wakeup");
+
+static void
+icl_batch_account(counter_u64_t *hist, u_int n)
+{
+	int bucket;
+
+	if (n == 0)
+		return;
+	bucket = fls(n) - 1;
+	if (bucket >= ICL_BATCH_BUCKETS)
+		bucket = ICL_BATCH_BUCKETS - 1;
+	counter_u64_add(hist[bucket], 1);
+}
+
 static MALLOC_DEFINE(M_ICL_SOFT, "icl_soft", "iSCSI software backend");
 static uma_zone_t icl_pdu_zone;
 
@@ -92,6 +134,7 @@ static icl_conn_pdu_free_t	icl_soft_conn_pdu_free;
 static icl_conn_pdu_data_segment_length_t
 				    icl_soft_conn_pdu_data_segment_length;
 static icl_conn_pdu_append_data_t	icl_soft_conn_pdu_append_data;
+static icl_conn_pdu_append_ext_t	icl_soft_conn_pdu_append_ext;
 static icl_conn_pdu_get_data_t	icl_soft_conn_pdu_get_data;
 static icl_conn_pdu_queue_t	icl_soft_conn_pdu_queue;
 static icl_conn_handoff_t	icl_soft_conn_handoff;
@@ -108,6 +151,7 @@ static kobj_method_t icl_soft_methods[] = {
 	KOBJMETHOD(icl_conn_pdu_data_segment_length,
 	    icl_soft_conn_pdu_data_segment_length),
 	KOBJMETHOD(icl_conn_pdu_append_data, icl_soft_conn_pdu_append_data),
+	KOBJMETHOD(icl_conn_pdu_append_ext, icl_soft_conn_pdu_append_ext),
 	KOBJMETHOD(icl_conn_pdu_get_data, icl_soft_conn_pdu_get_data),
 	KOBJMETHOD(icl_conn_pdu_queue, icl_soft_conn_pdu_queue),
 	KOBJMETHOD(icl_conn_handoff, icl_soft_conn_handoff),
@@ -135,8 +179,13 @@ icl_conn_fail(struct icl_conn *ic)
 	(ic->ic_error)(ic);
 }
 
-static struct mbuf *
-icl_conn_receive(struct icl_conn *ic, size_t len)
+/*
+ * Move up to len bytes from the socket into ic_receive_buf.  Doing it
+ * once per wakeup, rather than once for every piece of every PDU, keeps
+ * the socket buffer locking out of the per-PDU path.
+ */
+static int
+icl_conn_receive_buf(struct icl_conn *ic, size_t len)
 {
 	struct uio uio;
 	struct socket *so;
@@ -152,14 +201,46 @@ icl_conn_receive(struct icl_conn *ic, size_t len)
 	error = soreceive(so, NULL, &uio, &m, NULL, &flags);
 	if (error != 0) {
 		ICL_DEBUG("soreceive error %d", error);
-		return (NULL);
+		return (error);
 	}
-	if (uio.uio_resid != 0) {
-		m_freem(m);
+	if (m == NULL)
+		return (0);
+
+	if (ic->ic_receive_buf == NULL)
+		ic->ic_receive_buf = m;
+	else
+		m_cat(ic->ic_receive_buf, m);
+	ic->ic_receive_buf_len += len - uio.uio_resid;
+
+	return (0);
+}
+
+/*
+ * Take the first len bytes off ic_receive_buf.
+ */
+static struct mbuf *
+icl_conn_receive(struct icl_conn *ic, size_t len)
+{
+	struct mbuf *m;
+
+	if (len > ic->ic_receive_buf_len) {
 		ICL_DEBUG("short read");
 		return (NULL);
 	}
 
+	m = ic->ic_receive_buf;
+	if (len == ic->ic_receive_buf_len) {
+		ic->ic_receive_buf = NULL;
+	} else {
+		ic->ic_receive_buf = m_split(m, len, M_NOWAIT);
+		if (ic->ic_receive_buf == NULL) {
+			ICL_DEBUG("m_split failed");
+			ic->ic_receive_buf = m;
+			return (NULL);
+		}
+	}
+	ic->ic_receive_buf_len -= len;
+
 	return (m);
 }
 
@@ -708,11 +789,17 @@ icl_conn_receive_pdu(struct icl_conn *ic, size_t *availablep)
 	return (NULL);
 }
 
+/*
+ * Parse as many PDUs as the data read so far allows and hand them to the
+ * upper layer together, once the socket has been drained.
+ */
 static void
 icl_conn_receive_pdus(struct icl_conn *ic, size_t available)
 {
+	struct icl_pdu_stailq queue;
 	struct icl_pdu *response;
 	struct socket *so;
+	u_int n;
 
 	so = ic->ic_socket;
 
@@ -722,15 +809,24 @@ icl_conn_receive_pdus(struct icl_conn *ic, size_t available)
 	 */
 	KASSERT(so != NULL, ("NULL socket"));
 
+	if (available > ic->ic_receive_buf_len &&
+	    icl_conn_receive_buf(ic, available - ic->ic_receive_buf_len) != 0) {
+		icl_conn_fail(ic);
+		return;
+	}
+	available = ic->ic_receive_buf_len;
+
+	STAILQ_INIT(&queue);
+	n = 0;
 	for (;;) {
 		if (ic->ic_disconnecting)
-			return;
+			break;
 
 		if (so->so_error != 0) {
 			ICL_DEBUG("connection error %d; "
 			    "dropping connection", so->so_error);
 			icl_conn_fail(ic);
-			return;
+			break;
 		}
 
 		/*
@@ -743,7 +839,7 @@ icl_conn_receive_pdus(struct icl_conn *ic, size_t available)
 			    "need %zd", available,
 			    ic->ic_receive_len);
 #endif
-			return;
+			break;
 		}
 
 		response = icl_conn_receive_pdu(ic, &available);
@@ -756,9 +852,29 @@ icl_conn_receive_pdus(struct icl_conn *ic, size_t available)
 			    response->ip_bhs->bhs_opcode);
 			icl_pdu_free(response);
 			icl_conn_fail(ic);
-			return;
+			break;
 		}
 
+		STAILQ_INSERT_TAIL(&queue, response, ip_next);
+		n++;
+	}
+
+	/*
+	 * If the connection failed or is going away, ic_error has already
+	 * been called or the session is being torn down; the upper layer
+	 * must not see anything received in this pass.
+	 */
+	if (ic->ic_disconnecting || so->so_error != 0) {
+		while ((response = STAILQ_FIRST(&queue)) != NULL) {
+			STAILQ_REMOVE_HEAD(&queue, ip_next);
+			icl_pdu_free(response);
+		}
+		return;
+	}
+
+	icl_batch_account(icl_receive_batch, n);
+	while ((response = STAILQ_FIRST(&queue)) != NULL) {
+		STAILQ_REMOVE_HEAD(&queue, ip_next);
 		(ic->ic_receive)(response);
 	}
 }
@@ -786,9 +902,10 @@ icl_receive_thread(void *arg)
 		 * is enough data received to read the PDU.
 		 */
 		SOCKBUF_LOCK(&so->so_rcv);
-		available = sbavail(&so->so_rcv);
+		available = sbavail(&so->so_rcv) + ic->ic_receive_buf_len;
 		if (available < ic->ic_receive_len) {
-			so->so_rcv.sb_lowat = ic->ic_receive_len;
+			so->so_rcv.sb_lowat = ic->ic_receive_len -
+			    ic->ic_receive_buf_len;
 			cv_wait(&ic->ic_receive_cv, &so->so_rcv.sb_mtx);
 		} else
 			so->so_rcv.sb_lowat = so->so_rcv.sb_hiwat + 1;
@@ -957,7 +1074,6 @@ icl_conn_send_pdus(struct icl_conn *ic, struct icl_pdu_stailq *queue)
 				request2->ip_bhs_mbuf = NULL;
 				request->ip_bhs_mbuf->m_pkthdr.len += size2;
 				size += size2;
-				STAILQ_REMOVE_AFTER(queue, request, ip_next);
 				icl_pdu_free(request2);
 				coalesced++;
 			}
@@ -967,7 +1083,9 @@ icl_conn_send_pdus(struct icl_conn *ic, struct icl_pdu_stailq *queue)
 				    coalesced, size);
 			}
 #endif
-		}
+		} else
+			coalesced = 1;
+		icl_batch_account(icl_send_batch, coalesced);
 		available -= size;
 		error = sosend(so, NULL, NULL, request->ip_bhs_mbuf,
 		    NULL, MSG_DONTWAIT, curthread);
@@ -1114,6 +1232,56 @@ icl_soft_conn_pdu_append_data(struct icl_conn *ic, struct icl_pdu *request,
 	return (icl_pdu_append_data(request, addr, len, flags));
 }
 
+static void
+icl_pdu_ext_free(struct mbuf *m, void *arg1, void *arg2)
+{
+	icl_ext_free_t freef;
+
+	freef = (icl_ext_free_t)(uintptr_t)arg1;
+	freef(arg2);
+}
+
+/*
+ * Attach the caller's buffer to the PDU as external mbuf storage instead
+ * of copying it.  The mbuf is read-only, so padding and the data digest
+ * go into mbufs of their own.  The socket layer may hold on to the mbuf,
+ * and copies of it made for retransmission, until the data have been
+ * acknowledged; freef is called after the last of them is gone.
+ */
+int
+icl_soft_conn_pdu_append_ext(struct icl_conn *ic, struct icl_pdu *request,
+    void *addr, size_t len, icl_ext_free_t freef, void *arg, int flags)
+{
+	struct mbuf *newmb;
+	int error;
+
+	KASSERT(len > 0, ("len == 0"));
+
+	newmb = m_get(flags, MT_DATA);
+	if (newmb == NULL) {
+		ICL_WARN("failed to allocate mbuf");
+		return (ENOMEM);
+	}
+	error = m_extadd(newmb, addr, len, icl_pdu_ext_free,
+	    (void *)(uintptr_t)freef, arg, M_RDONLY, EXT_MOD_TYPE, flags);
+	if (error != 0) {
+		ICL_WARN("failed to attach %zd bytes", len);
+		m_free(newmb);
+		return (error);
+	}
+	newmb->m_len = len;
+
+	if (request->ip_data_mbuf == NULL) {
+		request->ip_data_mbuf = newmb;
+		request->ip_data_len = len;
+	} else {
+		m_cat(request->ip_data_mbuf, newmb);
+		request->ip_data_len += len;
+	}
+
+	return (0);
+}
+
 static void
 icl_pdu_get_data(struct icl_pdu *ip, size_t off, void *addr, size_t len)
 {
@@ -1403,6 +1571,9 @@ icl_soft_conn_close(struct icl_conn *ic)
 		icl_pdu_free(ic->ic_receive_pdu);
 		ic->ic_receive_pdu = NULL;
 	}
+	m_freem(ic->ic_receive_buf);
+	ic->ic_receive_buf = NULL;
+	ic->ic_receive_buf_len = 0;
 
 	/*
 	 * Remove any outstanding PDUs from the send queue.
@@ -1486,12 +1657,16 @@ icl_conn_handoff_sock(struct icl_conn *ic, struct socket *so)
 static int
 icl_soft_load(void)
 {
-	int error;
+	int error, i;
 
 	icl_pdu_zone = uma_zcreate("icl_pdu",
 	    sizeof(struct icl_pdu), NULL, NULL, NULL, NULL,
 	    UMA_ALIGN_PTR, 0);
 	refcount_init(&icl_ncons, 0);
+	for (i = 0; i < ICL_BATCH_BUCKETS; i++) {
+		icl_send_batch[i] = counter_u64_alloc(M_WAITOK);
+		icl_receive_batch[i] = counter_u64_alloc(M_WAITOK);
+	}
 
 	/*
 	 * The reason we call this "none" is that to the user,
@@ -1507,6 +1682,7 @@ icl_soft_load(void)
 static int
 icl_soft_unload(void)
 {
+	int i;
 
 	if (icl_ncons != 0)
 		return (EBUSY);
@@ -1514,6 +1690,11 @@ icl_soft_unload(void)
 	icl_unregister("none");
 
 	uma_zdestroy(icl_pdu_zone);
+	for (i = 0; i < ICL_BATCH_BUCKETS; i++) {
+		counter_u64_free(icl_send_batch[i]);
+		counter_u64_free(icl_receive_batch[i]);
+		icl_send_batch[i] = icl_receive_batch[i] = NULL;
+	}
 
 	return (0);
 }
@@ -63,6 +63,15 @@ icl_pdu_append_data(struct icl_pdu *ip, const void *addr, size_t len, int flags)
 	return (ICL_CONN_PDU_APPEND_DATA(ip->ip_conn, ip, addr, len, flags));
 }
 
+static inline int
+icl_pdu_append_ext(struct icl_pdu *ip, void *addr, size_t len,
+    icl_ext_free_t freef, void *arg, int flags)
+{
+
+	return (ICL_CONN_PDU_APPEND_EXT(ip->ip_conn, ip, addr, len, freef,
+	    arg, flags));
+}
+
 static inline void
 icl_pdu_get_data(struct icl_pdu *ip, size_t off, void *addr, size_t len)
 {
@@ -44,6 +44,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/rmlock.h>
+#include <sys/sx.h>
 #include <sys/module.h>
 #include <sys/bus.h>
 #include <sys/conf.h>
@@ -62,6 +63,7 @@ __FBSDID("$FreeBSD$");
 #include <machine/resource.h>
 #include <sys/rman.h>
 #include <sys/proc.h>
+#include <sys/sched.h>
 
 #include <dev/pci/pcivar.h>
 
@@ -100,6 +102,11 @@ static void mps_dispatch_event(struct mps_softc *sc, uintptr_t data,
     MPI2_EVENT_NOTIFICATION_REPLY *reply);
 static void mps_config_complete(struct mps_softc *sc, struct mps_command *cm);
 static void mps_periodic(void *);
+static int mps_process_queue(struct mps_queue *q);
+static void mps_poll_thread(void *arg);
+static int mps_poll_start_locked(struct mps_softc *sc);
+static void mps_poll_hold(struct mps_softc *sc);
+static void mps_poll_release(struct mps_softc *sc);
 static int mps_reregister_events(struct mps_softc *sc);
 static void mps_enqueue_request(struct mps_softc *sc, struct mps_command *cm);
 static int mps_get_iocfacts(struct mps_softc *sc, MPI2_IOC_FACTS_REPLY *facts);
@@ -109,6 +116,8 @@ static int sysctl_mps_io_cmds_highwater(SYSCTL_HANDLER_ARGS);
 static int sysctl_mps_chain_free(SYSCTL_HANDLER_ARGS);
 static int sysctl_mps_chain_free_lw(SYSCTL_HANDLER_ARGS);
 static int sysctl_mps_chain_alloc_fail(SYSCTL_HANDLER_ARGS);
+static int sysctl_mps_poll_queues(SYSCTL_HANDLER_ARGS);
+static int sysctl_mps_poll_stat(SYSCTL_HANDLER_ARGS);
 
 SYSCTL_NODE(_hw, OID_AUTO, mps, CTLFLAG_RD, 0, "MPS Driver Parameters");
 
@@ -134,6 +143,13 @@ typedef union _reply_descriptor {
         } u;
 }reply_descriptor,address_descriptor;
 
+/*
+ * Serializes changes to the set of polled queues, which may sleep creating
+ * or reaping the poller threads.
+ */
+static struct sx mps_poll_sx;
+SX_SYSINIT(mps_poll, &mps_poll_sx, "mps poll");
+
 /* Rate limit chain-fail messages to 1 per minute */
 struct timeval mps_chainfail_interval = { 60, 0 };
 
@@ -349,6 +365,7 @@ mps_transition_operational(struct mps_softc *sc)
 static void
 mps_resize_queues(struct mps_softc *sc)
 {
+	u_int chains, maxio, maxsegs;
 	int reqcr, prireqcr;
  
 	/*
@@ -388,6 +405,43 @@ mps_resize_queues(struct mps_softc *sc)
 			sc->numqueues = sc->msix_msgs;
 	}
 
+	/*
+	 * Size the largest I/O from the SGL depth that the IOC allows: one
+	 * simple element in the request frame followed by MaxChainDepth chain
+	 * frames, each holding as many simple elements as fit next to the
+	 * link to the next chain.  The user can only lower this.
+	 */
+	sc->sges_per_chain = (sc->facts->IOCRequestFrameSize * 4 -
+	    MPS_SGC_SIZE) / MPS_SGE64_SIZE;
+	maxsegs = 1 + sc->facts->MaxChainDepth * sc->sges_per_chain;
+	maxio = (maxsegs - 1) * PAGE_SIZE;
+	if (sc->max_io_pages > 0)
+		maxio = MIN(maxio, sc->max_io_pages * PAGE_SIZE);
+	sc->maxio = MAX(maxio, PAGE_SIZE);
+	sc->chains_per_io = mps_chains_for_size(sc, sc->maxio);
+
+	/*
+	 * Unless the user asked for a specific number, allocate enough chain
+	 * frames for every queue to have a few maxio-sized commands mapped at
+	 * once, so bulk transfers don't get starved by the chain pool.  The
+	 * frames come from one physically contiguous allocation and each
+	 * queue's chain ring needs a power of 2 size, hence the rounding and
+	 * the cap.
+	 */
+	if (sc->max_chains <= 0) {
+		chains = sc->numqueues * sc->chains_per_io * MPS_CHAIN_MIN_IOS;
+		if (chains > MPS_CHAIN_FRAMES)
+			chains = 1 << fls(chains - 1);
+		sc->max_chains = MIN(MAX(chains, MPS_CHAIN_FRAMES),
+		    MPS_CHAIN_FRAMES_MAX);
+	}
+
+	/* A single command must still fit in its queue's share of chains. */
+	chains = sc->max_chains / sc->numqueues;
+	if (sc->chains_per_io > chains) {
+		sc->maxio = MAX(chains * sc->sges_per_chain, 1) * PAGE_SIZE;
+		sc->chains_per_io = mps_chains_for_size(sc, sc->maxio);
+	}
 }
 
 /*
@@ -774,6 +828,12 @@ mps_reinit(struct mps_softc *sc)
 	mps_dprint(sc, MPS_INIT, "%s mask interrupts\n", __func__);
 	mps_mask_intr(sc);
 
+	/*
+	 * The reply queues are about to be reset and possibly reallocated,
+	 * so keep the pollers off them until they have been rebuilt.
+	 */
+	mps_poll_hold(sc);
+
 	error = mps_diag_reset(sc, CAN_SLEEP);
 	if (error != 0) {
 		/* XXXSL No need to panic here */
@@ -806,13 +866,16 @@ mps_reinit(struct mps_softc *sc)
 
 	/*
 	 * The static page function currently read is IOC Page8.  Others can be
-	 * added in future.  It's possible that the values in IOC Page8 have
-	 * changed after a Diag Reset due to user modification, so always read
-	 * these.  Interrupts are masked, so unmask them before getting config
-	 * pages.
+	 * added in future.  User modification of IOC Page8 goes through the
+	 * passthrough ioctls, which flush the config page cache, so a cached
+	 * copy is still good here.  Device handles are reassigned by the
+	 * reset, so cached device pages are not.  Interrupts are masked, so
+	 * unmask them before getting config pages.
 	 */
+	mps_config_cache_invalidate(sc, MPS_CFG_CLASS_DEVICE);
 	mps_unmask_intr(sc);
 	sc->mps_flags &= ~MPS_FLAGS_DIAGRESET;
+	mps_poll_release(sc);
 	mps_base_static_config_pages(sc);
 
 	/*
@@ -1147,7 +1210,22 @@ mps_alloc_transaction_queues(struct mps_softc *sc)
 	int qnum, nsegs;
 
 	for (qnum = 0; qnum < sc->numqueues; qnum++) {
-		q = malloc(sizeof(struct mps_queue), M_MPT2, M_WAITOK | M_ZERO);
+		/*
+		 * Queues survive a re-allocation after a Diag Reset so that a
+		 * poller thread bound to one keeps a valid reference.
+		 */
+		if ((q = sc->queues[qnum]) == NULL) {
+			q = malloc(sizeof(struct mps_queue), M_MPT2,
+			    M_WAITOK | M_ZERO);
+			mtx_init(&q->poll_mtx, "mpspoll", NULL, MTX_DEF);
+			q->poll_state = MPS_POLL_OFF;
+		} else {
+			free(q->chainmem, M_MPSSAS);
+			free(q->ringmem, M_MPSSAS);
+			if (q->buffer_dmat != NULL)
+				bus_dma_tag_destroy(q->buffer_dmat);
+			q->buffer_dmat = NULL;
+		}
 		q->sc = sc;
 		q->qnum = qnum;
 		postqueues = (uint8_t *)sc->post_queues;
@@ -1160,8 +1238,7 @@ mps_alloc_transaction_queues(struct mps_softc *sc)
 		ck_ring_init(&q->req_ring, roundup2(sc->num_reqs, 4096));
 		sc->queues[qnum] = q;
 
-		/* XXX Need to pick a more precise value */
-		nsegs = (MAXPHYS / PAGE_SIZE) + 1;
+		nsegs = (sc->maxio / PAGE_SIZE) + 1;
 		if (bus_dma_tag_create( sc->mps_parent_dmat,    /* parent */
 					1, 0,		/* algnmnt, boundary */
 					BUS_SPACE_MAXADDR,	/* lowaddr */
@@ -1197,6 +1274,9 @@ mps_free_transaction_queues(struct mps_softc *sc)
 			return;
 		if (q->buffer_dmat != NULL)
 			bus_dma_tag_destroy(q->buffer_dmat);
+		free(q->chainmem, M_MPSSAS);
+		free(q->ringmem, M_MPSSAS);
+		mtx_destroy(&q->poll_mtx);
 		sc->queues[qnum] = NULL;
 		free(q, M_MPT2);
 	}
@@ -1408,6 +1488,7 @@ mps_alloc_command_pool(struct mps_softc *sc)
 		cm->cm_sc = sc;
 		cm->cm_q = q;
 		STAILQ_INIT(&cm->cm_chain_list);
+		STAILQ_INIT(&cm->cm_chain_resv);
 		callout_init_mtx(&cm->cm_callout, &sc->mps_mtx, 0);
 
 		/* XXX Is a failure here a critical problem? */
@@ -1493,13 +1574,20 @@ mps_get_tunables(struct mps_softc *sc)
 	sc->disable_msix = 0;
 	sc->disable_msi = 0;
 	sc->max_msix = MPS_MSIX_MAX;
-	sc->max_chains = MPS_CHAIN_FRAMES;
+	sc->max_chains = 0;
+	sc->max_io_pages = 0;
 	sc->enable_ssu = MPS_SSU_ENABLE_SSD_DISABLE_HDD;
 	sc->spinup_wait_time = DEFAULT_SPINUP_WAIT;
 	sc->max_reqframes = MPS_REQ_FRAMES;
 	sc->max_prireqframes = MPS_PRI_REQ_FRAMES;
 	sc->max_replyframes = MPS_REPLY_FRAMES;
 	sc->max_evtframes = MPS_EVT_REPLY_FRAMES;
+	sc->poll_queues = 0;
+	sc->poll_idle_us = MPS_POLL_IDLE_US;
+	sc->DD_mirror_enable = 1;
+	sc->cfg_cache_enable = 1;
+	sc->dpm_flush_delay_ms = MPS_DPM_FLUSH_DELAY;
+	sc->dpm_flush_batch = MPS_DPM_FLUSH_BATCH;
 
 	/*
 	 * Grab the global variables.
@@ -1508,6 +1596,7 @@ mps_get_tunables(struct mps_softc *sc)
 	TUNABLE_INT_FETCH("hw.mps.disable_msix", &sc->disable_msix);
 	TUNABLE_INT_FETCH("hw.mps.disable_msi", &sc->disable_msi);
 	TUNABLE_INT_FETCH("hw.mps.max_chains", &sc->max_chains);
+	TUNABLE_INT_FETCH("hw.mps.max_io_pages", &sc->max_io_pages);
 	TUNABLE_INT_FETCH("hw.mps.enable_ssu", &sc->enable_ssu);
 	TUNABLE_INT_FETCH("hw.mps.spinup_wait_time", &sc->spinup_wait_time);
 	TUNABLE_INT_FETCH("hw.mps.max_msix", &sc->max_msix);
@@ -1515,6 +1604,12 @@ mps_get_tunables(struct mps_softc *sc)
 	TUNABLE_INT_FETCH("hw.mps.max_prireqframes", &sc->max_prireqframes);
 	TUNABLE_INT_FETCH("hw.mps.max_replyframes", &sc->max_replyframes);
 	TUNABLE_INT_FETCH("hw.mps.max_evtframes", &sc->max_evtframes);
+	TUNABLE_INT_FETCH("hw.mps.poll_queues", &sc->poll_queues);
+	TUNABLE_INT_FETCH("hw.mps.poll_idle_us", &sc->poll_idle_us);
+	TUNABLE_INT_FETCH("hw.mps.dd_mirror_enable", &sc->DD_mirror_enable);
+	TUNABLE_INT_FETCH("hw.mps.cfg_cache_enable", &sc->cfg_cache_enable);
+	TUNABLE_INT_FETCH("hw.mps.dpm_flush_delay_ms", &sc->dpm_flush_delay_ms);
+	TUNABLE_INT_FETCH("hw.mps.dpm_flush_batch", &sc->dpm_flush_batch);
 
 	/* Grab the unit-instance variables */
 	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.debug_level",
@@ -1533,6 +1628,10 @@ mps_get_tunables(struct mps_softc *sc)
 	    device_get_unit(sc->mps_dev));
 	TUNABLE_INT_FETCH(tmpstr, &sc->max_chains);
 
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.max_io_pages",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->max_io_pages);
+
 	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.max_msix",
 	    device_get_unit(sc->mps_dev));
 	TUNABLE_INT_FETCH(tmpstr, &sc->max_msix);
@@ -1553,6 +1652,30 @@ mps_get_tunables(struct mps_softc *sc)
 	    device_get_unit(sc->mps_dev));
 	TUNABLE_INT_FETCH(tmpstr, &sc->max_evtframes);
 
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.poll_queues",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->poll_queues);
+
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.poll_idle_us",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->poll_idle_us);
+
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.dd_mirror_enable",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->DD_mirror_enable);
+
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.cfg_cache_enable",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->cfg_cache_enable);
+
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.dpm_flush_delay_ms",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->dpm_flush_delay_ms);
+
+	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.dpm_flush_batch",
+	    device_get_unit(sc->mps_dev));
+	TUNABLE_INT_FETCH(tmpstr, &sc->dpm_flush_batch);
+
 	bzero(sc->exclude_ids, sizeof(sc->exclude_ids));
 	snprintf(tmpstr, sizeof(tmpstr), "dev.mps.%d.exclude_ids",
 	    device_get_unit(sc->mps_dev));
@@ -1673,6 +1796,18 @@ mps_setup_sysctl(struct mps_softc *sc)
 	    OID_AUTO, "max_chains", CTLFLAG_RD,
 	    &sc->max_chains, 0,"maximum chain frames that will be allocated");
 
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "max_io_pages", CTLFLAG_RD, &sc->max_io_pages, 0,
+	    "user-defined limit on pages per I/O, 0 for the IOC maximum");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "maxio", CTLFLAG_RD, &sc->maxio, 0,
+	    "largest I/O in bytes reported to CAM");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "chains_per_io", CTLFLAG_RD, &sc->chains_per_io, 0,
+	    "chain frames reserved for a maxio-sized command");
+
 	SYSCTL_ADD_INT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
 	    OID_AUTO, "enable_ssu", CTLFLAG_RW, &sc->enable_ssu, 0,
 	    "enable SSU to SATA SSD/HDD at shutdown");
@@ -1681,6 +1816,99 @@ mps_setup_sysctl(struct mps_softc *sc)
 	    OID_AUTO, "spinup_wait_time", CTLFLAG_RD,
 	    &sc->spinup_wait_time, DEFAULT_SPINUP_WAIT, "seconds to wait for "
 	    "spinup after SATA ID error");
+
+	SYSCTL_ADD_PROC(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "poll_queues",
+	    CTLTYPE_UINT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    sysctl_mps_poll_queues, "IU",
+	    "bitmask of reply queues completed by a busy-poll thread");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "poll_idle_us", CTLFLAG_RW, &sc->poll_idle_us, 0,
+	    "usecs without completions before a poller falls back to "
+	    "interrupts");
+
+	SYSCTL_ADD_PROC(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "poll_hits",
+	    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+	    offsetof(struct mps_queue, poll_hits), sysctl_mps_poll_stat, "QU",
+	    "polls that found completions, summed over all queues");
+
+	SYSCTL_ADD_PROC(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "poll_empty",
+	    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+	    offsetof(struct mps_queue, poll_empty), sysctl_mps_poll_stat, "QU",
+	    "polls that found nothing to do, summed over all queues");
+
+	SYSCTL_ADD_PROC(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "poll_idle_fallbacks",
+	    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+	    offsetof(struct mps_queue, poll_idle_fallbacks),
+	    sysctl_mps_poll_stat, "QU",
+	    "times a poller went idle and re-armed interrupts, summed over "
+	    "all queues");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dd_mirror_enable", CTLFLAG_RD, &sc->DD_mirror_enable, 0,
+	    "send reads for IR RAID1/RAID10 volumes directly to member disks");
+
+	SYSCTL_ADD_INT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dd_mirror_volumes", CTLFLAG_RD, &sc->DD_num_mirrors, 0,
+	    "IR mirror volumes using direct reads");
+
+	SYSCTL_ADD_ULONG(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dd_mirror_reads", CTLFLAG_RD, &sc->DD_mirror_reads,
+	    "reads sent directly to IR mirror members");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "cfg_cache_enable", CTLFLAG_RW, &sc->cfg_cache_enable, 0,
+	    "cache config pages that only change on events the driver sees");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "cfg_cache_entries", CTLFLAG_RD, &sc->cfg_cache_entries,
+	    0, "config pages currently cached");
+
+	SYSCTL_ADD_ULONG(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "cfg_cache_hits", CTLFLAG_RD, &sc->cfg_cache_hits,
+	    "config page reads served from the cache");
+
+	SYSCTL_ADD_ULONG(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "cfg_cache_misses", CTLFLAG_RD, &sc->cfg_cache_misses,
+	    "config page reads sent to the IOC");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_delay_ms", CTLFLAG_RW, &sc->dpm_flush_delay_ms,
+	    0, "max ms a dirty DPM entry waits for writeback, 0 for immediate");
+
+	SYSCTL_ADD_UINT(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_batch", CTLFLAG_RW, &sc->dpm_flush_batch, 0,
+	    "max DPM entries written per config request");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_marks", CTLFLAG_RD, &sc->dpm_flush_marks,
+	    "times a DPM entry was marked dirty");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_entries", CTLFLAG_RD, &sc->dpm_flush_entries,
+	    "dirty DPM entries written back");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_writes", CTLFLAG_RD, &sc->dpm_flush_writes,
+	    "DPM config page write requests");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_runs", CTLFLAG_RD, &sc->dpm_flush_runs,
+	    "DPM writebacks completed");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_lat_total_us", CTLFLAG_RD,
+	    &sc->dpm_flush_lat_total_us,
+	    "total us from first dirty entry to writeback");
+
+	SYSCTL_ADD_UQUAD(sysctl_ctx, SYSCTL_CHILDREN(sysctl_tree),
+	    OID_AUTO, "dpm_flush_lat_max_us", CTLFLAG_RD,
+	    &sc->dpm_flush_lat_max_us,
+	    "longest us from first dirty entry to writeback");
 }
 
 static int
@@ -1786,6 +2014,261 @@ sysctl_mps_chain_alloc_fail(SYSCTL_HANDLER_ARGS)
 	return (SYSCTL_OUT(req, &num, sizeof(num)));
 }
 
+static int
+sysctl_mps_poll_queues(SYSCTL_HANDLER_ARGS)
+{
+	struct mps_softc *sc;
+	u_int val;
+	int error;
+
+	sc = (struct mps_softc *)arg1;
+	val = sc->poll_queues;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	sx_xlock(&mps_poll_sx);
+	sc->poll_queues = val & ((1 << sc->numqueues) - 1);
+	error = mps_poll_start_locked(sc);
+	sx_xunlock(&mps_poll_sx);
+	return (error);
+}
+
+static int
+sysctl_mps_poll_stat(SYSCTL_HANDLER_ARGS)
+{
+	struct mps_softc *sc;
+	struct mps_queue *q;
+	uint64_t num;
+	int qnum;
+
+	sc = (struct mps_softc *)arg1;
+	num = 0;
+	for (qnum = 0; qnum < MPS_MSIX_MAX; qnum++) {
+		if ((q = sc->queues[qnum]) != NULL)
+			num += *(uint64_t *)((uint8_t *)q + arg2);
+	}
+
+	return (sysctl_handle_64(oidp, &num, 0, req));
+}
+
+/*
+ * Busy-poll completion mode.  A thread bound to the queue's CPU spins on the
+ * reply post queue while completions keep arriving, which saves the
+ * interrupt, the ithread wakeup and the thread hop for low-latency devices.
+ * Once the queue has been empty for poll_idle_us the thread parks and the
+ * queue goes back to being interrupt driven; the next interrupt wakes it.
+ */
+static void
+mps_poll_thread(void *arg)
+{
+	struct mps_softc *sc;
+	struct mps_queue *q;
+	sbintime_t idle, last;
+
+	q = (struct mps_queue *)arg;
+	sc = q->sc;
+
+	if (q->qnum <= mp_maxid && !CPU_ABSENT(q->qnum)) {
+		thread_lock(curthread);
+		sched_bind(curthread, q->qnum);
+		thread_unlock(curthread);
+	}
+
+	mtx_lock(&q->poll_mtx);
+	for (;;) {
+		while ((q->poll_state == MPS_POLL_OFF) ||
+		    (q->poll_state == MPS_POLL_IDLE))
+			msleep(&q->poll_state, &q->poll_mtx, PRIBIO, "mpspoll",
+			    0);
+		if (q->poll_state == MPS_POLL_EXIT)
+			break;
+		mtx_unlock(&q->poll_mtx);
+
+		idle = (sbintime_t)sc->poll_idle_us * SBT_1US;
+		last = sbinuptime();
+		while ((q->poll_state == MPS_POLL_ACTIVE) &&
+		    ((sc->mps_flags & MPS_FLAGS_DIAGRESET) == 0)) {
+			if (mps_process_queue(q) != 0) {
+				q->poll_hits++;
+				last = sbinuptime();
+			} else {
+				q->poll_empty++;
+				if (sbinuptime() - last > idle)
+					break;
+				cpu_spinwait();
+			}
+			maybe_yield();
+		}
+
+		mtx_lock(&q->poll_mtx);
+		if (q->poll_state == MPS_POLL_ACTIVE) {
+			q->poll_state = MPS_POLL_IDLE;
+			q->poll_idle_fallbacks++;
+		}
+		mtx_unlock(&q->poll_mtx);
+
+		/*
+		 * mps_intr_queue() returns without looking at the queue while
+		 * it is ACTIVE, so a reply posted just before the switch to
+		 * IDLE may have had its interrupt ignored.  Catch it here.
+		 */
+		mps_process_queue(q);
+		mtx_lock(&q->poll_mtx);
+	}
+	q->poll_td = NULL;
+	wakeup(&q->poll_td);
+	mtx_unlock(&q->poll_mtx);
+	kthread_exit();
+}
+
+/*
+ * Bring the set of polled queues in line with sc->poll_queues.  Threads are
+ * created on first use and are parked, not destroyed, when a queue is taken
+ * out of the set.
+ */
+int
+mps_poll_start(struct mps_softc *sc)
+{
+	int error;
+
+	sx_xlock(&mps_poll_sx);
+	error = mps_poll_start_locked(sc);
+	sx_xunlock(&mps_poll_sx);
+	return (error);
+}
+
+static int
+mps_poll_start_locked(struct mps_softc *sc)
+{
+	struct mps_queue *q;
+	int qnum, error;
+
+	sx_assert(&mps_poll_sx, SA_XLOCKED);
+
+	/* mps_poll_stop() has run; don't bring threads back on detach. */
+	if (sc->mps_flags & MPS_FLAGS_SHUTDOWN)
+		return (ENXIO);
+
+	error = 0;
+	for (qnum = 0; qnum < sc->numqueues; qnum++) {
+		if ((q = sc->queues[qnum]) == NULL)
+			continue;
+
+		mtx_lock(&q->poll_mtx);
+		if ((sc->poll_queues & (1 << qnum)) == 0) {
+			q->poll_state = MPS_POLL_OFF;
+			mtx_unlock(&q->poll_mtx);
+			continue;
+		}
+		if (q->poll_state == MPS_POLL_OFF)
+			q->poll_state = MPS_POLL_IDLE;
+		mtx_unlock(&q->poll_mtx);
+
+		if (q->poll_td != NULL)
+			continue;
+		error = kthread_add(mps_poll_thread, q, NULL, &q->poll_td, 0, 0,
+		    "%s poll%d", device_get_nameunit(sc->mps_dev), qnum);
+		if (error != 0) {
+			mps_dprint(sc, MPS_ERROR, "Cannot create poll thread "
+			    "for queue %d, error %d\n", qnum, error);
+			mtx_lock(&q->poll_mtx);
+			q->poll_state = MPS_POLL_OFF;
+			mtx_unlock(&q->poll_mtx);
+			sc->poll_queues &= ~(1 << qnum);
+		}
+	}
+
+	return (error);
+}
+
+/*
+ * Keep the pollers off the reply queues across a Diag Reset by taking
+ * ownership of every queue, as mps_process_queue() does, so that anyone
+ * else trying to drain one returns straight away.  A poller that is in the
+ * middle of a drain may need the driver lock to dispatch an event, so it
+ * is dropped while we wait.  Queues this thread already owns (the reset was
+ * started from a completion) are left alone.  This must not sleep: resets
+ * are started from callouts and completion handlers.
+ */
+static void
+mps_poll_hold(struct mps_softc *sc)
+{
+	struct mps_queue *q;
+	uintptr_t td;
+	int qnum;
+
+	mtx_assert(&sc->mps_mtx, MA_OWNED);
+
+	td = (uintptr_t)curthread;
+	sc->poll_held = 0;
+	mps_unlock(sc);
+	for (qnum = 0; qnum < MPS_MSIX_MAX; qnum++) {
+		if ((q = sc->queues[qnum]) == NULL || q->owner == td)
+			continue;
+		while (!atomic_cmpset_acq_ptr(&q->owner, 0, td))
+			cpu_spinwait();
+		sc->poll_held |= 1 << qnum;
+	}
+	mps_lock(sc);
+}
+
+/*
+ * Give the queues held by mps_poll_hold() back once the reset has rebuilt
+ * them.  The number of queues may have changed, so pollers left on queues
+ * that are no longer in use are turned off.
+ */
+static void
+mps_poll_release(struct mps_softc *sc)
+{
+	struct mps_queue *q;
+	int qnum;
+
+	sc->poll_queues &= (1 << sc->numqueues) - 1;
+	for (qnum = 0; qnum < MPS_MSIX_MAX; qnum++) {
+		if ((q = sc->queues[qnum]) == NULL)
+			continue;
+		if ((sc->poll_held & (1 << qnum)) != 0)
+			atomic_store_rel_ptr(&q->owner, 0);
+		if ((sc->poll_queues & (1 << qnum)) == 0) {
+			mtx_lock(&q->poll_mtx);
+			q->poll_state = MPS_POLL_OFF;
+			mtx_unlock(&q->poll_mtx);
+		}
+	}
+	sc->poll_held = 0;
+}
+
+/*
+ * Terminate all poller threads and return the queues to interrupt mode.
+ * Must be called without the driver lock held.
+ */
+void
+mps_poll_stop(struct mps_softc *sc)
+{
+	struct mps_queue *q;
+	int qnum;
+
+	sx_xlock(&mps_poll_sx);
+	for (qnum = 0; qnum < MPS_MSIX_MAX; qnum++) {
+		if ((q = sc->queues[qnum]) == NULL)
+			continue;
+
+		mtx_lock(&q->poll_mtx);
+		if (q->poll_td != NULL) {
+			q->poll_state = MPS_POLL_EXIT;
+			wakeup(&q->poll_state);
+			while (q->poll_td != NULL)
+				msleep(&q->poll_td, &q->poll_mtx, PRIBIO,
+				    "mpspstop", 0);
+		}
+		q->poll_state = MPS_POLL_OFF;
+		mtx_unlock(&q->poll_mtx);
+	}
+	sx_xunlock(&mps_poll_sx);
+	mps_intr_all_queues(sc);
+}
+
 int
 mps_attach(struct mps_softc *sc)
 {
@@ -1802,6 +2285,9 @@ mps_attach(struct mps_softc *sc)
 	mtx_init(&sc->mps_mtx, sc->mps_mtxname, NULL, MTX_DEF);
 	mtx_init(&sc->hw_mtx, sc->hw_mtxname, NULL, MTX_SPIN);
 	callout_init_mtx(&sc->periodic, &sc->mps_mtx, 0);
+	TIMEOUT_TASK_INIT(taskqueue_thread, &sc->dpm_flush_task, 0,
+	    mps_mapping_dpm_flush_task, sc);
+	mps_config_cache_init(sc);
 	TAILQ_INIT(&sc->event_list);
 	timevalclear(&sc->lastfail);
 
@@ -1858,6 +2344,10 @@ mps_attach(struct mps_softc *sc)
 
 	mps_setup_sysctl(sc);
 
+	sc->poll_queues &= (1 << sc->numqueues) - 1;
+	if (sc->poll_queues != 0)
+		mps_poll_start(sc);
+
 	sc->mps_flags |= MPS_FLAGS_ATTACH_DONE;
 
 	return (error);
@@ -1966,6 +2456,8 @@ mps_free(struct mps_softc *sc)
 	mps_unlock(sc);
 	/* Lock must not be held for this */
 	callout_drain(&sc->periodic);
+	mps_mapping_dpm_drain(sc);
+	mps_poll_stop(sc);
 
 	if (((error = mps_detach_log(sc)) != 0) ||
 	    ((error = mps_detach_sas(sc)) != 0))
@@ -1997,6 +2489,7 @@ mps_free(struct mps_softc *sc)
 	if (sc->shutdown_eh != NULL)
 		EVENTHANDLER_DEREGISTER(shutdown_final, sc->shutdown_eh);
 
+	mps_config_cache_fini(sc);
 	mtx_destroy(&sc->mps_mtx);
 
 	return (0);
@@ -2130,22 +2623,81 @@ mps_intr_all_queues(struct mps_softc *sc)
 }
 
 /*
- * The locking is overly broad and simplistic, but easy to deal with for now.
+ * Returns non-zero if the firmware has posted a reply descriptor at the
+ * current reply post index that hasn't been consumed yet.
+ */
+static __inline int
+mps_queue_pending(struct mps_queue *q)
+{
+	MPI2_REPLY_DESCRIPTORS_UNION *desc;
+	uint8_t flags;
+
+	desc = &q->post_queue[q->replypostindex];
+	flags = desc->Default.ReplyFlags & MPI2_RPY_DESCRIPT_FLAGS_TYPE_MASK;
+	if ((flags == MPI2_RPY_DESCRIPT_FLAGS_UNUSED)
+	 || (le32toh(desc->Words.High) == 0xffffffff))
+		return (0);
+	return (1);
+}
+
+/*
+ * Interrupt entry point for a reply queue.  While the queue's poller is
+ * spinning it owns the post queue, so the interrupt returns without
+ * touching it; the poller drains the queue once more after it stops
+ * spinning.  Otherwise drain the queue and, if the queue is set up for
+ * polling, hand it to the poller for the completions that are likely to
+ * follow.
  */
 void
 mps_intr_queue(void *data)
+{
+	struct mps_queue *q;
+
+	q = (struct mps_queue *)data;
+	if (q->poll_state == MPS_POLL_ACTIVE)
+		return;
+
+	mps_process_queue(q);
+
+	if (q->poll_state == MPS_POLL_IDLE) {
+		mtx_lock(&q->poll_mtx);
+		if (q->poll_state == MPS_POLL_IDLE) {
+			q->poll_state = MPS_POLL_ACTIVE;
+			wakeup(&q->poll_state);
+		}
+		mtx_unlock(&q->poll_mtx);
+	}
+}
+
+/*
+ * Drain the reply post queue.  Only one thread at a time may walk the
+ * queue; the interrupt handler, the poller and the driver's own polled
+ * waits all come through here, so ownership is claimed with an atomic
+ * swap of the owning thread.  A thread that already owns the queue (a
+ * completion handler waiting on a polled command) may re-enter.  Returns
+ * the number of descriptors that were processed.
+ */
+static int
+mps_process_queue(struct mps_queue *q)
 {
 	MPI2_REPLY_DESCRIPTORS_UNION *desc;
 	MPI2_DIAG_RELEASE_REPLY *rel_rep;
 	mps_fw_diagnostic_buffer_t *pBuffer;
 	struct mps_softc *sc;
-	struct mps_queue *q;
 	struct mps_command *cm = NULL;
+	uintptr_t td;
 	uint8_t flags;
 	u_int pq;
+	int count, recursed;
 
-	q = (struct mps_queue *)data;
 	sc = q->sc;
+	td = (uintptr_t)curthread;
+	count = 0;
+	recursed = (q->owner == td);
+
+again:
+	if (!recursed && !atomic_cmpset_acq_ptr(&q->owner, 0, td))
+		return (count);
 
 	pq = q->replypostindex;
 	mps_dprint(sc, MPS_TRACE, "%s q %d starting with replypostindex %u\n",
@@ -2172,6 +2724,7 @@ mps_intr_queue(void *data)
 		 */
 		if (++q->replypostindex >= sc->pqdepth)
 			q->replypostindex = 0;
+		count++;
 
 		switch (flags) {
 		case MPI2_RPY_DESCRIPT_FLAGS_SCSI_IO_SUCCESS:
@@ -2282,7 +2835,18 @@ mps_intr_queue(void *data)
 		mps_regwrite(sc, MPI2_REPLY_POST_HOST_INDEX_OFFSET, q->replypostindex | (q->qnum << 24));
 	}
 
-	return;
+	if (recursed)
+		return (count);
+	atomic_store_rel_ptr(&q->owner, 0);
+
+	/*
+	 * Another thread that found the queue owned by us returned without
+	 * draining it, so look again now that it's released.
+	 */
+	if (mps_queue_pending(q))
+		goto again;
+
+	return (count);
 }
 
 static void
@@ -2480,7 +3044,10 @@ mps_add_chain(struct mps_command *cm)
 	if (cm->cm_sglsize < MPS_SGC_SIZE)
 		panic("MPS: Need SGE Error Code\n");
 
-	chain = mps_alloc_chain(cm->cm_q);
+	if ((chain = STAILQ_FIRST(&cm->cm_chain_resv)) != NULL)
+		STAILQ_REMOVE_HEAD(&cm->cm_chain_resv, chain_slink);
+	else
+		chain = mps_alloc_chain(cm->cm_q);
 	if (chain == NULL)
 		return (ENOBUFS);
 
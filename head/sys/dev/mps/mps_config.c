@@ -58,6 +58,441 @@ __FBSDID("$FreeBSD$");
 #include <dev/mps/mps_ioctl.h>
 #include <dev/mps/mpsvar.h>
 
+struct mps_config_async {
+	struct mps_config_params	params;
+	mps_config_async_cb_t		*cb;
+	void				*cbarg;
+	void				*buf;
+	u_int				length;
+	void				*page;
+	u_int				page_length;
+	int				pclass;
+	u_int				seq;
+	uint8_t				page_type;
+	uint8_t				ext_page_type;
+	uint8_t				page_number;
+	uint32_t			page_address;
+};
+
+static void mps_config_async_header_done(struct mps_softc *,
+    struct mps_config_params *);
+static void mps_config_async_page_done(struct mps_softc *,
+    struct mps_config_params *);
+
+static __inline u_int
+mps_config_cache_hash(u_int page_type, u_int ext_page_type, u_int page_number,
+    uint32_t page_address)
+{
+
+	return ((page_type ^ (ext_page_type << 1) ^ (page_number << 3) ^
+	    page_address ^ (page_address >> 16)) & (MPS_CFG_CACHE_BUCKETS - 1));
+}
+
+/*
+ * Only pages that change solely through events we see are cached.
+ */
+static int
+mps_config_cache_class(u_int page_type, u_int ext_page_type,
+    uint32_t page_address)
+{
+
+	switch (page_type) {
+	case MPI2_CONFIG_PAGETYPE_IOC:
+	case MPI2_CONFIG_PAGETYPE_MANUFACTURING:
+	case MPI2_CONFIG_PAGETYPE_BIOS:
+		return (MPS_CFG_CLASS_IOC);
+	case MPI2_CONFIG_PAGETYPE_EXTENDED:
+		if (ext_page_type == MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE &&
+		    (page_address & MPI2_SAS_DEVICE_PGAD_FORM_MASK) ==
+		    MPI2_SAS_DEVICE_PGAD_FORM_HANDLE)
+			return (MPS_CFG_CLASS_DEVICE);
+		break;
+	}
+	return (-1);
+}
+
+static __inline int
+mps_config_cache_valid(struct mps_softc *sc, struct mps_cfg_cache_entry *e)
+{
+
+	return (e->stale == 0 && e->gen == sc->cfg_cache_gen[e->pclass]);
+}
+
+/*
+ * Sample the class sequence before a page is fetched.  Any invalidation in
+ * the class while the request is in flight makes the insert a no-op.
+ */
+static __inline u_int
+mps_config_cache_seq(struct mps_softc *sc, int pclass)
+{
+
+	if (pclass < 0)
+		return (0);
+	return (atomic_load_acq_int(&sc->cfg_cache_seq[pclass]));
+}
+
+static int
+mps_config_cache_lookup(struct mps_softc *sc, u_int page_type,
+    u_int ext_page_type, u_int page_number, uint32_t page_address,
+    Mpi2ConfigReply_t *mpi_reply, void *buf, u_int length)
+{
+	struct rm_priotracker tracker;
+	struct mps_cfg_cache_entry *e;
+	u_int h;
+
+	if (sc->cfg_cache_enable == 0 || mps_config_cache_class(page_type,
+	    ext_page_type, page_address) < 0)
+		return (ENOENT);
+
+	h = mps_config_cache_hash(page_type, ext_page_type, page_number,
+	    page_address);
+	rm_rlock(&sc->cfg_cache_lock, &tracker);
+	LIST_FOREACH(e, &sc->cfg_cache[h], link) {
+		if (e->page_type != page_type ||
+		    e->ext_page_type != ext_page_type ||
+		    e->page_number != page_number ||
+		    e->page_address != page_address ||
+		    !mps_config_cache_valid(sc, e))
+			continue;
+		if (mpi_reply != NULL)
+			bcopy(&e->reply, mpi_reply, sizeof(*mpi_reply));
+		bcopy(e->data, buf, MIN(length, e->length));
+		rm_runlock(&sc->cfg_cache_lock, &tracker);
+		atomic_add_long(&sc->cfg_cache_hits, 1);
+		return (0);
+	}
+	rm_runlock(&sc->cfg_cache_lock, &tracker);
+	atomic_add_long(&sc->cfg_cache_misses, 1);
+	return (ENOENT);
+}
+
+static void
+mps_config_cache_reap(struct mps_softc *sc)
+{
+	struct mps_cfg_cache_entry *e, *tmp;
+	u_int h;
+
+	rm_assert(&sc->cfg_cache_lock, RA_WLOCKED);
+	for (h = 0; h < MPS_CFG_CACHE_BUCKETS; h++) {
+		LIST_FOREACH_SAFE(e, &sc->cfg_cache[h], link, tmp) {
+			if (mps_config_cache_valid(sc, e))
+				continue;
+			LIST_REMOVE(e, link);
+			free(e, M_MPT2);
+			sc->cfg_cache_entries--;
+		}
+	}
+}
+
+static void
+mps_config_cache_insert(struct mps_softc *sc, u_int seq, u_int page_type,
+    u_int ext_page_type, u_int page_number, uint32_t page_address,
+    Mpi2ConfigReply_t *mpi_reply, void *buf, u_int length)
+{
+	struct mps_cfg_cache_entry *e, *old, *tmp;
+	int pclass;
+	u_int h;
+
+	pclass = mps_config_cache_class(page_type, ext_page_type,
+	    page_address);
+	if (sc->cfg_cache_enable == 0 || pclass < 0)
+		return;
+
+	e = malloc(sizeof(*e) + length, M_MPT2, M_ZERO | M_NOWAIT);
+	if (e == NULL)
+		return;
+	e->pclass = pclass;
+	e->page_type = page_type;
+	e->ext_page_type = ext_page_type;
+	e->page_number = page_number;
+	e->page_address = page_address;
+	bcopy(mpi_reply, &e->reply, sizeof(e->reply));
+	e->length = length;
+	bcopy(buf, e->data, length);
+
+	h = mps_config_cache_hash(page_type, ext_page_type, page_number,
+	    page_address);
+	rm_wlock(&sc->cfg_cache_lock);
+	/*
+	 * Read the generation before checking the sequence; invalidation
+	 * bumps them in the opposite order, so a racing invalidation either
+	 * fails the check or leaves us with the old generation.
+	 */
+	e->gen = atomic_load_acq_int(&sc->cfg_cache_gen[pclass]);
+	if (atomic_load_acq_int(&sc->cfg_cache_seq[pclass]) != seq) {
+		rm_wunlock(&sc->cfg_cache_lock);
+		free(e, M_MPT2);
+		return;
+	}
+	LIST_FOREACH_SAFE(old, &sc->cfg_cache[h], link, tmp) {
+		/* Drop dead entries and any older copy of this page. */
+		if (mps_config_cache_valid(sc, old) &&
+		    (old->page_type != page_type ||
+		    old->ext_page_type != ext_page_type ||
+		    old->page_number != page_number ||
+		    old->page_address != page_address))
+			continue;
+		LIST_REMOVE(old, link);
+		free(old, M_MPT2);
+		sc->cfg_cache_entries--;
+	}
+	if (sc->cfg_cache_entries >= MPS_CFG_CACHE_MAX)
+		mps_config_cache_reap(sc);
+	if (sc->cfg_cache_entries >= MPS_CFG_CACHE_MAX) {
+		rm_wunlock(&sc->cfg_cache_lock);
+		free(e, M_MPT2);
+		return;
+	}
+	LIST_INSERT_HEAD(&sc->cfg_cache[h], e, link);
+	sc->cfg_cache_entries++;
+	rm_wunlock(&sc->cfg_cache_lock);
+}
+
+/**
+ * mps_config_cache_invalidate - retire every cached page in a class
+ * @sc: per adapter object
+ * @pclass: MPS_CFG_CLASS_* or MPS_CFG_CLASS_ALL
+ * Context: any, no locks taken.
+ */
+void
+mps_config_cache_invalidate(struct mps_softc *sc, int pclass)
+{
+	int i;
+
+	for (i = 0; i < MPS_CFG_CLASS_MAX; i++) {
+		if (pclass != MPS_CFG_CLASS_ALL && pclass != i)
+			continue;
+		atomic_add_rel_int(&sc->cfg_cache_seq[i], 1);
+		atomic_add_rel_int(&sc->cfg_cache_gen[i], 1);
+	}
+}
+
+/**
+ * mps_config_cache_invalidate_device - retire the cached SAS Device Page 0
+ *   for one device handle
+ * @sc: per adapter object
+ * @handle: device handle
+ * Context: any.
+ */
+void
+mps_config_cache_invalidate_device(struct mps_softc *sc, u16 handle)
+{
+	struct rm_priotracker tracker;
+	struct mps_cfg_cache_entry *e;
+	uint32_t page_address;
+	u_int h;
+
+	atomic_add_rel_int(&sc->cfg_cache_seq[MPS_CFG_CLASS_DEVICE], 1);
+
+	page_address = MPI2_SAS_DEVICE_PGAD_FORM_HANDLE | handle;
+	h = mps_config_cache_hash(MPI2_CONFIG_PAGETYPE_EXTENDED,
+	    MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE, 0, page_address);
+	rm_rlock(&sc->cfg_cache_lock, &tracker);
+	LIST_FOREACH(e, &sc->cfg_cache[h], link) {
+		if (e->page_type == MPI2_CONFIG_PAGETYPE_EXTENDED &&
+		    e->ext_page_type == MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE &&
+		    e->page_address == page_address)
+			atomic_store_rel_int(&e->stale, 1);
+	}
+	rm_runlock(&sc->cfg_cache_lock, &tracker);
+}
+
+void
+mps_config_cache_init(struct mps_softc *sc)
+{
+	u_int h;
+
+	rm_init(&sc->cfg_cache_lock, "mps config cache");
+	for (h = 0; h < MPS_CFG_CACHE_BUCKETS; h++)
+		LIST_INIT(&sc->cfg_cache[h]);
+	sc->cfg_cache_entries = 0;
+}
+
+void
+mps_config_cache_fini(struct mps_softc *sc)
+{
+	struct mps_cfg_cache_entry *e;
+	u_int h;
+
+	rm_wlock(&sc->cfg_cache_lock);
+	for (h = 0; h < MPS_CFG_CACHE_BUCKETS; h++) {
+		while ((e = LIST_FIRST(&sc->cfg_cache[h])) != NULL) {
+			LIST_REMOVE(e, link);
+			free(e, M_MPT2);
+		}
+	}
+	sc->cfg_cache_entries = 0;
+	rm_wunlock(&sc->cfg_cache_lock);
+	rm_destroy(&sc->cfg_cache_lock);
+}
+
+static void
+mps_config_async_done(struct mps_softc *sc, struct mps_config_async *ca,
+    int error)
+{
+
+	ca->cb(sc, ca->cbarg, error);
+	free(ca->page, M_MPT2);
+	free(ca, M_MPT2);
+}
+
+/**
+ * mps_config_get_page_async - read a config page without sleeping
+ * @sc: per adapter object
+ * @page_type: MPI2_CONFIG_PAGETYPE_*
+ * @ext_page_type: MPI2_CONFIG_EXTPAGETYPE_* for extended pages, else 0
+ * @page_number: page number
+ * @page_address: form and handle value used to get page
+ * @buf: where to copy the page
+ * @length: size of buf
+ * @cb: called with the result once buf has been filled in
+ * @cbarg: argument for cb
+ * Context: any, mps lock held.
+ *
+ * Cached pages are copied out and cb is called before returning.  Otherwise
+ * the header and page requests are chained off each other's completions and
+ * cb runs from the interrupt path.  The page is added to the cache when it is
+ * of a cacheable type.
+ *
+ * Returns 0 if cb has been or will be called, non-zero for failure.
+ */
+int
+mps_config_get_page_async(struct mps_softc *sc, u_int page_type,
+    u_int ext_page_type, u_int page_number, u_int page_address, void *buf,
+    u_int length, mps_config_async_cb_t *cb, void *cbarg)
+{
+	struct mps_config_async *ca;
+	struct mps_config_params *params;
+	int error;
+
+	mps_dprint(sc, MPS_TRACE, "%s\n", __func__);
+
+	if (mps_config_cache_lookup(sc, page_type, ext_page_type, page_number,
+	    page_address, NULL, buf, length) == 0) {
+		cb(sc, cbarg, 0);
+		return (0);
+	}
+
+	ca = malloc(sizeof(*ca), M_MPT2, M_ZERO | M_NOWAIT);
+	if (ca == NULL)
+		return (ENOMEM);
+	ca->cb = cb;
+	ca->cbarg = cbarg;
+	ca->buf = buf;
+	ca->length = length;
+	ca->page_type = page_type;
+	ca->ext_page_type = ext_page_type;
+	ca->page_number = page_number;
+	ca->page_address = page_address;
+	ca->pclass = mps_config_cache_class(page_type, ext_page_type,
+	    page_address);
+	ca->seq = mps_config_cache_seq(sc, ca->pclass);
+
+	params = &ca->params;
+	if (page_type == MPI2_CONFIG_PAGETYPE_EXTENDED) {
+		params->hdr.Ext.PageType = MPI2_CONFIG_PAGETYPE_EXTENDED;
+		params->hdr.Ext.ExtPageType = ext_page_type;
+		params->hdr.Ext.PageNumber = page_number;
+	} else {
+		params->hdr.Struct.PageType = page_type;
+		params->hdr.Struct.PageNumber = page_number;
+	}
+	params->action = MPI2_CONFIG_ACTION_PAGE_HEADER;
+	params->page_address = htole32(page_address);
+	params->buffer = NULL;
+	params->length = 0;
+	params->callback = mps_config_async_header_done;
+	params->cbdata = ca;
+
+	/* EINPROGRESS means the request was queued and will complete. */
+	error = mps_read_config_page(sc, params);
+	if (error == EINPROGRESS)
+		error = 0;
+	else if (error != 0)
+		free(ca, M_MPT2);
+	return (error);
+}
+
+static void
+mps_config_async_header_done(struct mps_softc *sc,
+    struct mps_config_params *params)
+{
+	struct mps_config_async *ca;
+	int error;
+
+	ca = params->cbdata;
+	if ((le16toh(params->status) & MPI2_IOCSTATUS_MASK) !=
+	    MPI2_IOCSTATUS_SUCCESS) {
+		mps_dprint(sc, MPS_FAULT, "%s: header read with error; "
+		    "iocstatus = 0x%x\n", __func__, le16toh(params->status));
+		error = ENXIO;
+		goto out;
+	}
+
+	if (ca->page_type == MPI2_CONFIG_PAGETYPE_EXTENDED)
+		ca->page_length = le16toh(params->hdr.Ext.ExtPageLength) * 4;
+	else
+		ca->page_length = params->hdr.Struct.PageLength * 4;
+	ca->page = malloc(ca->page_length, M_MPT2, M_ZERO | M_NOWAIT);
+	if (ca->page == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	params->action = MPI2_CONFIG_ACTION_PAGE_READ_CURRENT;
+	params->buffer = ca->page;
+	params->length = ca->page_length;
+	params->callback = mps_config_async_page_done;
+	error = mps_read_config_page(sc, params);
+	if (error == 0 || error == EINPROGRESS)
+		return;
+out:
+	mps_config_async_done(sc, ca, error);
+}
+
+static void
+mps_config_async_page_done(struct mps_softc *sc,
+    struct mps_config_params *params)
+{
+	struct mps_config_async *ca;
+	Mpi2ConfigReply_t reply;
+	int error = 0;
+
+	ca = params->cbdata;
+	if ((le16toh(params->status) & MPI2_IOCSTATUS_MASK) !=
+	    MPI2_IOCSTATUS_SUCCESS) {
+		mps_dprint(sc, MPS_FAULT, "%s: page read with error; "
+		    "iocstatus = 0x%x\n", __func__, le16toh(params->status));
+		error = ENXIO;
+		goto out;
+	}
+
+	/*
+	 * The completion only hands back the header, so rebuild enough of the
+	 * reply for synchronous callers that hit this entry later.
+	 */
+	if (ca->pclass >= 0) {
+		bzero(&reply, sizeof(reply));
+		reply.Function = MPI2_FUNCTION_CONFIG;
+		reply.Action = MPI2_CONFIG_ACTION_PAGE_READ_CURRENT;
+		reply.IOCStatus = params->status;
+		if (ca->page_type == MPI2_CONFIG_PAGETYPE_EXTENDED) {
+			reply.Header.PageVersion = params->hdr.Ext.PageVersion;
+			reply.Header.PageNumber = params->hdr.Ext.PageNumber;
+			reply.Header.PageType = params->hdr.Ext.PageType;
+			reply.ExtPageLength = params->hdr.Ext.ExtPageLength;
+			reply.ExtPageType = params->hdr.Ext.ExtPageType;
+		} else
+			reply.Header = params->hdr.Struct;
+		mps_config_cache_insert(sc, ca->seq, ca->page_type,
+		    ca->ext_page_type, ca->page_number, ca->page_address,
+		    &reply, ca->page, ca->page_length);
+	}
+	bcopy(ca->page, ca->buf, MIN(ca->length, ca->page_length));
+out:
+	mps_config_async_done(sc, ca, error);
+}
+
 /**
  * mps_config_get_ioc_pg8 - obtain ioc page 8
  * @sc: per adapter object
@@ -77,9 +512,15 @@ mps_config_get_ioc_pg8(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 	MPI2_CONFIG_PAGE_IOC_8 *page = NULL;
 	int error = 0;
 	u16 ioc_status;
+	u_int seq;
 
 	mps_dprint(sc, MPS_TRACE, "%s\n", __func__);
 
+	seq = mps_config_cache_seq(sc, MPS_CFG_CLASS_IOC);
+	if (mps_config_cache_lookup(sc, MPI2_CONFIG_PAGETYPE_IOC, 0, 8, 0,
+	    mpi_reply, config_page, sizeof(*config_page)) == 0)
+		return (0);
+
 	if ((cm = mps_alloc_command(sc)) == NULL) {
 		printf("%s: command alloc failed @ line %d\n", __func__,
 		    __LINE__);
@@ -179,6 +620,8 @@ mps_config_get_ioc_pg8(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 		error = ENXIO;
 		goto out;
 	}
+	mps_config_cache_insert(sc, seq, MPI2_CONFIG_PAGETYPE_IOC, 0, 8, 0,
+	    mpi_reply, page, cm->cm_length);
 	bcopy(page, config_page, MIN(cm->cm_length, (sizeof(Mpi2IOCPage8_t))));
 
 out:
@@ -202,15 +645,26 @@ mps_config_get_man_pg10(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply)
 {
 	MPI2_CONFIG_REQUEST *request;
 	MPI2_CONFIG_REPLY *reply;
-	struct mps_command *cm;
+	struct mps_command *cm = NULL;
 	pMpi2ManufacturingPagePS_t page = NULL;
 	uint32_t *pPS_info;
 	uint8_t OEM_Value = 0;
 	int error = 0;
 	u16 ioc_status;
+	u_int seq;
 
 	mps_dprint(sc, MPS_TRACE, "%s\n", __func__);
 
+	page = malloc(MPS_MAN_PAGE10_SIZE, M_MPT2, M_ZERO | M_NOWAIT);
+	if (!page) {
+		printf("%s: page alloc failed\n", __func__);
+		return (ENOMEM);
+	}
+	seq = mps_config_cache_seq(sc, MPS_CFG_CLASS_IOC);
+	if (mps_config_cache_lookup(sc, MPI2_CONFIG_PAGETYPE_MANUFACTURING, 0,
+	    10, 0, mpi_reply, page, MPS_MAN_PAGE10_SIZE) == 0)
+		goto decode;
+
 	if ((cm = mps_alloc_command(sc)) == NULL) {
 		printf("%s: command alloc failed @ line %d\n", __func__,
 		    __LINE__);
@@ -275,12 +729,6 @@ mps_config_get_man_pg10(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply)
 	cm->cm_sglsize = sizeof(MPI2_SGE_IO_UNION);
 	cm->cm_flags = MPS_CM_FLAGS_SGE_SIMPLE | MPS_CM_FLAGS_DATAIN;
 	cm->cm_desc.Default.RequestFlags = MPI2_REQ_DESCRIPT_FLAGS_DEFAULT_TYPE;
-	page = malloc(MPS_MAN_PAGE10_SIZE, M_MPT2, M_ZERO | M_NOWAIT);
-	if (!page) {
-		printf("%s: page alloc failed\n", __func__);
-		error = ENOMEM;
-		goto out;
-	}
 	cm->cm_data = page;
 
 	/*
@@ -307,7 +755,10 @@ mps_config_get_man_pg10(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply)
 		error = ENXIO;
 		goto out;
 	}
+	mps_config_cache_insert(sc, seq, MPI2_CONFIG_PAGETYPE_MANUFACTURING, 0,
+	    10, 0, mpi_reply, page, MIN(cm->cm_length, MPS_MAN_PAGE10_SIZE));
 
+decode:
 	/*
 	 * If OEM ID is unknown, fail the request.
 	 */
@@ -544,6 +995,182 @@ out:
 	}
 }
 
+/**
+ * mps_mirror_invalidate - stop issuing direct reads to IR mirror members.
+ *    Called from event context as soon as the IR configuration may have
+ *    changed, before the new configuration has been read.
+ * @sc: per adapter object
+ *
+ * Return nothing.
+ */
+void
+mps_mirror_invalidate(struct mps_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < MPS_MAX_MIRROR_VOLS; i++)
+		atomic_store_rel_int(&sc->DD_mirror[i].valid, 0);
+}
+
+/**
+ * mps_mirror_config_pages - build the member map used for direct reads to
+ *    IR RAID1 and RAID10 volumes.  Only optimal volumes whose members are
+ *    all online are mapped; anything else keeps going through the IR
+ *    firmware.  This needs to be called after discovery is complete and
+ *    again whenever the IR configuration or volume/disk state changes.
+ * @sc: per adapter object
+ *
+ * Return nothing.
+ */
+void
+mps_mirror_config_pages(struct mps_softc *sc)
+{
+	Mpi2ConfigReply_t	mpi_reply;
+	pMpi2RaidVolPage0_t	raid_vol_pg0 = NULL;
+	Mpi2RaidPhysDiskPage0_t	phys_disk_pg0;
+	pMpi2RaidVol0PhysDisk_t	pRVPD;
+	struct mps_mirror_vol	*vol;
+	uint32_t		stripe_size;
+	uint16_t		block_size, handle;
+	uint8_t			index, map, stripe_exp, block_exp;
+	u_int			filled;
+	int			nvol;
+
+	mps_mirror_invalidate(sc);
+	sc->DD_num_mirrors = 0;
+	if (!sc->ir_firmware || sc->WD_available || !sc->DD_mirror_enable)
+		return;
+
+	raid_vol_pg0 = malloc(sizeof(Mpi2RaidVolPage0_t) +
+	    (sizeof(Mpi2RaidVol0PhysDisk_t) * MPS_MAX_DISKS_IN_VOL),
+	    M_MPT2, M_ZERO | M_NOWAIT);
+	if (!raid_vol_pg0) {
+		printf("%s: page alloc failed\n", __func__);
+		return;
+	}
+
+	/*
+	 * Walk all volumes using GET_NEXT_HANDLE, starting from 0xFFFF.
+	 */
+	nvol = 0;
+	handle = 0xFFFF;
+	while (nvol < MPS_MAX_MIRROR_VOLS) {
+		if (mps_config_get_raid_volume_pg0(sc, &mpi_reply, raid_vol_pg0,
+		    MPI2_RAID_VOLUME_PGAD_FORM_GET_NEXT_HANDLE | handle))
+			break;
+		if ((le16toh(mpi_reply.IOCStatus) & MPI2_IOCSTATUS_MASK) !=
+		    MPI2_IOCSTATUS_SUCCESS)
+			break;
+		handle = le16toh(raid_vol_pg0->DevHandle);
+
+		if (((raid_vol_pg0->VolumeType != MPI2_RAID_VOL_TYPE_RAID1) &&
+		    (raid_vol_pg0->VolumeType != MPI2_RAID_VOL_TYPE_RAID10)) ||
+		    (raid_vol_pg0->VolumeState != MPI2_RAID_VOL_STATE_OPTIMAL))
+			continue;
+		/*
+		 * While the members may differ, only the IR firmware knows
+		 * which copy is good; stay on the volume until the flags
+		 * clear and the IR Volume event brings us back here.
+		 */
+		if (le32toh(raid_vol_pg0->VolumeStatusFlags) &
+		    MPS_MIRROR_BAD_STATUS_FLAGS) {
+			mps_dprint(sc, MPS_INFO, "Volume 0x%04x status flags "
+			    "0x%08x, direct reads will not be used\n", handle,
+			    le32toh(raid_vol_pg0->VolumeStatusFlags));
+			continue;
+		}
+		if ((raid_vol_pg0->NumPhysDisks < 2) ||
+		    (raid_vol_pg0->NumPhysDisks > MPS_MAX_DISKS_IN_VOL) ||
+		    (raid_vol_pg0->NumPhysDisks & 1)) {
+			mps_dprint(sc, MPS_INFO, "Volume 0x%04x has %d disks, "
+			    "direct reads will not be used\n", handle,
+			    raid_vol_pg0->NumPhysDisks);
+			continue;
+		}
+
+		vol = &sc->DD_mirror[nvol];
+		vol->dev_handle = handle;
+		vol->volume_type = raid_vol_pg0->VolumeType;
+		vol->num_members = raid_vol_pg0->NumPhysDisks;
+		vol->max_lba = le64toh((uint64_t)raid_vol_pg0->MaxLBA.High <<
+		    32 | (uint64_t)raid_vol_pg0->MaxLBA.Low);
+		vol->stripe_size = le32toh(raid_vol_pg0->StripeSize);
+
+		/*
+		 * RAID10 is striped across mirrored pairs, so it needs power
+		 * of 2 stripe and block sizes just like WarpDrive RAID0.
+		 */
+		stripe_size = vol->stripe_size;
+		for (stripe_exp = 0; stripe_exp < 32; stripe_exp++) {
+			if (stripe_size & 1)
+				break;
+			stripe_size >>= 1;
+		}
+		block_size = le16toh(raid_vol_pg0->BlockSize);
+		for (block_exp = 0; block_exp < 16; block_exp++) {
+			if (block_size & 1)
+				break;
+			block_size >>= 1;
+		}
+		if ((block_exp == 16) || (block_size != 1) ||
+		    ((vol->volume_type == MPI2_RAID_VOL_TYPE_RAID10) &&
+		    ((stripe_exp == 32) || (stripe_size != 1)))) {
+			mps_dprint(sc, MPS_INFO, "Volume 0x%04x has unusable "
+			    "stripe or block size, direct reads will not be "
+			    "used\n", handle);
+			continue;
+		}
+		vol->stripe_exponent = stripe_exp;
+		vol->block_exponent = block_exp;
+
+		/*
+		 * Mirrored pair n is PhysDisk elements 2n and 2n + 1; a RAID1
+		 * volume is a single pair.  PhysDiskMap only flags which side
+		 * of its pair a disk is, so use it to order the pair's slots.
+		 */
+		filled = 0;
+		pRVPD = (pMpi2RaidVol0PhysDisk_t)&raid_vol_pg0->PhysDisk;
+		for (index = 0; index < vol->num_members; index++, pRVPD++) {
+			map = index & ~1;
+			if (pRVPD->PhysDiskMap & MPI2_RAIDVOL0_PHYSDISK_SECONDARY)
+				map++;
+			else if ((pRVPD->PhysDiskMap &
+			    MPI2_RAIDVOL0_PHYSDISK_PRIMARY) == 0)
+				map = index;
+			if (filled & (1 << map))
+				break;
+			filled |= 1 << map;
+			if (mps_config_get_raid_pd_pg0(sc, &mpi_reply,
+			    &phys_disk_pg0, MPI2_PHYSDISK_PGAD_FORM_PHYSDISKNUM +
+			    pRVPD->PhysDiskNum))
+				break;
+			if ((phys_disk_pg0.PhysDiskState !=
+			    MPI2_RAID_PD_STATE_ONLINE) ||
+			    (le16toh(phys_disk_pg0.DevHandle) == 0xFFFF))
+				break;
+			vol->members[map].phys_disk_num = pRVPD->PhysDiskNum;
+			vol->members[map].dev_handle =
+			    le16toh(phys_disk_pg0.DevHandle);
+		}
+		if (index != vol->num_members) {
+			mps_dprint(sc, MPS_INFO, "Volume 0x%04x member %d is not "
+			    "usable, direct reads will not be used\n", handle,
+			    index);
+			continue;
+		}
+
+		mps_dprint(sc, MPS_INFO, "Direct reads enabled for RAID%s "
+		    "volume 0x%04x with %d disks\n",
+		    (vol->volume_type == MPI2_RAID_VOL_TYPE_RAID1) ? "1" : "10",
+		    handle, vol->num_members);
+		atomic_store_rel_int(&vol->valid, 1);
+		nvol++;
+	}
+	sc->DD_num_mirrors = nvol;
+
+	free(raid_vol_pg0, M_MPT2);
+}
+
 /**
  * mps_config_get_dpm_pg0 - obtain driver persistent mapping page0
  * @sc: per adapter object
@@ -694,10 +1321,33 @@ out:
 int mps_config_set_dpm_pg0(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
     Mpi2DriverMappingPage0_t *config_page, u16 entry_idx)
 {
+
+	return (mps_config_set_dpm_pg0_range(sc, mpi_reply, config_page,
+	    entry_idx, 1));
+}
+
+/**
+ * mps_config_set_dpm_pg0_range - write consecutive entries in driver
+ *   persistent mapping page0 with a single request
+ * @sc: per adapter object
+ * @mpi_reply: reply mf payload returned from firmware
+ * @config_page: page header followed by @count entries
+ * @entry_idx: first entry index in DPM Page0 to be modified
+ * @count: number of entries
+ * Context: sleep.
+ *
+ * Returns 0 for success, non-zero for failure.
+ */
+int
+mps_config_set_dpm_pg0_range(struct mps_softc *sc, Mpi2ConfigReply_t
+    *mpi_reply, Mpi2DriverMappingPage0_t *config_page, u16 entry_idx,
+    u16 count)
+{
 	MPI2_CONFIG_REQUEST *request;
 	MPI2_CONFIG_REPLY *reply;
 	struct mps_command *cm;
 	MPI2_CONFIG_PAGE_DRIVER_MAPPING_0 *page = NULL;	
+	size_t len;
 	int error = 0;
 	u16 ioc_status;
 
@@ -718,8 +1368,8 @@ int mps_config_set_dpm_pg0(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 	request->Header.PageNumber = 0;
 	request->Header.PageVersion = MPI2_DRIVERMAPPING0_PAGEVERSION;
 	/* We can remove below two lines ????*/
-	request->PageAddress = 1 << MPI2_DPM_PGAD_ENTRY_COUNT_SHIFT;
-	request->PageAddress |= htole16(entry_idx);
+	request->PageAddress = htole32(MPI2_DPM_PGAD_FORM_ENTRY_RANGE |
+	    (count << MPI2_DPM_PGAD_ENTRY_COUNT_SHIFT) | entry_idx);
 	cm->cm_desc.Default.RequestFlags = MPI2_REQ_DESCRIPT_FLAGS_DEFAULT_TYPE;
 	cm->cm_data = NULL;
 	error = mps_wait_command(sc, cm, 60, CAN_SLEEP);
@@ -768,8 +1418,8 @@ int mps_config_set_dpm_pg0(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 	request->Header.PageNumber = 0;
 	request->Header.PageVersion = MPI2_DRIVERMAPPING0_PAGEVERSION;
 	request->ExtPageLength = mpi_reply->ExtPageLength;
-	request->PageAddress = 1 << MPI2_DPM_PGAD_ENTRY_COUNT_SHIFT;
-	request->PageAddress |= htole16(entry_idx);
+	request->PageAddress = htole32(MPI2_DPM_PGAD_FORM_ENTRY_RANGE |
+	    (count << MPI2_DPM_PGAD_ENTRY_COUNT_SHIFT) | entry_idx);
 	cm->cm_length = le16toh(mpi_reply->ExtPageLength) * 4;
 	cm->cm_sge = &request->PageBufferSGE;
 	cm->cm_sglsize = sizeof(MPI2_SGE_IO_UNION);
@@ -781,8 +1431,9 @@ int mps_config_set_dpm_pg0(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 		error = ENOMEM;
 		goto out;
 	}
-	bcopy(config_page, page, MIN(cm->cm_length, 
-	    (sizeof(Mpi2DriverMappingPage0_t))));
+	len = sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER) +
+	    count * sizeof(MPI2_CONFIG_PAGE_DRIVER_MAP0_ENTRY);
+	bcopy(config_page, page, MIN(cm->cm_length, len));
 	cm->cm_data = page;
 	error = mps_wait_command(sc, cm, 60, CAN_SLEEP);
 	reply = (MPI2_CONFIG_REPLY *)cm->cm_reply;
@@ -838,9 +1489,17 @@ mps_config_get_sas_device_pg0(struct mps_softc *sc, Mpi2ConfigReply_t
 	Mpi2SasDevicePage0_t *page = NULL;
 	int error = 0;
 	u16 ioc_status;
+	u_int seq;
 
 	mps_dprint(sc, MPS_TRACE, "%s\n", __func__);
 
+	/* Only the handle form is cached; GET_NEXT walks see fresh data. */
+	seq = mps_config_cache_seq(sc, MPS_CFG_CLASS_DEVICE);
+	if (mps_config_cache_lookup(sc, MPI2_CONFIG_PAGETYPE_EXTENDED,
+	    MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE, 0, form | handle, mpi_reply,
+	    config_page, sizeof(*config_page)) == 0)
+		return (0);
+
 	if ((cm = mps_alloc_command(sc)) == NULL) {
 		printf("%s: command alloc failed @ line %d\n", __func__,
 		    __LINE__);
@@ -943,6 +1602,9 @@ mps_config_get_sas_device_pg0(struct mps_softc *sc, Mpi2ConfigReply_t
 		error = ENXIO;
 		goto out;
 	}
+	mps_config_cache_insert(sc, seq, MPI2_CONFIG_PAGETYPE_EXTENDED,
+	    MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE, 0, form | handle, mpi_reply,
+	    page, cm->cm_length);
 	bcopy(page, config_page, MIN(cm->cm_length, 
 	    sizeof(Mpi2SasDevicePage0_t)));
 out:
@@ -971,9 +1633,15 @@ mps_config_get_bios_pg3(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 	Mpi2BiosPage3_t *page = NULL;
 	int error = 0;
 	u16 ioc_status;
+	u_int seq;
 
 	mps_dprint(sc, MPS_TRACE, "%s\n", __func__);
 
+	seq = mps_config_cache_seq(sc, MPS_CFG_CLASS_IOC);
+	if (mps_config_cache_lookup(sc, MPI2_CONFIG_PAGETYPE_BIOS, 0, 3, 0,
+	    mpi_reply, config_page, sizeof(*config_page)) == 0)
+		return (0);
+
 	if ((cm = mps_alloc_command(sc)) == NULL) {
 		printf("%s: command alloc failed @ line %d\n", __func__,
 		    __LINE__);
@@ -1073,6 +1741,8 @@ mps_config_get_bios_pg3(struct mps_softc *sc, Mpi2ConfigReply_t *mpi_reply,
 		error = ENXIO;
 		goto out;
 	}
+	mps_config_cache_insert(sc, seq, MPI2_CONFIG_PAGETYPE_BIOS, 0, 3, 0,
+	    mpi_reply, page, cm->cm_length);
 	bcopy(page, config_page, MIN(cm->cm_length, sizeof(Mpi2BiosPage3_t)));
 out:
 	free(page, M_MPT2);
@@ -35,6 +35,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/param.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/rmlock.h>
 #include <sys/systm.h>
 #include <sys/kernel.h>
 #include <sys/malloc.h>
@@ -101,6 +102,23 @@ _mapping_clear_enc_entry(struct enc_mapping_table *enc_entry)
 	enc_entry->init_complete = 0;
 }
 
+/**
+ * _mapping_dirty_dpm_entry - mark a DPM entry for writeback
+ * @sc: per adapter object
+ * @dpm_idx: entry index
+ *
+ * Returns nothing.
+ */
+static void
+_mapping_dirty_dpm_entry(struct mps_softc *sc, u16 dpm_idx)
+{
+
+	sc->dpm_flush_marks++;
+	sc->dpm_flush_entry[dpm_idx] = 1;
+	if (sc->dpm_dirty_time == 0)
+		sc->dpm_dirty_time = sbinuptime();
+}
+
 /**
  * _mapping_commit_enc_entry - write a particular enc entry in DPM page0.
  * @sc: per adapter object
@@ -629,7 +647,7 @@ _mapping_update_ir_missing_cnt(struct mps_softc *sc, u32 map_idx,
 		dpm_entry->MappingInformation = mt_entry->missing_count;
 		dpm_entry->PhysicalBitsMapping = 0;
 		dpm_entry->Reserved1 = 0;
-		sc->dpm_flush_entry[dpm_idx] = 1;
+		_mapping_dirty_dpm_entry(sc, dpm_idx);
 		sc->dpm_entry_used[dpm_idx] = 1;
 	} else if (dpm_idx == MPS_DPM_BAD_IDX) {
 		printf("%s: no space to add entry in DPM table\n", __func__);
@@ -730,7 +748,7 @@ _mapping_update_missing_count(struct mps_softc *sc,
 			    sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER));
 			dpm_entry += mt_entry->dpm_entry_num;
 			dpm_entry->MappingInformation = mt_entry->missing_count;
-			sc->dpm_flush_entry[mt_entry->dpm_entry_num] = 1;
+			_mapping_dirty_dpm_entry(sc, mt_entry->dpm_entry_num);
 		}
 		mt_entry->init_complete = 1;
 	}
@@ -1056,8 +1074,8 @@ _mapping_clear_removed_entries(struct mps_softc *sc)
 				dpm_entry->DeviceIndex = 0;
 				dpm_entry->MappingInformation = 0;
 				dpm_entry->PhysicalBitsMapping = 0;
-				sc->dpm_flush_entry[remove_entry->
-				    dpm_entry_num] = 1;
+				_mapping_dirty_dpm_entry(sc,
+				    remove_entry->dpm_entry_num);
 				sc->dpm_entry_used[remove_entry->dpm_entry_num]
 				    = 0;
 				remove_entry->dpm_entry_num = MPS_DPM_BAD_IDX;
@@ -1208,8 +1226,7 @@ _mapping_add_new_device(struct mps_softc *sc,
 						    dpm_idx;
 		/* FIXME Do I need to set the dpm_idxin mt_entry too */
 						sc->dpm_entry_used[dpm_idx] = 1;
-						sc->dpm_flush_entry[dpm_idx] =
-						    1;
+						_mapping_dirty_dpm_entry(sc, dpm_idx);
 						phy_change->is_processed = 1;
 					} else {
 						phy_change->is_processed = 1;
@@ -1311,7 +1328,7 @@ _mapping_add_new_device(struct mps_softc *sc,
 					dpm_entry->MappingInformation = 0;
 					dpm_entry->PhysicalBitsMapping = 0;
 					sc->dpm_entry_used[dpm_idx] = 1;
-					sc->dpm_flush_entry[dpm_idx] = 1;
+					_mapping_dirty_dpm_entry(sc, dpm_idx);
 					phy_change->is_processed = 1;
 				} else if (dpm_idx == MPS_DPM_BAD_IDX) {
 						phy_change->is_processed = 1;
@@ -1333,51 +1350,227 @@ _mapping_add_new_device(struct mps_softc *sc,
 		_mapping_clear_removed_entries(sc);
 }
 
+/**
+ * _mapping_write_dpm_range - write a run of DPM entries to NVRAM
+ * @sc: per adapter object
+ * @page: staging buffer for the page header and entries
+ * @start: first entry
+ * @count: number of entries
+ *
+ * The entries are copied into the staging buffer in little endian order, so
+ * nothing in the mapping tables is referenced while the write sleeps.
+ *
+ * Returns 0 for success, non-zero for failure.
+ */
+static int
+_mapping_write_dpm_range(struct mps_softc *sc, Mpi2DriverMappingPage0_t *page,
+    u16 start, u16 count)
+{
+	Mpi2DriverMap0Entry_t *dpm_entry, *out;
+	Mpi2ConfigReply_t mpi_reply;
+	u16 i;
+
+	memcpy(&page->Header, (u8 *)sc->dpm_pg0,
+	    sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER));
+	dpm_entry = (Mpi2DriverMap0Entry_t *) ((u8 *)sc->dpm_pg0 +
+	    sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER));
+	dpm_entry += start;
+	out = &page->Entry;
+	for (i = 0; i < count; i++, dpm_entry++, out++) {
+		memcpy(out, dpm_entry, sizeof(Mpi2DriverMap0Entry_t));
+		out->MappingInformation = htole16(dpm_entry->
+		    MappingInformation);
+		out->DeviceIndex = htole16(dpm_entry->DeviceIndex);
+		out->PhysicalBitsMapping = htole32(dpm_entry->
+		    PhysicalBitsMapping);
+	}
+	sc->dpm_flush_writes++;
+	return (mps_config_set_dpm_pg0_range(sc, &mpi_reply, page, start,
+	    count));
+}
+
 /**
  * _mapping_flush_dpm_pages -Flush the DPM pages to NVRAM
  * @sc: per adapter object
  *
+ * Dirty entries are written in runs of up to dpm_flush_batch entries, one
+ * config request per run.  A few clean entries between dirty ones are
+ * written along with them rather than splitting the run.  If a batched write
+ * fails, the run is retried one entry at a time.
+ *
  * Returns nothing
  */
 static void
 _mapping_flush_dpm_pages(struct mps_softc *sc)
 {
-	Mpi2DriverMap0Entry_t *dpm_entry;
-	Mpi2ConfigReply_t mpi_reply;
-	Mpi2DriverMappingPage0_t config_page;
-	u16 entry_num;
+	Mpi2DriverMappingPage0_t *page, one;
+	u_int batch, dirty, gen;
+	u16 entry_num, start, end, last, i;
+	int error;
+	sbintime_t lat;
+
+	if (sc->dpm_flush_entry == NULL || sc->dpm_pg0 == NULL ||
+	    sc->dpm_dirty_time == 0)
+		return;
+
+	batch = MAX(1, MIN(sc->dpm_flush_batch, sc->max_dpm_entries));
+	page = malloc(sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER) +
+	    batch * sizeof(Mpi2DriverMap0Entry_t), M_MPT2, M_ZERO | M_NOWAIT);
+	if (page == NULL)
+		batch = 1;
 
+	gen = sc->dpm_gen;
 	for (entry_num = 0; entry_num < sc->max_dpm_entries; entry_num++) {
 		if (!sc->dpm_flush_entry[entry_num])
 			continue;
-		memset(&config_page, 0, sizeof(Mpi2DriverMappingPage0_t));
-		memcpy(&config_page.Header, (u8 *)sc->dpm_pg0,
-		    sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER));
-		dpm_entry = (Mpi2DriverMap0Entry_t *) ((u8 *)sc->dpm_pg0 +
-		    sizeof(MPI2_CONFIG_EXTENDED_PAGE_HEADER));
-		dpm_entry += entry_num;
-		dpm_entry->MappingInformation = htole16(dpm_entry->
-		    MappingInformation);
-		dpm_entry->DeviceIndex = htole16(dpm_entry->DeviceIndex);
-		dpm_entry->PhysicalBitsMapping = htole32(dpm_entry->
-		    PhysicalBitsMapping);
-		memcpy(&config_page.Entry, (u8 *)dpm_entry,
-		    sizeof(Mpi2DriverMap0Entry_t));
-		/* TODO-How to handle failed writes? */
-		if (mps_config_set_dpm_pg0(sc, &mpi_reply, &config_page,
-		    entry_num)) {
-			printf("%s: write of dpm entry %d for device failed\n",
-			     __func__, entry_num);
-		} else
-			sc->dpm_flush_entry[entry_num] = 0;
-		dpm_entry->MappingInformation = le16toh(dpm_entry->
-		    MappingInformation);
-		dpm_entry->DeviceIndex = le16toh(dpm_entry->DeviceIndex);
-		dpm_entry->PhysicalBitsMapping = le32toh(dpm_entry->
-		    PhysicalBitsMapping);
+
+		/* Extend the run over dirty entries and small clean gaps. */
+		start = last = entry_num;
+		for (end = start + 1; end < sc->max_dpm_entries &&
+		    end - start < batch; end++) {
+			if (sc->dpm_flush_entry[end])
+				last = end;
+			else if (end - last > MPS_DPM_FLUSH_GAP)
+				break;
+		}
+		end = last + 1;
+
+		/*
+		 * Claim the run before writing it, so entries dirtied again
+		 * while we sleep stay dirty.
+		 */
+		dirty = 0;
+		for (i = start; i < end; i++) {
+			dirty += sc->dpm_flush_entry[i];
+			sc->dpm_flush_entry[i] = 0;
+		}
+		error = ENOMEM;
+		if (page != NULL)
+			error = _mapping_write_dpm_range(sc, page, start,
+			    end - start);
+		if (gen != sc->dpm_gen)
+			break;
+		if (error == 0)
+			sc->dpm_flush_entries += dirty;
+		else {
+			/* TODO-How to handle failed writes? */
+			for (i = start; i < end; i++) {
+				error = _mapping_write_dpm_range(sc, &one, i,
+				    1);
+				if (gen != sc->dpm_gen)
+					break;
+				if (error) {
+					printf("%s: write of dpm entry %d for "
+					    "device failed\n", __func__, i);
+					sc->dpm_flush_entry[i] = 1;
+				} else
+					sc->dpm_flush_entries++;
+			}
+			if (gen != sc->dpm_gen)
+				break;
+		}
+		entry_num = end - 1;
+	}
+	free(page, M_MPT2);
+
+	/* The tables were torn down while we slept; nothing left to do. */
+	if (gen != sc->dpm_gen)
+		return;
+
+	sc->dpm_flush_runs++;
+	lat = sbinuptime() - sc->dpm_dirty_time;
+	sc->dpm_flush_lat_total_us += lat / SBT_1US;
+	sc->dpm_flush_lat_max_us = MAX(sc->dpm_flush_lat_max_us,
+	    lat / SBT_1US);
+	sc->dpm_dirty_time = 0;
+	for (entry_num = 0; entry_num < sc->max_dpm_entries; entry_num++) {
+		/* Failed writes stay dirty and age from now. */
+		if (sc->dpm_flush_entry[entry_num]) {
+			sc->dpm_dirty_time = sbinuptime();
+			break;
+		}
 	}
 }
 
+/**
+ * _mapping_schedule_dpm_flush - arrange for dirty DPM entries to be written
+ * @sc: per adapter object
+ *
+ * Event processing marks entries dirty and calls this instead of writing
+ * them itself.  The flush runs from a task at most dpm_flush_delay_ms after
+ * the first entry was dirtied, so back to back events share one flush.  A
+ * delay of 0 keeps the old behavior of flushing synchronously.
+ *
+ * Returns nothing.
+ */
+static void
+_mapping_schedule_dpm_flush(struct mps_softc *sc)
+{
+	sbintime_t due, now;
+	int ticks;
+
+	mtx_assert(&sc->mps_mtx, MA_OWNED);
+
+	if (sc->dpm_dirty_time == 0)
+		return;
+	if (sc->dpm_flush_delay_ms == 0 ||
+	    (sc->mps_flags & MPS_FLAGS_SHUTDOWN) != 0) {
+		_mapping_flush_dpm_pages(sc);
+		return;
+	}
+	if (sc->dpm_flush_pending)
+		return;
+
+	/* Count the delay from when the oldest entry was dirtied. */
+	due = sc->dpm_dirty_time + sc->dpm_flush_delay_ms * SBT_1MS;
+	now = sbinuptime();
+	ticks = 0;
+	if (due > now)
+		ticks = howmany((due - now) / SBT_1MS * hz, 1000);
+	sc->dpm_flush_pending = 1;
+	taskqueue_enqueue_timeout(taskqueue_thread, &sc->dpm_flush_task,
+	    ticks);
+}
+
+/**
+ * mps_mapping_dpm_flush_task - deferred DPM writeback
+ * @arg: per adapter object
+ * @pending: unused
+ *
+ * Returns nothing.
+ */
+void
+mps_mapping_dpm_flush_task(void *arg, int pending)
+{
+	struct mps_softc *sc;
+
+	sc = arg;
+	mps_lock(sc);
+	sc->dpm_flush_pending = 0;
+	if ((sc->mps_flags & MPS_FLAGS_DIAGRESET) == 0)
+		_mapping_flush_dpm_pages(sc);
+	mps_unlock(sc);
+}
+
+/**
+ * mps_mapping_dpm_drain - write out any deferred DPM entries
+ * @sc: per adapter object
+ *
+ * Must be called without the adapter lock held.
+ *
+ * Returns nothing.
+ */
+void
+mps_mapping_dpm_drain(struct mps_softc *sc)
+{
+
+	taskqueue_drain_timeout(taskqueue_thread, &sc->dpm_flush_task);
+	mps_lock(sc);
+	sc->dpm_flush_pending = 0;
+	_mapping_flush_dpm_pages(sc);
+	mps_unlock(sc);
+}
+
 /**
  * _mapping_allocate_memory- allocates the memory required for mapping tables
  * @sc: per adapter object
@@ -1455,6 +1648,16 @@ mps_mapping_free_memory(struct mps_softc *sc)
 	free(sc->dpm_entry_used, M_MPT2);
 	free(sc->dpm_flush_entry, M_MPT2);
 	free(sc->dpm_pg0, M_MPT2);
+
+	/* Let a flush sleeping on a config write know the tables are gone. */
+	sc->mapping_table = NULL;
+	sc->removal_table = NULL;
+	sc->enclosure_table = NULL;
+	sc->dpm_entry_used = NULL;
+	sc->dpm_flush_entry = NULL;
+	sc->dpm_pg0 = NULL;
+	sc->dpm_dirty_time = 0;
+	sc->dpm_gen++;
 }
 
 
@@ -1805,6 +2008,9 @@ void
 mps_mapping_exit(struct mps_softc *sc)
 {
 	_mapping_flush_dpm_pages(sc);
+	if (taskqueue_cancel_timeout(taskqueue_thread, &sc->dpm_flush_task,
+	    NULL) == 0)
+		sc->dpm_flush_pending = 0;
 	mps_mapping_free_memory(sc);
 }
 
@@ -1958,8 +2164,8 @@ mps_mapping_enclosure_dev_status_change_event(struct mps_softc *sc,
 						    <<= map_shift;
 						dpm_entry->PhysicalBitsMapping
 						    = et_entry->phy_bits;
-						sc->dpm_flush_entry[et_entry->
-						    dpm_entry_num] = 1;
+						_mapping_dirty_dpm_entry(sc,
+						    et_entry->dpm_entry_num);
 					}
 				}
 			}
@@ -2010,13 +2216,14 @@ mps_mapping_enclosure_dev_status_change_event(struct mps_softc *sc,
 			dpm_entry->MappingInformation <<= map_shift;
 			dpm_entry->MappingInformation |=
 			    et_entry->missing_count;
-			sc->dpm_flush_entry[et_entry->dpm_entry_num] = 1;
+			_mapping_dirty_dpm_entry(sc,
+			    et_entry->dpm_entry_num);
 		}
 		et_entry->init_complete = 1;
 	}
 
 out:
-	_mapping_flush_dpm_pages(sc);
+	_mapping_schedule_dpm_flush(sc);
 	if (sc->pending_map_events)
 		sc->pending_map_events--;
 }
@@ -2067,7 +2274,7 @@ mps_mapping_topology_change_event(struct mps_softc *sc,
 
 out:
 	free(topo_change.phy_details, M_MPT2);
-	_mapping_flush_dpm_pages(sc);
+	_mapping_schedule_dpm_flush(sc);
 	if (sc->pending_map_events)
 		sc->pending_map_events--;
 }
@@ -2260,7 +2467,7 @@ mps_mapping_ir_config_change_event(struct mps_softc *sc,
 	}
 
 out:
-	_mapping_flush_dpm_pages(sc);
+	_mapping_schedule_dpm_flush(sc);
 	free(wwid_table, M_MPT2);
 	if (sc->pending_map_events)
 		sc->pending_map_events--;
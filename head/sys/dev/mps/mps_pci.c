@@ -43,6 +43,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/rmlock.h>
 #include <sys/sysctl.h>
 #include <sys/smp.h>
+#include <sys/taskqueue.h>
 #include <sys/uio.h>
 
 #include <machine/bus.h>
@@ -300,7 +301,7 @@ mps_pci_setup_interrupts(struct mps_softc *sc)
 			return (ENXIO);
 		}
 		error = bus_setup_intr(dev, q->irq,
-		    INTR_TYPE_BIO | INTR_MPSAFE, NULL, mps_intr_legacy, sc,
+		    INTR_TYPE_BIO | INTR_MPSAFE, NULL, mps_intr_legacy, q,
 		    &q->intrhand);
 		if (error)
 			mps_printf(sc, "Cannot setup INTx interrupt\n");
@@ -320,7 +321,7 @@ mps_pci_setup_interrupts(struct mps_softc *sc)
 		}
 		error = bus_setup_intr(dev, q->irq,
 		    INTR_TYPE_BIO | INTR_MPSAFE, NULL, mps_intr_queue,
-		    sc, &q->intrhand);
+		    q, &q->intrhand);
 		if (error) {
 			mps_printf(sc, "Cannot setup MSI interrupt\n");
 			return (ENXIO);
@@ -132,6 +132,8 @@ static void mpssas_abort_complete(struct mps_softc *sc, struct mps_command *cm);
 static void mpssas_scsiio_timeout(void *data);
 static void mpssas_direct_drive_io(struct mpssas_softc *sassc,
     struct mps_command *cm, union ccb *ccb);
+static void mpssas_mirror_direct_io(struct mpssas_softc *sassc,
+    struct mps_command *cm, union ccb *ccb);
 static void mpssas_action_scsiio(struct mpssas_softc *, union ccb *);
 static void mpssas_scsiio_complete(struct mps_softc *, struct mps_command *);
 static void mpssas_action_resetdev(struct mpssas_softc *, union ccb *);
@@ -951,9 +953,10 @@ mpssas_action(struct cam_sim *sim, union ccb *ccb)
 		cpi->protocol_version = SCSI_REV_SPC;
 #if __FreeBSD_version >= 800001
 		/*
-		 * XXX KDM where does this number come from?
+		 * Sized from the IOC's SGL depth and hw.mps.max_io_pages.
+		 * Peripheral drivers still clamp this to MAXPHYS.
 		 */
-		cpi->maxio = MAXPHYS;
+		cpi->maxio = sassc->sc->maxio;
 #endif
 		mpssas_set_ccbstatus(ccb, CAM_REQ_CMP);
 		break;
@@ -1905,6 +1908,9 @@ mpssas_action_scsiio(struct mpssas_softc *sassc, union ccb *ccb)
 		} else {
 			mpssas_set_ccbstatus(ccb, CAM_REQ_INPROG);
 		}
+	} else if ((sc->DD_num_mirrors != 0) &&
+	    (ccb->ccb_h.sim_priv.entries[0].field != MPS_WD_RETRY)) {
+		mpssas_mirror_direct_io(sassc, cm, ccb);
 	}
 
 	callout_reset_sbt_on(&cm->cm_callout, SBT_1MS * ccb->ccb_h.timeout, 0,
@@ -2138,6 +2144,11 @@ mpssas_scsiio_complete(struct mps_softc *sc, struct mps_command *cm)
 	/* XXX Locking This is a race */
 	callout_stop(&cm->cm_callout);
 
+	if (cm->cm_mirror != NULL) {
+		atomic_subtract_int(&cm->cm_mirror->outstanding, 1);
+		cm->cm_mirror = NULL;
+	}
+
 	sassc = sc->sassc;
 	ccb = cm->cm_complete_data;
 	csio = &ccb->csio;
@@ -2500,6 +2511,125 @@ mpssas_scsiio_complete(struct mps_softc *sc, struct mps_command *cm)
 	xpt_done(ccb);
 }
 
+/*
+ * Direct Drive reads for IR RAID1 and RAID10 volumes.  A read that fits in
+ * one stripe is sent straight to whichever copy of the data has the fewest
+ * direct reads outstanding, skipping the IR processor.  Writes and anything
+ * else stay on the volume.  Errors are retried against the volume through
+ * the same MPS_CM_FLAGS_DD_IO path used for WarpDrive.
+ */
+static void
+mpssas_mirror_direct_io(struct mpssas_softc *sassc, struct mps_command *cm,
+    union ccb *ccb)
+{
+	pMpi2SCSIIORequest_t	pIO_req;
+	struct mps_softc	*sc = sassc->sc;
+	struct mps_mirror_vol	*vol;
+	struct mps_mirror_member *member;
+	uint64_t		virtLBA, physLBA, stripe, ncolumns;
+	uint32_t		io_size, stripe_offset, column;
+	uint16_t		handle;
+	uint8_t			*CDB;
+	int			i, lba_idx, lba_len;
+
+	pIO_req = (pMpi2SCSIIORequest_t)cm->cm_req;
+	CDB = pIO_req->CDB.CDB32;
+
+	/* The reference tags are based on the volume's LBAs. */
+	if (pIO_req->EEDPFlags != 0)
+		return;
+
+	switch (CDB[0]) {
+	case READ_6:
+		lba_idx = 1;
+		lba_len = 3;
+		break;
+	case READ_10:
+	case READ_12:
+		lba_idx = 2;
+		lba_len = 4;
+		break;
+	case READ_16:
+		lba_idx = 2;
+		lba_len = 8;
+		break;
+	default:
+		return;
+	}
+
+	handle = le16toh(pIO_req->DevHandle);
+	vol = NULL;
+	for (i = 0; i < sc->DD_num_mirrors; i++) {
+		if ((sc->DD_mirror[i].dev_handle == handle) &&
+		    atomic_load_acq_int(&sc->DD_mirror[i].valid)) {
+			vol = &sc->DD_mirror[i];
+			break;
+		}
+	}
+	if (vol == NULL)
+		return;
+
+	virtLBA = 0;
+	for (i = 0; i < lba_len; i++)
+		virtLBA = (virtLBA << 8) | CDB[lba_idx + i];
+	if (CDB[0] == READ_6)
+		virtLBA &= 0x1FFFFF;
+	io_size = cm->cm_length >> vol->block_exponent;
+	if ((io_size == 0) || ((virtLBA + io_size - 1) > vol->max_lba))
+		return;
+
+	/*
+	 * RAID1 members are identical copies.  RAID10 stripes across mirrored
+	 * pairs, so translate the LBA like RAID0 over half as many columns.
+	 */
+	if (vol->volume_type == MPI2_RAID_VOL_TYPE_RAID1) {
+		column = 0;
+		physLBA = virtLBA;
+	} else {
+		stripe_offset = (uint32_t)virtLBA & (vol->stripe_size - 1);
+		if ((stripe_offset + io_size) > vol->stripe_size)
+			return;
+		ncolumns = vol->num_members / 2;
+		stripe = virtLBA >> vol->stripe_exponent;
+		column = stripe % ncolumns;
+		physLBA = ((stripe / ncolumns) << vol->stripe_exponent) +
+		    stripe_offset;
+	}
+
+	/*
+	 * Pick the less busy side of the mirror.  On a tie alternate by
+	 * region so that sequential streams stay on one disk for a while:
+	 * bit 11 of the LBA flips every 2048 blocks (1MB with 512 byte
+	 * sectors), large enough for the disk's read-ahead to pay off and
+	 * small enough that two streams still spread over both members.
+	 */
+	member = &vol->members[column * 2];
+	if ((member[1].outstanding < member[0].outstanding) ||
+	    ((member[1].outstanding == member[0].outstanding) &&
+	    ((virtLBA >> 11) & 1)))
+		member++;
+
+	if (physLBA != virtLBA) {
+		if (CDB[0] == READ_6) {
+			CDB[1] = (CDB[1] & 0xE0) | ((physLBA >> 16) & 0x1F);
+			CDB[2] = (uint8_t)(physLBA >> 8);
+			CDB[3] = (uint8_t)physLBA;
+		} else {
+			for (i = lba_len - 1; i >= 0; i--) {
+				CDB[lba_idx + i] = (uint8_t)physLBA;
+				physLBA >>= 8;
+			}
+		}
+	}
+
+	pIO_req->DevHandle = htole16(member->dev_handle);
+	cm->cm_desc.SCSIIO.DevHandle = pIO_req->DevHandle;
+	atomic_add_int(&member->outstanding, 1);
+	cm->cm_mirror = member;
+	cm->cm_flags |= MPS_CM_FLAGS_DD_IO;
+	atomic_add_long(&sc->DD_mirror_reads, 1);
+}
+
 /* All Request reached here are Endian safe */
 static void
 mpssas_direct_drive_io(struct mpssas_softc *sassc, struct mps_command *cm,
@@ -3631,6 +3761,7 @@ mpssas_portenable_complete(struct mps_softc *sc, struct mps_command *cm)
 	 * some info and a volume's will be 0.  Use that to remove disks.
 	 */
 	mps_wd_config_pages(sc);
+	mps_mirror_config_pages(sc);
 
 	/*
 	 * Done waiting for port enable to complete.  Decrement the refcount.
@@ -118,6 +118,11 @@ static void mpssas_fw_work(struct mps_softc *sc,
     struct mps_fw_event_work *fw_event);
 static void mpssas_fw_event_free(struct mps_softc *,
     struct mps_fw_event_work *);
+static void mpssas_evt_invalidate_pages(struct mps_softc *,
+    struct mps_fw_event_work *);
+static void mpssas_evt_prefetch_pages(struct mps_softc *,
+    struct mps_fw_event_work *);
+static void mpssas_prefetch_done(struct mps_softc *, void *, int);
 static int mpssas_add_device(struct mps_softc *sc, u16 handle, u8 linkrate);
 static int mpssas_get_sata_identify(struct mps_softc *sc, u16 handle,
     Mpi2SataPassthroughReply_t *mpi_reply, char *id_buffer, int sz,
@@ -158,6 +163,19 @@ mpssas_evt_handler(struct mps_softc *sc, uintptr_t data,
 
 	bcopy(event->EventData, fw_event->event_data, sz);
 	fw_event->event = event->Event;
+
+	mpssas_evt_invalidate_pages(sc, fw_event);
+	mpssas_evt_prefetch_pages(sc, fw_event);
+
+	/*
+	 * Stop direct reads to IR mirror members right away; the map is
+	 * rebuilt once the event has been processed.
+	 */
+	if ((event->Event == MPI2_EVENT_IR_CONFIGURATION_CHANGE_LIST ||
+	    event->Event == MPI2_EVENT_IR_VOLUME ||
+	    event->Event == MPI2_EVENT_IR_PHYSICAL_DISK) &&
+	    sc->DD_num_mirrors != 0)
+		mps_mirror_invalidate(sc);
 	if ((event->Event == MPI2_EVENT_SAS_TOPOLOGY_CHANGE_LIST ||
 	    event->Event == MPI2_EVENT_SAS_ENCL_DEVICE_STATUS_CHANGE ||
 	    event->Event == MPI2_EVENT_IR_CONFIGURATION_CHANGE_LIST) &&
@@ -179,6 +197,95 @@ mpssas_evt_handler(struct mps_softc *sc, uintptr_t data,
 
 }
 
+/*
+ * Retire cached config pages that the event may have changed, before anyone
+ * gets a chance to look at them.
+ */
+static void
+mpssas_evt_invalidate_pages(struct mps_softc *sc,
+    struct mps_fw_event_work *fw_event)
+{
+
+	switch (fw_event->event) {
+	case MPI2_EVENT_SAS_TOPOLOGY_CHANGE_LIST:
+	{
+		MPI2_EVENT_DATA_SAS_TOPOLOGY_CHANGE_LIST *data;
+		int i;
+
+		data = (MPI2_EVENT_DATA_SAS_TOPOLOGY_CHANGE_LIST *)
+		    fw_event->event_data;
+		if (le16toh(data->ExpanderDevHandle) != 0)
+			mps_config_cache_invalidate_device(sc,
+			    le16toh(data->ExpanderDevHandle));
+		for (i = 0; i < data->NumEntries; i++)
+			mps_config_cache_invalidate_device(sc,
+			    le16toh(data->PHY[i].AttachedDevHandle));
+		break;
+	}
+	case MPI2_EVENT_SAS_DEVICE_STATUS_CHANGE:
+	{
+		MPI2_EVENT_DATA_SAS_DEVICE_STATUS_CHANGE *data;
+
+		data = (MPI2_EVENT_DATA_SAS_DEVICE_STATUS_CHANGE *)
+		    fw_event->event_data;
+		mps_config_cache_invalidate_device(sc,
+		    le16toh(data->DevHandle));
+		break;
+	}
+	case MPI2_EVENT_IR_CONFIGURATION_CHANGE_LIST:
+	case MPI2_EVENT_IR_PHYSICAL_DISK:
+		/* Hiding and exposing members changes their device flags. */
+		mps_config_cache_invalidate(sc, MPS_CFG_CLASS_DEVICE);
+		break;
+	}
+}
+
+/*
+ * Start reading SAS Device Page 0 for targets that were just added, so the
+ * page is already cached by the time the event taskqueue gets to
+ * mps_mapping_topology_change_event() and mpssas_add_device().  Failures are
+ * harmless; those callers fall back to a synchronous read.
+ */
+static void
+mpssas_evt_prefetch_pages(struct mps_softc *sc,
+    struct mps_fw_event_work *fw_event)
+{
+	MPI2_EVENT_DATA_SAS_TOPOLOGY_CHANGE_LIST *data;
+	MPI2_EVENT_SAS_TOPO_PHY_ENTRY *phy;
+	Mpi2SasDevicePage0_t *page;
+	int i;
+
+	if (fw_event->event != MPI2_EVENT_SAS_TOPOLOGY_CHANGE_LIST ||
+	    sc->cfg_cache_enable == 0)
+		return;
+
+	data = (MPI2_EVENT_DATA_SAS_TOPOLOGY_CHANGE_LIST *)
+	    fw_event->event_data;
+	for (i = 0; i < data->NumEntries; i++) {
+		phy = &data->PHY[i];
+		if ((phy->PhyStatus & MPI2_EVENT_SAS_TOPO_RC_MASK) !=
+		    MPI2_EVENT_SAS_TOPO_RC_TARG_ADDED)
+			continue;
+		page = malloc(sizeof(*page), M_MPT2, M_NOWAIT);
+		if (page == NULL)
+			break;
+		if (mps_config_get_page_async(sc, MPI2_CONFIG_PAGETYPE_EXTENDED,
+		    MPI2_CONFIG_EXTPAGETYPE_SAS_DEVICE, 0,
+		    MPI2_SAS_DEVICE_PGAD_FORM_HANDLE |
+		    le16toh(phy->AttachedDevHandle), page, sizeof(*page),
+		    mpssas_prefetch_done, page) != 0)
+			free(page, M_MPT2);
+	}
+}
+
+static void
+mpssas_prefetch_done(struct mps_softc *sc, void *arg, int error)
+{
+
+	/* Only the cache entry was wanted. */
+	free(arg, M_MPT2);
+}
+
 static void
 mpssas_fw_event_free(struct mps_softc *sc, struct mps_fw_event_work *fw_event)
 {
@@ -587,6 +694,13 @@ mpssas_fw_work(struct mps_softc *sc, struct mps_fw_event_work *fw_event)
 		break;
 
 	}
+
+	if ((fw_event->event == MPI2_EVENT_IR_CONFIGURATION_CHANGE_LIST ||
+	    fw_event->event == MPI2_EVENT_IR_VOLUME ||
+	    fw_event->event == MPI2_EVENT_IR_PHYSICAL_DISK) &&
+	    (sassc->flags & MPSSAS_IN_STARTUP) == 0)
+		mps_mirror_config_pages(sc);
+
 	mps_dprint(sc, MPS_EVENT, "(%d)->(%s) Event Free: [%x]\n",event_count,__func__, fw_event->event);
 	mpssas_fw_event_free(sc, fw_event);
 }
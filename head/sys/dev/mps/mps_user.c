@@ -2123,9 +2123,15 @@ mps_ioctl(struct cdev *dev, u_long cmd, void *arg, int flag,
 		if (error)
 			break;
 		error = mps_user_write_cfg_page(sc, page_req, mps_page);
+		mps_config_cache_invalidate(sc, MPS_CFG_CLASS_ALL);
 		break;
 	case MPSIO_MPS_COMMAND:
+		/*
+		 * Raw MPI commands can write config pages or flash firmware,
+		 * so don't trust any cached page afterwards.
+		 */
 		error = mps_user_command(sc, (struct mps_usr_command *)arg);
+		mps_config_cache_invalidate(sc, MPS_CFG_CLASS_ALL);
 		break;
 	case MPTIOCTL_PASS_THRU:
 		/*
@@ -2134,6 +2140,7 @@ mps_ioctl(struct cdev *dev, u_long cmd, void *arg, int flag,
 		 * this.  Only allow one passthru IOCTL at one time.
 		 */
 		error = mps_user_pass_thru(sc, (mps_pass_thru_t *)arg);
+		mps_config_cache_invalidate(sc, MPS_CFG_CLASS_ALL);
 		break;
 	case MPTIOCTL_GET_ADAPTER_DATA:
 		/*
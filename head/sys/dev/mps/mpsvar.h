@@ -44,18 +44,21 @@
 #define MPS_EVT_REPLY_FRAMES	32
 #define MPS_REPLY_FRAMES	MPS_REQ_FRAMES
 #define MPS_CHAIN_FRAMES	2048
+#define MPS_CHAIN_FRAMES_MAX	16384	/* auto-sizing cap, must be a power of 2 */
 #define MPS_SENSE_LEN		SSD_FULL_SIZE
 #define MPS_MSI_MAX		1
 #define MPS_MSIX_MAX		16
 #define MPS_SGE64_SIZE		12
 #define MPS_SGE32_SIZE		8
 #define MPS_SGC_SIZE		8
-#define MPS_CHAIN_LOWWATER	((MAXPHYS / PAGE_SIZE + 1) / 10)
+#define MPS_CHAIN_MIN_IOS	16	/* maxio commands per queue for chains */
+#define MPS_SGL_MAIN_SGES	2	/* simple SGEs that fit in a request */
 
 #define	 CAN_SLEEP			1
 #define  NO_SLEEP			0
 
 #define MPS_PERIODIC_DELAY	1	/* 1 second heartbeat/watchdog check */
+#define MPS_POLL_IDLE_US	50	/* usecs of empty polls before fallback */
 #define MPS_ATA_ID_TIMEOUT	5	/* 5 second timeout for SATA ID cmd */
 
 #define MPS_SCSI_RI_INVALID_FRAME	(0x00000002)
@@ -90,6 +93,11 @@
 #define	MPS_MAN_PAGE10_SIZE	0x5C	/* Hardcode for now */
 #define MPS_MAX_DISKS_IN_VOL	10
 
+/*
+ * Direct Drive reads for IR mirrors
+ */
+#define	MPS_MAX_MIRROR_VOLS	8
+
 /*
  * WarpDrive Event Logging
  */
@@ -189,6 +197,7 @@ struct mpssas_softc;
 union ccb;
 struct mpssas_target;
 struct mps_column_map;
+struct mps_mirror_member;
 
 MALLOC_DECLARE(M_MPT2);
 
@@ -248,7 +257,9 @@ struct mps_command {
 #define MPS_CM_STATE_BUSY_CCB		3
 	bus_dmamap_t			cm_dmamap;
 	struct scsi_sense_data		*cm_sense;
+	struct mps_mirror_member	*cm_mirror;
 	STAILQ_HEAD(, mps_chain)	cm_chain_list;
+	STAILQ_HEAD(, mps_chain)	cm_chain_resv;
 	uint32_t			cm_req_busaddr;
 	uint32_t			cm_sense_busaddr;
 	struct callout			cm_callout;
@@ -259,6 +270,44 @@ struct mps_column_map {
 	uint8_t				phys_disk_num;
 };
 
+/*
+ * A member disk of an IR RAID1/RAID10 volume.  Outstanding counts direct
+ * reads in flight to the disk and is only a load balancing hint, so it is
+ * deliberately left alone when the volume map is rebuilt.
+ */
+struct mps_mirror_member {
+	uint16_t			dev_handle;
+	uint8_t				phys_disk_num;
+	volatile int			outstanding;
+};
+
+struct mps_mirror_vol {
+	volatile int			valid;
+	uint16_t			dev_handle;
+	uint8_t				volume_type;
+	uint8_t				num_members;
+	uint32_t			stripe_size;
+	uint32_t			stripe_exponent;
+	uint16_t			block_exponent;
+	uint64_t			max_lba;
+	struct mps_mirror_member	members[MPS_MAX_DISKS_IN_VOL];
+};
+
+/*
+ * Volume status flags under which the two sides of a mirror may hold
+ * different data, or the volume must not be touched at all.
+ */
+#define MPS_MIRROR_BAD_STATUS_FLAGS				\
+	(MPI2_RAIDVOL0_STATUS_FLAG_RESYNC_IN_PROGRESS |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_PENDING_RESYNC |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_BACKGROUND_INIT |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_BACKG_INIT_PENDING |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_MAKE_DATA_CONSISTENT |	\
+	 MPI2_RAIDVOL0_STATUS_FLAG_MDC_PENDING |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_VOL_NOT_CONSISTENT |		\
+	 MPI2_RAIDVOL0_STATUS_FLAG_QUIESCED |			\
+	 MPI2_RAIDVOL0_STATUS_FLAG_VOLUME_INACTIVE)
+
 struct mps_event_handle {
 	TAILQ_ENTRY(mps_event_handle)	eh_list;
 	mps_evt_callback_t		*callback;
@@ -282,8 +331,53 @@ struct mps_queue {
 	struct resource			*irq;
 	void				*intrhand;
 	int				irq_rid;
+	volatile uintptr_t		owner;
+	struct mtx			poll_mtx;
+	struct thread			*poll_td;
+	int				poll_state;
+#define MPS_POLL_OFF		0	/* Interrupt driven */
+#define MPS_POLL_IDLE		1	/* Poller parked, interrupts on */
+#define MPS_POLL_ACTIVE		2	/* Poller spinning on post_queue */
+#define MPS_POLL_EXIT		3	/* Poller asked to terminate */
+	uint64_t			poll_hits;
+	uint64_t			poll_empty;
+	uint64_t			poll_idle_fallbacks;
+};
+
+#define MPS_DPM_FLUSH_DELAY	100	/* ms from first dirty entry to write */
+#define MPS_DPM_FLUSH_BATCH	32	/* max DPM entries per config write */
+#define MPS_DPM_FLUSH_GAP	4	/* clean entries allowed inside a run */
+
+/*
+ * Config page cache.  Entries are keyed by page type, number and address and
+ * belong to an invalidation class.  Bumping a class generation retires every
+ * entry in it without taking the lock; single pages are retired by marking
+ * them stale.  Stale entries are reclaimed on the next insert.
+ */
+#define MPS_CFG_CACHE_BUCKETS	64
+#define MPS_CFG_CACHE_MAX	1024
+
+#define MPS_CFG_CLASS_IOC	0	/* IOC, Manufacturing and BIOS pages */
+#define MPS_CFG_CLASS_DEVICE	1	/* SAS Device pages, keyed by handle */
+#define MPS_CFG_CLASS_MAX	2
+#define MPS_CFG_CLASS_ALL	(-1)
+
+struct mps_cfg_cache_entry {
+	LIST_ENTRY(mps_cfg_cache_entry)	link;
+	volatile u_int			stale;
+	u_int				gen;
+	uint8_t				pclass;
+	uint8_t				page_type;
+	uint8_t				ext_page_type;
+	uint8_t				page_number;
+	uint32_t			page_address;
+	MPI2_CONFIG_REPLY		reply;
+	u_int				length;
+	uint8_t				data[];
 };
 
+typedef void mps_config_async_cb_t(struct mps_softc *, void *, int);
+
 struct mps_softc {
 	device_t			mps_dev;
 	struct cdev			*mps_cdev;
@@ -298,6 +392,10 @@ struct mps_softc {
 	u_int				mps_debug;
 	int				tm_cmds_active;
 	int				max_chains;
+	u_int				max_io_pages;
+	u_int				maxio;
+	u_int				sges_per_chain;
+	u_int				chains_per_io;
 	u_int				enable_ssu;
 	int				spinup_wait_time;
 	struct sysctl_ctx_list		sysctl_ctx;
@@ -394,6 +492,20 @@ struct mps_softc {
 	uint8_t				mt_full_retry;
 	uint8_t				mt_add_device_failed;
 
+	/* Deferred DPM writeback */
+	struct timeout_task		dpm_flush_task;
+	int				dpm_flush_pending;
+	u_int				dpm_gen;
+	sbintime_t			dpm_dirty_time;
+	u_int				dpm_flush_delay_ms;
+	u_int				dpm_flush_batch;
+	uint64_t			dpm_flush_marks;
+	uint64_t			dpm_flush_entries;
+	uint64_t			dpm_flush_writes;
+	uint64_t			dpm_flush_runs;
+	uint64_t			dpm_flush_lat_total_us;
+	uint64_t			dpm_flush_lat_max_us;
+
 	/* FW diag Buffer List */
 	mps_fw_diagnostic_buffer_t
 				fw_diag_buffer_list[MPI2_DIAG_BUF_TYPE_COUNT];
@@ -432,6 +544,12 @@ struct mps_softc {
 	uint64_t			DD_max_lba;
 	struct mps_column_map		DD_column_map[MPS_MAX_DISKS_IN_VOL];
 
+	/* Direct Drive reads for IR RAID1/RAID10 volumes */
+	u_int				DD_mirror_enable;
+	int				DD_num_mirrors;
+	u_long				DD_mirror_reads;
+	struct mps_mirror_vol		DD_mirror[MPS_MAX_MIRROR_VOLS];
+
 	char				exclude_ids[80];
 	struct timeval			lastfail;
 
@@ -449,6 +567,21 @@ struct mps_softc {
 	u_int				max_prireqframes;
 	u_int				max_replyframes;
 	u_int				max_evtframes;
+
+	/* Busy-poll completion mode */
+	u_int				poll_queues;
+	u_int				poll_held;	/* Queues held for reset */
+	u_int				poll_idle_us;
+
+	/* Config page cache */
+	struct rmlock			cfg_cache_lock;
+	LIST_HEAD(, mps_cfg_cache_entry)	cfg_cache[MPS_CFG_CACHE_BUCKETS];
+	volatile u_int			cfg_cache_gen[MPS_CFG_CLASS_MAX];
+	volatile u_int			cfg_cache_seq[MPS_CFG_CLASS_MAX];
+	u_int				cfg_cache_entries;
+	u_int				cfg_cache_enable;
+	u_long				cfg_cache_hits;
+	u_long				cfg_cache_misses;
 };
 
 struct mps_config_params {
@@ -549,7 +682,7 @@ mps_free_reply(struct mps_softc *sc, uint32_t busaddr)
 static __inline struct mps_chain *
 mps_alloc_chain(struct mps_queue *q)
 {
-	struct mps_chain *chain;
+	struct mps_chain *chain = NULL;
 	u_int val;
 
 	/* XXX Would be nice to have ck_ring_dequeue_spmc_size() */
@@ -592,11 +725,16 @@ mps_qfree_command(struct mps_command *cm, struct mps_queue *q)
 	cm->cm_out_len = 0;
 	cm->cm_sglsize = 0;
 	cm->cm_sge = NULL;
+	cm->cm_mirror = NULL;
 
 	while ((chain = STAILQ_FIRST(&cm->cm_chain_list)) != NULL) {
 		STAILQ_REMOVE_HEAD(&cm->cm_chain_list, chain_slink);
 		mps_free_chain(q, chain);
 	}
+	while ((chain = STAILQ_FIRST(&cm->cm_chain_resv)) != NULL) {
+		STAILQ_REMOVE_HEAD(&cm->cm_chain_resv, chain_slink);
+		mps_free_chain(q, chain);
+	}
 
 	ck_ring_enqueue_spmc(&q->req_ring, q->ringmem, cm);
 }
@@ -629,6 +767,22 @@ mps_qalloc_command(struct mps_queue *q)
 	return (cm);
 }
 
+/*
+ * Number of chain frames needed to map a buffer of the given size in the
+ * worst case, where every page is its own segment and the buffer doesn't
+ * start on a page boundary.
+ */
+static __inline u_int
+mps_chains_for_size(struct mps_softc *sc, size_t size)
+{
+	u_int segs;
+
+	segs = howmany(size, PAGE_SIZE) + 1;
+	if (segs <= MPS_SGL_MAIN_SGES)
+		return (0);
+	return (howmany(segs - 1, sc->sges_per_chain));
+}
+
 /*
  * Allocs a command.  A critical section is needed if size is used.
  */
@@ -637,26 +791,41 @@ mps_alloc_command_size(struct mps_softc *sc, size_t size)
 {
 	struct mps_command *cm;
 	struct mps_queue *q;
+	struct mps_chain *chain;
+	u_int needed;
 
 	q = sc->queues[curcpu % sc->numqueues];
 	if (q == NULL)
 		return (NULL);
 
+	cm = mps_qalloc_command(q);
+	if (cm == NULL)
+		return (NULL);
+
 	/*
 	 * Most command frames can hold at least 2 SG Elements;
 	 * any buffer that is a page size or less can have as
-	 * many as two segments.
+	 * many as two segments.  Anything larger gets its worst case
+	 * number of chain frames reserved up front so that the mapping
+	 * can't run out half way through.
 	 */
 	if (size > PAGE_SIZE) {
-		if (ck_ring_size(&q->chain_ring) < MPS_CHAIN_LOWWATER) {
-			if (ratecheck(&sc->lastfail, &mps_chainfail_interval))
-				mps_dprint(sc, MPS_INFO, "Out of chain frames, "
-				    "consider increasing hw.mps.max_chains.\n");
-			return (NULL);
+		for (needed = mps_chains_for_size(sc, size); needed > 0;
+		    needed--) {
+			if ((chain = mps_alloc_chain(q)) == NULL) {
+				if (ratecheck(&sc->lastfail,
+				    &mps_chainfail_interval))
+					mps_dprint(sc, MPS_INFO, "Out of chain "
+					    "frames, consider increasing "
+					    "hw.mps.max_chains.\n");
+				mps_qfree_command(cm, q);
+				return (NULL);
+			}
+			STAILQ_INSERT_TAIL(&cm->cm_chain_resv, chain,
+			    chain_slink);
 		}
 	}
 
-	cm = mps_qalloc_command(q);
 	return (cm);
 }
 
@@ -760,6 +929,8 @@ void mps_intr_legacy(void *);
 void mps_intr_queue(void *);
 void mps_intr_locked(struct mps_queue *q);
 void mps_intr_all_queues(struct mps_softc *sc);
+int mps_poll_start(struct mps_softc *sc);
+void mps_poll_stop(struct mps_softc *sc);
 int mps_register_events(struct mps_softc *, u32 *, mps_evt_callback_t *,
     void *, struct mps_event_handle **);
 int mps_restart(struct mps_softc *);
@@ -804,6 +975,15 @@ int mps_reinit(struct mps_softc *sc);
 
 void mps_base_static_config_pages(struct mps_softc *sc);
 void mps_wd_config_pages(struct mps_softc *sc);
+void mps_mirror_config_pages(struct mps_softc *sc);
+void mps_mirror_invalidate(struct mps_softc *sc);
+void mps_config_cache_init(struct mps_softc *sc);
+void mps_config_cache_fini(struct mps_softc *sc);
+void mps_config_cache_invalidate(struct mps_softc *sc, int pclass);
+void mps_config_cache_invalidate_device(struct mps_softc *sc, u16 handle);
+int mps_config_get_page_async(struct mps_softc *sc, u_int page_type,
+    u_int ext_page_type, u_int page_number, u_int page_address, void *buf,
+    u_int length, mps_config_async_cb_t *cb, void *cbarg);
 
 int mps_mapping_initialize(struct mps_softc *);
 void mps_mapping_topology_change_event(struct mps_softc *,
@@ -812,7 +992,11 @@ int mps_mapping_is_reinit_required(struct mps_softc *);
 void mps_mapping_free_memory(struct mps_softc *sc);
 int mps_config_set_dpm_pg0(struct mps_softc *, Mpi2ConfigReply_t *,
     Mpi2DriverMappingPage0_t *, u16 );
+int mps_config_set_dpm_pg0_range(struct mps_softc *, Mpi2ConfigReply_t *,
+    Mpi2DriverMappingPage0_t *, u16, u16);
 void mps_mapping_exit(struct mps_softc *);
+void mps_mapping_dpm_flush_task(void *, int);
+void mps_mapping_dpm_drain(struct mps_softc *);
 void mps_mapping_check_devices(struct mps_softc *, int);
 int mps_mapping_allocate_memory(struct mps_softc *sc);
 unsigned int mps_mapping_get_sas_id(struct mps_softc *, uint64_t , u16);
@@ -34,7 +34,13 @@ __FBSDID("$FreeBSD$");
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/bio.h>
+#include <sys/counter.h>
+#include <sys/kthread.h>
+#include <sys/limits.h>
+#include <sys/proc.h>
 #include <sys/sbuf.h>
+#include <sys/sched.h>
+#include <sys/smp.h>
 #include <sys/sysctl.h>
 #include <sys/malloc.h>
 #include <geom/geom.h>
@@ -48,6 +54,8 @@ SYSCTL_UINT(_kern_geom_benchmark, OID_AUTO, debug, CTLFLAG_RW, &g_benchmark_debu
     "Debug level");
 
 static int g_benchmark_destroy(struct g_geom *gp, boolean_t force);
+static void g_benchmark_wl_stop(struct g_benchmark_softc *sc,
+    struct g_consumer *cp);
 static int g_benchmark_destroy_geom(struct gctl_req *req, struct g_class *mp,
     struct g_geom *gp);
 static void g_benchmark_config(struct gctl_req *req, struct g_class *mp,
@@ -107,20 +115,18 @@ g_benchmark_start(struct bio *bp)
 	gp = bp->bio_to->geom;
 	sc = gp->softc;
 	G_BENCHMARK_LOGREQ(bp, "Request received.");
-	mtx_lock(&sc->sc_lock);
 	switch (bp->bio_cmd) {
 	case BIO_READ:
-		sc->sc_reads++;
-		sc->sc_readbytes += bp->bio_length;
+		counter_u64_add(sc->sc_reads, 1);
+		counter_u64_add(sc->sc_readbytes, bp->bio_length);
 		failprob = sc->sc_rfailprob;
 		break;
 	case BIO_WRITE:
-		sc->sc_writes++;
-		sc->sc_wrotebytes += bp->bio_length;
+		counter_u64_add(sc->sc_writes, 1);
+		counter_u64_add(sc->sc_wrotebytes, bp->bio_length);
 		failprob = sc->sc_wfailprob;
 		break;
 	}
-	mtx_unlock(&sc->sc_lock);
 	if (failprob > 0) {
 		u_int rval;
 
@@ -159,6 +165,370 @@ g_benchmark_access(struct g_provider *pp, int dr, int dw, int de)
 	return (error);
 }
 
+static void
+g_benchmark_counters_alloc(struct g_benchmark_softc *sc)
+{
+	int i;
+
+	sc->sc_reads = counter_u64_alloc(M_WAITOK);
+	sc->sc_writes = counter_u64_alloc(M_WAITOK);
+	sc->sc_readbytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wrotebytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_reads = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_writes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_readbytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_wrotebytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_errors = counter_u64_alloc(M_WAITOK);
+	sc->sc_wl_latsum = counter_u64_alloc(M_WAITOK);
+	for (i = 0; i < G_BENCHMARK_LAT_BUCKETS; i++)
+		sc->sc_wl_lat[i] = counter_u64_alloc(M_WAITOK);
+}
+
+static void
+g_benchmark_counters_free(struct g_benchmark_softc *sc)
+{
+	int i;
+
+	counter_u64_free(sc->sc_reads);
+	counter_u64_free(sc->sc_writes);
+	counter_u64_free(sc->sc_readbytes);
+	counter_u64_free(sc->sc_wrotebytes);
+	counter_u64_free(sc->sc_wl_reads);
+	counter_u64_free(sc->sc_wl_writes);
+	counter_u64_free(sc->sc_wl_readbytes);
+	counter_u64_free(sc->sc_wl_wrotebytes);
+	counter_u64_free(sc->sc_wl_errors);
+	counter_u64_free(sc->sc_wl_latsum);
+	for (i = 0; i < G_BENCHMARK_LAT_BUCKETS; i++)
+		counter_u64_free(sc->sc_wl_lat[i]);
+}
+
+static void
+g_benchmark_wl_zero(struct g_benchmark_softc *sc)
+{
+	int i;
+
+	counter_u64_zero(sc->sc_wl_reads);
+	counter_u64_zero(sc->sc_wl_writes);
+	counter_u64_zero(sc->sc_wl_readbytes);
+	counter_u64_zero(sc->sc_wl_wrotebytes);
+	counter_u64_zero(sc->sc_wl_errors);
+	counter_u64_zero(sc->sc_wl_latsum);
+	for (i = 0; i < G_BENCHMARK_LAT_BUCKETS; i++)
+		counter_u64_zero(sc->sc_wl_lat[i]);
+}
+
+/*
+ * Completion of a workload request.  Account it and hand the slot back to
+ * its worker; reissuing from here could recurse through a direct-dispatch
+ * stack and would run on whatever CPU completed the request.
+ */
+static void
+g_benchmark_wl_done(struct bio *bp)
+{
+	struct g_benchmark_softc *sc;
+	struct g_benchmark_worker *w;
+	struct g_benchmark_req *r;
+	uint64_t us;
+	int bucket;
+
+	r = bp->bio_caller1;
+	w = r->r_worker;
+	sc = w->w_softc;
+
+	us = (sbinuptime() - r->r_start) / SBT_1US;
+	bucket = us == 0 ? 0 : flsll(us);
+	if (bucket >= G_BENCHMARK_LAT_BUCKETS)
+		bucket = G_BENCHMARK_LAT_BUCKETS - 1;
+	counter_u64_add(sc->sc_wl_lat[bucket], 1);
+	counter_u64_add(sc->sc_wl_latsum, us);
+	if (bp->bio_error != 0) {
+		G_BENCHMARK_LOGREQLVL(1, bp, "Request failed (error=%d).",
+		    bp->bio_error);
+		counter_u64_add(sc->sc_wl_errors, 1);
+	} else if (bp->bio_cmd == BIO_READ) {
+		counter_u64_add(sc->sc_wl_reads, 1);
+		counter_u64_add(sc->sc_wl_readbytes, bp->bio_completed);
+	} else {
+		counter_u64_add(sc->sc_wl_writes, 1);
+		counter_u64_add(sc->sc_wl_wrotebytes, bp->bio_completed);
+	}
+	g_destroy_bio(bp);
+
+	mtx_lock(&w->w_lock);
+	TAILQ_INSERT_TAIL(&w->w_free, r, r_next);
+	w->w_inflight--;
+	wakeup(w);
+	mtx_unlock(&w->w_lock);
+}
+
+static void
+g_benchmark_wl_issue(struct g_benchmark_worker *w, struct g_benchmark_req *r)
+{
+	struct g_benchmark_softc *sc;
+	struct bio *bp;
+	off_t blk;
+
+	sc = w->w_softc;
+	bp = g_alloc_bio();
+	if (sc->sc_wl_rwmix == 100 ||
+	    (sc->sc_wl_rwmix > 0 && arc4random() % 100 < sc->sc_wl_rwmix))
+		bp->bio_cmd = BIO_READ;
+	else
+		bp->bio_cmd = BIO_WRITE;
+	if (sc->sc_wl_random) {
+		blk = (((uint64_t)arc4random() << 32) | arc4random()) %
+		    sc->sc_wl_nblocks;
+		bp->bio_offset = sc->sc_offset + blk * sc->sc_wl_bsize;
+	} else {
+		bp->bio_offset = w->w_next;
+		w->w_next += sc->sc_wl_bsize;
+		if (w->w_next >= w->w_last)
+			w->w_next = w->w_first;
+	}
+	bp->bio_length = sc->sc_wl_bsize;
+	bp->bio_data = r->r_data;
+	bp->bio_done = g_benchmark_wl_done;
+	bp->bio_caller1 = r;
+	r->r_start = sbinuptime();
+	G_BENCHMARK_LOGREQ(bp, "Sending workload request.");
+	g_io_request(bp, w->w_consumer);
+}
+
+static void
+g_benchmark_worker(void *arg)
+{
+	struct g_benchmark_softc *sc;
+	struct g_benchmark_worker *w;
+	struct g_benchmark_req *r;
+	int stopping;
+
+	w = arg;
+	sc = w->w_softc;
+#ifdef SMP
+	/* Before sched_bind() to a CPU, wait for all CPUs to go on-line. */
+	while (!smp_started)
+		tsleep(w, 0, "gbench:smp", hz / 4);
+#endif
+	thread_lock(curthread);
+	sched_bind(curthread, w->w_cpu);
+	thread_unlock(curthread);
+
+	G_BENCHMARK_DEBUG(1, "Thread %s started.", curthread->td_proc->p_comm);
+
+	stopping = 0;
+	mtx_lock(&w->w_lock);
+	for (;;) {
+		if (sc->sc_wl_state != G_BENCHMARK_WL_RUNNING ||
+		    (sc->sc_wl_end != 0 && sbinuptime() >= sc->sc_wl_end))
+			stopping = 1;
+		if (stopping) {
+			if (w->w_inflight == 0)
+				break;
+			msleep(w, &w->w_lock, PRIBIO, "gbench:drain", 0);
+			continue;
+		}
+		r = TAILQ_FIRST(&w->w_free);
+		if (r == NULL) {
+			msleep(w, &w->w_lock, PRIBIO, "gbench:w", 0);
+			continue;
+		}
+		TAILQ_REMOVE(&w->w_free, r, r_next);
+		w->w_inflight++;
+		mtx_unlock(&w->w_lock);
+		g_benchmark_wl_issue(w, r);
+		mtx_lock(&w->w_lock);
+	}
+	mtx_unlock(&w->w_lock);
+
+	G_BENCHMARK_DEBUG(1, "Thread %s exiting.", curthread->td_proc->p_comm);
+	mtx_lock(&sc->sc_lock);
+	if (--sc->sc_wl_running == 0) {
+		sc->sc_wl_stop = sbinuptime();
+		if (sc->sc_wl_state == G_BENCHMARK_WL_RUNNING)
+			sc->sc_wl_state = G_BENCHMARK_WL_DONE;
+		wakeup(&sc->sc_wl_running);
+	}
+	mtx_unlock(&sc->sc_lock);
+	kproc_exit(0);
+}
+
+/*
+ * Start a workload against the consumer.  Every worker gets its own CPU
+ * (round robin over the CPUs present), qdepth request slots and, for a
+ * sequential workload, its own slice of the provider to walk through.
+ */
+static int
+g_benchmark_wl_start(struct gctl_req *req, struct g_geom *gp, int random,
+    u_int rwmix, u_int qdepth, u_int bsize, u_int nworkers, u_int runtime)
+{
+	struct g_benchmark_softc *sc;
+	struct g_benchmark_worker *w;
+	struct g_benchmark_req *r;
+	struct g_consumer *cp;
+	struct g_provider *pp;
+	off_t slice;
+	u_int cpu, i, j;
+	int acr, acw, error;
+
+	g_topology_assert();
+
+	sc = gp->softc;
+	cp = LIST_FIRST(&gp->consumer);
+	pp = LIST_FIRST(&gp->provider);
+	if (sc->sc_wl_state == G_BENCHMARK_WL_RUNNING ||
+	    sc->sc_wl_state == G_BENCHMARK_WL_STOPPING) {
+		gctl_error(req, "Workload already running on %s.", gp->name);
+		return (EBUSY);
+	}
+	/* Release what a previous, finished workload left behind. */
+	g_benchmark_wl_stop(sc, cp);
+
+	if (bsize == 0)
+		bsize = pp->sectorsize;
+	if ((bsize % cp->provider->sectorsize) != 0 || bsize > MAXPHYS) {
+		gctl_error(req, "Invalid bsize for provider %s.", gp->name);
+		return (EINVAL);
+	}
+	if (pp->mediasize < bsize) {
+		gctl_error(req, "Provider %s is too small.", gp->name);
+		return (EINVAL);
+	}
+	if (nworkers == 0)
+		nworkers = mp_ncpus;
+
+	acr = rwmix > 0 ? 1 : 0;
+	acw = rwmix < 100 ? 1 : 0;
+	error = g_access(cp, acr, acw, 0);
+	if (error != 0) {
+		gctl_error(req, "Cannot access provider %s (error=%d).",
+		    cp->provider->name, error);
+		return (error);
+	}
+	sc->sc_wl_acr = acr;
+	sc->sc_wl_acw = acw;
+
+	sc->sc_wl_random = random;
+	sc->sc_wl_rwmix = rwmix;
+	sc->sc_wl_qdepth = qdepth;
+	sc->sc_wl_bsize = bsize;
+	sc->sc_wl_nblocks = pp->mediasize / bsize;
+	sc->sc_wl_nworkers = nworkers;
+	g_benchmark_wl_zero(sc);
+
+	/*
+	 * Sequential workers each walk their own slice, unless there are
+	 * fewer blocks than workers, in which case they all share the lot.
+	 */
+	slice = sc->sc_wl_nblocks / nworkers;
+	if (slice == 0)
+		slice = sc->sc_wl_nblocks;
+	sc->sc_wl_workers = malloc(sizeof(*w) * nworkers, M_GEOM,
+	    M_WAITOK | M_ZERO);
+	cpu = CPU_FIRST();
+	for (i = 0; i < nworkers; i++) {
+		w = &sc->sc_wl_workers[i];
+		w->w_softc = sc;
+		w->w_consumer = cp;
+		w->w_number = i;
+		w->w_cpu = cpu;
+		cpu = CPU_NEXT(cpu);
+		w->w_first = sc->sc_offset +
+		    ((i * slice) % sc->sc_wl_nblocks) * bsize;
+		w->w_last = w->w_first + slice * bsize;
+		w->w_next = w->w_first;
+		mtx_init(&w->w_lock, "gbenchmark worker", NULL, MTX_DEF);
+		TAILQ_INIT(&w->w_free);
+		w->w_reqs = malloc(sizeof(*r) * qdepth, M_GEOM,
+		    M_WAITOK | M_ZERO);
+		for (j = 0; j < qdepth; j++) {
+			r = &w->w_reqs[j];
+			r->r_worker = w;
+			r->r_data = malloc(bsize, M_GEOM, M_WAITOK | M_ZERO);
+			TAILQ_INSERT_TAIL(&w->w_free, r, r_next);
+		}
+	}
+
+	mtx_lock(&sc->sc_lock);
+	sc->sc_wl_state = G_BENCHMARK_WL_RUNNING;
+	sc->sc_wl_running = nworkers;
+	sc->sc_wl_start = sbinuptime();
+	sc->sc_wl_end = runtime == 0 ? 0 :
+	    sc->sc_wl_start + (sbintime_t)runtime * SBT_1S;
+	sc->sc_wl_stop = 0;
+	mtx_unlock(&sc->sc_lock);
+
+	for (i = 0; i < nworkers; i++) {
+		w = &sc->sc_wl_workers[i];
+		error = kproc_create(g_benchmark_worker, w, &w->w_proc, 0, 0,
+		    "g_bench[%u] %s", i, gp->name);
+		if (error != 0) {
+			gctl_error(req, "Cannot create kernel thread for %s "
+			    "(error=%d).", gp->name, error);
+			mtx_lock(&sc->sc_lock);
+			sc->sc_wl_running -= nworkers - i;
+			mtx_unlock(&sc->sc_lock);
+			g_benchmark_wl_stop(sc, cp);
+			sc->sc_wl_state = G_BENCHMARK_WL_IDLE;
+			return (error);
+		}
+	}
+	G_BENCHMARK_DEBUG(0, "Workload started on %s (%u workers).", gp->name,
+	    nworkers);
+	return (0);
+}
+
+/*
+ * Stop a running workload, wait for its workers to drain and exit, and
+ * release the workers and the consumer access they used.
+ */
+static void
+g_benchmark_wl_stop(struct g_benchmark_softc *sc, struct g_consumer *cp)
+{
+	struct g_benchmark_worker *w;
+	u_int i, j;
+
+	g_topology_assert();
+
+	if (sc->sc_wl_workers == NULL)
+		return;
+	mtx_lock(&sc->sc_lock);
+	if (sc->sc_wl_state == G_BENCHMARK_WL_RUNNING)
+		sc->sc_wl_state = G_BENCHMARK_WL_STOPPING;
+	mtx_unlock(&sc->sc_lock);
+	for (i = 0; i < sc->sc_wl_nworkers; i++) {
+		w = &sc->sc_wl_workers[i];
+		mtx_lock(&w->w_lock);
+		wakeup(w);
+		mtx_unlock(&w->w_lock);
+	}
+	mtx_lock(&sc->sc_lock);
+	while (sc->sc_wl_running > 0) {
+		msleep(&sc->sc_wl_running, &sc->sc_lock, PRIBIO,
+		    "gbench:stop", 0);
+	}
+	if (sc->sc_wl_state == G_BENCHMARK_WL_STOPPING) {
+		sc->sc_wl_state = G_BENCHMARK_WL_DONE;
+		if (sc->sc_wl_stop == 0)
+			sc->sc_wl_stop = sbinuptime();
+	}
+	mtx_unlock(&sc->sc_lock);
+
+	for (i = 0; i < sc->sc_wl_nworkers; i++) {
+		w = &sc->sc_wl_workers[i];
+		for (j = 0; j < sc->sc_wl_qdepth; j++)
+			free(w->w_reqs[j].r_data, M_GEOM);
+		free(w->w_reqs, M_GEOM);
+		mtx_destroy(&w->w_lock);
+	}
+	free(sc->sc_wl_workers, M_GEOM);
+	sc->sc_wl_workers = NULL;
+	if (sc->sc_wl_acr != 0 || sc->sc_wl_acw != 0) {
+		g_access(cp, -sc->sc_wl_acr, -sc->sc_wl_acw, 0);
+		sc->sc_wl_acr = sc->sc_wl_acw = 0;
+	}
+}
+
 static int
 g_benchmark_create(struct gctl_req *req, struct g_class *mp, struct g_provider *pp,
     int ioerror, u_int rfailprob, u_int wfailprob, off_t offset, off_t size,
@@ -222,10 +592,7 @@ g_benchmark_create(struct gctl_req *req, struct g_class *mp, struct g_provider *
 	sc->sc_error = ioerror;
 	sc->sc_rfailprob = rfailprob;
 	sc->sc_wfailprob = wfailprob;
-	sc->sc_reads = 0;
-	sc->sc_writes = 0;
-	sc->sc_readbytes = 0;
-	sc->sc_wrotebytes = 0;
+	g_benchmark_counters_alloc(sc);
 	mtx_init(&sc->sc_lock, "gbenchmark lock", NULL, MTX_DEF);
 	gp->softc = sc;
 	gp->start = g_benchmark_start;
@@ -257,6 +624,7 @@ fail:
 	g_destroy_consumer(cp);
 	g_destroy_provider(newpp);
 	mtx_destroy(&sc->sc_lock);
+	g_benchmark_counters_free(sc);
 	g_free(gp->softc);
 	g_destroy_geom(gp);
 	return (error);
@@ -285,8 +653,10 @@ g_benchmark_destroy(struct g_geom *gp, boolean_t force)
 	} else {
 		G_BENCHMARK_DEBUG(0, "Device %s removed.", gp->name);
 	}
+	g_benchmark_wl_stop(sc, LIST_FIRST(&gp->consumer));
 	gp->softc = NULL;
 	mtx_destroy(&sc->sc_lock);
+	g_benchmark_counters_free(sc);
 	g_free(sc);
 	g_wither_geom(gp, ENXIO);
 
@@ -564,10 +934,158 @@ g_benchmark_ctl_reset(struct gctl_req *req, struct g_class *mp)
 			return;
 		}
 		sc = pp->geom->softc;
-		sc->sc_reads = 0;
-		sc->sc_writes = 0;
-		sc->sc_readbytes = 0;
-		sc->sc_wrotebytes = 0;
+		counter_u64_zero(sc->sc_reads);
+		counter_u64_zero(sc->sc_writes);
+		counter_u64_zero(sc->sc_readbytes);
+		counter_u64_zero(sc->sc_wrotebytes);
+		if (sc->sc_wl_state != G_BENCHMARK_WL_RUNNING &&
+		    sc->sc_wl_state != G_BENCHMARK_WL_STOPPING) {
+			g_benchmark_wl_stop(sc, LIST_FIRST(&pp->geom->consumer));
+			g_benchmark_wl_zero(sc);
+			sc->sc_wl_state = G_BENCHMARK_WL_IDLE;
+		}
+	}
+}
+
+static void
+g_benchmark_ctl_start(struct gctl_req *req, struct g_class *mp)
+{
+	struct g_provider *pp;
+	intmax_t *rwmix, *qdepth, *bsize, *threads, *runtime;
+	const char *name, *pattern;
+	char param[16];
+	int i, *nargs, random;
+
+	g_topology_assert();
+
+	nargs = gctl_get_paraml(req, "nargs", sizeof(*nargs));
+	if (nargs == NULL) {
+		gctl_error(req, "No '%s' argument", "nargs");
+		return;
+	}
+	if (*nargs <= 0) {
+		gctl_error(req, "Missing device(s).");
+		return;
+	}
+	pattern = gctl_get_asciiparam(req, "pattern");
+	if (pattern == NULL) {
+		gctl_error(req, "No '%s' argument", "pattern");
+		return;
+	}
+	if (strcmp(pattern, "random") == 0)
+		random = 1;
+	else if (strcmp(pattern, "sequential") == 0)
+		random = 0;
+	else {
+		gctl_error(req, "Invalid '%s' argument", "pattern");
+		return;
+	}
+	rwmix = gctl_get_paraml(req, "rwmix", sizeof(*rwmix));
+	if (rwmix == NULL) {
+		gctl_error(req, "No '%s' argument", "rwmix");
+		return;
+	}
+	if (*rwmix < 0 || *rwmix > 100) {
+		gctl_error(req, "Invalid '%s' argument", "rwmix");
+		return;
+	}
+	qdepth = gctl_get_paraml(req, "qdepth", sizeof(*qdepth));
+	if (qdepth == NULL) {
+		gctl_error(req, "No '%s' argument", "qdepth");
+		return;
+	}
+	if (*qdepth < 1 || *qdepth > G_BENCHMARK_MAX_QDEPTH) {
+		gctl_error(req, "Invalid '%s' argument", "qdepth");
+		return;
+	}
+	bsize = gctl_get_paraml(req, "bsize", sizeof(*bsize));
+	if (bsize == NULL) {
+		gctl_error(req, "No '%s' argument", "bsize");
+		return;
+	}
+	if (*bsize < 0 || *bsize > MAXPHYS) {
+		gctl_error(req, "Invalid '%s' argument", "bsize");
+		return;
+	}
+	threads = gctl_get_paraml(req, "threads", sizeof(*threads));
+	if (threads == NULL) {
+		gctl_error(req, "No '%s' argument", "threads");
+		return;
+	}
+	if (*threads < 0 || *threads > MAXCPU) {
+		gctl_error(req, "Invalid '%s' argument", "threads");
+		return;
+	}
+	runtime = gctl_get_paraml(req, "runtime", sizeof(*runtime));
+	if (runtime == NULL) {
+		gctl_error(req, "No '%s' argument", "runtime");
+		return;
+	}
+	if (*runtime < 0 || *runtime > UINT_MAX) {
+		gctl_error(req, "Invalid '%s' argument", "runtime");
+		return;
+	}
+
+	for (i = 0; i < *nargs; i++) {
+		snprintf(param, sizeof(param), "arg%d", i);
+		name = gctl_get_asciiparam(req, param);
+		if (name == NULL) {
+			gctl_error(req, "No 'arg%d' argument", i);
+			return;
+		}
+		if (strncmp(name, "/dev/", strlen("/dev/")) == 0)
+			name += strlen("/dev/");
+		pp = g_provider_by_name(name);
+		if (pp == NULL || pp->geom->class != mp) {
+			G_BENCHMARK_DEBUG(1, "Provider %s is invalid.", name);
+			gctl_error(req, "Provider %s is invalid.", name);
+			return;
+		}
+		if (g_benchmark_wl_start(req, pp->geom, random, (u_int)*rwmix,
+		    (u_int)*qdepth, (u_int)*bsize, (u_int)*threads,
+		    (u_int)*runtime) != 0) {
+			return;
+		}
+	}
+}
+
+static void
+g_benchmark_ctl_stop(struct gctl_req *req, struct g_class *mp)
+{
+	struct g_provider *pp;
+	const char *name;
+	char param[16];
+	int i, *nargs;
+
+	g_topology_assert();
+
+	nargs = gctl_get_paraml(req, "nargs", sizeof(*nargs));
+	if (nargs == NULL) {
+		gctl_error(req, "No '%s' argument", "nargs");
+		return;
+	}
+	if (*nargs <= 0) {
+		gctl_error(req, "Missing device(s).");
+		return;
+	}
+
+	for (i = 0; i < *nargs; i++) {
+		snprintf(param, sizeof(param), "arg%d", i);
+		name = gctl_get_asciiparam(req, param);
+		if (name == NULL) {
+			gctl_error(req, "No 'arg%d' argument", i);
+			return;
+		}
+		if (strncmp(name, "/dev/", strlen("/dev/")) == 0)
+			name += strlen("/dev/");
+		pp = g_provider_by_name(name);
+		if (pp == NULL || pp->geom->class != mp) {
+			G_BENCHMARK_DEBUG(1, "Provider %s is invalid.", name);
+			gctl_error(req, "Provider %s is invalid.", name);
+			return;
+		}
+		g_benchmark_wl_stop(pp->geom->softc,
+		    LIST_FIRST(&pp->geom->consumer));
 	}
 }
 
@@ -600,11 +1118,89 @@ g_benchmark_config(struct gctl_req *req, struct g_class *mp, const char *verb)
 	} else if (strcmp(verb, "reset") == 0) {
 		g_benchmark_ctl_reset(req, mp);
 		return;
+	} else if (strcmp(verb, "start") == 0) {
+		g_benchmark_ctl_start(req, mp);
+		return;
+	} else if (strcmp(verb, "stop") == 0) {
+		g_benchmark_ctl_stop(req, mp);
+		return;
 	}
 
 	gctl_error(req, "Unknown verb.");
 }
 
+/* Per-second rate of n events over us microseconds, without overflow. */
+static uint64_t
+g_benchmark_rate(uint64_t n, uint64_t us)
+{
+
+	return (n / us * 1000000 + n % us * 1000000 / us);
+}
+
+static void
+g_benchmark_wl_dumpconf(struct sbuf *sb, const char *indent,
+    struct g_benchmark_softc *sc)
+{
+	static const char *states[] = { "IDLE", "RUNNING", "STOPPING", "DONE" };
+	uint64_t reads, writes, rbytes, wbytes, ios, cnt, us;
+	sbintime_t end;
+	int i;
+
+	if (sc->sc_wl_state == G_BENCHMARK_WL_IDLE)
+		return;
+	sbuf_printf(sb, "%s<Workload>%s</Workload>\n", indent,
+	    states[sc->sc_wl_state]);
+	sbuf_printf(sb, "%s<Pattern>%s</Pattern>\n", indent,
+	    sc->sc_wl_random ? "random" : "sequential");
+	sbuf_printf(sb, "%s<ReadPercent>%u</ReadPercent>\n", indent,
+	    sc->sc_wl_rwmix);
+	sbuf_printf(sb, "%s<QueueDepth>%u</QueueDepth>\n", indent,
+	    sc->sc_wl_qdepth);
+	sbuf_printf(sb, "%s<BlockSize>%u</BlockSize>\n", indent,
+	    sc->sc_wl_bsize);
+	sbuf_printf(sb, "%s<Workers>%u</Workers>\n", indent,
+	    sc->sc_wl_nworkers);
+
+	end = sc->sc_wl_state == G_BENCHMARK_WL_DONE ? sc->sc_wl_stop :
+	    sbinuptime();
+	us = (end - sc->sc_wl_start) / SBT_1US;
+	if (us == 0)
+		us = 1;
+	reads = counter_u64_fetch(sc->sc_wl_reads);
+	writes = counter_u64_fetch(sc->sc_wl_writes);
+	rbytes = counter_u64_fetch(sc->sc_wl_readbytes);
+	wbytes = counter_u64_fetch(sc->sc_wl_wrotebytes);
+	ios = reads + writes;
+	sbuf_printf(sb, "%s<ElapsedUs>%ju</ElapsedUs>\n", indent,
+	    (uintmax_t)us);
+	sbuf_printf(sb, "%s<WorkloadReads>%ju</WorkloadReads>\n", indent,
+	    (uintmax_t)reads);
+	sbuf_printf(sb, "%s<WorkloadWrites>%ju</WorkloadWrites>\n", indent,
+	    (uintmax_t)writes);
+	sbuf_printf(sb, "%s<WorkloadErrors>%ju</WorkloadErrors>\n", indent,
+	    (uintmax_t)counter_u64_fetch(sc->sc_wl_errors));
+	sbuf_printf(sb, "%s<IOPS>%ju</IOPS>\n", indent,
+	    (uintmax_t)g_benchmark_rate(ios, us));
+	sbuf_printf(sb, "%s<ReadBandwidth>%ju</ReadBandwidth>\n", indent,
+	    (uintmax_t)g_benchmark_rate(rbytes, us));
+	sbuf_printf(sb, "%s<WriteBandwidth>%ju</WriteBandwidth>\n", indent,
+	    (uintmax_t)g_benchmark_rate(wbytes, us));
+	cnt = 0;
+	for (i = 0; i < G_BENCHMARK_LAT_BUCKETS; i++)
+		cnt += counter_u64_fetch(sc->sc_wl_lat[i]);
+	sbuf_printf(sb, "%s<AvgLatencyUs>%ju</AvgLatencyUs>\n", indent,
+	    (uintmax_t)(cnt == 0 ? 0 :
+	    counter_u64_fetch(sc->sc_wl_latsum) / cnt));
+	/* Only the populated buckets, named by their upper bound. */
+	for (i = 0; i < G_BENCHMARK_LAT_BUCKETS; i++) {
+		cnt = counter_u64_fetch(sc->sc_wl_lat[i]);
+		if (cnt == 0)
+			continue;
+		sbuf_printf(sb, "%s<Latency%juUs>%ju</Latency%juUs>\n", indent,
+		    (uintmax_t)1 << i, (uintmax_t)cnt, (uintmax_t)1 << i);
+	}
+}
+
 static void
 g_benchmark_dumpconf(struct sbuf *sb, const char *indent, struct g_geom *gp,
     struct g_consumer *cp, struct g_provider *pp)
@@ -621,12 +1217,15 @@ g_benchmark_dumpconf(struct sbuf *sb, const char *indent, struct g_geom *gp,
 	sbuf_printf(sb, "%s<WriteFailProb>%u</WriteFailProb>\n", indent,
 	    sc->sc_wfailprob);
 	sbuf_printf(sb, "%s<Error>%d</Error>\n", indent, sc->sc_error);
-	sbuf_printf(sb, "%s<Reads>%ju</Reads>\n", indent, sc->sc_reads);
-	sbuf_printf(sb, "%s<Writes>%ju</Writes>\n", indent, sc->sc_writes);
+	sbuf_printf(sb, "%s<Reads>%ju</Reads>\n", indent,
+	    (uintmax_t)counter_u64_fetch(sc->sc_reads));
+	sbuf_printf(sb, "%s<Writes>%ju</Writes>\n", indent,
+	    (uintmax_t)counter_u64_fetch(sc->sc_writes));
 	sbuf_printf(sb, "%s<ReadBytes>%ju</ReadBytes>\n", indent,
-	    sc->sc_readbytes);
+	    (uintmax_t)counter_u64_fetch(sc->sc_readbytes));
 	sbuf_printf(sb, "%s<WroteBytes>%ju</WroteBytes>\n", indent,
-	    sc->sc_wrotebytes);
+	    (uintmax_t)counter_u64_fetch(sc->sc_wrotebytes));
+	g_benchmark_wl_dumpconf(sb, indent, sc);
 }
 
 DECLARE_GEOM_CLASS(g_benchmark_class, g_benchmark);
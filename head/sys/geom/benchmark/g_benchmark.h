@@ -30,7 +30,7 @@
 #define	_G_BENCHMARK_H_
 
 #define	G_BENCHMARK_CLASS_NAME	"BENCHMARK"
-#define	G_BENCHMARK_VERSION	1
+#define	G_BENCHMARK_VERSION	2
 #define	G_BENCHMARK_SUFFIX	".benchmark"
 
 #ifdef _KERNEL
@@ -55,17 +55,87 @@
 	}								\
 } while (0)
 
+/*
+ * Latency histogram: bucket 0 counts requests that completed in under 1us,
+ * bucket n (n > 0) those that took [2^(n-1), 2^n) us.  The last bucket
+ * also absorbs everything slower.
+ */
+#define	G_BENCHMARK_LAT_BUCKETS	32
+
+#define	G_BENCHMARK_MAX_QDEPTH	1024
+
+struct g_benchmark_softc;
+
+/*
+ * Slot for one in-flight workload request.  Each worker owns qdepth of
+ * these together with their data buffers.
+ */
+struct g_benchmark_req {
+	struct g_benchmark_worker	*r_worker;
+	void				*r_data;
+	sbintime_t			 r_start;
+	TAILQ_ENTRY(g_benchmark_req)	 r_next;
+};
+
+/*
+ * Workload thread, bound to a single CPU.  Completed requests are handed
+ * back on w_free and the thread reissues them, so that the submission
+ * path always runs on the worker's own CPU.
+ */
+struct g_benchmark_worker {
+	struct g_benchmark_softc	*w_softc;
+	struct g_consumer		*w_consumer;
+	struct proc			*w_proc;
+	struct mtx			 w_lock;
+	TAILQ_HEAD(, g_benchmark_req)	 w_free;
+	struct g_benchmark_req		*w_reqs;
+	u_int				 w_number;
+	u_int				 w_cpu;
+	u_int				 w_inflight;
+	off_t				 w_next;	/* Sequential cursor. */
+	off_t				 w_first;	/* Sequential range. */
+	off_t				 w_last;
+};
+
+#define	G_BENCHMARK_WL_IDLE	0
+#define	G_BENCHMARK_WL_RUNNING	1
+#define	G_BENCHMARK_WL_STOPPING	2
+#define	G_BENCHMARK_WL_DONE	3
+
 struct g_benchmark_softc {
 	int		sc_error;
 	off_t		sc_offset;
 	off_t		sc_explicitsize;
 	u_int		sc_rfailprob;
 	u_int		sc_wfailprob;
-	uintmax_t	sc_reads;
-	uintmax_t	sc_writes;
-	uintmax_t	sc_readbytes;
-	uintmax_t	sc_wrotebytes;
+	counter_u64_t	sc_reads;
+	counter_u64_t	sc_writes;
+	counter_u64_t	sc_readbytes;
+	counter_u64_t	sc_wrotebytes;
 	struct mtx	sc_lock;
+
+	/* Workload engine. */
+	volatile int	sc_wl_state;
+	int		sc_wl_random;
+	u_int		sc_wl_rwmix;	/* Percentage of reads. */
+	u_int		sc_wl_qdepth;	/* Per worker. */
+	u_int		sc_wl_bsize;
+	off_t		sc_wl_nblocks;	/* Of sc_wl_bsize each. */
+	u_int		sc_wl_nworkers;
+	u_int		sc_wl_running;	/* Workers not yet exited. */
+	int		sc_wl_acr;	/* Consumer access we hold. */
+	int		sc_wl_acw;
+	sbintime_t	sc_wl_start;
+	sbintime_t	sc_wl_end;	/* Deadline, 0 means none. */
+	sbintime_t	sc_wl_stop;	/* When the last worker exited. */
+	struct g_benchmark_worker *sc_wl_workers;
+	counter_u64_t	sc_wl_reads;
+	counter_u64_t	sc_wl_writes;
+	counter_u64_t	sc_wl_readbytes;
+	counter_u64_t	sc_wl_wrotebytes;
+	counter_u64_t	sc_wl_errors;
+	counter_u64_t	sc_wl_latsum;	/* In microseconds. */
+	counter_u64_t	sc_wl_lat[G_BENCHMARK_LAT_BUCKETS];
 };
 #endif	/* _KERNEL */
 
@@ -34,10 +34,12 @@ __FBSDID("$FreeBSD$");
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/bio.h>
+#include <sys/counter.h>
 #include <sys/sysctl.h>
 #include <sys/malloc.h>
 #include <sys/queue.h>
 #include <sys/sbuf.h>
+#include <sys/smp.h>
 #include <sys/time.h>
 #include <vm/uma.h>
 #include <geom/geom.h>
@@ -62,8 +64,16 @@ SYSCTL_UINT(_kern_geom_cache, OID_AUTO, timeout, CTLFLAG_RW, &g_cache_timeout,
 static u_int g_cache_idletime = 5;
 SYSCTL_UINT(_kern_geom_cache, OID_AUTO, idletime, CTLFLAG_RW, &g_cache_idletime,
     0, "");
+static u_int g_cache_shards = 0;
+SYSCTL_UINT(_kern_geom_cache, OID_AUTO, shards, CTLFLAG_RDTUN,
+    &g_cache_shards, 0, "Number of cache shards per device (0 - auto)");
+static u_int g_cache_readahead = 4;
+SYSCTL_UINT(_kern_geom_cache, OID_AUTO, readahead, CTLFLAG_RW,
+    &g_cache_readahead, 0, "Blocks to read ahead of sequential streams");
 static u_int g_cache_used_lo = 5;
 static u_int g_cache_used_hi = 20;
+static u_int g_cache_a1in = 25;
+static u_int g_cache_a1out = 50;
 static int
 sysctl_handle_pct(SYSCTL_HANDLER_ARGS)
 {
@@ -85,9 +95,16 @@ SYSCTL_PROC(_kern_geom_cache, OID_AUTO, used_lo, CTLTYPE_UINT|CTLFLAG_RW,
 	&g_cache_used_lo, 0, sysctl_handle_pct, "IU", "");
 SYSCTL_PROC(_kern_geom_cache, OID_AUTO, used_hi, CTLTYPE_UINT|CTLFLAG_RW,
 	&g_cache_used_hi, 0, sysctl_handle_pct, "IU", "");
+SYSCTL_PROC(_kern_geom_cache, OID_AUTO, a1in, CTLTYPE_UINT|CTLFLAG_RW,
+	&g_cache_a1in, 0, sysctl_handle_pct, "IU",
+	"Percentage of a shard kept for blocks seen once (2Q A1in)");
+SYSCTL_PROC(_kern_geom_cache, OID_AUTO, a1out, CTLTYPE_UINT|CTLFLAG_RW,
+	&g_cache_a1out, 0, sysctl_handle_pct, "IU",
+	"Evicted A1in blocks remembered, as a percentage of a shard (2Q A1out)");
 
 
 static int g_cache_destroy(struct g_cache_softc *sc, boolean_t force);
+static void g_cache_free_softc(struct g_cache_softc *sc);
 static g_ctl_destroy_geom_t g_cache_destroy_geom;
 
 static g_taste_t g_cache_taste;
@@ -105,66 +122,238 @@ struct g_class g_cache_class = {
 #define	OFF2BNO(off, sc)	((off) >> (sc)->sc_bshift)
 #define	BNO2OFF(bno, sc)	((bno) << (sc)->sc_bshift)
 
+/* Per-shard limits, derived from the (reconfigurable) device size. */
+#define	SHARDMAX(sc)	MAX((sc)->sc_maxent >> (sc)->sc_shardshift, 1)
+#define	SHARDPCT(sc, pct)	((pct) * SHARDMAX(sc) / 100)
+
+
+static void
+g_cache_enqueue(struct g_cache_shard *sp, struct g_cache_desc *dp, int queue)
+{
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+	KASSERT(dp->d_queue == D_QUEUE_NONE, ("entry already queued"));
+
+	switch (queue) {
+	case D_QUEUE_A1IN:
+		TAILQ_INSERT_TAIL(&sp->s_a1in, dp, d_lru);
+		sp->s_na1in++;
+		break;
+	case D_QUEUE_A1OUT:
+		TAILQ_INSERT_TAIL(&sp->s_a1out, dp, d_lru);
+		sp->s_na1out++;
+		break;
+	case D_QUEUE_AM:
+		TAILQ_INSERT_TAIL(&sp->s_am, dp, d_lru);
+		sp->s_nam++;
+		break;
+	}
+	dp->d_queue = queue;
+}
+
+static void
+g_cache_unqueue(struct g_cache_shard *sp, struct g_cache_desc *dp)
+{
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+
+	switch (dp->d_queue) {
+	case D_QUEUE_A1IN:
+		TAILQ_REMOVE(&sp->s_a1in, dp, d_lru);
+		sp->s_na1in--;
+		break;
+	case D_QUEUE_A1OUT:
+		TAILQ_REMOVE(&sp->s_a1out, dp, d_lru);
+		sp->s_na1out--;
+		break;
+	case D_QUEUE_AM:
+		TAILQ_REMOVE(&sp->s_am, dp, d_lru);
+		sp->s_nam--;
+		break;
+	}
+	dp->d_queue = D_QUEUE_NONE;
+}
+
+static void
+g_cache_free(struct g_cache_softc *sc, struct g_cache_shard *sp,
+    struct g_cache_desc *dp)
+{
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+
+	if (dp->d_data != NULL) {
+		uma_zfree(sc->sc_zone, dp->d_data);
+		sp->s_nent--;
+	}
+	free(dp, M_GCACHE);
+}
+
+/*
+ * Drop the data of a resident entry.  Entries leaving A1in are kept on
+ * A1out as ghosts, so that a second reference can promote them to Am;
+ * entries leaving Am are forgotten.
+ */
+static void
+g_cache_evict(struct g_cache_softc *sc, struct g_cache_shard *sp,
+    struct g_cache_desc *dp)
+{
+	struct g_cache_desc *gdp;
+	int queue;
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+	KASSERT((dp->d_flags & D_FLAG_BUSY) == 0, ("evicting busy entry"));
+
+	queue = dp->d_queue;
+	g_cache_unqueue(sp, dp);
+	if (queue != D_QUEUE_A1IN || SHARDPCT(sc, g_cache_a1out) == 0) {
+		LIST_REMOVE(dp, d_next);
+		g_cache_free(sc, sp, dp);
+		return;
+	}
+	if (dp->d_data != NULL) {
+		uma_zfree(sc->sc_zone, dp->d_data);
+		dp->d_data = NULL;
+		sp->s_nent--;
+	}
+	g_cache_enqueue(sp, dp, D_QUEUE_A1OUT);
+	while (sp->s_na1out > SHARDPCT(sc, g_cache_a1out)) {
+		gdp = TAILQ_FIRST(&sp->s_a1out);
+		g_cache_unqueue(sp, gdp);
+		LIST_REMOVE(gdp, d_next);
+		free(gdp, M_GCACHE);
+	}
+}
 
 static struct g_cache_desc *
-g_cache_alloc(struct g_cache_softc *sc)
+g_cache_victim(struct g_cache_shard *sp, int queue)
 {
 	struct g_cache_desc *dp;
 
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
+	mtx_assert(&sp->s_mtx, MA_OWNED);
 
-	if (!TAILQ_EMPTY(&sc->sc_usedlist)) {
-		dp = TAILQ_FIRST(&sc->sc_usedlist);
-		TAILQ_REMOVE(&sc->sc_usedlist, dp, d_used);
-		sc->sc_nused--;
-		dp->d_flags = 0;
-		LIST_REMOVE(dp, d_next);
-		return (dp);
+	if (queue == D_QUEUE_A1IN) {
+		TAILQ_FOREACH(dp, &sp->s_a1in, d_lru)
+			if ((dp->d_flags & D_FLAG_BUSY) == 0)
+				return (dp);
+	} else {
+		TAILQ_FOREACH(dp, &sp->s_am, d_lru)
+			if ((dp->d_flags & D_FLAG_BUSY) == 0)
+				return (dp);
 	}
-	if (sc->sc_nent > sc->sc_maxent) {
-		sc->sc_cachefull++;
-		return (NULL);
+	return (NULL);
+}
+
+/*
+ * Get a data buffer for a new entry: allocate one while the shard is below
+ * its share of the cache, otherwise take it over from the 2Q victim.
+ */
+static caddr_t
+g_cache_getbuf(struct g_cache_softc *sc, struct g_cache_shard *sp)
+{
+	struct g_cache_desc *dp;
+	caddr_t data;
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+
+	if (sp->s_nent < SHARDMAX(sc)) {
+		data = uma_zalloc(sc->sc_zone, M_NOWAIT);
+		if (data != NULL) {
+			sp->s_nent++;
+			return (data);
+		}
 	}
-	dp = malloc(sizeof(*dp), M_GCACHE, M_NOWAIT | M_ZERO);
+	dp = NULL;
+	if (sp->s_na1in > SHARDPCT(sc, g_cache_a1in))
+		dp = g_cache_victim(sp, D_QUEUE_A1IN);
+	if (dp == NULL)
+		dp = g_cache_victim(sp, D_QUEUE_AM);
 	if (dp == NULL)
+		dp = g_cache_victim(sp, D_QUEUE_A1IN);
+	if (dp == NULL) {
+		sp->s_full++;
 		return (NULL);
-	dp->d_data = uma_zalloc(sc->sc_zone, M_NOWAIT);
+	}
+	data = dp->d_data;
+	dp->d_data = NULL;
+	sp->s_nent--;
+	g_cache_evict(sc, sp, dp);
+	sp->s_nent++;
+	return (data);
+}
+
+/*
+ * Set up a busy entry for block bno.  A block found on A1out (gdp) was
+ * referenced again shortly after leaving A1in and goes straight to Am,
+ * any other block starts on A1in.
+ */
+static struct g_cache_desc *
+g_cache_alloc(struct g_cache_softc *sc, struct g_cache_shard *sp,
+    struct g_cache_desc *gdp, off_t bno)
+{
+	struct g_cache_desc *dp;
+	int queue;
+
+	mtx_assert(&sp->s_mtx, MA_OWNED);
+
+	if (gdp != NULL) {
+		KASSERT(gdp->d_queue == D_QUEUE_A1OUT, ("entry not a ghost"));
+		/* Keep getbuf from trimming it off A1out under us. */
+		g_cache_unqueue(sp, gdp);
+		dp = gdp;
+		queue = D_QUEUE_AM;
+	} else {
+		dp = malloc(sizeof(*dp), M_GCACHE, M_NOWAIT | M_ZERO);
+		if (dp == NULL)
+			return (NULL);
+		dp->d_bno = bno;
+		queue = D_QUEUE_A1IN;
+	}
+	dp->d_data = g_cache_getbuf(sc, sp);
 	if (dp->d_data == NULL) {
+		if (gdp != NULL)
+			LIST_REMOVE(gdp, d_next);
 		free(dp, M_GCACHE);
 		return (NULL);
 	}
-	sc->sc_nent++;
+	if (gdp == NULL)
+		LIST_INSERT_HEAD(G_CACHE_HASH(sc, sp, bno), dp, d_next);
+	dp->d_flags = D_FLAG_BUSY;
+	dp->d_atime = time_uptime;
+	g_cache_enqueue(sp, dp, queue);
 	return (dp);
 }
 
-static void
-g_cache_free(struct g_cache_softc *sc, struct g_cache_desc *dp)
+static struct g_cache_desc *
+g_cache_lookup(struct g_cache_softc *sc, struct g_cache_shard *sp, off_t bno)
 {
+	struct g_cache_desc *dp;
 
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
+	mtx_assert(&sp->s_mtx, MA_OWNED);
 
-	uma_zfree(sc->sc_zone, dp->d_data);
-	free(dp, M_GCACHE);
-	sc->sc_nent--;
+	LIST_FOREACH(dp, G_CACHE_HASH(sc, sp, bno), d_next)
+		if (dp->d_bno == bno)
+			return (dp);
+	return (NULL);
 }
 
+/*
+ * Account one block of a read request.  A request can span several
+ * blocks, each owned by a different shard, so completion is counted in
+ * bio_children/bio_inbed and the request is delivered with its last block.
+ */
 static void
-g_cache_free_used(struct g_cache_softc *sc)
+g_cache_complete(struct bio *bp, int error)
 {
-	struct g_cache_desc *dp;
-	u_int n;
-
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
 
-	n = g_cache_used_lo * sc->sc_maxent / 100;
-	while (sc->sc_nused > n) {
-		KASSERT(!TAILQ_EMPTY(&sc->sc_usedlist), ("used list empty"));
-		dp = TAILQ_FIRST(&sc->sc_usedlist);
-		TAILQ_REMOVE(&sc->sc_usedlist, dp, d_used);
-		sc->sc_nused--;
-		LIST_REMOVE(dp, d_next);
-		g_cache_free(sc, dp);
-	}
+	if (error != 0)
+		atomic_cmpset_int((volatile u_int *)&bp->bio_error, 0, error);
+	if (atomic_fetchadd_int(&bp->bio_inbed, 1) + 1 < bp->bio_children)
+		return;
+	if (bp->bio_error == 0)
+		bp->bio_completed = bp->bio_length;
+	else
+		bp->bio_completed = 0;
+	g_io_deliver(bp, bp->bio_error);
 }
 
 static void
@@ -173,7 +362,6 @@ g_cache_deliver(struct g_cache_softc *sc, struct bio *bp,
 {
 	off_t off1, off, len;
 
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
 	KASSERT(OFF2BNO(bp->bio_offset, sc) <= dp->d_bno, ("wrong entry"));
 	KASSERT(OFF2BNO(bp->bio_offset + bp->bio_length - 1, sc) >=
 	    dp->d_bno, ("wrong entry"));
@@ -182,158 +370,259 @@ g_cache_deliver(struct g_cache_softc *sc, struct bio *bp,
 	off = MAX(bp->bio_offset, off1);
 	len = MIN(bp->bio_offset + bp->bio_length, off1 + sc->sc_bsize) - off;
 
-	if (bp->bio_error == 0)
-		bp->bio_error = error;
-	if (bp->bio_error == 0) {
+	if (error == 0) {
 		bcopy(dp->d_data + (off - off1),
 		    bp->bio_data + (off - bp->bio_offset), len);
 	}
-	bp->bio_completed += len;
-	KASSERT(bp->bio_completed <= bp->bio_length, ("extra data"));
-	if (bp->bio_completed == bp->bio_length) {
-		if (bp->bio_error != 0)
-			bp->bio_completed = 0;
-		g_io_deliver(bp, bp->bio_error);
-	}
-
-	if (dp->d_flags & D_FLAG_USED) {
-		TAILQ_REMOVE(&sc->sc_usedlist, dp, d_used);
-		TAILQ_INSERT_TAIL(&sc->sc_usedlist, dp, d_used);
-	} else if (OFF2BNO(off + len, sc) > dp->d_bno) {
-		TAILQ_INSERT_TAIL(&sc->sc_usedlist, dp, d_used);
-		sc->sc_nused++;
-		dp->d_flags |= D_FLAG_USED;
-	}
-	dp->d_atime = time_uptime;
+	g_cache_complete(bp, error);
 }
 
 static void
 g_cache_done(struct bio *bp)
 {
 	struct g_cache_softc *sc;
+	struct g_cache_shard *sp;
 	struct g_cache_desc *dp;
-	struct bio *bp2, *tmpbp;
+	struct g_cache_wait *wp, *tmpwp;
 
-	sc = bp->bio_from->geom->softc;
-	KASSERT(G_CACHE_DESC1(bp) == sc, ("corrupt bio_caller in g_cache_done()"));
+	sc = G_CACHE_DESC1(bp);
+	KASSERT(sc == bp->bio_from->geom->softc,
+	    ("corrupt bio_caller in g_cache_done()"));
 	dp = G_CACHE_DESC2(bp);
-	mtx_lock(&sc->sc_mtx);
-	bp2 = dp->d_biolist;
-	while (bp2 != NULL) {
-		KASSERT(G_CACHE_NEXT_BIO1(bp2) == sc, ("corrupt bio_driver in g_cache_done()"));
-		tmpbp = G_CACHE_NEXT_BIO2(bp2);
-		g_cache_deliver(sc, bp2, dp, bp->bio_error);
-		bp2 = tmpbp;
-	}
-	dp->d_biolist = NULL;
+	sp = G_CACHE_SHARD(sc, dp->d_bno);
+	mtx_lock(&sp->s_mtx);
+	KASSERT(dp->d_flags & D_FLAG_BUSY, ("entry not busy"));
+	wp = dp->d_waiters;
+	dp->d_waiters = NULL;
+	dp->d_flags &= ~D_FLAG_BUSY;
+	while (wp != NULL) {
+		tmpwp = wp->w_next;
+		g_cache_deliver(sc, wp->w_bp, dp, bp->bio_error);
+		free(wp, M_GCACHE);
+		wp = tmpwp;
+	}
 	if (dp->d_flags & D_FLAG_INVALID) {
-		sc->sc_invalid--;
-		g_cache_free(sc, dp);
+		sp->s_invalid--;
+		g_cache_free(sc, sp, dp);
 	} else if (bp->bio_error) {
+		g_cache_unqueue(sp, dp);
 		LIST_REMOVE(dp, d_next);
-		if (dp->d_flags & D_FLAG_USED) {
-			TAILQ_REMOVE(&sc->sc_usedlist, dp, d_used);
-			sc->sc_nused--;
-		}
-		g_cache_free(sc, dp);
+		g_cache_free(sc, sp, dp);
 	}
-	mtx_unlock(&sc->sc_mtx);
+	mtx_unlock(&sp->s_mtx);
 	g_destroy_bio(bp);
 }
 
-static struct g_cache_desc *
-g_cache_lookup(struct g_cache_softc *sc, off_t bno)
+/*
+ * Read a whole block into a busy entry.  The entry can not be evicted or
+ * freed until g_cache_done() clears D_FLAG_BUSY, so no lock is needed here.
+ */
+static void
+g_cache_fill(struct g_cache_softc *sc, struct g_cache_desc *dp,
+    struct bio *cbp)
 {
-	struct g_cache_desc *dp;
 
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
+	cbp->bio_cmd = BIO_READ;
+	cbp->bio_done = g_cache_done;
+	G_CACHE_DESC1(cbp) = sc;
+	G_CACHE_DESC2(cbp) = dp;
+	cbp->bio_offset = BNO2OFF(dp->d_bno, sc);
+	cbp->bio_data = dp->d_data;
+	cbp->bio_length = sc->sc_bsize;
+	G_CACHE_LOGREQ(cbp, "Sending request.");
+	g_io_request(cbp, LIST_FIRST(&sc->sc_geom->consumer));
+}
+
+static void
+g_cache_direct_done(struct bio *cbp)
+{
+	struct bio *bp;
+	int error;
 
-	LIST_FOREACH(dp, &sc->sc_desclist[G_CACHE_BUCKET(bno)], d_next)
-		if (dp->d_bno == bno)
-			return (dp);
-	return (NULL);
+	bp = cbp->bio_parent;
+	error = cbp->bio_error;
+	g_destroy_bio(cbp);
+	g_cache_complete(bp, error);
 }
 
-static int
-g_cache_read(struct g_cache_softc *sc, struct bio *bp)
+/*
+ * Pass the part of a request that falls into block bno straight to the
+ * provider below, for when there is no memory to cache it.
+ */
+static void
+g_cache_read_direct(struct g_cache_softc *sc, struct bio *bp, off_t bno)
 {
 	struct bio *cbp;
+	off_t off, len;
+
+	cbp = g_new_bio();
+	if (cbp == NULL) {
+		g_cache_complete(bp, ENOMEM);
+		return;
+	}
+	off = MAX(bp->bio_offset, BNO2OFF(bno, sc));
+	len = MIN(bp->bio_offset + bp->bio_length, BNO2OFF(bno + 1, sc)) - off;
+	cbp->bio_cmd = BIO_READ;
+	cbp->bio_offset = off;
+	cbp->bio_length = len;
+	cbp->bio_data = bp->bio_data + (off - bp->bio_offset);
+	cbp->bio_parent = bp;
+	cbp->bio_done = g_cache_direct_done;
+	G_CACHE_LOGREQ(cbp, "Sending request.");
+	g_io_request(cbp, LIST_FIRST(&sc->sc_geom->consumer));
+}
+
+static void
+g_cache_read_block(struct g_cache_softc *sc, struct bio *bp, off_t bno)
+{
+	struct g_cache_shard *sp;
 	struct g_cache_desc *dp;
+	struct g_cache_wait *wp;
+	struct bio *cbp;
 
-	mtx_lock(&sc->sc_mtx);
-	dp = g_cache_lookup(sc,
-	    OFF2BNO(bp->bio_offset + bp->bio_completed, sc));
-	if (dp != NULL) {
-		/* Add to waiters list or deliver. */
-		sc->sc_cachehits++;
-		if (dp->d_biolist != NULL) {
-			G_CACHE_NEXT_BIO1(bp) = sc;
-			G_CACHE_NEXT_BIO2(bp) = dp->d_biolist;
-			dp->d_biolist = bp;
-		} else
+	sp = G_CACHE_SHARD(sc, bno);
+	mtx_lock(&sp->s_mtx);
+	dp = g_cache_lookup(sc, sp, bno);
+	if (dp != NULL && dp->d_queue != D_QUEUE_A1OUT) {
+		sp->s_hits++;
+		dp->d_atime = time_uptime;
+		if (dp->d_queue == D_QUEUE_AM) {
+			TAILQ_REMOVE(&sp->s_am, dp, d_lru);
+			TAILQ_INSERT_TAIL(&sp->s_am, dp, d_lru);
+		}
+		if ((dp->d_flags & D_FLAG_BUSY) == 0) {
 			g_cache_deliver(sc, bp, dp, 0);
-		mtx_unlock(&sc->sc_mtx);
-		return (0);
+			mtx_unlock(&sp->s_mtx);
+			return;
+		}
+		/* Add to waiters list. */
+		wp = malloc(sizeof(*wp), M_GCACHE, M_NOWAIT);
+		if (wp == NULL) {
+			mtx_unlock(&sp->s_mtx);
+			g_cache_read_direct(sc, bp, bno);
+			return;
+		}
+		wp->w_bp = bp;
+		wp->w_next = dp->d_waiters;
+		dp->d_waiters = wp;
+		mtx_unlock(&sp->s_mtx);
+		return;
 	}
 
 	/* Cache miss.  Allocate entry and schedule bio.  */
-	sc->sc_cachemisses++;
-	dp = g_cache_alloc(sc);
-	if (dp == NULL) {
-		mtx_unlock(&sc->sc_mtx);
-		return (ENOMEM);
+	sp->s_misses++;
+	if (dp != NULL)
+		sp->s_ghosthits++;
+	wp = malloc(sizeof(*wp), M_GCACHE, M_NOWAIT);
+	cbp = g_new_bio();
+	if (wp == NULL || cbp == NULL ||
+	    (dp = g_cache_alloc(sc, sp, dp, bno)) == NULL) {
+		mtx_unlock(&sp->s_mtx);
+		free(wp, M_GCACHE);
+		if (cbp != NULL)
+			g_destroy_bio(cbp);
+		g_cache_read_direct(sc, bp, bno);
+		return;
 	}
-	cbp = g_clone_bio(bp);
-	if (cbp == NULL) {
-		g_cache_free(sc, dp);
-		mtx_unlock(&sc->sc_mtx);
-		return (ENOMEM);
+	wp->w_bp = bp;
+	wp->w_next = NULL;
+	dp->d_waiters = wp;
+	mtx_unlock(&sp->s_mtx);
+	g_cache_fill(sc, dp, cbp);
+}
+
+/*
+ * Start reading count blocks from bno that are not cached yet.  They are
+ * only placed on A1in, so read-ahead that is never used does not displace
+ * anything from Am.
+ */
+static void
+g_cache_read_ahead(struct g_cache_softc *sc, off_t bno, u_int count)
+{
+	struct g_cache_shard *sp;
+	struct g_cache_desc *dp;
+	struct bio *cbp;
+
+	for (; count > 0 && BNO2OFF(bno, sc) < sc->sc_tail; count--, bno++) {
+		sp = G_CACHE_SHARD(sc, bno);
+		mtx_lock(&sp->s_mtx);
+		if (g_cache_lookup(sc, sp, bno) != NULL) {
+			mtx_unlock(&sp->s_mtx);
+			continue;
+		}
+		cbp = g_new_bio();
+		if (cbp == NULL) {
+			mtx_unlock(&sp->s_mtx);
+			break;
+		}
+		dp = g_cache_alloc(sc, sp, NULL, bno);
+		if (dp == NULL) {
+			mtx_unlock(&sp->s_mtx);
+			g_destroy_bio(cbp);
+			break;
+		}
+		sp->s_readahead++;
+		mtx_unlock(&sp->s_mtx);
+		g_cache_fill(sc, dp, cbp);
 	}
+}
 
-	dp->d_bno = OFF2BNO(bp->bio_offset + bp->bio_completed, sc);
-	G_CACHE_NEXT_BIO1(bp) = sc;
-	G_CACHE_NEXT_BIO2(bp) = NULL;
-	dp->d_biolist = bp;
-	LIST_INSERT_HEAD(&sc->sc_desclist[G_CACHE_BUCKET(dp->d_bno)],
-	    dp, d_next);
-	mtx_unlock(&sc->sc_mtx);
+static void
+g_cache_read(struct g_cache_softc *sc, struct bio *bp)
+{
+	off_t bno, lim, seq;
+	u_int ra;
 
-	G_CACHE_DESC1(cbp) = sc;
-	G_CACHE_DESC2(cbp) = dp;
-	cbp->bio_done = g_cache_done;
-	cbp->bio_offset = BNO2OFF(dp->d_bno, sc);
-	cbp->bio_data = dp->d_data;
-	cbp->bio_length = sc->sc_bsize;
-	g_io_request(cbp, LIST_FIRST(&bp->bio_to->geom->consumer));
-	return (0);
+	bno = OFF2BNO(bp->bio_offset, sc);
+	lim = OFF2BNO(bp->bio_offset + bp->bio_length - 1, sc);
+
+	/*
+	 * A read that starts in or right after the last block of the
+	 * previous one and moves past it continues a sequential stream.
+	 * The shared hint is updated without a lock; a lost update only
+	 * costs a missed read-ahead.
+	 */
+	seq = sc->sc_seqnext;
+	ra = 0;
+	if (lim >= seq && (bno == seq || bno + 1 == seq))
+		ra = g_cache_readahead;
+	sc->sc_seqnext = lim + 1;
+
+	/* The request may be delivered as soon as its last block is. */
+	bp->bio_children = lim - bno + 1;
+	bp->bio_inbed = 0;
+	for (seq = bno; seq <= lim; seq++)
+		g_cache_read_block(sc, bp, seq);
+	if (ra > 0)
+		g_cache_read_ahead(sc, lim + 1, ra);
 }
 
 static void
 g_cache_invalidate(struct g_cache_softc *sc, struct bio *bp)
 {
+	struct g_cache_shard *sp;
 	struct g_cache_desc *dp;
 	off_t bno, lim;
 
-	mtx_lock(&sc->sc_mtx);
 	bno = OFF2BNO(bp->bio_offset, sc);
 	lim = OFF2BNO(bp->bio_offset + bp->bio_length - 1, sc);
 	do {
-		if ((dp = g_cache_lookup(sc, bno)) != NULL) {
+		sp = G_CACHE_SHARD(sc, bno);
+		mtx_lock(&sp->s_mtx);
+		dp = g_cache_lookup(sc, sp, bno);
+		if (dp != NULL && dp->d_queue != D_QUEUE_A1OUT) {
+			g_cache_unqueue(sp, dp);
 			LIST_REMOVE(dp, d_next);
-			if (dp->d_flags & D_FLAG_USED) {
-				TAILQ_REMOVE(&sc->sc_usedlist, dp, d_used);
-				sc->sc_nused--;
-			}
-			if (dp->d_biolist == NULL)
-				g_cache_free(sc, dp);
+			if ((dp->d_flags & D_FLAG_BUSY) == 0)
+				g_cache_free(sc, sp, dp);
 			else {
-				dp->d_flags = D_FLAG_INVALID;
-				sc->sc_invalid++;
+				dp->d_flags |= D_FLAG_INVALID;
+				sp->s_invalid++;
 			}
 		}
+		mtx_unlock(&sp->s_mtx);
 		bno++;
 	} while (bno <= lim);
-	mtx_unlock(&sc->sc_mtx);
 }
 
 static void
@@ -341,7 +630,6 @@ g_cache_start(struct bio *bp)
 {
 	struct g_cache_softc *sc;
 	struct g_geom *gp;
-	struct g_cache_desc *dp;
 	struct bio *cbp;
 
 	gp = bp->bio_to->geom;
@@ -349,43 +637,20 @@ g_cache_start(struct bio *bp)
 	G_CACHE_LOGREQ(bp, "Request received.");
 	switch (bp->bio_cmd) {
 	case BIO_READ:
-		sc->sc_reads++;
-		sc->sc_readbytes += bp->bio_length;
+		counter_u64_add(sc->sc_reads, 1);
+		counter_u64_add(sc->sc_readbytes, bp->bio_length);
 		if (!g_cache_enable)
 			break;
-		if (bp->bio_offset + bp->bio_length > sc->sc_tail)
+		if (bp->bio_length == 0 ||
+		    bp->bio_offset + bp->bio_length > sc->sc_tail)
 			break;
-		if (OFF2BNO(bp->bio_offset, sc) ==
-		    OFF2BNO(bp->bio_offset + bp->bio_length - 1, sc)) {
-			sc->sc_cachereads++;
-			sc->sc_cachereadbytes += bp->bio_length;
-			if (g_cache_read(sc, bp) == 0)
-				return;
-			sc->sc_cachereads--;
-			sc->sc_cachereadbytes -= bp->bio_length;
-			break;
-		} else if (OFF2BNO(bp->bio_offset, sc) + 1 ==
-		    OFF2BNO(bp->bio_offset + bp->bio_length - 1, sc)) {
-			mtx_lock(&sc->sc_mtx);
-			dp = g_cache_lookup(sc, OFF2BNO(bp->bio_offset, sc));
-			if (dp == NULL || dp->d_biolist != NULL) {
-				mtx_unlock(&sc->sc_mtx);
-				break;
-			}
-			sc->sc_cachereads++;
-			sc->sc_cachereadbytes += bp->bio_length;
-			g_cache_deliver(sc, bp, dp, 0);
-			mtx_unlock(&sc->sc_mtx);
-			if (g_cache_read(sc, bp) == 0)
-				return;
-			sc->sc_cachereads--;
-			sc->sc_cachereadbytes -= bp->bio_length;
-			break;
-		}
-		break;
+		counter_u64_add(sc->sc_cachereads, 1);
+		counter_u64_add(sc->sc_cachereadbytes, bp->bio_length);
+		g_cache_read(sc, bp);
+		return;
 	case BIO_WRITE:
-		sc->sc_writes++;
-		sc->sc_wrotebytes += bp->bio_length;
+		counter_u64_add(sc->sc_writes, 1);
+		counter_u64_add(sc->sc_wrotebytes, bp->bio_length);
 		g_cache_invalidate(sc, bp);
 		break;
 	}
@@ -403,28 +668,32 @@ static void
 g_cache_go(void *arg)
 {
 	struct g_cache_softc *sc = arg;
-	struct g_cache_desc *dp;
-	int i;
-
-	mtx_assert(&sc->sc_mtx, MA_OWNED);
-
-	/* Forcibly mark idle ready entries as used. */
-	for (i = 0; i < G_CACHE_BUCKETS; i++) {
-		LIST_FOREACH(dp, &sc->sc_desclist[i], d_next) {
-			if (dp->d_flags & D_FLAG_USED ||
-			    dp->d_biolist != NULL ||
-			    time_uptime - dp->d_atime < g_cache_idletime)
-				continue;
-			TAILQ_INSERT_TAIL(&sc->sc_usedlist, dp, d_used);
-			sc->sc_nused++;
-			dp->d_flags |= D_FLAG_USED;
+	struct g_cache_shard *sp;
+	struct g_cache_desc *dp, *dp2;
+	u_int i, lo;
+
+	/*
+	 * Blocks that were read once and then left alone are the first
+	 * to give their memory back: once A1in of a shard grows above
+	 * used_hi percent, release its idle entries down to used_lo.
+	 */
+	for (i = 0; i < sc->sc_nshards; i++) {
+		sp = &sc->sc_shards[i];
+		mtx_lock(&sp->s_mtx);
+		if (sp->s_na1in > SHARDPCT(sc, g_cache_used_hi)) {
+			lo = SHARDPCT(sc, g_cache_used_lo);
+			TAILQ_FOREACH_SAFE(dp, &sp->s_a1in, d_lru, dp2) {
+				if (sp->s_na1in <= lo)
+					break;
+				if (dp->d_flags & D_FLAG_BUSY ||
+				    time_uptime - dp->d_atime < g_cache_idletime)
+					continue;
+				g_cache_evict(sc, sp, dp);
+			}
 		}
+		mtx_unlock(&sp->s_mtx);
 	}
 
-	/* Keep the number of used entries low. */
-	if (sc->sc_nused > g_cache_used_hi * sc->sc_maxent / 100)
-		g_cache_free_used(sc);
-
 	callout_reset(&sc->sc_callout, g_cache_timeout * hz, g_cache_go, sc);
 }
 
@@ -470,8 +739,8 @@ g_cache_create(struct g_class *mp, struct g_provider *pp,
 	struct g_geom *gp;
 	struct g_provider *newpp;
 	struct g_consumer *cp;
-	u_int bshift;
-	int i;
+	struct g_cache_shard *sp;
+	u_int bshift, i, nshards;
 
 	g_topology_assert();
 
@@ -509,12 +778,36 @@ g_cache_create(struct g_class *mp, struct g_provider *pp,
 	sc->sc_bsize = 1 << bshift;
 	sc->sc_zone = uma_zcreate("gcache", sc->sc_bsize, NULL, NULL, NULL, NULL,
 	    UMA_ALIGN_PTR, 0);
-	mtx_init(&sc->sc_mtx, "GEOM CACHE mutex", NULL, MTX_DEF);
-	for (i = 0; i < G_CACHE_BUCKETS; i++)
-		LIST_INIT(&sc->sc_desclist[i]);
-	TAILQ_INIT(&sc->sc_usedlist);
 	sc->sc_maxent = md->md_size;
-	callout_init_mtx(&sc->sc_callout, &sc->sc_mtx, 0);
+
+	/*
+	 * One shard per CPU by default, rounded to a power of two, but
+	 * never so many that a shard holds less than a handful of blocks.
+	 */
+	nshards = g_cache_shards != 0 ? g_cache_shards : mp_ncpus;
+	nshards = MIN(nshards, G_CACHE_MAXSHARDS);
+	sc->sc_shardshift = 0;
+	while ((1U << (sc->sc_shardshift + 1)) <= nshards &&
+	    (sc->sc_maxent >> (sc->sc_shardshift + 1)) >= 16)
+		sc->sc_shardshift++;
+	sc->sc_nshards = 1 << sc->sc_shardshift;
+	sc->sc_shards = malloc(sc->sc_nshards * sizeof(*sc->sc_shards),
+	    M_GCACHE, M_WAITOK | M_ZERO);
+	for (i = 0; i < sc->sc_nshards; i++) {
+		sp = &sc->sc_shards[i];
+		mtx_init(&sp->s_mtx, "GEOM CACHE mutex", NULL, MTX_DEF);
+		sp->s_hash = hashinit(SHARDMAX(sc), M_GCACHE, &sp->s_hashmask);
+		TAILQ_INIT(&sp->s_a1in);
+		TAILQ_INIT(&sp->s_a1out);
+		TAILQ_INIT(&sp->s_am);
+	}
+	sc->sc_reads = counter_u64_alloc(M_WAITOK);
+	sc->sc_readbytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_cachereads = counter_u64_alloc(M_WAITOK);
+	sc->sc_cachereadbytes = counter_u64_alloc(M_WAITOK);
+	sc->sc_writes = counter_u64_alloc(M_WAITOK);
+	sc->sc_wrotebytes = counter_u64_alloc(M_WAITOK);
+	callout_init(&sc->sc_callout, 1);
 	gp->softc = sc;
 	sc->sc_geom = gp;
 	gp->start = g_cache_start;
@@ -534,8 +827,7 @@ g_cache_create(struct g_class *mp, struct g_provider *pp,
 		G_CACHE_DEBUG(0, "Cannot attach to provider %s.", pp->name);
 		g_destroy_consumer(cp);
 		g_destroy_provider(newpp);
-		mtx_destroy(&sc->sc_mtx);
-		g_free(sc);
+		g_cache_free_softc(sc);
 		g_destroy_geom(gp);
 		return (NULL);
 	}
@@ -546,13 +838,43 @@ g_cache_create(struct g_class *mp, struct g_provider *pp,
 	return (gp);
 }
 
+static void
+g_cache_free_softc(struct g_cache_softc *sc)
+{
+	struct g_cache_shard *sp;
+	struct g_cache_desc *dp, *dp2;
+	u_int i;
+	u_long j;
+
+	for (i = 0; i < sc->sc_nshards; i++) {
+		sp = &sc->sc_shards[i];
+		mtx_lock(&sp->s_mtx);
+		for (j = 0; j <= sp->s_hashmask; j++) {
+			LIST_FOREACH_SAFE(dp, &sp->s_hash[j], d_next, dp2) {
+				g_cache_unqueue(sp, dp);
+				g_cache_free(sc, sp, dp);
+			}
+		}
+		mtx_unlock(&sp->s_mtx);
+		hashdestroy(sp->s_hash, M_GCACHE, sp->s_hashmask);
+		mtx_destroy(&sp->s_mtx);
+	}
+	free(sc->sc_shards, M_GCACHE);
+	counter_u64_free(sc->sc_reads);
+	counter_u64_free(sc->sc_readbytes);
+	counter_u64_free(sc->sc_cachereads);
+	counter_u64_free(sc->sc_cachereadbytes);
+	counter_u64_free(sc->sc_writes);
+	counter_u64_free(sc->sc_wrotebytes);
+	uma_zdestroy(sc->sc_zone);
+	g_free(sc);
+}
+
 static int
 g_cache_destroy(struct g_cache_softc *sc, boolean_t force)
 {
 	struct g_geom *gp;
 	struct g_provider *pp;
-	struct g_cache_desc *dp, *dp2;
-	int i;
 
 	g_topology_assert();
 	if (sc == NULL)
@@ -572,19 +894,7 @@ g_cache_destroy(struct g_cache_softc *sc, boolean_t force)
 		G_CACHE_DEBUG(0, "Device %s removed.", gp->name);
 	}
 	callout_drain(&sc->sc_callout);
-	mtx_lock(&sc->sc_mtx);
-	for (i = 0; i < G_CACHE_BUCKETS; i++) {
-		dp = LIST_FIRST(&sc->sc_desclist[i]);
-		while (dp != NULL) {
-			dp2 = LIST_NEXT(dp, d_next);
-			g_cache_free(sc, dp);
-			dp = dp2;
-		}
-	}
-	mtx_unlock(&sc->sc_mtx);
-	mtx_destroy(&sc->sc_mtx);
-	uma_zdestroy(sc->sc_zone);
-	g_free(sc);
+	g_cache_free_softc(sc);
 	gp->softc = NULL;
 	g_wither_geom(gp, ENXIO);
 
@@ -901,9 +1211,11 @@ static void
 g_cache_ctl_reset(struct gctl_req *req, struct g_class *mp)
 {
 	struct g_cache_softc *sc;
+	struct g_cache_shard *sp;
 	const char *name;
 	char param[16];
 	int i, *nargs;
+	u_int j;
 
 	g_topology_assert();
 
@@ -930,15 +1242,22 @@ g_cache_ctl_reset(struct gctl_req *req, struct g_class *mp)
 			gctl_error(req, "Device %s is invalid.", name);
 			return;
 		}
-		sc->sc_reads = 0;
-		sc->sc_readbytes = 0;
-		sc->sc_cachereads = 0;
-		sc->sc_cachereadbytes = 0;
-		sc->sc_cachehits = 0;
-		sc->sc_cachemisses = 0;
-		sc->sc_cachefull = 0;
-		sc->sc_writes = 0;
-		sc->sc_wrotebytes = 0;
+		counter_u64_zero(sc->sc_reads);
+		counter_u64_zero(sc->sc_readbytes);
+		counter_u64_zero(sc->sc_cachereads);
+		counter_u64_zero(sc->sc_cachereadbytes);
+		counter_u64_zero(sc->sc_writes);
+		counter_u64_zero(sc->sc_wrotebytes);
+		for (j = 0; j < sc->sc_nshards; j++) {
+			sp = &sc->sc_shards[j];
+			mtx_lock(&sp->s_mtx);
+			sp->s_hits = 0;
+			sp->s_misses = 0;
+			sp->s_ghosthits = 0;
+			sp->s_readahead = 0;
+			sp->s_full = 0;
+			mtx_unlock(&sp->s_mtx);
+		}
 	}
 }
 
@@ -982,35 +1301,73 @@ g_cache_dumpconf(struct sbuf *sb, const char *indent, struct g_geom *gp,
     struct g_consumer *cp, struct g_provider *pp)
 {
 	struct g_cache_softc *sc;
+	struct g_cache_shard *sp;
+	uint64_t hits, misses, ghosthits, readahead, full;
+	u_int i, nent, na1in, na1out, nam, invalid;
 
 	if (pp != NULL || cp != NULL)
 		return;
 	sc = gp->softc;
+	hits = misses = ghosthits = readahead = full = 0;
+	nent = na1in = na1out = nam = invalid = 0;
+	for (i = 0; i < sc->sc_nshards; i++) {
+		sp = &sc->sc_shards[i];
+		hits += sp->s_hits;
+		misses += sp->s_misses;
+		ghosthits += sp->s_ghosthits;
+		readahead += sp->s_readahead;
+		full += sp->s_full;
+		nent += sp->s_nent;
+		na1in += sp->s_na1in;
+		na1out += sp->s_na1out;
+		nam += sp->s_nam;
+		invalid += sp->s_invalid;
+	}
 	sbuf_printf(sb, "%s<Size>%u</Size>\n", indent, sc->sc_maxent);
 	sbuf_printf(sb, "%s<BlockSize>%u</BlockSize>\n", indent, sc->sc_bsize);
 	sbuf_printf(sb, "%s<TailOffset>%ju</TailOffset>\n", indent,
 	    (uintmax_t)sc->sc_tail);
-	sbuf_printf(sb, "%s<Entries>%u</Entries>\n", indent, sc->sc_nent);
-	sbuf_printf(sb, "%s<UsedEntries>%u</UsedEntries>\n", indent,
-	    sc->sc_nused);
+	sbuf_printf(sb, "%s<Shards>%u</Shards>\n", indent, sc->sc_nshards);
+	sbuf_printf(sb, "%s<Entries>%u</Entries>\n", indent, nent);
+	sbuf_printf(sb, "%s<A1inEntries>%u</A1inEntries>\n", indent, na1in);
+	sbuf_printf(sb, "%s<A1outEntries>%u</A1outEntries>\n", indent, na1out);
+	sbuf_printf(sb, "%s<AmEntries>%u</AmEntries>\n", indent, nam);
 	sbuf_printf(sb, "%s<InvalidEntries>%u</InvalidEntries>\n", indent,
-	    sc->sc_invalid);
-	sbuf_printf(sb, "%s<Reads>%ju</Reads>\n", indent, sc->sc_reads);
+	    invalid);
+	sbuf_printf(sb, "%s<Reads>%ju</Reads>\n", indent,
+	    (uintmax_t)counter_u64_fetch(sc->sc_reads));
 	sbuf_printf(sb, "%s<ReadBytes>%ju</ReadBytes>\n", indent,
-	    sc->sc_readbytes);
+	    (uintmax_t)counter_u64_fetch(sc->sc_readbytes));
 	sbuf_printf(sb, "%s<CacheReads>%ju</CacheReads>\n", indent,
-	    sc->sc_cachereads);
+	    (uintmax_t)counter_u64_fetch(sc->sc_cachereads));
 	sbuf_printf(sb, "%s<CacheReadBytes>%ju</CacheReadBytes>\n", indent,
-	    sc->sc_cachereadbytes);
+	    (uintmax_t)counter_u64_fetch(sc->sc_cachereadbytes));
 	sbuf_printf(sb, "%s<CacheHits>%ju</CacheHits>\n", indent,
-	    sc->sc_cachehits);
+	    (uintmax_t)hits);
 	sbuf_printf(sb, "%s<CacheMisses>%ju</CacheMisses>\n", indent,
-	    sc->sc_cachemisses);
+	    (uintmax_t)misses);
+	sbuf_printf(sb, "%s<CacheGhostHits>%ju</CacheGhostHits>\n", indent,
+	    (uintmax_t)ghosthits);
+	sbuf_printf(sb, "%s<CacheReadAhead>%ju</CacheReadAhead>\n", indent,
+	    (uintmax_t)readahead);
 	sbuf_printf(sb, "%s<CacheFull>%ju</CacheFull>\n", indent,
-	    sc->sc_cachefull);
-	sbuf_printf(sb, "%s<Writes>%ju</Writes>\n", indent, sc->sc_writes);
+	    (uintmax_t)full);
+	sbuf_printf(sb, "%s<Writes>%ju</Writes>\n", indent,
+	    (uintmax_t)counter_u64_fetch(sc->sc_writes));
 	sbuf_printf(sb, "%s<WroteBytes>%ju</WroteBytes>\n", indent,
-	    sc->sc_wrotebytes);
+	    (uintmax_t)counter_u64_fetch(sc->sc_wrotebytes));
+
+	/* Per-shard hit and miss counts, in shard order. */
+	sbuf_printf(sb, "%s<ShardHits>", indent);
+	for (i = 0; i < sc->sc_nshards; i++)
+		sbuf_printf(sb, "%s%ju", i == 0 ? "" : " ",
+		    (uintmax_t)sc->sc_shards[i].s_hits);
+	sbuf_printf(sb, "</ShardHits>\n");
+	sbuf_printf(sb, "%s<ShardMisses>", indent);
+	for (i = 0; i < sc->sc_nshards; i++)
+		sbuf_printf(sb, "%s%ju", i == 0 ? "" : " ",
+		    (uintmax_t)sc->sc_shards[i].s_misses);
+	sbuf_printf(sb, "</ShardMisses>\n");
 }
 
 DECLARE_GEOM_CLASS(g_cache_class, g_cache);
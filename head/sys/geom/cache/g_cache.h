@@ -59,8 +59,36 @@
 	}								\
 } while (0)
 
-#define	G_CACHE_BUCKETS		(1 << 3)
-#define	G_CACHE_BUCKET(bno)	((bno) & (G_CACHE_BUCKETS - 1))
+#define	G_CACHE_MAXSHARDS	64
+
+/*
+ * Blocks are spread over a power-of-two number of shards by the low bits
+ * of the block number, so that neighbouring blocks of a sequential stream
+ * land on different shards.  Each shard runs its own 2Q replacement:
+ * blocks read for the first time enter A1in, blocks pushed out of A1in
+ * are remembered (without data) in A1out, and only blocks referenced
+ * again while in A1out are admitted to the LRU-ordered Am queue.  A
+ * single scan therefore can not flush the frequently used blocks.
+ */
+struct g_cache_shard {
+	struct mtx	s_mtx;
+	LIST_HEAD(, g_cache_desc) *s_hash;
+	u_long		s_hashmask;
+	TAILQ_HEAD(, g_cache_desc) s_a1in;	/* first-time blocks */
+	TAILQ_HEAD(, g_cache_desc) s_a1out;	/* ghosts of evicted A1in */
+	TAILQ_HEAD(, g_cache_desc) s_am;	/* re-referenced blocks */
+	u_int		s_nent;			/* entries holding data */
+	u_int		s_na1in;		/* entries on A1in */
+	u_int		s_na1out;		/* entries on A1out */
+	u_int		s_nam;			/* entries on Am */
+	u_int		s_invalid;		/* invalid entries */
+
+	uint64_t	s_hits;			/* cache hits */
+	uint64_t	s_misses;		/* cache misses */
+	uint64_t	s_ghosthits;		/* misses found on A1out */
+	uint64_t	s_readahead;		/* blocks read ahead */
+	uint64_t	s_full;			/* #times the shard was full */
+} __aligned(CACHE_LINE_SIZE);
 
 struct g_cache_softc {
 	struct g_geom	*sc_geom;
@@ -68,43 +96,51 @@ struct g_cache_softc {
 	u_int		sc_bshift;
 	u_int		sc_bsize;
 	off_t		sc_tail;
-	struct mtx	sc_mtx;
+	off_t		sc_seqnext;		/* block after last read */
 	struct callout	sc_callout;
-	LIST_HEAD(, g_cache_desc) sc_desclist[G_CACHE_BUCKETS];
-	TAILQ_HEAD(, g_cache_desc) sc_usedlist;
+	struct g_cache_shard *sc_shards;
+	u_int		sc_nshards;
+	u_int		sc_shardshift;
 	uma_zone_t	sc_zone;
 
 	u_int		sc_maxent;		/* max entries */
-	u_int		sc_nent;		/* allocated entries */
-	u_int		sc_nused;		/* re-useable entries */
-	u_int		sc_invalid;		/* invalid entries */
-
-	uintmax_t	sc_reads;		/* #reads */
-	uintmax_t	sc_readbytes;		/* bytes read */
-	uintmax_t	sc_cachereads;		/* #reads from cache */
-	uintmax_t	sc_cachereadbytes;	/* bytes read from cache */
-	uintmax_t	sc_cachehits;		/* cache hits */
-	uintmax_t	sc_cachemisses;		/* cache misses */
-	uintmax_t	sc_cachefull;		/* #times a cache was full */
-	uintmax_t	sc_writes;		/* #writes */
-	uintmax_t	sc_wrotebytes;		/* bytes written */
+
+	counter_u64_t	sc_reads;		/* #reads */
+	counter_u64_t	sc_readbytes;		/* bytes read */
+	counter_u64_t	sc_cachereads;		/* #reads from cache */
+	counter_u64_t	sc_cachereadbytes;	/* bytes read from cache */
+	counter_u64_t	sc_writes;		/* #writes */
+	counter_u64_t	sc_wrotebytes;		/* bytes written */
 };
 #define	sc_name	sc_geom->name
 
+#define	G_CACHE_SHARD(sc, bno)						\
+	(&(sc)->sc_shards[(bno) & ((sc)->sc_nshards - 1)])
+#define	G_CACHE_HASH(sc, sp, bno)					\
+	(&(sp)->s_hash[((bno) >> (sc)->sc_shardshift) & (sp)->s_hashmask])
+
+struct g_cache_wait {
+	struct bio	*w_bp;			/* waiting request */
+	struct g_cache_wait *w_next;		/* list */
+};
+
 struct g_cache_desc {
 	off_t		d_bno;			/* block number */
-	caddr_t		d_data;			/* data area */
-	struct bio	*d_biolist;		/* waiters */
+	caddr_t		d_data;			/* data area, NULL on A1out */
+	struct g_cache_wait *d_waiters;		/* waiters */
 	time_t		d_atime;		/* access time */
 	int		d_flags;		/* flags */
-#define	D_FLAG_USED	(1 << 0)			/* can be reused */
+#define	D_FLAG_BUSY	(1 << 0)			/* read in progress */
 #define	D_FLAG_INVALID	(1 << 1)			/* invalid */
-	LIST_ENTRY(g_cache_desc) d_next;	/* list */
-	TAILQ_ENTRY(g_cache_desc) d_used;	/* used list */
+	int		d_queue;		/* 2Q queue */
+#define	D_QUEUE_NONE	0
+#define	D_QUEUE_A1IN	1
+#define	D_QUEUE_A1OUT	2
+#define	D_QUEUE_AM	3
+	LIST_ENTRY(g_cache_desc) d_next;	/* hash list */
+	TAILQ_ENTRY(g_cache_desc) d_lru;	/* 2Q queue */
 };
 
-#define	G_CACHE_NEXT_BIO1(bp)	(bp)->bio_driver1
-#define	G_CACHE_NEXT_BIO2(bp)	(bp)->bio_driver2
 #define	G_CACHE_DESC1(bp)	(bp)->bio_caller1
 #define	G_CACHE_DESC2(bp)	(bp)->bio_caller2
 
@@ -81,6 +81,10 @@ SYSCTL_UINT(_kern_geom_eli, OID_AUTO, threads, CTLFLAG_RWTUN, &g_eli_threads, 0,
 u_int g_eli_batch = 0;
 SYSCTL_UINT(_kern_geom_eli, OID_AUTO, batch, CTLFLAG_RWTUN, &g_eli_batch, 0,
     "Use crypto operations batching");
+static u_int g_eli_worker_batch = 16;
+SYSCTL_UINT(_kern_geom_eli, OID_AUTO, worker_batch, CTLFLAG_RWTUN,
+    &g_eli_worker_batch, 0,
+    "Maximum number of requests a worker takes off its queue at once");
 
 /*
  * Passphrase cached during boot, in order to be more user-friendly if
@@ -164,11 +168,10 @@ g_eli_crypto_rerun(struct cryptop *crp)
 
 	bp = (struct bio *)crp->crp_opaque;
 	sc = bp->bio_to->geom->softc;
-	LIST_FOREACH(wr, &sc->sc_workers, w_next) {
-		if (wr->w_number == bp->bio_pflags)
-			break;
-	}
-	KASSERT(wr != NULL, ("Invalid worker (%u).", bp->bio_pflags));
+	KASSERT(bp->bio_pflags < sc->sc_nwqueues &&
+	    sc->sc_wqueues[bp->bio_pflags] != NULL,
+	    ("Invalid worker (%u).", bp->bio_pflags));
+	wr = sc->sc_wqueues[bp->bio_pflags];
 	G_ELI_DEBUG(1, "Rerunning crypto %s request (sid: %ju -> %ju).",
 	    bp->bio_cmd == BIO_READ ? "READ" : "WRITE", (uintmax_t)wr->w_sid,
 	    (uintmax_t)crp->crp_sid);
@@ -191,6 +194,7 @@ void
 g_eli_read_done(struct bio *bp)
 {
 	struct g_eli_softc *sc;
+	struct g_eli_worker *wr;
 	struct bio *pbp;
 
 	G_ELI_LOGREQ(2, bp, "Request done.");
@@ -216,10 +220,11 @@ g_eli_read_done(struct bio *bp)
 		atomic_subtract_int(&sc->sc_inflight, 1);
 		return;
 	}
-	mtx_lock(&sc->sc_queue_mtx);
-	bioq_insert_tail(&sc->sc_queue, pbp);
-	mtx_unlock(&sc->sc_queue_mtx);
-	wakeup(sc);
+	wr = sc->sc_wqueues[pbp->bio_pflags];
+	mtx_lock(&wr->w_queue_mtx);
+	bioq_insert_tail(&wr->w_queue, pbp);
+	wakeup(wr);
+	mtx_unlock(&wr->w_queue_mtx);
 }
 
 /*
@@ -291,10 +296,70 @@ g_eli_orphan(struct g_consumer *cp)
  * BIO_WRITE:
  *	G_ELI_START -> g_eli_crypto_run -> g_eli_crypto_write_done -> g_io_request -> g_eli_write_done -> g_io_deliver
  */
+/*
+ * Pick the worker for a new request.  With one worker bound to every CPU
+ * (the default) this is the worker running on the submitting CPU.
+ */
+static struct g_eli_worker *
+g_eli_curworker(struct g_eli_softc *sc)
+{
+	struct g_eli_worker *wr;
+
+	wr = sc->sc_wqueues[curcpu % sc->sc_nwqueues];
+	if (wr == NULL)
+		wr = LIST_FIRST(&sc->sc_workers);
+	return (wr);
+}
+
+/*
+ * Wake up all workers, after a change of the suspend or destroy state.
+ * Must not be called with sc_queue_mtx held, as the workers take their
+ * own queue lock first.
+ */
+void
+g_eli_wakeup_workers(struct g_eli_softc *sc)
+{
+	struct g_eli_worker *wr;
+	u_int i;
+
+	mtx_assert(&sc->sc_queue_mtx, MA_NOTOWNED);
+
+	for (i = 0; i < sc->sc_nwqueues; i++) {
+		wr = sc->sc_wqueues[i];
+		if (wr == NULL)
+			continue;
+		mtx_lock(&wr->w_queue_mtx);
+		wakeup(wr);
+		mtx_unlock(&wr->w_queue_mtx);
+	}
+}
+
+/*
+ * Free the workers once all of their threads are gone.
+ */
+static void
+g_eli_free_workers(struct g_eli_softc *sc)
+{
+	struct g_eli_worker *wr;
+	u_int i;
+
+	for (i = 0; i < sc->sc_nwqueues; i++) {
+		wr = sc->sc_wqueues[i];
+		if (wr == NULL)
+			continue;
+		mtx_destroy(&wr->w_queue_mtx);
+		free(wr, M_ELI);
+	}
+	free(sc->sc_wqueues, M_ELI);
+	sc->sc_wqueues = NULL;
+	sc->sc_nwqueues = 0;
+}
+
 static void
 g_eli_start(struct bio *bp)
 {
 	struct g_eli_softc *sc;
+	struct g_eli_worker *wr;
 	struct g_consumer *cp;
 	struct bio *cbp;
 
@@ -334,16 +399,18 @@ g_eli_start(struct bio *bp)
 	bp->bio_pflags = G_ELI_NEW_BIO;
 	switch (bp->bio_cmd) {
 	case BIO_READ:
+		wr = g_eli_curworker(sc);
 		if (!(sc->sc_flags & G_ELI_FLAG_AUTH)) {
-			g_eli_crypto_read(sc, bp, 0);
+			g_eli_crypto_read(wr, bp, 0);
 			break;
 		}
 		/* FALLTHROUGH */
 	case BIO_WRITE:
-		mtx_lock(&sc->sc_queue_mtx);
-		bioq_insert_tail(&sc->sc_queue, bp);
-		mtx_unlock(&sc->sc_queue_mtx);
-		wakeup(sc);
+		wr = g_eli_curworker(sc);
+		mtx_lock(&wr->w_queue_mtx);
+		bioq_insert_tail(&wr->w_queue, bp);
+		wakeup(wr);
+		mtx_unlock(&wr->w_queue_mtx);
 		break;
 	case BIO_GETATTR:
 	case BIO_FLUSH:
@@ -428,38 +495,52 @@ g_eli_freesession(struct g_eli_worker *wr)
 	crypto_freesession(wr->w_sid);
 }
 
+/*
+ * Fail all requests still queued on the worker.  The provider allows direct
+ * dispatch, so g_io_deliver() may call straight back into g_eli_start() and
+ * the queue lock must not be held while the requests are delivered.
+ */
 static void
-g_eli_cancel(struct g_eli_softc *sc)
+g_eli_cancel(struct g_eli_worker *wr)
 {
+	struct bio_queue_head queue;
 	struct bio *bp;
 
-	mtx_assert(&sc->sc_queue_mtx, MA_OWNED);
+	mtx_assert(&wr->w_queue_mtx, MA_NOTOWNED);
 
-	while ((bp = bioq_takefirst(&sc->sc_queue)) != NULL) {
+	bioq_init(&queue);
+	mtx_lock(&wr->w_queue_mtx);
+	while ((bp = bioq_takefirst(&wr->w_queue)) != NULL) {
 		KASSERT(bp->bio_pflags == G_ELI_NEW_BIO,
 		    ("Not new bio when canceling (bp=%p).", bp));
-		g_io_deliver(bp, ENXIO);
+		bioq_insert_tail(&queue, bp);
 	}
+	mtx_unlock(&wr->w_queue_mtx);
+
+	while ((bp = bioq_takefirst(&queue)) != NULL)
+		g_io_deliver(bp, ENXIO);
 }
 
 static struct bio *
-g_eli_takefirst(struct g_eli_softc *sc)
+g_eli_takefirst(struct g_eli_worker *wr)
 {
+	struct g_eli_softc *sc;
 	struct bio *bp;
 
-	mtx_assert(&sc->sc_queue_mtx, MA_OWNED);
+	mtx_assert(&wr->w_queue_mtx, MA_OWNED);
 
+	sc = wr->w_softc;
 	if (!(sc->sc_flags & G_ELI_FLAG_SUSPEND))
-		return (bioq_takefirst(&sc->sc_queue));
+		return (bioq_takefirst(&wr->w_queue));
 	/*
 	 * Device suspended, so we skip new I/O requests.
 	 */
-	TAILQ_FOREACH(bp, &sc->sc_queue.queue, bio_queue) {
+	TAILQ_FOREACH(bp, &wr->w_queue.queue, bio_queue) {
 		if (bp->bio_pflags != G_ELI_NEW_BIO)
 			break;
 	}
 	if (bp != NULL)
-		bioq_remove(&sc->sc_queue, bp);
+		bioq_remove(&wr->w_queue, bp);
 	return (bp);
 }
 
@@ -468,13 +549,17 @@ g_eli_takefirst(struct g_eli_softc *sc)
  * hardware acceleration and we have to do cryptography in software.
  * Dedicated thread is needed, so we don't slow down g_up/g_down GEOM
  * threads with crypto work.
+ * Every worker serves its own queue, and takes up to g_eli_worker_batch
+ * requests off it per lock acquisition.
  */
 static void
 g_eli_worker(void *arg)
 {
+	TAILQ_HEAD(, bio) batch;
 	struct g_eli_softc *sc;
 	struct g_eli_worker *wr;
 	struct bio *bp;
+	u_int n;
 	int error;
 
 	wr = arg;
@@ -494,18 +579,25 @@ g_eli_worker(void *arg)
 
 	G_ELI_DEBUG(1, "Thread %s started.", curthread->td_proc->p_comm);
 
+	TAILQ_INIT(&batch);
 	for (;;) {
-		mtx_lock(&sc->sc_queue_mtx);
+		mtx_lock(&wr->w_queue_mtx);
 again:
-		bp = g_eli_takefirst(sc);
+		bp = g_eli_takefirst(wr);
 		if (bp == NULL) {
 			if (sc->sc_flags & G_ELI_FLAG_DESTROY) {
-				g_eli_cancel(sc);
-				LIST_REMOVE(wr, w_next);
-				g_eli_freesession(wr);
-				free(wr, M_ELI);
+				if (wr->w_active)
+					g_eli_freesession(wr);
+				mtx_unlock(&wr->w_queue_mtx);
+				g_eli_cancel(wr);
 				G_ELI_DEBUG(1, "Thread %s exiting.",
 				    curthread->td_proc->p_comm);
+				/*
+				 * The worker itself is freed by whoever
+				 * waits for the list to become empty.
+				 */
+				mtx_lock(&sc->sc_queue_mtx);
+				LIST_REMOVE(wr, w_next);
 				wakeup(&sc->sc_workers);
 				mtx_unlock(&sc->sc_queue_mtx);
 				kproc_exit(0);
@@ -518,7 +610,7 @@ again:
 					 * We still have inflight BIOs, so
 					 * sleep and retry.
 					 */
-					msleep(sc, &sc->sc_queue_mtx, PRIBIO,
+					msleep(wr, &wr->w_queue_mtx, PRIBIO,
 					    "geli:inf", hz / 5);
 					goto again;
 				}
@@ -526,12 +618,13 @@ again:
 				 * Suspend requested, mark the worker as
 				 * suspended and go to sleep.
 				 */
-				if (wr->w_active) {
+				if (wr->w_active)
 					g_eli_freesession(wr);
-					wr->w_active = FALSE;
-				}
+				mtx_lock(&sc->sc_queue_mtx);
+				wr->w_active = FALSE;
 				wakeup(&sc->sc_workers);
-				msleep(sc, &sc->sc_queue_mtx, PRIBIO,
+				mtx_unlock(&sc->sc_queue_mtx);
+				msleep(wr, &wr->w_queue_mtx, PRIBIO,
 				    "geli:suspend", 0);
 				if (!wr->w_active &&
 				    !(sc->sc_flags & G_ELI_FLAG_SUSPEND)) {
@@ -543,30 +636,38 @@ again:
 				}
 				goto again;
 			}
-			msleep(sc, &sc->sc_queue_mtx, PDROP, "geli:w", 0);
+			msleep(wr, &wr->w_queue_mtx, PDROP, "geli:w", 0);
 			continue;
 		}
-		if (bp->bio_pflags == G_ELI_NEW_BIO)
-			atomic_add_int(&sc->sc_inflight, 1);
-		mtx_unlock(&sc->sc_queue_mtx);
-		if (bp->bio_pflags == G_ELI_NEW_BIO) {
-			bp->bio_pflags = 0;
-			if (sc->sc_flags & G_ELI_FLAG_AUTH) {
-				if (bp->bio_cmd == BIO_READ)
-					g_eli_auth_read(sc, bp);
-				else
-					g_eli_auth_run(wr, bp);
+		n = 0;
+		do {
+			if (bp->bio_pflags == G_ELI_NEW_BIO)
+				atomic_add_int(&sc->sc_inflight, 1);
+			TAILQ_INSERT_TAIL(&batch, bp, bio_queue);
+		} while (++n < g_eli_worker_batch &&
+		    (bp = g_eli_takefirst(wr)) != NULL);
+		mtx_unlock(&wr->w_queue_mtx);
+		while ((bp = TAILQ_FIRST(&batch)) != NULL) {
+			TAILQ_REMOVE(&batch, bp, bio_queue);
+			if (bp->bio_pflags == G_ELI_NEW_BIO) {
+				bp->bio_pflags = 0;
+				if (sc->sc_flags & G_ELI_FLAG_AUTH) {
+					if (bp->bio_cmd == BIO_READ)
+						g_eli_auth_read(wr, bp);
+					else
+						g_eli_auth_run(wr, bp);
+				} else {
+					if (bp->bio_cmd == BIO_READ)
+						g_eli_crypto_read(wr, bp, 1);
+					else
+						g_eli_crypto_run(wr, bp);
+				}
 			} else {
-				if (bp->bio_cmd == BIO_READ)
-					g_eli_crypto_read(sc, bp, 1);
+				if (sc->sc_flags & G_ELI_FLAG_AUTH)
+					g_eli_auth_run(wr, bp);
 				else
 					g_eli_crypto_run(wr, bp);
 			}
-		} else {
-			if (sc->sc_flags & G_ELI_FLAG_AUTH)
-				g_eli_auth_run(wr, bp);
-			else
-				g_eli_crypto_run(wr, bp);
 		}
 	}
 }
@@ -627,6 +728,7 @@ g_eli_read_metadata(struct g_class *mp, struct g_provider *pp,
 	gp->orphan = g_eli_orphan_spoil_assert;
 	gp->spoiled = g_eli_orphan_spoil_assert;
 	cp = g_new_consumer(gp);
+	cp->flags |= G_CF_DIRECT_SEND | G_CF_DIRECT_RECEIVE;
 	error = g_attach(cp, pp);
 	if (error != 0)
 		goto end;
@@ -792,12 +894,12 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 	gp->softc = sc;
 	sc->sc_geom = gp;
 
-	bioq_init(&sc->sc_queue);
 	mtx_init(&sc->sc_queue_mtx, "geli:queue", NULL, MTX_DEF);
 	mtx_init(&sc->sc_ekeys_lock, "geli:ekeys", NULL, MTX_DEF);
 
 	pp = NULL;
 	cp = g_new_consumer(gp);
+	cp->flags |= G_CF_DIRECT_SEND | G_CF_DIRECT_RECEIVE;
 	error = g_attach(cp, bpp);
 	if (error != 0) {
 		if (req != NULL) {
@@ -854,6 +956,16 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 	if (threads == 0)
 		threads = mp_ncpus;
 	sc->sc_cpubind = (mp_ncpus > 1 && threads == mp_ncpus);
+	/*
+	 * The worker number is kept in bio_pflags, next to G_ELI_NEW_BIO,
+	 * so there can be no more workers than that.  With more CPUs the
+	 * remaining ones share the queues through g_eli_curworker().
+	 */
+	if (threads > G_ELI_NEW_BIO)
+		threads = G_ELI_NEW_BIO;
+	sc->sc_wqueues = malloc(sizeof(*sc->sc_wqueues) * threads, M_ELI,
+	    M_WAITOK | M_ZERO);
+	sc->sc_nwqueues = threads;
 	for (i = 0; i < threads; i++) {
 		if (g_eli_cpu_is_disabled(i)) {
 			G_ELI_DEBUG(1, "%s: CPU %u disabled, skipping.",
@@ -863,7 +975,11 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 		wr = malloc(sizeof(*wr), M_ELI, M_WAITOK | M_ZERO);
 		wr->w_softc = sc;
 		wr->w_number = i;
+		KASSERT(wr->w_number < G_ELI_NEW_BIO,
+		    ("%s: worker number %u collides with G_ELI_NEW_BIO.",
+		    __func__, wr->w_number));
 		wr->w_active = TRUE;
+		bioq_init(&wr->w_queue);
 
 		error = g_eli_newsession(wr);
 		if (error != 0) {
@@ -878,10 +994,19 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 			goto failed;
 		}
 
+		mtx_init(&wr->w_queue_mtx, "geli:wqueue", NULL, MTX_DEF);
+		sc->sc_wqueues[i] = wr;
+		mtx_lock(&sc->sc_queue_mtx);
+		LIST_INSERT_HEAD(&sc->sc_workers, wr, w_next);
+		mtx_unlock(&sc->sc_queue_mtx);
+
 		error = kproc_create(g_eli_worker, wr, &wr->w_proc, 0, 0,
 		    "g_eli[%u] %s", i, bpp->name);
 		if (error != 0) {
+			LIST_REMOVE(wr, w_next);
+			sc->sc_wqueues[i] = NULL;
 			g_eli_freesession(wr);
+			mtx_destroy(&wr->w_queue_mtx);
 			free(wr, M_ELI);
 			if (req != NULL) {
 				gctl_error(req, "Cannot create kernel thread "
@@ -892,13 +1017,13 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 			}
 			goto failed;
 		}
-		LIST_INSERT_HEAD(&sc->sc_workers, wr, w_next);
 	}
 
 	/*
 	 * Create decrypted provider.
 	 */
 	pp = g_new_providerf(gp, "%s%s", bpp->name, G_ELI_SUFFIX);
+	pp->flags |= G_PF_DIRECT_SEND | G_PF_DIRECT_RECEIVE;
 	pp->mediasize = sc->sc_mediasize;
 	pp->sectorsize = sc->sc_sectorsize;
 
@@ -915,14 +1040,18 @@ g_eli_create(struct gctl_req *req, struct g_class *mp, struct g_provider *bpp,
 failed:
 	mtx_lock(&sc->sc_queue_mtx);
 	sc->sc_flags |= G_ELI_FLAG_DESTROY;
-	wakeup(sc);
+	mtx_unlock(&sc->sc_queue_mtx);
+	g_eli_wakeup_workers(sc);
 	/*
 	 * Wait for kernel threads self destruction.
 	 */
+	mtx_lock(&sc->sc_queue_mtx);
 	while (!LIST_EMPTY(&sc->sc_workers)) {
 		msleep(&sc->sc_workers, &sc->sc_queue_mtx, PRIBIO,
 		    "geli:destroy", 0);
 	}
+	mtx_unlock(&sc->sc_queue_mtx);
+	g_eli_free_workers(sc);
 	mtx_destroy(&sc->sc_queue_mtx);
 	if (cp->provider != NULL) {
 		if (cp->acr == 1)
@@ -968,11 +1097,15 @@ g_eli_destroy(struct g_eli_softc *sc, boolean_t force)
 
 	mtx_lock(&sc->sc_queue_mtx);
 	sc->sc_flags |= G_ELI_FLAG_DESTROY;
-	wakeup(sc);
+	mtx_unlock(&sc->sc_queue_mtx);
+	g_eli_wakeup_workers(sc);
+	mtx_lock(&sc->sc_queue_mtx);
 	while (!LIST_EMPTY(&sc->sc_workers)) {
 		msleep(&sc->sc_workers, &sc->sc_queue_mtx, PRIBIO,
 		    "geli:destroy", 0);
 	}
+	mtx_unlock(&sc->sc_queue_mtx);
+	g_eli_free_workers(sc);
 	mtx_destroy(&sc->sc_queue_mtx);
 	gp->softc = NULL;
 	g_eli_key_destroy(sc);
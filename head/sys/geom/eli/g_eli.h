@@ -169,6 +169,8 @@ struct g_eli_worker {
 	u_int			 w_number;
 	uint64_t		 w_sid;
 	boolean_t		 w_active;
+	struct bio_queue_head	 w_queue;
+	struct mtx		 w_queue_mtx;
 	LIST_ENTRY(g_eli_worker) w_next;
 };
 
@@ -201,10 +203,16 @@ struct g_eli_softc {
 	u_int		 sc_data_per_sector;
 	boolean_t	 sc_cpubind;
 
-	/* Only for software cryptography. */
-	struct bio_queue_head sc_queue;
+	/*
+	 * Every worker has its own queue.  Requests are queued to the
+	 * worker of the CPU they were submitted on, and stay with that
+	 * worker until they are done.  sc_queue_mtx only protects the
+	 * worker list and the suspend and destroy state.
+	 */
 	struct mtx	 sc_queue_mtx;
 	LIST_HEAD(, g_eli_worker) sc_workers;
+	struct g_eli_worker **sc_wqueues;	/* Indexed by w_number. */
+	u_int		 sc_nwqueues;
 };
 #define	sc_name		 sc_geom->name
 #endif	/* _KERNEL */
@@ -577,6 +585,7 @@ struct g_geom *g_eli_create(struct gctl_req *req, struct g_class *mp,
 int g_eli_destroy(struct g_eli_softc *sc, boolean_t force);
 
 int g_eli_access(struct g_provider *pp, int dr, int dw, int de);
+void g_eli_wakeup_workers(struct g_eli_softc *sc);
 void g_eli_config(struct gctl_req *req, struct g_class *mp, const char *verb);
 
 void g_eli_read_done(struct bio *bp);
@@ -585,10 +594,11 @@ int g_eli_crypto_rerun(struct cryptop *crp);
 void g_eli_crypto_ivgen(struct g_eli_softc *sc, off_t offset, u_char *iv,
     size_t size);
 
-void g_eli_crypto_read(struct g_eli_softc *sc, struct bio *bp, boolean_t fromworker);
+void g_eli_crypto_read(struct g_eli_worker *wr, struct bio *bp,
+    boolean_t fromworker);
 void g_eli_crypto_run(struct g_eli_worker *wr, struct bio *bp);
 
-void g_eli_auth_read(struct g_eli_softc *sc, struct bio *bp);
+void g_eli_auth_read(struct g_eli_worker *wr, struct bio *bp);
 void g_eli_auth_run(struct g_eli_worker *wr, struct bio *bp);
 #endif
 
@@ -771,7 +771,9 @@ g_eli_suspend_one(struct g_eli_softc *sc, struct gctl_req *req)
 		return;
 	}
 	sc->sc_flags |= G_ELI_FLAG_SUSPEND;
-	wakeup(sc);
+	mtx_unlock(&sc->sc_queue_mtx);
+	g_eli_wakeup_workers(sc);
+	mtx_lock(&sc->sc_queue_mtx);
 	for (;;) {
 		LIST_FOREACH(wr, &sc->sc_workers, w_next) {
 			if (wr->w_active)
@@ -925,16 +927,17 @@ g_eli_ctl_resume(struct gctl_req *req, struct g_class *mp)
 	G_ELI_DEBUG(1, "Using Master Key %u for %s.", nkey, pp->name);
 
 	mtx_lock(&sc->sc_queue_mtx);
-	if (!(sc->sc_flags & G_ELI_FLAG_SUSPEND))
+	if (!(sc->sc_flags & G_ELI_FLAG_SUSPEND)) {
+		mtx_unlock(&sc->sc_queue_mtx);
 		gctl_error(req, "Device %s is not suspended.", name);
-	else {
+	} else {
 		/* Restore sc_mkey, sc_ekeys, sc_akey and sc_ivkey. */
 		g_eli_mkey_propagate(sc, mkey);
 		sc->sc_flags &= ~G_ELI_FLAG_SUSPEND;
 		G_ELI_DEBUG(1, "Resumed %s.", pp->name);
-		wakeup(sc);
+		mtx_unlock(&sc->sc_queue_mtx);
+		g_eli_wakeup_workers(sc);
 	}
-	mtx_unlock(&sc->sc_queue_mtx);
 	bzero(mkey, sizeof(mkey));
 	bzero(&md, sizeof(md));
 }
@@ -336,14 +336,16 @@ g_eli_auth_write_done(struct cryptop *crp)
 }
 
 void
-g_eli_auth_read(struct g_eli_softc *sc, struct bio *bp)
+g_eli_auth_read(struct g_eli_worker *wr, struct bio *bp)
 {
+	struct g_eli_softc *sc;
 	struct g_consumer *cp;
 	struct bio *cbp, *cbp2;
 	size_t size;
 	off_t nsec;
 
-	bp->bio_pflags = 0;
+	sc = wr->w_softc;
+	bp->bio_pflags = wr->w_number;
 
 	cp = LIST_FIRST(&sc->sc_geom->consumer);
 	cbp = bp->bio_driver1;
@@ -176,32 +176,36 @@ g_eli_crypto_write_done(struct cryptop *crp)
  * g_eli_start -> G_ELI_CRYPTO_READ -> g_io_request -> g_eli_read_done -> g_eli_crypto_run -> g_eli_crypto_read_done -> g_io_deliver
  */
 void
-g_eli_crypto_read(struct g_eli_softc *sc, struct bio *bp, boolean_t fromworker)
+g_eli_crypto_read(struct g_eli_worker *wr, struct bio *bp,
+    boolean_t fromworker)
 {
+	struct g_eli_softc *sc;
 	struct g_consumer *cp;
 	struct bio *cbp;
 
+	sc = wr->w_softc;
 	if (!fromworker) {
 		/*
 		 * We are not called from the worker thread, so check if
 		 * device is suspended.
 		 */
-		mtx_lock(&sc->sc_queue_mtx);
+		mtx_lock(&wr->w_queue_mtx);
 		if (sc->sc_flags & G_ELI_FLAG_SUSPEND) {
 			/*
 			 * If device is suspended, we place the request onto
 			 * the queue, so it can be handled after resume.
 			 */
 			G_ELI_DEBUG(0, "device suspended, move onto queue");
-			bioq_insert_tail(&sc->sc_queue, bp);
-			mtx_unlock(&sc->sc_queue_mtx);
-			wakeup(sc);
+			bioq_insert_tail(&wr->w_queue, bp);
+			wakeup(wr);
+			mtx_unlock(&wr->w_queue_mtx);
 			return;
 		}
 		atomic_add_int(&sc->sc_inflight, 1);
-		mtx_unlock(&sc->sc_queue_mtx);
+		mtx_unlock(&wr->w_queue_mtx);
 	}
-	bp->bio_pflags = 0;
+	/* Decrypt on the same worker once the data is read. */
+	bp->bio_pflags = wr->w_number;
 	bp->bio_driver2 = NULL;
 	cbp = bp->bio_driver1;
 	cbp->bio_done = g_eli_read_done;
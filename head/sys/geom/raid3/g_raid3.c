@@ -226,32 +226,7 @@ g_raid3_uma_dtor(void *mem, int size, void *arg)
 }
 
 #define	g_raid3_xor(src, dst, size)					\
-	_g_raid3_xor((uint64_t *)(src),					\
-	    (uint64_t *)(dst), (size_t)size)
-static void
-_g_raid3_xor(uint64_t *src, uint64_t *dst, size_t size)
-{
-
-	KASSERT((size % 128) == 0, ("Invalid size: %zu.", size));
-	for (; size > 0; size -= 128) {
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-		*dst++ ^= (*src++);
-	}
-}
+	memxor((dst), (src), (size_t)(size))
 
 static int
 g_raid3_is_zero(struct bio *bp)
@@ -495,6 +470,7 @@ g_raid3_connect_disk(struct g_raid3_disk *disk, struct g_provider *pp)
 
 	g_topology_lock();
 	cp = g_new_consumer(disk->d_softc->sc_geom);
+	cp->flags |= G_CF_DIRECT_SEND | G_CF_DIRECT_RECEIVE;
 	error = g_attach(cp, pp);
 	if (error != 0) {
 		g_destroy_consumer(cp);
@@ -1378,6 +1354,25 @@ g_raid3_sync_done(struct bio *bp)
 	wakeup(&sc->sc_queue);
 }
 
+/*
+ * With direct dispatch the components may complete a flush concurrently
+ * on different CPUs, so unlike g_std_done() account for them atomically.
+ */
+static void
+g_raid3_flush_done(struct bio *bp)
+{
+	struct bio *pbp;
+	int error;
+
+	pbp = bp->bio_parent;
+	error = bp->bio_error;
+	g_destroy_bio(bp);
+	if (error != 0)
+		atomic_cmpset_int((volatile u_int *)&pbp->bio_error, 0, error);
+	if (atomic_fetchadd_int(&pbp->bio_inbed, 1) + 1 == pbp->bio_children)
+		g_io_deliver(pbp, pbp->bio_error);
+}
+
 static void
 g_raid3_flush(struct g_raid3_softc *sc, struct bio *bp)
 {
@@ -1405,7 +1400,7 @@ g_raid3_flush(struct g_raid3_softc *sc, struct bio *bp)
 			return;
 		}
 		bioq_insert_tail(&queue, cbp);
-		cbp->bio_done = g_std_done;
+		cbp->bio_done = g_raid3_flush_done;
 		cbp->bio_caller1 = disk;
 		cbp->bio_to = disk->d_consumer->provider;
 	}
@@ -2207,6 +2202,7 @@ g_raid3_sync_start(struct g_raid3_softc *sc)
 	sx_xunlock(&sc->sc_lock);
 	g_topology_lock();
 	cp = g_new_consumer(sc->sc_sync.ds_geom);
+	cp->flags |= G_CF_DIRECT_SEND | G_CF_DIRECT_RECEIVE;
 	error = g_attach(cp, sc->sc_provider);
 	KASSERT(error == 0,
 	    ("Cannot attach to %s (error=%d).", sc->sc_name, error));
@@ -2325,6 +2321,7 @@ g_raid3_launch_provider(struct g_raid3_softc *sc)
 
 	g_topology_lock();
 	pp = g_new_providerf(sc->sc_geom, "raid3/%s", sc->sc_name);
+	pp->flags |= G_PF_DIRECT_SEND | G_PF_DIRECT_RECEIVE;
 	pp->mediasize = sc->sc_mediasize;
 	pp->sectorsize = sc->sc_sectorsize;
 	pp->stripesize = 0;
@@ -2352,6 +2349,7 @@ g_raid3_launch_provider(struct g_raid3_softc *sc)
 static void
 g_raid3_destroy_provider(struct g_raid3_softc *sc)
 {
+	struct bio_queue_head queue;
 	struct bio *bp;
 
 	g_topology_assert_not();
@@ -2360,12 +2358,20 @@ g_raid3_destroy_provider(struct g_raid3_softc *sc)
 
 	g_topology_lock();
 	g_error_provider(sc->sc_provider, ENXIO);
+	g_topology_unlock();
+	/*
+	 * The provider is direct dispatch capable, so the consumer's
+	 * bio_done may run from g_io_deliver() and call back into GEOM;
+	 * fail the queued requests without holding any of our locks.
+	 */
+	bioq_init(&queue);
 	mtx_lock(&sc->sc_queue_mtx);
-	while ((bp = bioq_first(&sc->sc_queue)) != NULL) {
-		bioq_remove(&sc->sc_queue, bp);
-		g_io_deliver(bp, ENXIO);
-	}
+	while ((bp = bioq_takefirst(&sc->sc_queue)) != NULL)
+		bioq_insert_tail(&queue, bp);
 	mtx_unlock(&sc->sc_queue_mtx);
+	while ((bp = bioq_takefirst(&queue)) != NULL)
+		g_io_deliver(bp, ENXIO);
+	g_topology_lock();
 	G_RAID3_DEBUG(0, "Device %s: provider %s destroyed.", sc->sc_name,
 	    sc->sc_provider->name);
 	sc->sc_provider->flags |= G_PF_WITHER;
@@ -251,6 +251,7 @@ g_shsec_done(struct bio *bp)
 {
 	struct g_shsec_softc *sc;
 	struct bio *pbp;
+	int last;
 
 	pbp = bp->bio_parent;
 	sc = pbp->bio_to->geom->softc;
@@ -259,9 +260,14 @@ g_shsec_done(struct bio *bp)
 	else {
 		G_SHSEC_LOGREQ(0, bp, "Request failed (error=%d).",
 		    bp->bio_error);
-		if (pbp->bio_error == 0)
-			pbp->bio_error = bp->bio_error;
 	}
+	/*
+	 * With direct dispatch the components can complete concurrently,
+	 * so combining their data into the parent is done under a lock.
+	 */
+	mtx_lock(&sc->sc_done_mtx);
+	if (bp->bio_error != 0 && pbp->bio_error == 0)
+		pbp->bio_error = bp->bio_error;
 	if (pbp->bio_cmd == BIO_READ) {
 		if ((pbp->bio_pflags & G_SHSEC_BFLAG_FIRST) != 0) {
 			bcopy(bp->bio_data, pbp->bio_data, pbp->bio_length);
@@ -272,11 +278,13 @@ g_shsec_done(struct bio *bp)
 			    (ssize_t)pbp->bio_length);
 		}
 	}
+	pbp->bio_inbed++;
+	last = (pbp->bio_children == pbp->bio_inbed);
+	mtx_unlock(&sc->sc_done_mtx);
 	bzero(bp->bio_data, bp->bio_length);
 	uma_zfree(g_shsec_zone, bp->bio_data);
 	g_destroy_bio(bp);
-	pbp->bio_inbed++;
-	if (pbp->bio_children == pbp->bio_inbed) {
+	if (last) {
 		pbp->bio_completed = pbp->bio_length;
 		g_io_deliver(pbp, pbp->bio_error);
 	}
@@ -406,6 +414,7 @@ g_shsec_check_and_run(struct g_shsec_softc *sc)
 		return;
 
 	sc->sc_provider = g_new_providerf(sc->sc_geom, "shsec/%s", sc->sc_name);
+	sc->sc_provider->flags |= G_PF_DIRECT_SEND | G_PF_DIRECT_RECEIVE;
 	/*
 	 * Find the smallest disk.
 	 */
@@ -478,6 +487,7 @@ g_shsec_add_disk(struct g_shsec_softc *sc, struct g_provider *pp, u_int no)
 	fcp = LIST_FIRST(&gp->consumer);
 
 	cp = g_new_consumer(gp);
+	cp->flags |= G_CF_DIRECT_SEND | G_CF_DIRECT_RECEIVE;
 	error = g_attach(cp, pp);
 	if (error != 0) {
 		g_destroy_consumer(cp);
@@ -559,6 +569,7 @@ g_shsec_create(struct g_class *mp, const struct g_shsec_metadata *md)
 	    M_SHSEC, M_WAITOK | M_ZERO);
 	for (no = 0; no < sc->sc_ndisks; no++)
 		sc->sc_disks[no] = NULL;
+	mtx_init(&sc->sc_done_mtx, "gshsec:done", NULL, MTX_DEF);
 
 	gp->softc = sc;
 	sc->sc_geom = gp;
@@ -603,6 +614,7 @@ g_shsec_destroy(struct g_shsec_softc *sc, boolean_t force)
 	gp->softc = NULL;
 	KASSERT(sc->sc_provider == NULL, ("Provider still exists? (device=%s)",
 	    gp->name));
+	mtx_destroy(&sc->sc_done_mtx);
 	free(sc->sc_disks, M_SHSEC);
 	free(sc, M_SHSEC);
 
@@ -74,6 +74,7 @@ struct g_shsec_softc {
 	uint32_t	 sc_id;		/* device unique ID */
 	struct g_consumer **sc_disks;
 	uint16_t	 sc_ndisks;
+	struct mtx	 sc_done_mtx;	/* serializes component completion */
 };
 #define	sc_name	sc_geom->name
 #endif	/* _KERNEL */
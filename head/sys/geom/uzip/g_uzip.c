@@ -30,12 +30,17 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/bio.h>
+#include <sys/counter.h>
 #include <sys/endian.h>
 #include <sys/errno.h>
 #include <sys/kernel.h>
+#include <sys/kthread.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/malloc.h>
+#include <sys/proc.h>
+#include <sys/sched.h>
+#include <sys/smp.h>
 #include <sys/sysctl.h>
 #include <sys/systm.h>
 #include <sys/zlib.h>
@@ -55,6 +60,37 @@ static MALLOC_DEFINE(M_GEOM_UZIP, "geom_uzip", "GEOM UZIP data structures");
 
 #define	UZIP_CLASS_NAME	"UZIP"
 
+SYSCTL_DECL(_kern_geom);
+static SYSCTL_NODE(_kern_geom, OID_AUTO, uzip, CTLFLAG_RW, 0,
+    "GEOM_UZIP stuff");
+static u_int g_uzip_cache_size = 4 * 1024 * 1024;
+SYSCTL_UINT(_kern_geom_uzip, OID_AUTO, cache_size, CTLFLAG_RWTUN,
+    &g_uzip_cache_size, 0,
+    "Memory for decompressed clusters, per device (applied at taste)");
+static u_int g_uzip_readahead = 2;
+SYSCTL_UINT(_kern_geom_uzip, OID_AUTO, readahead, CTLFLAG_RWTUN,
+    &g_uzip_readahead, 0,
+    "Clusters to read and decompress ahead of sequential reads");
+static u_int g_uzip_workers = 0;
+SYSCTL_UINT(_kern_geom_uzip, OID_AUTO, workers, CTLFLAG_RDTUN,
+    &g_uzip_workers, 0,
+    "Decompression threads shared by all devices (0 = one per CPU)");
+
+static counter_u64_t g_uzip_hits;
+static counter_u64_t g_uzip_misses;
+static counter_u64_t g_uzip_ra;
+static counter_u64_t g_uzip_inflated;
+static SYSCTL_NODE(_kern_geom_uzip, OID_AUTO, stats, CTLFLAG_RD, 0,
+    "GEOM_UZIP cache statistics");
+SYSCTL_COUNTER_U64(_kern_geom_uzip_stats, OID_AUTO, hits, CTLFLAG_RD,
+    &g_uzip_hits, "Clusters read from the cache");
+SYSCTL_COUNTER_U64(_kern_geom_uzip_stats, OID_AUTO, misses, CTLFLAG_RD,
+    &g_uzip_misses, "Clusters that had to be read from the media");
+SYSCTL_COUNTER_U64(_kern_geom_uzip_stats, OID_AUTO, readahead, CTLFLAG_RD,
+    &g_uzip_ra, "Clusters decompressed ahead of sequential reads");
+SYSCTL_COUNTER_U64(_kern_geom_uzip_stats, OID_AUTO, inflated, CTLFLAG_RD,
+    &g_uzip_inflated, "Clusters decompressed");
+
 /*
  * Maximum allowed valid block size (to prevent foot-shooting)
  */
@@ -75,23 +111,65 @@ struct cloop_header {
 	uint32_t nblocks;		/* number of blocks */
 };
 
+/*
+ * Decompressed cluster.  While in the cache it is on the LRU list and
+ * its hash chain; a worker that is decompressing into it owns it
+ * privately until it is inserted.
+ */
+struct g_uzip_blk {
+	uint32_t blk;			/* block number */
+	char *data;			/* decompressed data */
+	TAILQ_ENTRY(g_uzip_blk) lru;
+	LIST_ENTRY(g_uzip_blk) hash;
+};
+
+/*
+ * Decompression thread.  The compressed data read from the media is
+ * queued by g_uzip_done() on a queue shared by all devices, and taken
+ * from there by a pool of threads under one process, so that several
+ * requests are decompressed in parallel and off the g_up thread.  Each
+ * thread has its own zlib stream.  The pool is started by the first
+ * taste and stopped when the class is unloaded.
+ */
+struct g_uzip_worker {
+	struct thread *td;
+	u_int number;
+	z_stream zs;
+};
+
+static struct mtx g_uzip_pool_mtx;
+static struct bio_queue_head g_uzip_pool_queue;	/* reads to decompress */
+static struct proc *g_uzip_pool_proc;
+static struct g_uzip_worker *g_uzip_pool;
+static u_int g_uzip_pool_size;
+static u_int g_uzip_pool_running;
+static int g_uzip_pool_dying;
+
 struct g_uzip_softc {
 	uint32_t blksz;			/* block size */
 	uint32_t nblocks;		/* number of blocks */
 	uint64_t *offsets;
 
-	struct mtx last_mtx;
-	uint32_t last_blk;		/* last blk no */
-	char *last_buf;			/* last blk data */
+	struct mtx cache_mtx;
+	TAILQ_HEAD(g_uzip_lru, g_uzip_blk) cache_lru;	/* most recent first */
+	LIST_HEAD(, g_uzip_blk) *cache_hash;
+	u_long cache_hashmask;
+	u_int cache_nblks;		/* allocated clusters */
+	u_int cache_max;		/* cached clusters limit */
+	uint32_t seq_next;		/* block after the last request */
+
 	int req_total;			/* total requests */
 	int req_cached;			/* cached requests */
 };
 
 static void g_uzip_done(struct bio *bp);
+static int g_uzip_request(struct g_geom *gp, struct bio *bp);
+static void g_uzip_pool_stop(void);
 
 static void
 g_uzip_softc_free(struct g_uzip_softc *sc, struct g_geom *gp)
 {
+	struct g_uzip_blk *e;
 
 	if (gp != NULL) {
 		DPRINTF(("%s: %d requests, %d cached\n",
@@ -101,8 +179,14 @@ g_uzip_softc_free(struct g_uzip_softc *sc, struct g_geom *gp)
 		free(sc->offsets, M_GEOM_UZIP);
 		sc->offsets = NULL;
 	}
-	mtx_destroy(&sc->last_mtx);
-	free(sc->last_buf, M_GEOM_UZIP);
+	if (sc->cache_hash != NULL) {
+		while ((e = TAILQ_FIRST(&sc->cache_lru)) != NULL) {
+			TAILQ_REMOVE(&sc->cache_lru, e, lru);
+			free(e, M_GEOM_UZIP);
+		}
+		hashdestroy(sc->cache_hash, M_GEOM_UZIP, sc->cache_hashmask);
+		mtx_destroy(&sc->cache_mtx);
+	}
 	free(sc, M_GEOM_UZIP);
 }
 
@@ -123,40 +207,137 @@ z_free(void *nil, void *ptr)
 	free(ptr, M_GEOM_UZIP);
 }
 
+#define	G_UZIP_HASH(sc, blk)	(&(sc)->cache_hash[(blk) & (sc)->cache_hashmask])
+
+/*
+ * Look up a block in the cache and make it the most recently used one.
+ * Called with the cache lock held.
+ */
+static struct g_uzip_blk *
+g_uzip_cache_lookup(struct g_uzip_softc *sc, uint32_t blk)
+{
+	struct g_uzip_blk *e;
+
+	mtx_assert(&sc->cache_mtx, MA_OWNED);
+
+	LIST_FOREACH(e, G_UZIP_HASH(sc, blk), hash) {
+		if (e->blk == blk) {
+			if (e != TAILQ_FIRST(&sc->cache_lru)) {
+				TAILQ_REMOVE(&sc->cache_lru, e, lru);
+				TAILQ_INSERT_HEAD(&sc->cache_lru, e, lru);
+			}
+			return (e);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Get a cluster buffer to decompress into: the least recently used one
+ * when the cache is full, a new one otherwise.  Buffers being filled by
+ * the workers are not on the LRU list, so the cache may briefly hold up
+ * to one cluster per worker over its limit.
+ */
+static struct g_uzip_blk *
+g_uzip_cache_alloc(struct g_uzip_softc *sc)
+{
+	struct g_uzip_blk *e;
+
+	mtx_lock(&sc->cache_mtx);
+	if (sc->cache_nblks >= sc->cache_max &&
+	    (e = TAILQ_LAST(&sc->cache_lru, g_uzip_lru)) != NULL) {
+		TAILQ_REMOVE(&sc->cache_lru, e, lru);
+		LIST_REMOVE(e, hash);
+		mtx_unlock(&sc->cache_mtx);
+		return (e);
+	}
+	sc->cache_nblks++;
+	mtx_unlock(&sc->cache_mtx);
+	e = malloc(sizeof(*e) + sc->blksz, M_GEOM_UZIP, M_WAITOK);
+	e->data = (char *)(e + 1);
+	return (e);
+}
+
+static void
+g_uzip_cache_release(struct g_uzip_softc *sc, struct g_uzip_blk *e)
+{
+
+	mtx_lock(&sc->cache_mtx);
+	sc->cache_nblks--;
+	mtx_unlock(&sc->cache_mtx);
+	free(e, M_GEOM_UZIP);
+}
+
+static void
+g_uzip_cache_insert(struct g_uzip_softc *sc, struct g_uzip_blk *e,
+    uint32_t blk)
+{
+	struct g_uzip_blk *e2;
+
+	mtx_lock(&sc->cache_mtx);
+	LIST_FOREACH(e2, G_UZIP_HASH(sc, blk), hash) {
+		if (e2->blk == blk)
+			break;
+	}
+	if (e2 != NULL) {
+		/* Another worker decompressed it meanwhile. */
+		sc->cache_nblks--;
+		mtx_unlock(&sc->cache_mtx);
+		free(e, M_GEOM_UZIP);
+		return;
+	}
+	e->blk = blk;
+	LIST_INSERT_HEAD(G_UZIP_HASH(sc, blk), e, hash);
+	TAILQ_INSERT_HEAD(&sc->cache_lru, e, lru);
+	mtx_unlock(&sc->cache_mtx);
+}
+
+/*
+ * Satisfy as much of the request as possible from the cache, starting at
+ * its current position.  Returns 1 if the request was completed.
+ */
 static int
 g_uzip_cached(struct g_geom *gp, struct bio *bp)
 {
 	struct g_uzip_softc *sc;
+	struct g_uzip_blk *e;
 	off_t ofs;
 	size_t blk, blkofs, usz;
 
 	sc = gp->softc;
-	ofs = bp->bio_offset + bp->bio_completed;
-	blk = ofs / sc->blksz;
-	mtx_lock(&sc->last_mtx);
-	if (blk == sc->last_blk) {
+	mtx_lock(&sc->cache_mtx);
+	while (bp->bio_resid > 0) {
+		ofs = bp->bio_offset + bp->bio_completed;
+		blk = ofs / sc->blksz;
 		blkofs = ofs % sc->blksz;
 		usz = sc->blksz - blkofs;
 		if (bp->bio_resid < usz)
 			usz = bp->bio_resid;
-		memcpy(bp->bio_data + bp->bio_completed, sc->last_buf + blkofs,
-		    usz);
-		sc->req_cached++;
-		mtx_unlock(&sc->last_mtx);
+		if (sc->offsets[blk + 1] == sc->offsets[blk]) {
+			/* All zero block, never cached. */
+			bzero(bp->bio_data + bp->bio_completed, usz);
+		} else {
+			e = g_uzip_cache_lookup(sc, blk);
+			if (e == NULL)
+				break;
+			memcpy(bp->bio_data + bp->bio_completed,
+			    e->data + blkofs, usz);
+			counter_u64_add(g_uzip_hits, 1);
+		}
 
 		DPRINTF(("%s/%s: %p: offset=%jd: got %jd bytes from cache\n",
 		    __func__, gp->name, bp, (intmax_t)ofs, (intmax_t)usz));
 
 		bp->bio_completed += usz;
 		bp->bio_resid -= usz;
+	}
+	mtx_unlock(&sc->cache_mtx);
 
-		if (bp->bio_resid == 0) {
-			g_io_deliver(bp, 0);
-			return (1);
-		}
-	} else
-		mtx_unlock(&sc->last_mtx);
-
+	if (bp->bio_resid == 0) {
+		sc->req_cached++;
+		g_io_deliver(bp, 0);
+		return (1);
+	}
 	return (0);
 }
 
@@ -191,6 +372,16 @@ g_uzip_request(struct g_geom *gp, struct bio *bp)
 	end_blk = (ofs + bp->bio_resid + sc->blksz - 1) / sc->blksz;
 	KASSERT(end_blk <= sc->nblocks, ("end_blk out of range"));
 
+	/*
+	 * If this read continues where the previous one ended, fetch and
+	 * decompress the next few clusters along with it.
+	 */
+	if (start_blk == sc->seq_next) {
+		sc->seq_next = end_blk;
+		end_blk = MIN(end_blk + g_uzip_readahead, sc->nblocks);
+	} else
+		sc->seq_next = end_blk;
+
 	DPRINTF(("%s/%s: %p: start=%u (%jd), end=%u (%jd)\n",
 	    __func__, gp->name, bp,
 	    (u_int)start_blk, (intmax_t)sc->offsets[start_blk],
@@ -207,6 +398,7 @@ g_uzip_request(struct g_geom *gp, struct bio *bp)
 
 		end_blk--;
 	}
+	bp2->bio_caller1 = (void *)(uintptr_t)end_blk;
 
 	bp2->bio_data = malloc(bp2->bio_length, M_GEOM_UZIP, M_NOWAIT);
 	if (bp2->bio_data == NULL) {
@@ -223,22 +415,41 @@ g_uzip_request(struct g_geom *gp, struct bio *bp)
 	return (0);
 }
 
+/*
+ * Compressed data was read; pass it on to a decompression worker.
+ */
 static void
 g_uzip_done(struct bio *bp)
 {
-	z_stream zs;
+
+	mtx_lock(&g_uzip_pool_mtx);
+	bioq_insert_tail(&g_uzip_pool_queue, bp);
+	wakeup_one(&g_uzip_pool_queue);
+	mtx_unlock(&g_uzip_pool_mtx);
+}
+
+/*
+ * Decompress the clusters of a completed read into the cache, copying
+ * the parts the parent request asked for into its buffer.  Clusters past
+ * the end of the request are read-ahead and only cached.
+ */
+static void
+g_uzip_inflate(struct g_uzip_worker *wr, struct bio *bp)
+{
 	struct bio *bp2;
 	struct g_provider *pp;
 	struct g_consumer *cp;
 	struct g_geom *gp;
 	struct g_uzip_softc *sc;
+	struct g_uzip_blk *e;
 	char *data, *data2;
-	off_t ofs;
-	size_t blk, blkofs, len, ulen;
+	off_t ofs, avail;
+	size_t blk, end_blk, blkofs, len, ulen;
 
 	bp2 = bp->bio_parent;
 	gp = bp2->bio_to->geom;
 	sc = gp->softc;
+	end_blk = (uintptr_t)bp->bio_caller1;
 
 	cp = LIST_FIRST(&gp->consumer);
 	pp = cp->provider;
@@ -253,63 +464,67 @@ g_uzip_done(struct bio *bp)
 		goto done;
 	}
 
-	zs.zalloc = z_alloc;
-	zs.zfree = z_free;
-	if (inflateInit(&zs) != Z_OK) {
-		bp2->bio_error = EILSEQ;
-		goto done;
-	}
-
 	ofs = bp2->bio_offset + bp2->bio_completed;
 	blk = ofs / sc->blksz;
 	blkofs = ofs % sc->blksz;
 	data = bp->bio_data + sc->offsets[blk] % pp->sectorsize;
 	data2 = bp2->bio_data + bp2->bio_completed;
-	while (bp->bio_completed && bp2->bio_resid) {
+	avail = bp->bio_completed - sc->offsets[blk] % pp->sectorsize;
+	while (blk < end_blk) {
 		ulen = MIN(sc->blksz - blkofs, bp2->bio_resid);
 		len = sc->offsets[blk + 1] - sc->offsets[blk];
 		DPRINTF(("%s/%s: %p/%ju: data2=%p, ulen=%u, data=%p, len=%u\n",
-		    __func__, gp->name, gp, bp->bio_completed,
+		    __func__, gp->name, gp, (uintmax_t)avail,
 		    data2, (u_int)ulen, data, (u_int)len));
+		if (len > avail)
+			break;
 		if (len == 0) {
 			/* All zero block: no cache update */
 			bzero(data2, ulen);
-		} else if (len <= bp->bio_completed) {
-			zs.next_in = data;
-			zs.avail_in = len;
-			zs.next_out = sc->last_buf;
-			zs.avail_out = sc->blksz;
-			mtx_lock(&sc->last_mtx);
-			if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
-				sc->last_blk = -1;
-				mtx_unlock(&sc->last_mtx);
-				inflateEnd(&zs);
-				bp2->bio_error = EILSEQ;
-				goto done;
-			}
-			sc->last_blk = blk;
-			memcpy(data2, sc->last_buf + blkofs, ulen);
-			mtx_unlock(&sc->last_mtx);
-			if (inflateReset(&zs) != Z_OK) {
-				inflateEnd(&zs);
-				bp2->bio_error = EILSEQ;
-				goto done;
+		} else {
+			mtx_lock(&sc->cache_mtx);
+			e = g_uzip_cache_lookup(sc, blk);
+			if (e != NULL && ulen > 0)
+				memcpy(data2, e->data + blkofs, ulen);
+			mtx_unlock(&sc->cache_mtx);
+			if (e != NULL) {
+				/* Read ahead, or by another request. */
+				if (ulen > 0)
+					counter_u64_add(g_uzip_hits, 1);
+			} else {
+				e = g_uzip_cache_alloc(sc);
+				wr->zs.next_in = data;
+				wr->zs.avail_in = len;
+				wr->zs.next_out = e->data;
+				wr->zs.avail_out = sc->blksz;
+				if (inflate(&wr->zs, Z_FINISH) != Z_STREAM_END ||
+				    inflateReset(&wr->zs) != Z_OK) {
+					inflateReset(&wr->zs);
+					g_uzip_cache_release(sc, e);
+					if (ulen > 0)
+						bp2->bio_error = EILSEQ;
+					goto done;
+				}
+				if (ulen > 0)
+					memcpy(data2, e->data + blkofs, ulen);
+				g_uzip_cache_insert(sc, e, blk);
+				counter_u64_add(g_uzip_inflated, 1);
+				if (ulen > 0)
+					counter_u64_add(g_uzip_misses, 1);
+				else
+					counter_u64_add(g_uzip_ra, 1);
 			}
-			data += len;
-		} else
-			break;
+		}
 
+		data += len;
+		avail -= len;
 		data2 += ulen;
 		bp2->bio_completed += ulen;
 		bp2->bio_resid -= ulen;
-		bp->bio_completed -= len;
 		blkofs = 0;
 		blk++;
 	}
 
-	if (inflateEnd(&zs) != Z_OK)
-		bp2->bio_error = EILSEQ;
-
 done:
 	/* Finish processing the request. */
 	free(bp->bio_data, M_GEOM_UZIP);
@@ -320,6 +535,132 @@ done:
 		g_uzip_request(gp, bp2);
 }
 
+static void
+g_uzip_worker(void *arg)
+{
+	struct g_uzip_worker *wr;
+	struct bio *bp;
+	u_int n;
+	int cpu;
+
+	wr = arg;
+#ifdef SMP
+	/* Before sched_bind() to a CPU, wait for all CPUs to go on-line. */
+	if (g_uzip_pool_size == mp_ncpus) {
+		while (!smp_started)
+			tsleep(wr, 0, "guzip:smp", hz / 4);
+	}
+#endif
+	thread_lock(curthread);
+	sched_prio(curthread, PRIBIO);
+	if (mp_ncpus > 1 && g_uzip_pool_size == mp_ncpus) {
+		/* Spread the threads over the CPUs that are present. */
+		n = wr->number;
+		CPU_FOREACH(cpu) {
+			if (n-- == 0) {
+				sched_bind(curthread, cpu);
+				break;
+			}
+		}
+	}
+	thread_unlock(curthread);
+
+	for (;;) {
+		mtx_lock(&g_uzip_pool_mtx);
+		bp = bioq_takefirst(&g_uzip_pool_queue);
+		if (bp == NULL) {
+			if (g_uzip_pool_dying) {
+				if (--g_uzip_pool_running == 0)
+					wakeup(&g_uzip_pool_running);
+				mtx_unlock(&g_uzip_pool_mtx);
+				kthread_exit();
+			}
+			msleep(&g_uzip_pool_queue, &g_uzip_pool_mtx,
+			    PRIBIO | PDROP, "guzip:w", 0);
+			continue;
+		}
+		mtx_unlock(&g_uzip_pool_mtx);
+		g_uzip_inflate(wr, bp);
+	}
+}
+
+/*
+ * Start the decompression threads, if not done yet.  Only called from
+ * taste, which the event thread serializes.
+ */
+static int
+g_uzip_pool_start(void)
+{
+	struct g_uzip_worker *wr;
+	u_int i, n;
+	int error;
+
+	if (g_uzip_pool != NULL)
+		return (0);
+	n = g_uzip_workers;
+	if (n == 0)
+		n = mp_ncpus;
+	g_uzip_pool = malloc(sizeof(*g_uzip_pool) * n, M_GEOM_UZIP,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < n; i++) {
+		wr = &g_uzip_pool[i];
+		wr->number = i;
+		wr->zs.zalloc = z_alloc;
+		wr->zs.zfree = z_free;
+		if (inflateInit(&wr->zs) != Z_OK) {
+			error = ENOMEM;
+			goto fail;
+		}
+	}
+	g_uzip_pool_size = n;
+	for (i = 0; i < n; i++) {
+		wr = &g_uzip_pool[i];
+		mtx_lock(&g_uzip_pool_mtx);
+		g_uzip_pool_running++;
+		mtx_unlock(&g_uzip_pool_mtx);
+		error = kproc_kthread_add(g_uzip_worker, wr,
+		    &g_uzip_pool_proc, &wr->td, 0, 0, "g_uzip", "g_uzip %u", i);
+		if (error != 0) {
+			mtx_lock(&g_uzip_pool_mtx);
+			g_uzip_pool_running--;
+			mtx_unlock(&g_uzip_pool_mtx);
+			g_uzip_pool_stop();
+			return (error);
+		}
+	}
+	return (0);
+
+fail:
+	while (i-- > 0)
+		inflateEnd(&g_uzip_pool[i].zs);
+	free(g_uzip_pool, M_GEOM_UZIP);
+	g_uzip_pool = NULL;
+	return (error);
+}
+
+static void
+g_uzip_pool_stop(void)
+{
+	u_int i;
+
+	if (g_uzip_pool == NULL)
+		return;
+	mtx_lock(&g_uzip_pool_mtx);
+	g_uzip_pool_dying = 1;
+	wakeup(&g_uzip_pool_queue);
+	while (g_uzip_pool_running > 0)
+		msleep(&g_uzip_pool_running, &g_uzip_pool_mtx, PRIBIO,
+		    "guzip:d", 0);
+	g_uzip_pool_dying = 0;
+	mtx_unlock(&g_uzip_pool_mtx);
+	for (i = 0; i < g_uzip_pool_size; i++)
+		inflateEnd(&g_uzip_pool[i].zs);
+	free(g_uzip_pool, M_GEOM_UZIP);
+	g_uzip_pool = NULL;
+	g_uzip_pool_size = 0;
+	g_uzip_pool_proc = NULL;
+}
+
 static void
 g_uzip_start(struct bio *bp)
 {
@@ -456,7 +797,7 @@ g_uzip_taste(struct g_class *mp, struct g_provider *pp, int flags)
 	gp->softc = sc;
 	sc->blksz = ntohl(header->blksz);
 	sc->nblocks = ntohl(header->nblocks);
-	if (sc->blksz % 512 != 0) {
+	if (sc->blksz == 0 || sc->blksz % 512 != 0) {
 		printf("%s: block size (%u) should be multiple of 512.\n",
 		    gp->name, sc->blksz);
 		goto err;
@@ -500,11 +841,18 @@ g_uzip_taste(struct g_class *mp, struct g_provider *pp, int flags)
 	}
 	free(buf, M_GEOM);
 	DPRINTF(("%s: done reading offsets\n", gp->name));
-	mtx_init(&sc->last_mtx, "geom_uzip cache", NULL, MTX_DEF);
-	sc->last_blk = -1;
-	sc->last_buf = malloc(sc->blksz, M_GEOM_UZIP, M_WAITOK);
+	mtx_init(&sc->cache_mtx, "geom_uzip cache", NULL, MTX_DEF);
+	TAILQ_INIT(&sc->cache_lru);
+	sc->cache_max = MAX(g_uzip_cache_size / sc->blksz, 1);
+	sc->cache_hash = hashinit(sc->cache_max, M_GEOM_UZIP,
+	    &sc->cache_hashmask);
 	sc->req_total = 0;
 	sc->req_cached = 0;
+	if (g_uzip_pool_start() != 0) {
+		printf("%s: cannot start decompression threads.\n",
+		    gp->name);
+		goto err;
+	}
 
 	g_topology_lock();
 	pp2 = g_new_providerf(gp, "%s", gp->name);
@@ -564,9 +912,35 @@ g_uzip_destroy_geom(struct gctl_req *req, struct g_class *mp, struct g_geom *gp)
 	return (0);
 }
 
+static void
+g_uzip_init(struct g_class *mp __unused)
+{
+
+	g_uzip_hits = counter_u64_alloc(M_WAITOK);
+	g_uzip_misses = counter_u64_alloc(M_WAITOK);
+	g_uzip_ra = counter_u64_alloc(M_WAITOK);
+	g_uzip_inflated = counter_u64_alloc(M_WAITOK);
+	mtx_init(&g_uzip_pool_mtx, "geom_uzip pool", NULL, MTX_DEF);
+	bioq_init(&g_uzip_pool_queue);
+}
+
+static void
+g_uzip_fini(struct g_class *mp __unused)
+{
+
+	counter_u64_free(g_uzip_hits);
+	counter_u64_free(g_uzip_misses);
+	counter_u64_free(g_uzip_ra);
+	counter_u64_free(g_uzip_inflated);
+	g_uzip_pool_stop();
+	mtx_destroy(&g_uzip_pool_mtx);
+}
+
 static struct g_class g_uzip_class = {
 	.name = UZIP_CLASS_NAME,
 	.version = G_VERSION,
+	.init = g_uzip_init,
+	.fini = g_uzip_fini,
 	.taste = g_uzip_taste,
 	.destroy_geom = g_uzip_destroy_geom,
 
@@ -39,7 +39,10 @@ __FBSDID("$FreeBSD$");
 #include <sys/malloc.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/callout.h>
 #include <sys/conf.h>
+#include <sys/pcpu.h>
+#include <sys/smp.h>
 #include <vm/vm.h>
 #include <vm/pmap.h>
 
@@ -69,8 +72,38 @@ static struct mtx devstat_mutex;
 MTX_SYSINIT(devstat_mutex, &devstat_mutex, "devstat", MTX_DEF);
 
 static struct devstatlist device_statq = STAILQ_HEAD_INITIALIZER(device_statq);
+
+/*
+ * With kern.devstat.pcpu set, the counters behind each struct devstat are
+ * kept per CPU and folded into the exported structure when the sysctl is
+ * read, and every kern.devstat.fold_interval milliseconds for the benefit
+ * of consumers that mmap(2) the statistics pages.  Only the idle/busy
+ * transitions, which busy_time needs, are serialized per device.
+ */
+struct devstat_pcpu {
+	u_int			start_count;
+	u_int			end_count;
+	uint64_t		bytes[DEVSTAT_N_TRANS_FLAGS];
+	uint64_t		operations[DEVSTAT_N_TRANS_FLAGS];
+	struct bintime		duration[DEVSTAT_N_TRANS_FLAGS];
+	uint64_t		tag_types[3];
+} __aligned(CACHE_LINE_SIZE);
+
+struct devstat_priv {
+	struct devstat_pcpu	*pcpu;		/* mp_maxid + 1 entries */
+	struct mtx		busy_mtx;
+	volatile u_int		outstanding;
+	struct bintime		busy_from;
+	struct bintime		busy_time;
+} __aligned(CACHE_LINE_SIZE);
+
+static int devstat_pcpu = 1;
+static int devstat_fold_interval = 100;
+static struct callout devstat_fold_callout;
+
 static struct devstat *devstat_alloc(void);
 static void devstat_free(struct devstat *);
+static struct devstat_priv *devstat_priv(struct devstat *);
 static void devstat_add_entry(struct devstat *ds, const void *dev_name, 
 		       int unit_number, uint32_t block_size,
 		       devstat_support_flags flags,
@@ -215,6 +248,141 @@ devstat_remove_entry(struct devstat *ds)
 	mtx_unlock(&devstat_mutex);
 }
 
+/*
+ * Per-CPU halves of devstat_start_transaction() and
+ * devstat_end_transaction().  The counters are only touched by the CPU
+ * they belong to.  The count of outstanding transactions is adjusted
+ * with a compare-and-set while the device stays busy; moving between idle
+ * and busy takes the device's busy_mtx so that busy_from and busy_time
+ * are updated in order.
+ */
+static void
+devstat_pcpu_start(struct devstat *ds, struct bintime *now)
+{
+	struct devstat_priv *dp;
+	struct bintime lnow;
+	u_int c;
+
+	dp = devstat_priv(ds);
+
+	critical_enter();
+	dp->pcpu[curcpu].start_count++;
+	critical_exit();
+
+	for (c = dp->outstanding; c != 0; c = dp->outstanding) {
+		if (atomic_cmpset_int(&dp->outstanding, c, c + 1))
+			return;
+	}
+
+	if (now == NULL) {
+		now = &lnow;
+		binuptime(now);
+	}
+	mtx_lock(&dp->busy_mtx);
+	if (atomic_fetchadd_int(&dp->outstanding, 1) == 0)
+		dp->busy_from = *now;
+	mtx_unlock(&dp->busy_mtx);
+}
+
+static void
+devstat_pcpu_end(struct devstat *ds, uint32_t bytes,
+		 devstat_tag_type tag_type, devstat_trans_flags flags,
+		 struct bintime *now, struct bintime *then)
+{
+	struct devstat_priv *dp;
+	struct devstat_pcpu *pc;
+	struct bintime dt;
+	u_int c;
+
+	dp = devstat_priv(ds);
+
+	critical_enter();
+	pc = &dp->pcpu[curcpu];
+	pc->bytes[flags] += bytes;
+	pc->operations[flags]++;
+	if ((ds->flags & DEVSTAT_NO_ORDERED_TAGS) == 0 &&
+	    tag_type != DEVSTAT_TAG_NONE)
+		pc->tag_types[tag_type]++;
+	if (then != NULL) {
+		dt = *now;
+		bintime_sub(&dt, then);
+		bintime_add(&pc->duration[flags], &dt);
+	}
+	pc->end_count++;
+	critical_exit();
+
+	for (c = dp->outstanding; c > 1; c = dp->outstanding) {
+		if (atomic_cmpset_int(&dp->outstanding, c, c - 1))
+			return;
+	}
+
+	mtx_lock(&dp->busy_mtx);
+	do {
+		c = dp->outstanding;
+		if (c == 0)
+			break;
+	} while (!atomic_cmpset_int(&dp->outstanding, c, c - 1));
+	if (c == 1) {
+		dt = *now;
+		bintime_sub(&dt, &dp->busy_from);
+		bintime_add(&dp->busy_time, &dt);
+		dp->busy_from = *now;
+	}
+	mtx_unlock(&dp->busy_mtx);
+}
+
+/*
+ * Fold the per-CPU counters of one device into its exported struct
+ * devstat, following the sequence0/sequence1 protocol described above
+ * devstat_end_transaction().  Busy time still running is accounted up to
+ * now, exactly as a completion would have in the unfolded case.
+ */
+static void
+devstat_fold(struct devstat *ds, struct devstat_priv *dp)
+{
+	struct devstat_pcpu sum, *pc;
+	struct bintime busy_from, busy_time, dt;
+	int cpu, i;
+
+	mtx_assert(&devstat_mutex, MA_OWNED);
+
+	bzero(&sum, sizeof(sum));
+	for (cpu = 0; cpu <= mp_maxid; cpu++) {
+		pc = &dp->pcpu[cpu];
+		sum.start_count += pc->start_count;
+		sum.end_count += pc->end_count;
+		for (i = 0; i < DEVSTAT_N_TRANS_FLAGS; i++) {
+			sum.bytes[i] += pc->bytes[i];
+			sum.operations[i] += pc->operations[i];
+			bintime_add(&sum.duration[i], &pc->duration[i]);
+		}
+		for (i = 0; i < 3; i++)
+			sum.tag_types[i] += pc->tag_types[i];
+	}
+
+	mtx_lock(&dp->busy_mtx);
+	busy_time = dp->busy_time;
+	if (dp->outstanding != 0) {
+		binuptime(&busy_from);
+		dt = busy_from;
+		bintime_sub(&dt, &dp->busy_from);
+		bintime_add(&busy_time, &dt);
+	} else
+		busy_from = dp->busy_from;
+	mtx_unlock(&dp->busy_mtx);
+
+	atomic_add_acq_int(&ds->sequence1, 1);
+	ds->start_count = sum.start_count;
+	ds->end_count = sum.end_count;
+	ds->busy_from = busy_from;
+	bcopy(sum.bytes, ds->bytes, sizeof(ds->bytes));
+	bcopy(sum.operations, ds->operations, sizeof(ds->operations));
+	bcopy(sum.duration, ds->duration, sizeof(ds->duration));
+	ds->busy_time = busy_time;
+	bcopy(sum.tag_types, ds->tag_types, sizeof(ds->tag_types));
+	atomic_add_rel_int(&ds->sequence0, 1);
+}
+
 /*
  * Record a transaction start.
  *
@@ -231,6 +399,12 @@ devstat_start_transaction(struct devstat *ds, struct bintime *now)
 	if (ds == NULL)
 		return;
 
+	if (devstat_pcpu) {
+		devstat_pcpu_start(ds, now);
+		DTRACE_DEVSTAT_START();
+		return;
+	}
+
 	atomic_add_acq_int(&ds->sequence1, 1);
 	/*
 	 * We only want to set the start time when we are going from idle
@@ -305,6 +479,12 @@ devstat_end_transaction(struct devstat *ds, uint32_t bytes,
 		binuptime(now);
 	}
 
+	if (devstat_pcpu) {
+		devstat_pcpu_end(ds, bytes, tag_type, flags, now, then);
+		DTRACE_DEVSTAT_DONE();
+		return;
+	}
+
 	atomic_add_acq_int(&ds->sequence1, 1);
 	/* Update byte and operations counts */
 	ds->bytes[flags] += bytes;
@@ -366,6 +546,24 @@ devstat_end_transaction_bio_bt(struct devstat *ds, struct bio *bp,
 	DTRACE_DEVSTAT_BIO_DONE();
 }
 
+/*
+ * Copy out a consistent view of ds, folding in any per-CPU counters first.
+ */
+static void
+devstat_snapshot(struct devstat *ds, struct devstat *copy)
+{
+	struct devstat_priv *dp;
+
+	mtx_assert(&devstat_mutex, MA_OWNED);
+
+	if (devstat_pcpu) {
+		dp = devstat_priv(ds);
+		if (dp->pcpu != NULL)
+			devstat_fold(ds, dp);
+	}
+	bcopy(ds, copy, sizeof(*copy));
+}
+
 /*
  * This is the sysctl handler for the devstat package.  The data pushed out
  * on the kern.devstat.all sysctl variable consists of the current devstat
@@ -381,7 +579,7 @@ sysctl_devstat(SYSCTL_HANDLER_ARGS)
 {
 	int error;
 	long mygen;
-	struct devstat *nds;
+	struct devstat *nds, lds;
 
 	mtx_assert(&devstat_mutex, MA_NOTOWNED);
 
@@ -407,20 +605,25 @@ sysctl_devstat(SYSCTL_HANDLER_ARGS)
 	nds = STAILQ_FIRST(&device_statq); 
 	if (mygen != devstat_generation)
 		error = EBUSY;
+	else if (nds != NULL)
+		devstat_snapshot(nds, &lds);
 	mtx_unlock(&devstat_mutex);
 
 	if (error != 0)
 		return (error);
 
 	for (;nds != NULL;) {
-		error = SYSCTL_OUT(req, nds, sizeof(struct devstat));
+		error = SYSCTL_OUT(req, &lds, sizeof(struct devstat));
 		if (error != 0)
 			return (error);
 		mtx_lock(&devstat_mutex);
 		if (mygen != devstat_generation)
 			error = EBUSY;
-		else
+		else {
 			nds = STAILQ_NEXT(nds, dev_links);
+			if (nds != NULL)
+				devstat_snapshot(nds, &lds);
+		}
 		mtx_unlock(&devstat_mutex);
 		if (error != 0)
 			return (error);
@@ -447,6 +650,11 @@ SYSCTL_LONG(_kern_devstat, OID_AUTO, generation, CTLFLAG_RD,
     &devstat_generation, 0, "Devstat list generation");
 SYSCTL_INT(_kern_devstat, OID_AUTO, version, CTLFLAG_RD, 
     &devstat_version, 0, "Devstat list version number");
+SYSCTL_INT(_kern_devstat, OID_AUTO, pcpu, CTLFLAG_RDTUN,
+    &devstat_pcpu, 0, "Keep devstat counters per CPU");
+SYSCTL_INT(_kern_devstat, OID_AUTO, fold_interval, CTLFLAG_RWTUN,
+    &devstat_fold_interval, 0,
+    "Milliseconds between refreshes of the mmap(2)able statistics");
 
 /*
  * Allocator for struct devstat structures.  We sub-allocate these from pages
@@ -466,13 +674,92 @@ static struct cdevsw devstat_cdevsw = {
 
 struct statspage {
 	TAILQ_ENTRY(statspage)	list;
+	struct statspage	*hash_next;
 	struct devstat		*stat;
+	struct devstat_priv	*priv;		/* statsperpage entries */
 	u_int			nfree;
 };
 
 static TAILQ_HEAD(, statspage)	pagelist = TAILQ_HEAD_INITIALIZER(pagelist);
 static MALLOC_DEFINE(M_DEVSTAT, "devstat", "Device statistics");
 
+/*
+ * Statistics pages are never freed, so the hash from a page to its
+ * statspage is only ever added to and can be walked without the lock.
+ */
+#define	DEVSTAT_HASH_SIZE	64
+#define	DEVSTAT_HASH(va)	(((va) >> PAGE_SHIFT) & (DEVSTAT_HASH_SIZE - 1))
+
+static struct statspage *devstat_hash[DEVSTAT_HASH_SIZE];
+
+static struct devstat_priv *
+devstat_priv(struct devstat *ds)
+{
+	struct statspage *spp;
+	uintptr_t va;
+
+	va = trunc_page((uintptr_t)ds);
+	spp = (struct statspage *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&devstat_hash[DEVSTAT_HASH(va)]);
+	for (; spp != NULL; spp = spp->hash_next) {
+		if ((uintptr_t)spp->stat == va)
+			return (&spp->priv[ds - spp->stat]);
+	}
+	panic("devstat_priv: %p is not a devstat", ds);
+}
+
+static void
+devstat_fold_all(void *arg __unused)
+{
+	struct statspage *spp;
+	u_int u;
+	int to;
+
+	mtx_assert(&devstat_mutex, MA_OWNED);
+
+	TAILQ_FOREACH(spp, &pagelist, list) {
+		for (u = 0; u < statsperpage; u++) {
+			if (spp->priv[u].pcpu != NULL)
+				devstat_fold(&spp->stat[u], &spp->priv[u]);
+		}
+	}
+
+	to = (int64_t)max(devstat_fold_interval, 1) * hz / 1000;
+	callout_reset(&devstat_fold_callout, max(to, 1), devstat_fold_all,
+	    NULL);
+}
+
+static struct statspage *
+devstat_page_alloc(void)
+{
+	struct statspage *spp;
+	u_int u;
+
+	spp = malloc(sizeof *spp, M_DEVSTAT, M_ZERO | M_WAITOK);
+	spp->stat = malloc(PAGE_SIZE, M_DEVSTAT, M_ZERO | M_WAITOK);
+	KASSERT(((uintptr_t)spp->stat & PAGE_MASK) == 0,
+	    ("devstat page %p is not page aligned", spp->stat));
+	spp->priv = malloc(statsperpage * sizeof(*spp->priv), M_DEVSTAT,
+	    M_ZERO | M_WAITOK);
+	for (u = 0; u < statsperpage; u++)
+		mtx_init(&spp->priv[u].busy_mtx, "devstat busy", NULL,
+		    MTX_DEF);
+	spp->nfree = statsperpage;
+	return (spp);
+}
+
+static void
+devstat_page_free(struct statspage *spp)
+{
+	u_int u;
+
+	for (u = 0; u < statsperpage; u++)
+		mtx_destroy(&spp->priv[u].busy_mtx);
+	free(spp->priv, M_DEVSTAT);
+	free(spp->stat, M_DEVSTAT);
+	free(spp, M_DEVSTAT);
+}
+
 static int
 devstat_mmap(struct cdev *dev, vm_ooffset_t offset, vm_paddr_t *paddr,
     int nprot, vm_memattr_t *memattr)
@@ -498,6 +785,7 @@ static struct devstat *
 devstat_alloc(void)
 {
 	struct devstat *dsp;
+	struct devstat_pcpu *pcpu;
 	struct statspage *spp, *spp2;
 	u_int u;
 	static int once;
@@ -507,8 +795,19 @@ devstat_alloc(void)
 		make_dev_credf(MAKEDEV_ETERNAL | MAKEDEV_CHECKNAME,
 		    &devstat_cdevsw, 0, NULL, UID_ROOT, GID_WHEEL, 0444,
 		    DEVSTAT_DEVICE_NAME);
+		if (devstat_pcpu) {
+			callout_init_mtx(&devstat_fold_callout,
+			    &devstat_mutex, 0);
+			mtx_lock(&devstat_mutex);
+			devstat_fold_all(NULL);
+			mtx_unlock(&devstat_mutex);
+		}
 		once = 1;
 	}
+	pcpu = NULL;
+	if (devstat_pcpu)
+		pcpu = malloc(sizeof(*pcpu) * (mp_maxid + 1), M_DEVSTAT,
+		    M_ZERO | M_WAITOK);
 	spp2 = NULL;
 	mtx_lock(&devstat_mutex);
 	for (;;) {
@@ -519,9 +818,7 @@ devstat_alloc(void)
 		if (spp != NULL)
 			break;
 		mtx_unlock(&devstat_mutex);
-		spp2 = malloc(sizeof *spp, M_DEVSTAT, M_ZERO | M_WAITOK);
-		spp2->stat = malloc(PAGE_SIZE, M_DEVSTAT, M_ZERO | M_WAITOK);
-		spp2->nfree = statsperpage;
+		spp2 = devstat_page_alloc();
 
 		/*
 		 * If free statspages were added while the lock was released
@@ -540,6 +837,11 @@ devstat_alloc(void)
 			 * sequence of the mapping so we can't do that.
 			 */
 			TAILQ_INSERT_TAIL(&pagelist, spp, list);
+			spp->hash_next = devstat_hash[DEVSTAT_HASH(
+			    (uintptr_t)spp->stat)];
+			atomic_store_rel_ptr((volatile uintptr_t *)
+			    &devstat_hash[DEVSTAT_HASH((uintptr_t)spp->stat)],
+			    (uintptr_t)spp);
 		} else
 			break;
 	}
@@ -551,23 +853,29 @@ devstat_alloc(void)
 	}
 	spp->nfree--;
 	dsp->allocated = 1;
+	spp->priv[u].pcpu = pcpu;
 	mtx_unlock(&devstat_mutex);
-	if (spp2 != NULL && spp2 != spp) {
-		free(spp2->stat, M_DEVSTAT);
-		free(spp2, M_DEVSTAT);
-	}
+	if (spp2 != NULL && spp2 != spp)
+		devstat_page_free(spp2);
 	return (dsp);
 }
 
 static void
 devstat_free(struct devstat *dsp)
 {
+	struct devstat_priv *dp;
 	struct statspage *spp;
 
 	mtx_assert(&devstat_mutex, MA_OWNED);
 	bzero(dsp, sizeof *dsp);
 	TAILQ_FOREACH(spp, &pagelist, list) {
 		if (dsp >= spp->stat && dsp < (spp->stat + statsperpage)) {
+			dp = &spp->priv[dsp - spp->stat];
+			free(dp->pcpu, M_DEVSTAT);
+			dp->pcpu = NULL;
+			dp->outstanding = 0;
+			bintime_clear(&dp->busy_from);
+			bintime_clear(&dp->busy_time);
 			spp->nfree++;
 			return;
 		}
@@ -21,6 +21,10 @@ __FBSDID("$FreeBSD$");
 #include <sys/bio.h>
 #include <sys/conf.h>
 #include <sys/disk.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
 #include <geom/geom_disk.h>
 
 /*-
@@ -141,8 +145,61 @@ disk_err(struct bio *bp, const char *what, int blkdone, int nl)
  * the queue may contain multiple inversion points (i.e. more than
  * two sorted sequences of requests).
  *
+ * --- Indexed queues ---
+ *
+ * bioq_disksort() walks the queue from insert_point, which gets costly
+ * with thousands of queued requests.  A queue set up with
+ * bioq_init_sorted() also keeps the requests after insert_point in a
+ * red-black tree ordered by bio_offset, so an insertion finds its place
+ * in O(log n); the TAILQ stays the dispatch order and bioq_first() and
+ * bioq_takefirst() still just look at its head.
+ *
+ * The indexed requests are kept in exactly the order bioq_disksort()
+ * defines: offset order rotated to start at last_offset.  Three details
+ * differ, all needed to keep that rotation intact:
+ *
+ *  - when the head is taken and the next request starts inside the range
+ *    just dispatched, last_offset stops at that request's offset instead
+ *    of the end of the range, so the overlapping request stays first;
+ *
+ *  - bioq_insert_head() does not move last_offset; the request is
+ *    simply kept ahead of every request bioq_disksort() inserts;
+ *
+ *  - removing insert_point moves it to the previous request rather than
+ *    clearing it, so requests queued before the barrier never join the
+ *    sorted part.
+ *
+ * Each bioq_insert_tail() starts a new, empty index in O(1); requests left
+ * in the old one are told apart by a generation number.  The TAILQ of
+ * an indexed queue must only be changed through the bioq_*() functions.
  */
 
+static int
+bioq_sort_cmp(struct bio *a, struct bio *b)
+{
+
+	if (a->bio_offset != b->bio_offset)
+		return (a->bio_offset < b->bio_offset ? -1 : 1);
+	if (a->bio_sortseq != b->bio_sortseq)
+		return ((int)(a->bio_sortseq - b->bio_sortseq) < 0 ? -1 : 1);
+	return (0);
+}
+
+RB_GENERATE_STATIC(bio_sorttree, bio, bio_sortlink, bioq_sort_cmp);
+
+#define	BIOQ_INDEXED(head, bp)						\
+	(((head)->flags & BIOQ_SORTED) != 0 &&				\
+	 (bp)->bio_sortgen == (head)->sort_gen)
+
+static void
+bioq_sort_reset(struct bio_queue_head *head)
+{
+
+	if (++head->sort_gen == 0)
+		head->sort_gen = 1;
+	RB_INIT(&head->sort_tree);
+}
+
 void
 bioq_init(struct bio_queue_head *head)
 {
@@ -150,13 +207,41 @@ bioq_init(struct bio_queue_head *head)
 	TAILQ_INIT(&head->queue);
 	head->last_offset = 0;
 	head->insert_point = NULL;
+	head->flags = 0;
+	head->sort_gen = 1;
+	head->sort_seq = 0;
+	RB_INIT(&head->sort_tree);
+}
+
+void
+bioq_init_sorted(struct bio_queue_head *head)
+{
+
+	bioq_init(head);
+	head->flags |= BIOQ_SORTED;
 }
 
 void
 bioq_remove(struct bio_queue_head *head, struct bio *bp)
 {
+	struct bio *next;
 
-	if (head->insert_point == NULL) {
+	if (BIOQ_INDEXED(head, bp)) {
+		if (head->insert_point == NULL &&
+		    bp == TAILQ_FIRST(&head->queue)) {
+			head->last_offset = bp->bio_offset + bp->bio_length;
+			next = TAILQ_NEXT(bp, bio_queue);
+			if (next != NULL && next->bio_offset >= bp->bio_offset &&
+			    next->bio_offset < head->last_offset)
+				head->last_offset = next->bio_offset;
+		}
+		RB_REMOVE(bio_sorttree, &head->sort_tree, bp);
+		bp->bio_sortgen = 0;
+	} else if ((head->flags & BIOQ_SORTED) != 0) {
+		if (bp == head->insert_point)
+			head->insert_point = TAILQ_PREV(bp, bio_queue,
+			    bio_queue);
+	} else if (head->insert_point == NULL) {
 		if (bp == TAILQ_FIRST(&head->queue))
 			head->last_offset = bp->bio_offset + bp->bio_length;
 	} else if (bp == head->insert_point)
@@ -178,7 +263,9 @@ void
 bioq_insert_head(struct bio_queue_head *head, struct bio *bp)
 {
 
-	if (head->insert_point == NULL)
+	if ((head->flags & BIOQ_SORTED) != 0)
+		bp->bio_sortgen = 0;
+	else if (head->insert_point == NULL)
 		head->last_offset = bp->bio_offset;
 	TAILQ_INSERT_HEAD(&head->queue, bp, bio_queue);
 }
@@ -187,6 +274,10 @@ void
 bioq_insert_tail(struct bio_queue_head *head, struct bio *bp)
 {
 
+	if ((head->flags & BIOQ_SORTED) != 0) {
+		bp->bio_sortgen = 0;
+		bioq_sort_reset(head);
+	}
 	TAILQ_INSERT_TAIL(&head->queue, bp, bio_queue);
 	head->insert_point = bp;
 	head->last_offset = bp->bio_offset;
@@ -222,6 +313,53 @@ bioq_bio_key(struct bio_queue_head *head, struct bio *bp)
 	return ((uoff_t)(bp->bio_offset - head->last_offset));
 }
 
+/*
+ * Seek sort through the tree index.  The neighbours bp would have in a
+ * queue sorted by bioq_bio_key() are its neighbours in offset order,
+ * except across the wrap at last_offset.
+ */
+static void
+bioq_disksort_indexed(struct bio_queue_head *head, struct bio *bp)
+{
+	struct bio *prev, *next;
+	off_t pivot;
+
+	pivot = head->last_offset;
+	bp->bio_sortgen = head->sort_gen;
+	bp->bio_sortseq = head->sort_seq++;
+	RB_INSERT(bio_sorttree, &head->sort_tree, bp);
+
+	prev = RB_PREV(bio_sorttree, &head->sort_tree, bp);
+	if (bp->bio_offset >= pivot) {
+		/* Nothing earlier in this sweep; bp goes first. */
+		if (prev != NULL && prev->bio_offset < pivot)
+			prev = NULL;
+	} else if (prev == NULL) {
+		/* First of the next sweep: after the end of this one. */
+		prev = RB_MAX(bio_sorttree, &head->sort_tree);
+		if (prev->bio_offset < pivot)
+			prev = NULL;
+	}
+	if (prev != NULL) {
+		TAILQ_INSERT_AFTER(&head->queue, prev, bp, bio_queue);
+		return;
+	}
+
+	next = RB_NEXT(bio_sorttree, &head->sort_tree, bp);
+	if (next == NULL) {
+		next = RB_MIN(bio_sorttree, &head->sort_tree);
+		if (next == bp)
+			next = NULL;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, bp, bio_queue);
+	else if (head->insert_point != NULL)
+		TAILQ_INSERT_AFTER(&head->queue, head->insert_point, bp,
+		    bio_queue);
+	else
+		TAILQ_INSERT_TAIL(&head->queue, bp, bio_queue);
+}
+
 /*
  * Seek sort for disks.
  *
@@ -246,6 +384,11 @@ bioq_disksort(struct bio_queue_head *head, struct bio *bp)
 		return;
 	}
 
+	if ((head->flags & BIOQ_SORTED) != 0) {
+		bioq_disksort_indexed(head, bp);
+		return;
+	}
+
 	prev = NULL;
 	key = bioq_bio_key(head, bp);
 	cur = TAILQ_FIRST(&head->queue);
@@ -265,3 +408,57 @@ bioq_disksort(struct bio_queue_head *head, struct bio *bp)
 	else
 		TAILQ_INSERT_AFTER(&head->queue, prev, bp, bio_queue);
 }
+
+/*
+ * Time both bioq_disksort() implementations at the queue depth written to
+ * debug.bioq_bench: fill a queue with bios at random offsets, cycle each
+ * one through bioq_takefirst() and back in, then drain it.
+ */
+static int
+sysctl_debug_bioq_bench(SYSCTL_HANDLER_ARGS)
+{
+	struct bio_queue_head head;
+	struct bio *bios, *bp;
+	sbintime_t start, t[2];
+	int depth, error, i, sorted;
+
+	depth = 0;
+	error = sysctl_handle_int(oidp, &depth, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (depth < 1 || depth > 65536)
+		return (EINVAL);
+
+	bios = malloc(sizeof(*bios) * depth, M_TEMP, M_WAITOK | M_ZERO);
+	for (i = 0; i < depth; i++) {
+		bios[i].bio_offset = (off_t)(arc4random() % (1 << 24)) *
+		    DEV_BSIZE;
+		bios[i].bio_length = MAXPHYS;
+	}
+	for (sorted = 0; sorted < 2; sorted++) {
+		if (sorted)
+			bioq_init_sorted(&head);
+		else
+			bioq_init(&head);
+		start = sbinuptime();
+		for (i = 0; i < depth; i++)
+			bioq_disksort(&head, &bios[i]);
+		for (i = 0; i < depth; i++) {
+			bp = bioq_takefirst(&head);
+			bioq_disksort(&head, bp);
+		}
+		while (bioq_takefirst(&head) != NULL)
+			continue;
+		t[sorted] = sbinuptime() - start;
+	}
+	free(bios, M_TEMP);
+
+	printf("bioq_bench: depth %d: list %ju us, tree %ju us "
+	    "for %d insertions\n", depth,
+	    (uintmax_t)((t[0] * 1000000) >> 32),
+	    (uintmax_t)((t[1] * 1000000) >> 32), depth * 2);
+	return (0);
+}
+SYSCTL_PROC(_debug, OID_AUTO, bioq_bench, CTLTYPE_INT | CTLFLAG_RW, 0, 0,
+    sysctl_debug_bioq_bench, "I",
+    "Benchmark bioq_disksort() at the given queue depth");
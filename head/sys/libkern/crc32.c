@@ -48,6 +48,14 @@ __FBSDID("$FreeBSD$");
 #include <sys/param.h>
 #include <sys/systm.h>
 
+#if defined(_KERNEL) && defined(__amd64__)
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+#endif
+
 const uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
 	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -744,8 +752,8 @@ multitable_crc32c(uint32_t crc32c,
 	return (crc32c_sb8_64_bit(crc32c, buffer, length, to_even_word));
 }
 
-uint32_t
-calculate_crc32c(uint32_t crc32c,
+static uint32_t
+table_crc32c(uint32_t crc32c,
     const unsigned char *buffer,
     unsigned int length)
 {
@@ -755,3 +763,81 @@ calculate_crc32c(uint32_t crc32c,
 		return (multitable_crc32c(crc32c, buffer, length));
 	}
 }
+
+#if defined(_KERNEL) && defined(__amd64__)
+/*
+ * Set at boot once the CPU is known to support SSE4.2 and the hardware
+ * routine has been checked against the table-driven one.
+ */
+static int crc32c_sse42;
+
+/*
+ * Compare sse42_crc32c() with the table implementation over every
+ * alignment and over lengths that exercise each of its paths: the byte
+ * head and tail, the plain 8-byte loop and the three-way interleaved
+ * SHORT (256) and LONG (8192) blocks, including their recombination.
+ */
+static int
+crc32c_sse42_selftest(void)
+{
+	static const u_int lengths[] = {
+		0, 1, 2, 3, 4, 7, 8, 9, 15, 16, 31, 63, 64, 65, 255, 256,
+		767, 768, 769, 1024, 1500, 4096, 8192, 9000, 24575, 24576,
+		24577, 24576 + 768 + 13, 65536
+	};
+	unsigned char *buf;
+	uint32_t seed;
+	u_int i, off;
+	int ok;
+
+	buf = malloc(65536 + 8, M_TEMP, M_WAITOK);
+	seed = 0x12345678;
+	for (i = 0; i < 65536 + 8; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+	ok = 1;
+	for (i = 0; i < nitems(lengths) && ok; i++) {
+		for (off = 0; off < 8; off++) {
+			if (sse42_crc32c(0xffffffff, buf + off, lengths[i]) !=
+			    table_crc32c(0xffffffff, buf + off, lengths[i])) {
+				printf("crc32c: SSE4.2 mismatch at offset %u, "
+				    "length %u\n", off, lengths[i]);
+				ok = 0;
+				break;
+			}
+		}
+	}
+	free(buf, M_TEMP);
+	return (ok);
+}
+
+static void
+crc32c_sse42_init(void *arg __unused)
+{
+
+	if ((cpu_feature2 & CPUID2_SSE42) == 0)
+		return;
+	sse42_crc32c_init();
+	if (!crc32c_sse42_selftest()) {
+		printf("crc32c: SSE4.2 self-test failed, using tables\n");
+		return;
+	}
+	crc32c_sse42 = 1;
+	if (bootverbose)
+		printf("crc32c: using SSE4.2\n");
+}
+SYSINIT(crc32c_sse42, SI_SUB_CPU, SI_ORDER_ANY, crc32c_sse42_init, NULL);
+#endif
+
+uint32_t
+calculate_crc32c(uint32_t crc32c,
+    const unsigned char *buffer,
+    unsigned int length)
+{
+#if defined(_KERNEL) && defined(__amd64__)
+	if (crc32c_sse42)
+		return (sse42_crc32c(crc32c, buffer, length));
+#endif
+	return (table_crc32c(crc32c, buffer, length));
+}
@@ -0,0 +1,280 @@
+/*-
+ * XOR of memory buffers, scalar version and run-time selection.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer,
+ *    without modification, immediately at the beginning of the file.
+ * 2. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+/*
+ * memxor(dst, src, len) computes dst ^= src over len bytes.  It is the
+ * parity primitive for the GEOM RAID classes.  On amd64 an SSE2 or AVX2
+ * loop is picked at boot by measuring each candidate that the CPU
+ * supports and that agrees with the scalar code.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+
+#ifdef __amd64__
+#include <machine/cpufunc.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+#endif
+
+typedef void memxor_t(void *, const void *, size_t);
+
+static void
+scalar_memxor(void *dst, const void *src, size_t len)
+{
+	uint64_t *d64;
+	const uint64_t *s64;
+	uint8_t *d;
+	const uint8_t *s;
+
+	d = dst;
+	s = src;
+	if ((((uintptr_t)d | (uintptr_t)s) & (sizeof(uint64_t) - 1)) == 0) {
+		d64 = (uint64_t *)d;
+		s64 = (const uint64_t *)s;
+		for (; len >= 8 * sizeof(uint64_t); len -= 8 * sizeof(uint64_t)) {
+			d64[0] ^= s64[0];
+			d64[1] ^= s64[1];
+			d64[2] ^= s64[2];
+			d64[3] ^= s64[3];
+			d64[4] ^= s64[4];
+			d64[5] ^= s64[5];
+			d64[6] ^= s64[6];
+			d64[7] ^= s64[7];
+			d64 += 8;
+			s64 += 8;
+		}
+		for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t))
+			*d64++ ^= *s64++;
+		d = (uint8_t *)d64;
+		s = (const uint8_t *)s64;
+	}
+	for (; len > 0; len--)
+		*d++ ^= *s++;
+}
+
+static memxor_t *memxor_func = scalar_memxor;
+
+#ifdef __amd64__
+/* Below this size saving the FPU state costs more than SIMD gains. */
+#define	MEMXOR_SIMD_MIN		512
+
+#define	MEMXOR_BENCH_SIZE	(64 * 1024)
+#define	MEMXOR_BENCH_LOOPS	64
+
+static struct memxor_impl {
+	const char	*mi_name;
+	memxor_t	*mi_func;
+	int		 mi_avail;
+	uint64_t	 mi_rate;	/* MB/s measured at boot */
+} memxor_impls[] = {
+	{ "scalar",	scalar_memxor,	1,	0 },
+	{ "sse2",	sse2_memxor,	0,	0 },
+	{ "avx2",	avx2_memxor,	0,	0 },
+};
+
+static int
+sysctl_memxor_impl(SYSCTL_HANDLER_ARGS)
+{
+	char name[16];
+	u_int i;
+	int error;
+
+	strlcpy(name, "scalar", sizeof(name));
+	for (i = 0; i < nitems(memxor_impls); i++) {
+		if (memxor_impls[i].mi_func == memxor_func)
+			strlcpy(name, memxor_impls[i].mi_name, sizeof(name));
+	}
+	error = sysctl_handle_string(oidp, name, sizeof(name), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	for (i = 0; i < nitems(memxor_impls); i++) {
+		if (strcmp(name, memxor_impls[i].mi_name) == 0 &&
+		    memxor_impls[i].mi_avail) {
+			memxor_func = memxor_impls[i].mi_func;
+			return (0);
+		}
+	}
+	return (EINVAL);
+}
+
+static int
+sysctl_memxor_rates(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf sb;
+	u_int i;
+	int error;
+
+	sbuf_new_for_sysctl(&sb, NULL, 64, req);
+	for (i = 0; i < nitems(memxor_impls); i++) {
+		if (!memxor_impls[i].mi_avail)
+			continue;
+		sbuf_printf(&sb, "%s%s %ju", i == 0 ? "" : " ",
+		    memxor_impls[i].mi_name,
+		    (uintmax_t)memxor_impls[i].mi_rate);
+	}
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+static SYSCTL_NODE(_kern, OID_AUTO, memxor, CTLFLAG_RW, 0,
+    "Buffer XOR implementation");
+SYSCTL_PROC(_kern_memxor, OID_AUTO, impl, CTLTYPE_STRING | CTLFLAG_RW,
+    NULL, 0, sysctl_memxor_impl, "A", "Implementation in use");
+SYSCTL_PROC(_kern_memxor, OID_AUTO, rates, CTLTYPE_STRING | CTLFLAG_RD,
+    NULL, 0, sysctl_memxor_rates, "A",
+    "Boot-time throughput of each usable implementation, in MB/s");
+
+/*
+ * Compare an implementation with scalar_memxor() over short, odd and
+ * block-sized lengths at several source and destination alignments,
+ * checking that no byte past the end is touched.
+ */
+static int
+memxor_selftest(memxor_t *func, uint8_t *a, uint8_t *b, uint8_t *c)
+{
+	static const u_int lengths[] = {
+		1, 15, 16, 17, 63, 64, 65, 127, 128, 129, 511, 512, 1000, 4096
+	};
+	static const u_int offs[] = { 0, 1, 8, 17 };
+	uint32_t seed;
+	u_int i, j, k;
+
+	seed = 0x12345678;
+	for (i = 0; i < 4096 + 64; i++) {
+		seed = seed * 1103515245 + 12345;
+		a[i] = seed >> 16;
+		seed = seed * 1103515245 + 12345;
+		b[i] = seed >> 16;
+	}
+	for (i = 0; i < nitems(lengths); i++) {
+		for (j = 0; j < nitems(offs); j++) {
+			for (k = 0; k < nitems(offs); k++) {
+				bcopy(a, c, 4096 + 64);
+				func(a + offs[j], b + offs[k], lengths[i]);
+				scalar_memxor(c + offs[j], b + offs[k],
+				    lengths[i]);
+				if (bcmp(a, c, 4096 + 64) != 0)
+					return (0);
+			}
+		}
+	}
+	return (1);
+}
+
+static uint64_t
+memxor_bench(memxor_t *func, uint8_t *dst, const uint8_t *src)
+{
+	struct bintime bt, end;
+	struct timespec ts;
+	uint64_t ns;
+	int i;
+
+	func(dst, src, MEMXOR_BENCH_SIZE);	/* Warm up the caches. */
+	binuptime(&bt);
+	for (i = 0; i < MEMXOR_BENCH_LOOPS; i++)
+		func(dst, src, MEMXOR_BENCH_SIZE);
+	binuptime(&end);
+	bintime_sub(&end, &bt);
+	bintime2timespec(&end, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (ns == 0)
+		ns = 1;
+	return ((uint64_t)MEMXOR_BENCH_SIZE * MEMXOR_BENCH_LOOPS * 1000 / ns);
+}
+
+static void
+memxor_init(void *arg __unused)
+{
+	struct memxor_impl *mi, *best;
+	uint8_t *a, *b, *c;
+	u_int i;
+
+	if ((cpu_feature & CPUID_SSE2) != 0)
+		memxor_impls[1].mi_avail = 1;
+	if ((cpu_stdext_feature & CPUID_STDEXT_AVX2) != 0 &&
+	    (cpu_feature2 & CPUID2_OSXSAVE) != 0 &&
+	    (rxcr(0) & (XFEATURE_ENABLED_SSE | XFEATURE_ENABLED_AVX)) ==
+	    (XFEATURE_ENABLED_SSE | XFEATURE_ENABLED_AVX))
+		memxor_impls[2].mi_avail = 1;
+	if (!memxor_impls[1].mi_avail && !memxor_impls[2].mi_avail)
+		return;
+	memxor_fpu_init();
+
+	a = malloc(MEMXOR_BENCH_SIZE + 64, M_TEMP, M_WAITOK);
+	b = malloc(MEMXOR_BENCH_SIZE + 64, M_TEMP, M_WAITOK);
+	c = malloc(MEMXOR_BENCH_SIZE + 64, M_TEMP, M_WAITOK);
+	best = NULL;
+	for (i = 0; i < nitems(memxor_impls); i++) {
+		mi = &memxor_impls[i];
+		if (!mi->mi_avail)
+			continue;
+		if (mi->mi_func != scalar_memxor &&
+		    !memxor_selftest(mi->mi_func, a, b, c)) {
+			printf("memxor: %s self-test failed\n", mi->mi_name);
+			mi->mi_avail = 0;
+			continue;
+		}
+		mi->mi_rate = memxor_bench(mi->mi_func, a, b);
+		if (best == NULL || mi->mi_rate > best->mi_rate)
+			best = mi;
+	}
+	free(a, M_TEMP);
+	free(b, M_TEMP);
+	free(c, M_TEMP);
+	memxor_func = best->mi_func;
+	if (bootverbose) {
+		printf("memxor: using %s (%ju MB/s)\n", best->mi_name,
+		    (uintmax_t)best->mi_rate);
+	}
+}
+/* Timecounters are needed for the measurement. */
+SYSINIT(memxor, SI_SUB_CLOCKS, SI_ORDER_ANY, memxor_init, NULL);
+#endif	/* __amd64__ */
+
+void
+memxor(void *dst, const void *src, size_t len)
+{
+
+#ifdef __amd64__
+	if (len < MEMXOR_SIMD_MIN) {
+		scalar_memxor(dst, src, len);
+		return;
+	}
+#endif
+	memxor_func(dst, src, len);
+}
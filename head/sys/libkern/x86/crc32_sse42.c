@@ -0,0 +1,269 @@
+/*
+ * Derived from crc32c.c version 1.1 by Mark Adler.
+ *
+ * Copyright (C) 2013 Mark Adler
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the author be held liable for any damages arising from the
+ * use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Mark Adler
+ * madler@alumni.caltech.edu
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+/*
+ * CRC32C computed with the SSE4.2 crc32 instruction.  The instruction
+ * works on general purpose registers only, so no FPU context needs to be
+ * saved and this is safe to call from any context.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+
+static __inline uint32_t
+_mm_crc32_u8(uint32_t x, uint8_t y)
+{
+
+	__asm("crc32b %1,%0" : "+r" (x) : "rm" (y));
+	return (x);
+}
+
+static __inline uint64_t
+_mm_crc32_u64(uint64_t x, uint64_t y)
+{
+
+	__asm("crc32q %1,%0" : "+r" (x) : "rm" (y));
+	return (x);
+}
+
+/* CRC-32C (iSCSI) polynomial in reversed bit order. */
+#define	POLY	0x82f63b78
+
+/*
+ * Block sizes for three-way parallel crc computation.  LONG and SHORT must
+ * both be powers of two.
+ */
+#define	LONG	8192
+#define	SHORT	256
+
+/* Tables for advancing a crc over LONG and SHORT zero bytes. */
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+/* Multiply a matrix times a vector over the Galois field of two elements. */
+static uint32_t
+gf2_matrix_times(uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum;
+
+	sum = 0;
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return (sum);
+}
+
+/*
+ * Multiply a matrix by itself over GF(2).  Both mat and square must have
+ * 32 rows.
+ */
+static void
+gf2_matrix_square(uint32_t *square, uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Construct an operator to apply len zeros to a crc.  len must be a power
+ * of two.  If len is not a power of two, then the result is the same as
+ * for the largest power of two less than len.  The result for len == 0 is
+ * the same as for len == 1.
+ */
+static void
+crc32c_zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32];	/* odd-power-of-two zeros operator */
+	uint32_t row;
+	int n;
+
+	/* Put operator for one zero bit in odd. */
+	odd[0] = POLY;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* Put operator for two zero bits in even. */
+	gf2_matrix_square(even, odd);
+
+	/* Put operator for four zero bits in odd. */
+	gf2_matrix_square(odd, even);
+
+	/*
+	 * First square will put the operator for one zero byte (eight zero
+	 * bits), in even -- next square puts operator for two zero bytes in
+	 * odd, and so on, until len has been rotated down to zero.
+	 */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+
+	/* Answer ended up in odd -- copy to even. */
+	for (n = 0; n < 32; n++)
+		even[n] = odd[n];
+}
+
+/*
+ * Take a length and build four lookup tables for applying the zeros
+ * operator for that length, byte-by-byte on the operand.
+ */
+static void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+/* Apply the zeros operator table to crc. */
+static __inline uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+
+	return (zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	    zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24]);
+}
+
+/*
+ * Build the shift tables.  Must be called once before sse42_crc32c().
+ */
+void
+sse42_crc32c_init(void)
+{
+
+	crc32c_zeros(crc32c_long, LONG);
+	crc32c_zeros(crc32c_short, SHORT);
+}
+
+/*
+ * Compute CRC-32C using the Intel hardware instruction.  As with
+ * calculate_crc32c(), the crc is neither pre- nor post-inverted here.
+ */
+uint32_t
+sse42_crc32c(uint32_t crc, const unsigned char *buf, unsigned len)
+{
+	const unsigned char *next, *end;
+	uint64_t crc0, crc1, crc2;
+
+	next = buf;
+	crc0 = crc;
+
+	/* Compute the crc to bring the data pointer to an 8-byte boundary. */
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc0 = _mm_crc32_u8(crc0, *next);
+		next++;
+		len--;
+	}
+
+	/*
+	 * Compute the crc on sets of LONG*3 bytes, executing three
+	 * independent crc instructions, each on LONG bytes.  The crc
+	 * instruction has a throughput of one per cycle but a latency of
+	 * three, so interleaving three streams keeps the unit busy.  The
+	 * partial crcs are then recombined by shifting them over the bytes
+	 * that follow them, using the precomputed zeros tables.
+	 */
+	while (len >= LONG * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = next + LONG;
+		do {
+			crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+			crc1 = _mm_crc32_u64(crc1,
+			    *(const uint64_t *)(next + LONG));
+			crc2 = _mm_crc32_u64(crc2,
+			    *(const uint64_t *)(next + (LONG * 2)));
+			next += 8;
+		} while (next < end);
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+		next += LONG * 2;
+		len -= LONG * 3;
+	}
+
+	/*
+	 * Do the same thing, but now on SHORT*3 blocks for the remaining
+	 * data less than a LONG*3 block.
+	 */
+	while (len >= SHORT * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = next + SHORT;
+		do {
+			crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+			crc1 = _mm_crc32_u64(crc1,
+			    *(const uint64_t *)(next + SHORT));
+			crc2 = _mm_crc32_u64(crc2,
+			    *(const uint64_t *)(next + (SHORT * 2)));
+			next += 8;
+		} while (next < end);
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+		next += SHORT * 2;
+		len -= SHORT * 3;
+	}
+
+	/*
+	 * Compute the crc on the remaining 8-byte units less than a SHORT*3
+	 * block length.
+	 */
+	end = next + (len - (len & 7));
+	while (next < end) {
+		crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+		next += 8;
+	}
+	len &= 7;
+
+	/* Compute the crc for up to seven trailing bytes. */
+	while (len) {
+		crc0 = _mm_crc32_u8(crc0, *next);
+		next++;
+		len--;
+	}
+
+	return ((uint32_t)crc0);
+}
@@ -0,0 +1,156 @@
+/*-
+ * SSE2 and AVX2 XOR of memory buffers.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions, and the following disclaimer,
+ *    without modification, immediately at the beginning of the file.
+ * 2. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+/*
+ * The kernel is built without SSE, so the loops are written in inline
+ * assembly and the vector registers are not listed as clobbered: they
+ * only ever hold the state saved by fpu_kern_enter().
+ *
+ * Each call runs inside a critical section with a context reserved for
+ * the current CPU.  fpu_kern_enter() does not sleep and no other thread
+ * can run on the CPU to use the same context.  Long buffers are split so
+ * that preemption is not held off for too long.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/pcpu.h>
+#include <sys/proc.h>
+#include <sys/smp.h>
+
+#include <machine/fpu.h>
+
+#define	MEMXOR_FPU_CHUNK	(64 * 1024)
+
+static struct fpu_kern_ctx *memxor_fpu_ctx[MAXCPU];
+
+void
+memxor_fpu_init(void)
+{
+	u_int i;
+
+	CPU_FOREACH(i) {
+		if (memxor_fpu_ctx[i] == NULL)
+			memxor_fpu_ctx[i] = fpu_kern_alloc_ctx(FPU_KERN_NORMAL);
+	}
+}
+
+/* len is a multiple of 64. */
+static void
+sse2_memxor_loop(uint8_t *dst, const uint8_t *src, size_t len)
+{
+
+	for (; len > 0; len -= 64, dst += 64, src += 64) {
+		__asm __volatile(
+		    "movdqu	  (%1), %%xmm0\n\t"
+		    "movdqu	16(%1), %%xmm1\n\t"
+		    "movdqu	32(%1), %%xmm2\n\t"
+		    "movdqu	48(%1), %%xmm3\n\t"
+		    "movdqu	  (%0), %%xmm4\n\t"
+		    "movdqu	16(%0), %%xmm5\n\t"
+		    "movdqu	32(%0), %%xmm6\n\t"
+		    "movdqu	48(%0), %%xmm7\n\t"
+		    "pxor	%%xmm4, %%xmm0\n\t"
+		    "pxor	%%xmm5, %%xmm1\n\t"
+		    "pxor	%%xmm6, %%xmm2\n\t"
+		    "pxor	%%xmm7, %%xmm3\n\t"
+		    "movdqu	%%xmm0,   (%0)\n\t"
+		    "movdqu	%%xmm1, 16(%0)\n\t"
+		    "movdqu	%%xmm2, 32(%0)\n\t"
+		    "movdqu	%%xmm3, 48(%0)"
+		    : : "r" (dst), "r" (src) : "memory");
+	}
+}
+
+/* len is a multiple of 128. */
+static void
+avx2_memxor_loop(uint8_t *dst, const uint8_t *src, size_t len)
+{
+
+	for (; len > 0; len -= 128, dst += 128, src += 128) {
+		__asm __volatile(
+		    "vmovdqu	  (%1), %%ymm0\n\t"
+		    "vmovdqu	32(%1), %%ymm1\n\t"
+		    "vmovdqu	64(%1), %%ymm2\n\t"
+		    "vmovdqu	96(%1), %%ymm3\n\t"
+		    "vpxor	  (%0), %%ymm0, %%ymm0\n\t"
+		    "vpxor	32(%0), %%ymm1, %%ymm1\n\t"
+		    "vpxor	64(%0), %%ymm2, %%ymm2\n\t"
+		    "vpxor	96(%0), %%ymm3, %%ymm3\n\t"
+		    "vmovdqu	%%ymm0,   (%0)\n\t"
+		    "vmovdqu	%%ymm1, 32(%0)\n\t"
+		    "vmovdqu	%%ymm2, 64(%0)\n\t"
+		    "vmovdqu	%%ymm3, 96(%0)"
+		    : : "r" (dst), "r" (src) : "memory");
+	}
+	__asm __volatile("vzeroupper");
+}
+
+static void
+memxor_fpu(void (*loop)(uint8_t *, const uint8_t *, size_t), size_t unit,
+    void *dst, const void *src, size_t len)
+{
+	struct fpu_kern_ctx *ctx;
+	uint8_t *d;
+	const uint8_t *s;
+	size_t n;
+
+	d = dst;
+	s = src;
+	while (len >= unit) {
+		n = MIN(len, MEMXOR_FPU_CHUNK) & ~(unit - 1);
+		critical_enter();
+		ctx = memxor_fpu_ctx[curcpu];
+		fpu_kern_enter(curthread, ctx, FPU_KERN_NORMAL);
+		loop(d, s, n);
+		fpu_kern_leave(curthread, ctx);
+		critical_exit();
+		d += n;
+		s += n;
+		len -= n;
+	}
+	for (; len > 0; len--)
+		*d++ ^= *s++;
+}
+
+void
+sse2_memxor(void *dst, const void *src, size_t len)
+{
+
+	memxor_fpu(sse2_memxor_loop, 64, dst, src, len);
+}
+
+void
+avx2_memxor(void *dst, const void *src, size_t len)
+{
+
+	memxor_fpu(avx2_memxor_loop, 128, dst, src, len);
+}
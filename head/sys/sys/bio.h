@@ -39,6 +39,7 @@
 #define	_SYS_BIO_H_
 
 #include <sys/queue.h>
+#include <sys/tree.h>
 
 /* bio_cmd */
 #define BIO_READ	0x01	/* Read I/O data */
@@ -97,6 +98,9 @@ struct bio {
 	void	*bio_caller1;		/* Private use by the consumer. */
 	void	*bio_caller2;		/* Private use by the consumer. */
 	TAILQ_ENTRY(bio) bio_queue;	/* Disksort queue. */
+	RB_ENTRY(bio) bio_sortlink;	/* Disksort index, see bioq_init_sorted */
+	u_int	bio_sortgen;		/* Index generation, 0 if not indexed */
+	u_int	bio_sortseq;		/* Orders bios with equal offsets */
 	const char *bio_attribute;	/* Attribute for BIO_[GS]ETATTR */
 	struct g_consumer *bio_from;	/* GEOM linkage */
 	struct g_provider *bio_to;	/* GEOM linkage */
@@ -130,8 +134,15 @@ struct bio_queue_head {
 	TAILQ_HEAD(bio_queue, bio) queue;
 	off_t last_offset;
 	struct	bio *insert_point;
+	int	flags;
+	u_int	sort_gen;
+	u_int	sort_seq;
+	RB_HEAD(bio_sorttree, bio) sort_tree;
 };
 
+/* bio_queue_head flags */
+#define	BIOQ_SORTED	0x01	/* bioq_disksort() uses the tree index */
+
 extern struct vm_map *bio_transient_map;
 extern int bio_transient_maxcnt;
 
@@ -144,6 +155,7 @@ struct bio *bioq_first(struct bio_queue_head *head);
 struct bio *bioq_takefirst(struct bio_queue_head *head);
 void bioq_flush(struct bio_queue_head *head, struct devstat *stp, int error);
 void bioq_init(struct bio_queue_head *head);
+void bioq_init_sorted(struct bio_queue_head *head);
 void bioq_insert_head(struct bio_queue_head *head, struct bio *bp);
 void bioq_insert_tail(struct bio_queue_head *head, struct bio *bp);
 void bioq_remove(struct bio_queue_head *head, struct bio *bp);
@@ -162,7 +162,17 @@ crc32(const void *buf, size_t size)
 uint32_t
 calculate_crc32c(uint32_t crc32c, const unsigned char *buffer,
     unsigned int length);
+#if defined(_KERNEL) && defined(__amd64__)
+void	sse42_crc32c_init(void);
+uint32_t sse42_crc32c(uint32_t, const unsigned char *, unsigned);
+#endif
 
+void	memxor(void *dst, const void *src, size_t len);
+#if defined(_KERNEL) && defined(__amd64__)
+void	memxor_fpu_init(void);
+void	sse2_memxor(void *, const void *, size_t);
+void	avx2_memxor(void *, const void *, size_t);
+#endif
 
 LIBKERN_INLINE void *memset(void *, int, size_t);
 #ifdef LIBKERN_BODY